@@ -42,11 +42,24 @@ else
   append_cflags '-O3'
 end
 
+# Ractor support (Ruby 3.0+) - the extension can be marked as safe to use from non-main Ractors
+have_func('rb_ext_ractor_safe', 'ruby.h')
+
 # Renders an ASCII presentation of the shadow stack at runtime
 if ENV['DEBUG_SHADOW_STACK']
   append_cflags '-DRB_RG_DEBUG_SHADOW_STACK'
 end
 
+# Compiles the default blacklist into a snapshot embedded in the extension - tracers bulk load it on boot instead of parsing the defaults
+begin
+  $LOAD_PATH.unshift File.expand_path('../../lib', __dir__)
+  require 'raygun/apm/blacklist/snapshot'
+  File.write('raygun_blacklist_snapshot.h', Raygun::Apm::Blacklist::Snapshot.c_header)
+  $defs.push('-DRB_RG_BLACKLIST_SNAPSHOT')
+rescue LoadError, StandardError => e
+  STDERR.print("Blacklist snapshot could not be generated, tracers will parse the default blacklist on boot: #{e.message}\n")
+end
+
 unless create_header
   STDERR.print("extconf.h creation failed\n")
   exit(1)
@@ -8,5 +8,7 @@
 #include <unistd.h>
 
 #include "raygun_encoder.h"
+#include "raygun_compression.h"
+#include "raygun_spsc.h"
 
 #endif
@@ -0,0 +1,183 @@
+#include "raygun.h"
+
+void rg_arena_init(rg_arena_t *arena, const size_t chunk_size)
+{
+  arena->chunks = NULL;
+  arena->chunk_size = chunk_size;
+  arena->reserved = 0;
+  arena->used = 0;
+  arena->released = 0;
+}
+
+// Bumps a block of size bytes off the current chunk, starting a new chunk if it doesn't fit. Blocks larger than the chunk size get a dedicated chunk
+// linked in behind the current one, which thus stays current. Returns NULL on allocation failure.
+void *rg_arena_alloc(rg_arena_t *arena, const size_t size)
+{
+  rg_arena_chunk_t *chunk = arena->chunks;
+  size_t aligned = RG_ARENA_ALIGN(size ? size : 1), chunk_size;
+  void *ptr;
+  if (!chunk || chunk->size - chunk->used < aligned) {
+    chunk_size = aligned > arena->chunk_size ? aligned : arena->chunk_size;
+    chunk = malloc(sizeof(rg_arena_chunk_t) + chunk_size);
+    if (!chunk) return NULL;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    arena->reserved += sizeof(rg_arena_chunk_t) + chunk_size;
+    if (chunk_size > arena->chunk_size && arena->chunks) {
+      chunk->next = arena->chunks->next;
+      arena->chunks->next = chunk;
+    } else {
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+    }
+  }
+  ptr = chunk->data + chunk->used;
+  chunk->used += aligned;
+  arena->used += aligned;
+  return ptr;
+}
+
+// Copies size bytes into a new block. Returns NULL on allocation failure.
+void *rg_arena_dup(rg_arena_t *arena, const void *ptr, const size_t size)
+{
+  void *block = rg_arena_alloc(arena, size);
+  if (block) memcpy(block, ptr, size);
+  return block;
+}
+
+// Marks a block of size bytes as no longer in use - the memory is only reclaimed once the arena is freed
+void rg_arena_release(rg_arena_t *arena, const size_t size)
+{
+  arena->released += RG_ARENA_ALIGN(size ? size : 1);
+}
+
+// Frees all chunks - the arena can be allocated from again
+void rg_arena_free(rg_arena_t *arena)
+{
+  rg_arena_chunk_t *chunk = arena->chunks, *next;
+  while (chunk) {
+    next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  rg_arena_init(arena, arena->chunk_size);
+}
+
+// Moves the chunks of another arena behind the current chunk of this one, for their blocks to be freed along with it. The other arena is left empty.
+void rg_arena_merge(rg_arena_t *arena, rg_arena_t *other)
+{
+  rg_arena_chunk_t *tail = other->chunks;
+  if (!tail) return;
+  while (tail->next) tail = tail->next;
+  tail->next = arena->chunks;
+  arena->chunks = other->chunks;
+  arena->reserved += other->reserved;
+  arena->used += other->used;
+  arena->released += other->released;
+  rg_arena_init(other, other->chunk_size);
+}
+
+size_t rg_arena_size(const rg_arena_t *arena)
+{
+  return arena->reserved;
+}
+
+// FNV-1a, continued from the given digest
+static uint64_t rg_digest(const rg_byte_t *data, const size_t size, uint64_t digest)
+{
+  for (size_t i = 0; i < size; i++) {
+    digest ^= data[i];
+    digest *= 1099511628211ULL;
+  }
+  return digest;
+}
+
+// Digest of the blocks handed out by the arena, for checking they're not written to
+uint64_t rg_arena_digest(const rg_arena_t *arena, uint64_t digest)
+{
+  for (const rg_arena_chunk_t *chunk = arena->chunks; chunk; chunk = chunk->next) digest = rg_digest(chunk->data, chunk->used, digest);
+  return digest;
+}
+
+void rg_slab_init(rg_slab_t *slab, const size_t object_size, const size_t objects_per_chunk)
+{
+  slab->chunks = NULL;
+  slab->free = NULL;
+  slab->object_size = RG_ARENA_ALIGN(object_size < sizeof(void *) ? sizeof(void *) : object_size);
+  slab->objects_per_chunk = objects_per_chunk;
+  slab->reserved = 0;
+  slab->used = 0;
+}
+
+// Hands out a zeroed object, off the free list or carved from a new chunk. Returns NULL on allocation failure.
+void *rg_slab_alloc(rg_slab_t *slab)
+{
+  rg_byte_t *chunk, *object;
+  size_t i;
+  if (!slab->free) {
+    // The first slot of a chunk links it to the previous one
+    chunk = malloc(slab->object_size * (slab->objects_per_chunk + 1));
+    if (!chunk) return NULL;
+    *(void **)chunk = slab->chunks;
+    slab->chunks = chunk;
+    slab->reserved += slab->object_size * (slab->objects_per_chunk + 1);
+    for (i = slab->objects_per_chunk; i > 0; i--) {
+      object = chunk + i * slab->object_size;
+      *(void **)object = slab->free;
+      slab->free = object;
+    }
+  }
+  object = slab->free;
+  slab->free = *(void **)object;
+  slab->used++;
+  memset(object, 0, slab->object_size);
+  return object;
+}
+
+void rg_slab_free(rg_slab_t *slab, void *ptr)
+{
+  if (!ptr) return;
+  *(void **)ptr = slab->free;
+  slab->free = ptr;
+  slab->used--;
+}
+
+// Frees all chunks, including objects still handed out - the slab can be allocated from again
+void rg_slab_destroy(rg_slab_t *slab)
+{
+  void *chunk = slab->chunks, *next;
+  while (chunk) {
+    next = *(void **)chunk;
+    free(chunk);
+    chunk = next;
+  }
+  rg_slab_init(slab, slab->object_size, slab->objects_per_chunk);
+}
+
+// Moves the chunks of another slab of the same object size into this one, objects still handed out are freed along with it. Free objects of the other
+// slab are not reused. The other slab is left empty.
+void rg_slab_merge(rg_slab_t *slab, rg_slab_t *other)
+{
+  void *tail = other->chunks;
+  if (!tail) return;
+  while (*(void **)tail) tail = *(void **)tail;
+  *(void **)tail = slab->chunks;
+  slab->chunks = other->chunks;
+  slab->reserved += other->reserved;
+  slab->used += other->used;
+  rg_slab_init(other, other->object_size, other->objects_per_chunk);
+}
+
+size_t rg_slab_size(const rg_slab_t *slab)
+{
+  return slab->reserved;
+}
+
+// Digest of all objects of the slab, handed out or free, for checking they're not written to
+uint64_t rg_slab_digest(const rg_slab_t *slab, uint64_t digest)
+{
+  for (const rg_byte_t *chunk = slab->chunks; chunk; chunk = *(const rg_byte_t **)chunk) {
+    digest = rg_digest(chunk + slab->object_size, slab->object_size * slab->objects_per_chunk, digest);
+  }
+  return digest;
+}
@@ -0,0 +1,60 @@
+#ifndef RAYGUN_ARENA_H
+#define RAYGUN_ARENA_H
+
+// Bulk storage for long lived, small and numerous tracer data such as method entries, their names and pre-encoded methodinfo events - a few large
+// allocations instead of one per method, which cuts down on allocator overhead and heap fragmentation and allows for exact memory accounting.
+//
+// The arena is a bump allocator of variable sized blocks across a list of chunks. Blocks can't be freed individually, released blocks are only
+// tracked for deciding when it's worth compacting the arena (copying the live blocks to a new one and freeing the old one).
+//
+// The slab hands out fixed size objects from chunks, freed objects are kept on a free list for reuse.
+
+// Blocks and objects are aligned to 8 bytes
+#define RG_ARENA_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+typedef struct _rg_arena_chunk_t {
+  struct _rg_arena_chunk_t *next;
+  size_t size;
+  size_t used;
+  rg_byte_t data[];
+} rg_arena_chunk_t;
+
+typedef struct _rg_arena_t {
+  // The chunk blocks are bumped off of is the head of the list
+  rg_arena_chunk_t *chunks;
+  size_t chunk_size;
+  // Telemetry and accounting specific - bytes allocated from the system, handed out as blocks and released again
+  size_t reserved;
+  size_t used;
+  size_t released;
+} rg_arena_t;
+
+typedef struct _rg_slab_t {
+  // Chunks are linked through their first word, free objects through their first word too
+  void *chunks;
+  void *free;
+  size_t object_size;
+  size_t objects_per_chunk;
+  // Telemetry and accounting specific - bytes allocated from the system and objects handed out
+  size_t reserved;
+  size_t used;
+} rg_slab_t;
+
+void rg_arena_init(rg_arena_t *arena, const size_t chunk_size);
+void *rg_arena_alloc(rg_arena_t *arena, const size_t size);
+void *rg_arena_dup(rg_arena_t *arena, const void *ptr, const size_t size);
+void rg_arena_release(rg_arena_t *arena, const size_t size);
+void rg_arena_free(rg_arena_t *arena);
+void rg_arena_merge(rg_arena_t *arena, rg_arena_t *other);
+size_t rg_arena_size(const rg_arena_t *arena);
+uint64_t rg_arena_digest(const rg_arena_t *arena, uint64_t digest);
+
+void rg_slab_init(rg_slab_t *slab, const size_t object_size, const size_t objects_per_chunk);
+void *rg_slab_alloc(rg_slab_t *slab);
+void rg_slab_free(rg_slab_t *slab, void *ptr);
+void rg_slab_destroy(rg_slab_t *slab);
+void rg_slab_merge(rg_slab_t *slab, rg_slab_t *other);
+size_t rg_slab_size(const rg_slab_t *slab);
+uint64_t rg_slab_digest(const rg_slab_t *slab, uint64_t digest);
+
+#endif
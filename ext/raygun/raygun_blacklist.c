@@ -0,0 +1,385 @@
+#include "extconf.h"
+#include "raygun.h"
+#include "raygun_blacklist.h"
+
+#ifdef RB_RG_BLACKLIST_SNAPSHOT
+// Generated by extconf.rb in the build directory
+#include "raygun_blacklist_snapshot.h"
+const rg_byte_t *rg_blacklist_snapshot = rg_blacklist_snapshot_data;
+const size_t rg_blacklist_snapshot_size = sizeof(rg_blacklist_snapshot_data);
+const char *rg_blacklist_snapshot_digest = RG_BLACKLIST_SNAPSHOT_DIGEST;
+#else
+const rg_byte_t *rg_blacklist_snapshot = NULL;
+const size_t rg_blacklist_snapshot_size = 0;
+const char *rg_blacklist_snapshot_digest = NULL;
+#endif
+
+// Intermediate trie the automaton is compiled from - children are kept as a sorted sibling list
+typedef struct _rg_blacklist_node_t {
+  struct _rg_blacklist_node_t *child;
+  struct _rg_blacklist_node_t *sibling;
+  rg_byte_t label;
+  rg_byte_t fully_qualified;
+  rg_byte_t path;
+  rg_byte_t method;
+  rg_byte_t flags;
+} rg_blacklist_node_t;
+
+typedef struct _rg_blacklist_builder_t {
+  rg_blacklist_node_t *roots[2];
+  uint32_t node_count;
+  uint32_t edge_count;
+} rg_blacklist_builder_t;
+
+static void rg_blacklist_free_nodes(rg_blacklist_node_t *node)
+{
+  rg_blacklist_node_t *sibling;
+  while (node) {
+    sibling = node->sibling;
+    rg_blacklist_free_nodes(node->child);
+    free(node);
+    node = sibling;
+  }
+}
+
+// Walks the trie along key from the given root, adding any missing nodes. Returns the node the key ends in, or NULL on allocation failure.
+static rg_blacklist_node_t *rg_blacklist_insert(rg_blacklist_builder_t *builder, rg_blacklist_node_t *root, const unsigned char *key, const size_t key_len)
+{
+  rg_blacklist_node_t *node = root, **link, *child;
+  for (size_t i = 0; i < key_len; i++) {
+    link = &node->child;
+    while (*link && (*link)->label < key[i]) link = &(*link)->sibling;
+    if (!*link || (*link)->label != key[i]) {
+      child = calloc(1, sizeof(rg_blacklist_node_t));
+      if (!child) return NULL;
+      child->label = key[i];
+      child->sibling = *link;
+      *link = child;
+      builder->node_count++;
+      builder->edge_count++;
+    }
+    node = *link;
+  }
+  return node;
+}
+
+// Adds all rules of a radix tree to the trie. Which = 0 for fully qualified, 1 for path and 2 for method rules.
+static int rg_blacklist_insert_rules(rg_blacklist_builder_t *builder, rax *tree, const int which)
+{
+  raxIterator iter;
+  rg_blacklist_node_t *node;
+  raxStart(&iter, tree);
+  raxSeek(&iter, "^", NULL, 0);
+  while (raxNext(&iter)) {
+    node = rg_blacklist_insert(builder, builder->roots[which == 2 ? 1 : 0], iter.key, iter.key_len);
+    if (!node) {
+      raxStop(&iter);
+      return 0;
+    }
+    switch (which) {
+      case 0:
+        node->fully_qualified = (rg_byte_t)(uintptr_t)iter.data;
+        break;
+      case 1:
+        node->path = (rg_byte_t)(uintptr_t)iter.data;
+        // Namespace (Foo::) and method call (Foo#) rules
+        if (iter.key_len > 2 && (iter.key[iter.key_len - 1] == '#' || (iter.key[iter.key_len - 1] == ':' && iter.key[iter.key_len - 2] == ':')))
+          node->flags |= RG_BLACKLIST_STATE_SEPARATOR;
+        break;
+      case 2:
+        node->method = (rg_byte_t)(uintptr_t)iter.data;
+        break;
+    }
+  }
+  raxStop(&iter);
+  return 1;
+}
+
+// Compiles the blacklist radix trees into an automaton. Returns NULL on allocation failure.
+rg_blacklist_t *rg_blacklist_compile(rax *fully_qualified, rax *paths, rax *methods)
+{
+  rg_blacklist_builder_t builder = {{NULL, NULL}, 2, 0};
+  rg_blacklist_t *blacklist = NULL;
+  rg_blacklist_node_t **queue = NULL, *node, *child;
+  rg_blacklist_state_t *state;
+  uint32_t head, tail;
+
+  builder.roots[0] = calloc(1, sizeof(rg_blacklist_node_t));
+  builder.roots[1] = calloc(1, sizeof(rg_blacklist_node_t));
+  if (!builder.roots[0] || !builder.roots[1]) goto error;
+  if (!rg_blacklist_insert_rules(&builder, fully_qualified, 0) || !rg_blacklist_insert_rules(&builder, paths, 1) || !rg_blacklist_insert_rules(&builder, methods, 2))
+    goto error;
+
+  blacklist = calloc(1, sizeof(rg_blacklist_t));
+  if (!blacklist) goto error;
+  blacklist->states = malloc(builder.node_count * sizeof(rg_blacklist_state_t));
+  blacklist->labels = malloc(builder.edge_count ? builder.edge_count : 1);
+  blacklist->targets = malloc((builder.edge_count ? builder.edge_count : 1) * sizeof(uint32_t));
+  queue = malloc(builder.node_count * sizeof(rg_blacklist_node_t *));
+  if (!blacklist->states || !blacklist->labels || !blacklist->targets || !queue) goto error;
+
+  // Breadth first, which numbers the children of a state consecutively and keeps it's edges contiguous
+  queue[0] = builder.roots[0];
+  queue[1] = builder.roots[1];
+  blacklist->root = 0;
+  blacklist->method_root = 1;
+  for (head = 0, tail = 2; head < tail; head++) {
+    node = queue[head];
+    state = &blacklist->states[head];
+    state->edges = blacklist->edge_count;
+    state->edge_count = 0;
+    state->fully_qualified = node->fully_qualified;
+    state->path = node->path;
+    state->method = node->method;
+    state->flags = node->flags;
+    for (child = node->child; child; child = child->sibling) {
+      blacklist->labels[blacklist->edge_count] = child->label;
+      blacklist->targets[blacklist->edge_count] = tail;
+      blacklist->edge_count++;
+      state->edge_count++;
+      queue[tail++] = child;
+    }
+  }
+  blacklist->state_count = tail;
+
+  free(queue);
+  rg_blacklist_free_nodes(builder.roots[0]);
+  rg_blacklist_free_nodes(builder.roots[1]);
+  return blacklist;
+
+error:
+  free(queue);
+  rg_blacklist_free(blacklist);
+  rg_blacklist_free_nodes(builder.roots[0]);
+  rg_blacklist_free_nodes(builder.roots[1]);
+  return NULL;
+}
+
+void rg_blacklist_free(rg_blacklist_t *blacklist)
+{
+  if (!blacklist) return;
+  free(blacklist->states);
+  free(blacklist->labels);
+  free(blacklist->targets);
+  free(blacklist);
+}
+
+size_t rg_blacklist_size(const rg_blacklist_t *blacklist)
+{
+  if (!blacklist) return 0;
+  return sizeof(rg_blacklist_t) + blacklist->state_count * sizeof(rg_blacklist_state_t) + blacklist->edge_count * (sizeof(rg_byte_t) + sizeof(uint32_t));
+}
+
+// Transitions from a state on the given byte, returns -1 if there's no such edge
+static inline int64_t rg_blacklist_next(const rg_blacklist_t *blacklist, const uint32_t from, const rg_byte_t byte)
+{
+  const rg_blacklist_state_t *state = &blacklist->states[from];
+  const rg_byte_t *labels = blacklist->labels + state->edges;
+  uint32_t low = 0, high = state->edge_count, mid;
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (labels[mid] < byte) {
+      low = mid + 1;
+    } else if (labels[mid] > byte) {
+      high = mid;
+    } else {
+      return blacklist->targets[state->edges + mid];
+    }
+  }
+  return -1;
+}
+
+// Classifies a method in a single pass over it's fully qualified name - path_len is the length of the path, followed by the separator and the method name.
+// Returns a RG_BLACKLIST_* value. Rules take precedence in this order:
+//
+// * An exact fully qualified rule (Foo::Bar#baz)
+// * An exact path rule (Foo::Bar)
+// * An exact method rule (baz)
+// * The longest path rule that is a prefix of the path, if it is a namespace or method call rule (Foo:: or Foo#)
+// * A method call rule for the path (Foo::Bar#)
+// * Any path rule that is a prefix of the path - whitelisted if any of them is
+// * Any method rule that is a prefix of the method - whitelisted if any of them is
+//
+long rg_blacklist_match(const rg_blacklist_t *blacklist, const unsigned char *fully_qualified, const size_t fully_qualified_len, const size_t path_len)
+{
+  const rg_blacklist_state_t *state;
+  int64_t current = blacklist->root, method = -1;
+  long exact_path = RG_BLACKLIST_UNLISTED, exact_method = RG_BLACKLIST_UNLISTED, method_call = RG_BLACKLIST_UNLISTED, longest_prefix = RG_BLACKLIST_UNLISTED;
+  int longest_prefix_separator = 0, path_prefixes = 0, path_prefixes_whitelisted = 0, method_prefixes = 0, method_prefixes_whitelisted = 0;
+  size_t i;
+
+  for (i = 0; ; i++) {
+    // Both automatons consumed i bytes of the fully qualified name
+    if (current >= 0) {
+      state = &blacklist->states[current];
+      if (state->path && i > 0) {
+        if (i < path_len) {
+          longest_prefix = state->path;
+          longest_prefix_separator = state->flags & RG_BLACKLIST_STATE_SEPARATOR;
+          path_prefixes = 1;
+          if (state->path == RG_BLACKLIST_WHITELISTED) path_prefixes_whitelisted = 1;
+        } else if (i == path_len) {
+          exact_path = state->path;
+        } else if (i == path_len + 1 && (state->flags & RG_BLACKLIST_STATE_SEPARATOR)) {
+          method_call = state->path;
+        }
+      }
+      if (i == fully_qualified_len && state->fully_qualified) return state->fully_qualified;
+    }
+    if (method >= 0) {
+      state = &blacklist->states[method];
+      if (state->method) {
+        if (i == fully_qualified_len) {
+          exact_method = state->method;
+        } else if (i > path_len + 1) {
+          method_prefixes = 1;
+          if (state->method == RG_BLACKLIST_WHITELISTED) method_prefixes_whitelisted = 1;
+        }
+      }
+    }
+    if (i == fully_qualified_len) break;
+    // The method automaton starts past the path separator
+    if (i == path_len) {
+      method = blacklist->method_root;
+    } else if (method >= 0) {
+      method = rg_blacklist_next(blacklist, (uint32_t)method, fully_qualified[i]);
+    }
+    if (current >= 0) current = rg_blacklist_next(blacklist, (uint32_t)current, fully_qualified[i]);
+    // Nothing left to match
+    if (current < 0 && method < 0 && i > path_len) break;
+  }
+
+  if (exact_path) return exact_path;
+  if (exact_method) return exact_method;
+  if (longest_prefix && longest_prefix_separator) return longest_prefix;
+  if (method_call) return method_call;
+  if (path_prefixes) return path_prefixes_whitelisted ? RG_BLACKLIST_WHITELISTED : RG_BLACKLIST_BLACKLISTED;
+  if (method_prefixes) return method_prefixes_whitelisted ? RG_BLACKLIST_WHITELISTED : RG_BLACKLIST_BLACKLISTED;
+  return RG_BLACKLIST_UNLISTED;
+}
+
+// Compiles the keys of a radix tree to a prefix index. Returns NULL on allocation failure.
+rg_prefix_index_t *rg_prefix_index_compile(rax *tree)
+{
+  raxIterator iter;
+  rg_prefix_index_t *index = NULL;
+  size_t bytes = 0, offset = 0, last_len = 0;
+  uint32_t count = 0;
+  int has_last = 0;
+
+  // Radix tree iteration is in lexicographic order, so a key with a shorter key as prefix always directly follows the last key kept
+  raxStart(&iter, tree);
+  raxSeek(&iter, "^", NULL, 0);
+  while (raxNext(&iter)) bytes += iter.key_len;
+  raxStop(&iter);
+
+  index = calloc(1, sizeof(rg_prefix_index_t));
+  if (!index) return NULL;
+  index->keys = malloc(bytes ? bytes : 1);
+  index->offsets = malloc((raxSize(tree) + 1) * sizeof(uint32_t));
+  if (!index->keys || !index->offsets) {
+    rg_prefix_index_free(index);
+    return NULL;
+  }
+
+  raxStart(&iter, tree);
+  raxSeek(&iter, "^", NULL, 0);
+  while (raxNext(&iter)) {
+    // An empty key would match anything
+    if (iter.key_len == 0) continue;
+    if (has_last && iter.key_len >= last_len && memcmp(iter.key, index->keys + index->offsets[count - 1], last_len) == 0) continue;
+    index->offsets[count++] = (uint32_t)offset;
+    memcpy(index->keys + offset, iter.key, iter.key_len);
+    offset += iter.key_len;
+    last_len = iter.key_len;
+    has_last = 1;
+  }
+  raxStop(&iter);
+  index->offsets[count] = (uint32_t)offset;
+  index->count = count;
+  return index;
+}
+
+void rg_prefix_index_free(rg_prefix_index_t *index)
+{
+  if (!index) return;
+  free(index->keys);
+  free(index->offsets);
+  free(index);
+}
+
+size_t rg_prefix_index_size(const rg_prefix_index_t *index)
+{
+  if (!index) return 0;
+  return sizeof(rg_prefix_index_t) + index->offsets[index->count] + (index->count + 1) * sizeof(uint32_t);
+}
+
+// As keys are prefix free, a key that is a prefix of the needle must be the greatest key that sorts before or equal to the needle - any key in between
+// would have to start with that prefix too.
+int rg_prefix_index_match(const rg_prefix_index_t *index, const unsigned char *needle, const size_t needle_len)
+{
+  uint32_t low = 0, high = index->count, mid;
+  size_t key_len;
+  int cmp;
+  // Find the first key that sorts after the needle
+  while (low < high) {
+    mid = (low + high) / 2;
+    key_len = index->offsets[mid + 1] - index->offsets[mid];
+    cmp = memcmp(index->keys + index->offsets[mid], needle, key_len < needle_len ? key_len : needle_len);
+    if (cmp < 0 || (cmp == 0 && key_len <= needle_len)) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low == 0) return 0;
+  key_len = index->offsets[low] - index->offsets[low - 1];
+  return key_len <= needle_len && memcmp(index->keys + index->offsets[low - 1], needle, key_len) == 0;
+}
+
+static inline uint16_t rg_blacklist_snapshot_u16(const rg_byte_t *p)
+{
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t rg_blacklist_snapshot_u32(const rg_byte_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Walks the rules of a snapshot, invoking fn for each of them. The whole snapshot is validated before fn is invoked for any rule, so that a truncated or
+// corrupt snapshot is never partially loaded. Returns 0 if the snapshot is malformed, 1 otherwise.
+int rg_blacklist_snapshot_each(const rg_byte_t *snapshot, const size_t size, rg_blacklist_snapshot_rule_fn fn, void *ctx)
+{
+  const rg_byte_t *rule, *end = snapshot + size;
+  uint32_t count, i;
+  uint16_t path_len, method_len;
+  rg_byte_t data, flags;
+  int pass;
+
+  if (!snapshot || size < RG_BLACKLIST_SNAPSHOT_HEADER_SIZE) return 0;
+  if (memcmp(snapshot, RG_BLACKLIST_SNAPSHOT_MAGIC, 4) != 0 || snapshot[4] != RG_BLACKLIST_SNAPSHOT_FORMAT_VERSION) return 0;
+  count = rg_blacklist_snapshot_u32(snapshot + 8);
+
+  // First pass validates, second pass invokes the callback
+  for (pass = 0; pass < (fn ? 2 : 1); pass++) {
+    rule = snapshot + RG_BLACKLIST_SNAPSHOT_HEADER_SIZE;
+    for (i = 0; i < count; i++) {
+      if ((size_t)(end - rule) < RG_BLACKLIST_SNAPSHOT_RULE_SIZE) return 0;
+      data = rule[0];
+      flags = rule[1];
+      path_len = rg_blacklist_snapshot_u16(rule + 2);
+      method_len = rg_blacklist_snapshot_u16(rule + 4);
+      rule += RG_BLACKLIST_SNAPSHOT_RULE_SIZE;
+      if ((size_t)(end - rule) < (size_t)path_len + method_len) return 0;
+      if (data != RG_BLACKLIST_WHITELISTED && data != RG_BLACKLIST_BLACKLISTED) return 0;
+      if (!(flags & (RG_BLACKLIST_SNAPSHOT_HAS_PATH | RG_BLACKLIST_SNAPSHOT_HAS_METHOD))) return 0;
+      if (pass == 1) {
+        fn(data, (flags & RG_BLACKLIST_SNAPSHOT_HAS_PATH) ? rule : NULL, path_len, (flags & RG_BLACKLIST_SNAPSHOT_HAS_METHOD) ? rule + path_len : NULL, method_len, ctx);
+      }
+      rule += path_len + method_len;
+    }
+    if (rule != end) return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,78 @@
+#ifndef RAYGUN_BLACKLIST_H
+#define RAYGUN_BLACKLIST_H
+
+#include "rax.h"
+
+// The fully qualified, path and method blacklist radix trees compiled into a single deterministic automaton that classifies a method in one pass over
+// it's fully qualified name (Foo::Bar#baz). The radix trees remain the source of truth the automaton is compiled from, and are queried directly when
+// debugging the blacklist.
+//
+// States are stored in a flat array, with the outgoing edges of a state contiguous and sorted by byte. There are two start states - one for the fully
+// qualified name (which the fully qualified and path rules share, as both are anchored at the start of the name) and one for the method name, which
+// is fed the bytes after the path separator in the same pass.
+
+// Set on states that end a path rule terminating in "::" or "#"
+#define RG_BLACKLIST_STATE_SEPARATOR 0x1
+
+typedef struct _rg_blacklist_state_t {
+  // Offset of the first outgoing edge in the edge arrays
+  uint32_t edges;
+  uint16_t edge_count;
+  // RG_BLACKLIST_* value of the fully qualified, path and method rules ending in this state, RG_BLACKLIST_UNLISTED if none
+  rg_byte_t fully_qualified;
+  rg_byte_t path;
+  rg_byte_t method;
+  rg_byte_t flags;
+} rg_blacklist_state_t;
+
+typedef struct _rg_blacklist_t {
+  rg_blacklist_state_t *states;
+  uint32_t state_count;
+  // Edge labels and the states they transition to
+  rg_byte_t *labels;
+  uint32_t *targets;
+  uint32_t edge_count;
+  // Start states
+  uint32_t root;
+  uint32_t method_root;
+} rg_blacklist_t;
+
+rg_blacklist_t *rg_blacklist_compile(rax *fully_qualified, rax *paths, rax *methods);
+void rg_blacklist_free(rg_blacklist_t *blacklist);
+size_t rg_blacklist_size(const rg_blacklist_t *blacklist);
+long rg_blacklist_match(const rg_blacklist_t *blacklist, const unsigned char *fully_qualified, const size_t fully_qualified_len, const size_t path_len);
+
+// A sorted, prefix free set of strings compiled from a radix tree, which answers whether any of the keys is a prefix of a needle with a single binary search
+// and one comparison. Used for classifying source paths as library code, where the keys are the registered library paths. A key that has a shorter key
+// as prefix is dropped on compilation as it can't change the outcome. The key strings are packed back to back, key i spans [offsets[i], offsets[i + 1]).
+typedef struct _rg_prefix_index_t {
+  unsigned char *keys;
+  uint32_t *offsets;
+  uint32_t count;
+} rg_prefix_index_t;
+
+rg_prefix_index_t *rg_prefix_index_compile(rax *tree);
+void rg_prefix_index_free(rg_prefix_index_t *index);
+size_t rg_prefix_index_size(const rg_prefix_index_t *index);
+int rg_prefix_index_match(const rg_prefix_index_t *index, const unsigned char *needle, const size_t needle_len);
+
+// Blacklist snapshots - translated rules bulk loaded by Tracer#load_blacklist, see lib/raygun/apm/blacklist/snapshot.rb for the layout. The default
+// blacklist is compiled to a snapshot at build time and embedded in the extension (rodata, so mapped in with the shared object and never copied).
+#define RG_BLACKLIST_SNAPSHOT_MAGIC "RGBL"
+#define RG_BLACKLIST_SNAPSHOT_FORMAT_VERSION 1
+#define RG_BLACKLIST_SNAPSHOT_HEADER_SIZE 12
+#define RG_BLACKLIST_SNAPSHOT_RULE_SIZE 6
+#define RG_BLACKLIST_SNAPSHOT_HAS_PATH 0x1
+#define RG_BLACKLIST_SNAPSHOT_HAS_METHOD 0x2
+
+// Invoked for each rule in a snapshot - path or method is NULL if the rule does not have one
+typedef void (*rg_blacklist_snapshot_rule_fn)(const rg_byte_t data, const unsigned char *path, const uint16_t path_len, const unsigned char *method, const uint16_t method_len, void *ctx);
+
+int rg_blacklist_snapshot_each(const rg_byte_t *snapshot, const size_t size, rg_blacklist_snapshot_rule_fn fn, void *ctx);
+
+// The embedded default blacklist snapshot and digest of the defaults it was compiled from - NULL if the extension was built without one
+extern const rg_byte_t *rg_blacklist_snapshot;
+extern const size_t rg_blacklist_snapshot_size;
+extern const char *rg_blacklist_snapshot_digest;
+
+#endif
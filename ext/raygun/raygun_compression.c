@@ -0,0 +1,139 @@
+#include "raygun.h"
+
+// Multiplicative hash of the next 4 bytes of input to a RG_LZ4_HASH_LOG bits table slot
+static inline uint32_t rg_lz4_hash(const rg_byte_t *ptr)
+{
+  uint32_t sequence;
+  memcpy(&sequence, ptr, sizeof(sequence));
+  return (sequence * 2654435761U) >> (32 - RG_LZ4_HASH_LOG);
+}
+
+// Encodes the remainder of a literal or match length exceeding the 4 bit token field as a run of 255 bytes and a final byte
+static inline rg_byte_t *rg_lz4_encode_length(rg_byte_t *op, int length)
+{
+  for (; length >= 255; length -= 255) *op++ = 255;
+  *op++ = (rg_byte_t)length;
+  return op;
+}
+
+// Compresses src into dst as a single LZ4 block. Returns the compressed size, or 0 if the output does not fit dstcap - callers send the
+// input as-is in that case. Inputs larger than 64KB are not supported as table positions are 16 bit.
+//
+int rg_compress(const rg_byte_t *src, const int srclen, rg_byte_t *dst, const int dstcap)
+{
+  uint16_t table[1 << RG_LZ4_HASH_LOG];
+  const rg_byte_t *ip = src, *anchor = src, *ref, *end = src + srclen;
+  const rg_byte_t *mflimit = end - RG_LZ4_MFLIMIT, *matchlimit = end - RG_LZ4_LAST_LITERALS;
+  rg_byte_t *op = dst, *oend = dst + dstcap, *token;
+  int literals, match;
+  uint32_t h;
+
+  if (srclen < 0 || srclen > RG_LZ4_MAX_OFFSET + 1) return 0;
+  memset(table, 0, sizeof(table));
+
+  // Inputs shorter than the minimum match distance to the end of the block are literals only
+  if (srclen >= RG_LZ4_MFLIMIT) {
+    while (ip < mflimit) {
+      h = rg_lz4_hash(ip);
+      ref = src + table[h];
+      table[h] = (uint16_t)(ip - src);
+      if (ref >= ip || memcmp(ref, ip, RG_LZ4_MIN_MATCH)) {
+        ip++;
+        continue;
+      }
+      // Extend the match forward, but never into the last literals of the block
+      match = RG_LZ4_MIN_MATCH;
+      while (ip + match < matchlimit && ref[match] == ip[match]) match++;
+
+      literals = (int)(ip - anchor);
+      if (op + 1 + literals + (literals / 255) + 1 + 2 + (match / 255) + 1 > oend) return 0;
+      token = op++;
+      *token = (rg_byte_t)((literals >= 15 ? 15 : literals) << 4);
+      if (literals >= 15) op = rg_lz4_encode_length(op, literals - 15);
+      memcpy(op, anchor, literals); op+= literals;
+      *op++ = (rg_byte_t)((ip - ref) & 0xff);
+      *op++ = (rg_byte_t)((ip - ref) >> 8);
+      match -= RG_LZ4_MIN_MATCH;
+      *token |= (rg_byte_t)(match >= 15 ? 15 : match);
+      if (match >= 15) op = rg_lz4_encode_length(op, match - 15);
+
+      ip += match + RG_LZ4_MIN_MATCH;
+      anchor = ip;
+    }
+  }
+
+  // The last sequence is literals only
+  literals = (int)(end - anchor);
+  if (op + 1 + literals + (literals / 255) + 1 > oend) return 0;
+  token = op++;
+  *token = (rg_byte_t)((literals >= 15 ? 15 : literals) << 4);
+  if (literals >= 15) op = rg_lz4_encode_length(op, literals - 15);
+  memcpy(op, anchor, literals); op+= literals;
+  return (int)(op - dst);
+}
+
+// Decompresses a single LZ4 block, never reading or writing out of bounds. Returns the decompressed size or -1 for a malformed block or if the
+// output does not fit dstcap.
+//
+int rg_decompress(const rg_byte_t *src, const int srclen, rg_byte_t *dst, const int dstcap)
+{
+  const rg_byte_t *ip = src, *end = src + srclen;
+  rg_byte_t *op = dst, *oend = dst + dstcap;
+  const rg_byte_t *ref;
+  int literals, match, offset;
+  rg_byte_t token, extra;
+
+  while (ip < end) {
+    token = *ip++;
+    literals = token >> 4;
+    if (literals == 15) {
+      do {
+        if (ip >= end) return -1;
+        extra = *ip++;
+        literals += extra;
+      } while (extra == 255);
+    }
+    if (literals > end - ip || literals > oend - op) return -1;
+    memcpy(op, ip, literals); op+= literals; ip+= literals;
+    // Last sequence, no match follows
+    if (ip == end) break;
+
+    if (end - ip < 2) return -1;
+    offset = ip[0] | (ip[1] << 8);
+    ip+= 2;
+    if (offset == 0 || offset > op - dst) return -1;
+    match = token & 0xf;
+    if (match == 15) {
+      do {
+        if (ip >= end) return -1;
+        extra = *ip++;
+        match += extra;
+      } while (extra == 255);
+    }
+    match += RG_LZ4_MIN_MATCH;
+    if (match > oend - op) return -1;
+    // Byte by byte as matches may overlap their own output (run length encoding)
+    ref = op - offset;
+    while (match--) *op++ = *ref++;
+  }
+  return (int)(op - dst);
+}
+
+// Wraps an encoded batch in a RG_EVENT_BATCH_COMPRESSED frame: length, type and the uncompressed batch length followed by the LZ4 block.
+// Returns the frame length, or 0 if compression does not save any bytes and the batch is to be sent as-is.
+//
+rg_length_t rg_compress_batch(const rg_byte_t *batch, const rg_length_t size, rg_byte_t *frame, const int framecap)
+{
+  rg_byte_t *ptr = frame;
+  rg_byte_t type = RG_EVENT_BATCH_COMPRESSED;
+  rg_length_t length;
+  int compressed;
+  if (framecap <= RG_BATCH_COMPRESSED_HEADLEN) return 0;
+  compressed = rg_compress(batch, size, frame + RG_BATCH_COMPRESSED_HEADLEN, framecap - RG_BATCH_COMPRESSED_HEADLEN);
+  if (!compressed || RG_BATCH_COMPRESSED_HEADLEN + compressed >= size) return 0;
+  length = (rg_length_t)(RG_BATCH_COMPRESSED_HEADLEN + compressed);
+  memcpy(ptr, &length, sizeof(length)); ptr+= sizeof(length);
+  memcpy(ptr, &type, sizeof(type)); ptr+= sizeof(type);
+  memcpy(ptr, &size, sizeof(size));
+  return length;
+}
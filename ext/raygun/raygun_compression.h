@@ -0,0 +1,20 @@
+#ifndef RAYGUN_COMPRESSION_H
+#define RAYGUN_COMPRESSION_H
+
+// Batch compression for stream transports. An in-tree implementation of the LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md)
+// tuned for batch sized inputs - greedy matching with a small hash table, trading some ratio for very little CPU on the dispatcher thread. Any stock
+// LZ4 block decoder understands the output.
+
+#define RG_LZ4_HASH_LOG 12
+#define RG_LZ4_MIN_MATCH 4
+#define RG_LZ4_LAST_LITERALS 5
+#define RG_LZ4_MFLIMIT 12
+#define RG_LZ4_MAX_OFFSET 65535
+// Worst case compressed size of incompressible input
+#define RG_LZ4_COMPRESS_BOUND(size) ((size) + ((size) / 255) + 16)
+
+int rg_compress(const rg_byte_t *src, const int srclen, rg_byte_t *dst, const int dstcap);
+int rg_decompress(const rg_byte_t *src, const int srclen, rg_byte_t *dst, const int dstcap);
+rg_length_t rg_compress_batch(const rg_byte_t *batch, const rg_length_t size, rg_byte_t *frame, const int framecap);
+
+#endif
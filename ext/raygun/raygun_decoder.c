@@ -0,0 +1,108 @@
+#include "raygun_decoder.h"
+
+// Wraps the stand-in decoder for the v3 compact batch framing - the Agent owns the real one and we don't use this in production paths, but it
+// allows for asserting both wire protocol versions describe the same stream of events in tests.
+
+VALUE rb_cRaygunDecoder;
+
+// Callback for the stand-in batch decoder, collects each command as a v2 encoded String
+static int rb_rg_decoder_decode_i(const rg_byte_t *encoded, const rg_length_t size, void *userdata)
+{
+    rb_ary_push((VALUE)userdata, rb_str_new((const char *)encoded, size));
+    return 1;
+}
+
+// Expands a batch as dispatched by the UDP or TCP sinks (either framing) to an Array of v2 encoded commands. A fragment yields the event it
+// belongs to once all fragments arrived and an empty Array until then. Batches of a connection are expected
+// in dispatch order as string definitions are learned along the way.
+VALUE rb_rg_decoder_decode(VALUE obj, VALUE payload)
+{
+    VALUE commands = rb_ary_new();
+    rb_rg_get_decoder(obj);
+    Check_Type(payload, T_STRING);
+    if (RSTRING_LEN(payload) > RG_MAX_STREAM_BATCH_PACKET_SIZE) rb_raise(rb_eArgError, "not a batch");
+    if (rg_decode_batch(decoder, (const rg_byte_t *)RSTRING_PTR(payload), (rg_length_t)RSTRING_LEN(payload), rb_rg_decoder_decode_i, (void *)commands) < 0) {
+        rb_raise(rb_eArgError, "malformed batch");
+    }
+    RB_GC_GUARD(payload);
+    return commands;
+}
+
+// Returns the number of strings defined thus far
+VALUE rb_rg_decoder_strings(VALUE obj)
+{
+    int count = 0;
+    rb_rg_get_decoder(obj);
+    for (int i = 1; i <= RG_MAX_INTERNED_STRINGS; i++) {
+        if (decoder->strings[i]) count++;
+    }
+    return INT2NUM(count);
+}
+
+// Returns the number of fragment groups (fragmented events) that could not be reassembled due to missing fragments
+VALUE rb_rg_decoder_lost_fragment_groups(VALUE obj)
+{
+    rb_rg_get_decoder(obj);
+    return SIZET2NUM(decoder->fragment_groups_lost);
+}
+
+// The main GC callback from the typed data (https://github.com/ruby/ruby/blob/master/doc/extension.rdoc#encapsulate-c-data-into-a-ruby-object-) struct.
+// The decoder is allocated by the encoder and frees any learned strings along with it.
+//
+void rg_decoder_sfree(void *ptr)
+{
+    rg_decoder_free((rg_decoder_t *)ptr);
+}
+
+// Used by ObjectSpace to estimate the size of a Ruby object. This needs to account for all the retained memory of the object and requires walking any
+// collection specific struct members and anything else malloc heap allocated.
+//
+size_t rg_decoder_sizeof(const void *ptr)
+{
+    const rg_decoder_t *decoder = (const rg_decoder_t *)ptr;
+    size_t size = sizeof(rg_decoder_t);
+    for (int i = 1; i <= RG_MAX_INTERNED_STRINGS; i++) {
+        if (decoder->strings[i]) size += sizeof(rg_encoded_string_t);
+    }
+    return size;
+}
+
+// The main typed data struct that helps to inform the VM (mostly the GC) on how to handle a wrapped structure
+// References https://github.com/ruby/ruby/blob/master/doc/extension.rdoc#encapsulate-c-data-into-a-ruby-object-
+//
+// The decoder struct knows NOTHING about Ruby and as such the mark callback is empty as there's nothing to let the Ruby GC know about with
+// regards to object reachability.
+//
+const rb_data_type_t rb_rg_decoder_type = {
+    .wrap_struct_name = "rb_rg_decoder",
+    .function = {
+        .dmark = NULL,
+        .dfree = rg_decoder_sfree,
+        .dsize = rg_decoder_sizeof,
+    },
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+// Allocation helper for allocating a blank decoder struct and let a Ruby land object wrap the allocated struct.
+static VALUE rb_rg_decoder_alloc(VALUE klass)
+{
+    rg_decoder_t *decoder = rg_decoder_alloc();
+    if (!decoder) rb_raise(rb_eRaygunFatal, "Could not alloc decoder");
+    return TypedData_Wrap_Struct(klass, &rb_rg_decoder_type, decoder);
+}
+
+// Init helper, called when raygun_ext.so is loaded
+void _init_raygun_decoder()
+{
+    // Define the class
+    rb_cRaygunDecoder = rb_define_class_under(rb_mRaygunApm, "Decoder", rb_cObject);
+
+    // Custom allocator
+    rb_define_alloc_func(rb_cRaygunDecoder, rb_rg_decoder_alloc);
+
+    // Define the methods
+    rb_define_method(rb_cRaygunDecoder, "decode", rb_rg_decoder_decode, 1);
+    rb_define_method(rb_cRaygunDecoder, "strings", rb_rg_decoder_strings, 0);
+    rb_define_method(rb_cRaygunDecoder, "lost_fragment_groups", rb_rg_decoder_lost_fragment_groups, 0);
+}
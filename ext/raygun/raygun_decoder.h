@@ -0,0 +1,21 @@
+#ifndef RAYGUN_DECODER_H
+#define RAYGUN_DECODER_H
+
+#include "raygun_coercion.h"
+
+extern VALUE rb_mRaygunApm;
+extern VALUE rb_cRaygunDecoder;
+
+// Ruby interface that wraps the stand-in batch decoder of the encoder - not used in production, but allows tests to expand batches dispatched by
+// the UDP and TCP sinks back to v2 encoded commands. One instance per connection as the string dictionary is stateful.
+
+void _init_raygun_decoder();
+
+// Coerces a Ruby object -> a decoder C struct
+extern const rb_data_type_t rb_rg_decoder_type;
+#define rb_rg_get_decoder(obj) \
+    rg_decoder_t *decoder = NULL; \
+    TypedData_Get_Struct(obj, rg_decoder_t, &rb_rg_decoder_type, decoder); \
+    if (!decoder) rb_raise(rb_eRaygunFatal, "Could not initialize decoder"); \
+
+#endif
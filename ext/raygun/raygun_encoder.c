@@ -26,6 +26,14 @@ rg_context_t *rg_context_alloc()
   return context;
 }
 
+// Resets a context inherited by a forked child - the pid is looked up again and events go to the blackhole sink until the child sets up a sink of it's
+// own
+void rg_context_forked(rg_context_t *context)
+{
+  context->pid = rg_getpid();
+  context->sink = rg_event_sink_blackhole;
+}
+
 // Populates the header part of a new wire protocol command being encoded
 static inline void rg_fill_header(const rg_context_t *context, rg_event_t *event, const rg_short_t size)
 {
@@ -60,6 +68,12 @@ rg_short_t rg_encode_header_impl(rg_byte_t *ptr, rg_event_t *event)
   return RG_MIN_PAYLOAD;
 }
 
+// Rewrites the pid of an already encoded command, for pre-encoded commands re-sent by a forked child
+void rg_encode_header_pid(rg_byte_t *ptr, const rg_pid_t pid)
+{
+  memcpy(ptr + sizeof(rg_length_t) + sizeof(rg_byte_t), &pid, sizeof(pid));
+}
+
 // Calculates the size of CT_METHODINFO
 rg_short_t rg_encode_methodinfo_size(const rg_event_t *event)
 {
@@ -254,6 +268,32 @@ rg_short_t rg_encode_http_out(rg_byte_t *ptr, rg_event_t *event)
   return size;
 }
 
+// Calculates the size of CT_STRING_DEFINITION
+rg_short_t rg_encode_string_definition_size(const rg_event_t *event)
+{
+  return RG_MIN_PAYLOAD +
+    sizeof(event->data.string_definition.string_id) +
+    sizeof(event->data.string_definition.value.encoding) +
+    sizeof(event->data.string_definition.value.length) +
+    event->data.string_definition.value.length;
+}
+
+// Encodes CT_STRING_DEFINITION (wire protocol v3)
+rg_short_t rg_encode_string_definition(rg_byte_t *ptr, rg_event_t *event)
+{
+  rg_byte_t *offset = ptr;
+  rg_short_t size;
+  memcpy(ptr, &event->data.string_definition.string_id, sizeof(event->data.string_definition.string_id)); ptr+= sizeof(event->data.string_definition.string_id);
+  memcpy(ptr, &event->data.string_definition.value.encoding, sizeof(event->data.string_definition.value.encoding)); ptr+= sizeof(event->data.string_definition.value.encoding);
+  memcpy(ptr, &event->data.string_definition.value.length, sizeof(event->data.string_definition.value.length)); ptr+= sizeof(event->data.string_definition.value.length);
+  memcpy(ptr, event->data.string_definition.value.string, event->data.string_definition.value.length); ptr+= event->data.string_definition.value.length;
+  size = (rg_short_t)(ptr - offset);
+#ifdef RG_DEBUG
+  assert(size + RG_MIN_PAYLOAD == rg_encode_string_definition_size(event));
+#endif
+  return size;
+}
+
 // Calculates the size of a supported variable type (very rarely used as we don't emit arguments by default)
 rg_short_t rg_encode_variableinfo_size(const rg_variable_info_t *variableinfo)
 {
@@ -428,10 +468,489 @@ void rg_encode_batch_header(rg_event_batch_t *batch)
   memcpy(ptr, &batch->type, sizeof(batch->type)); ptr+= sizeof(batch->type);
   memcpy(ptr, &batch->count, sizeof(batch->count)); ptr+= sizeof(batch->count);
   memcpy(ptr, &batch->sequence, sizeof(batch->sequence)); ptr+= sizeof(batch->sequence);
-  memcpy(ptr, &batch->pid, sizeof(batch->pid));
+  memcpy(ptr, &batch->pid, sizeof(batch->pid)); ptr+= sizeof(batch->pid);
+  // The compact framing additionally carries the thread and base timestamp all compact records are relative to
+  if (batch->type == RG_EVENT_BATCH_V3) {
+    memcpy(ptr, &batch->tid, sizeof(batch->tid)); ptr+= sizeof(batch->tid);
+    memcpy(ptr, &batch->timestamp, sizeof(batch->timestamp));
+  }
   batch->sequence +=1;
 }
 
+// Header length for a given batch type, which is also the offset the first command in the batch is encoded at
+rg_short_t rg_batch_headlen(const rg_event_batch_t *batch)
+{
+  return batch->type == RG_EVENT_BATCH_V3 ? RG_BATCH_V3_HEADLEN : RG_BATCH_HEADLEN;
+}
+
+// Number of fragments an encoded event of buflen bytes is split into for frames of at most fragment_size bytes, 0 if the event can't be
+// represented within RG_MAX_FRAGMENTS
+rg_byte_t rg_fragment_count(const rg_length_t buflen, const rg_length_t fragment_size)
+{
+  rg_length_t payload = fragment_size - RG_FRAGMENT_HEADLEN;
+  int count = (buflen + payload - 1) / payload;
+  return count > RG_MAX_FRAGMENTS ? 0 : (rg_byte_t)count;
+}
+
+// Encodes fragment index of the encoded event in buf into frame. Every fragment but the last carries fragment_size - RG_FRAGMENT_HEADLEN
+// bytes of the event, which also lets the receiver infer the offset of a fragment from it's index. All fragments of an event share the
+// group sequence number, which the receiver uses to detect lost fragments and groups. Returns the length of the frame.
+//
+rg_length_t rg_encode_fragment(rg_byte_t *frame, const rg_byte_t *buf, const rg_length_t buflen, const rg_length_t fragment_size, const rg_pid_t pid, const rg_sequence_t group, const rg_byte_t index)
+{
+  rg_byte_t *ptr = frame;
+  rg_byte_t type = RG_EVENT_FRAGMENT;
+  rg_byte_t count = rg_fragment_count(buflen, fragment_size);
+  rg_length_t payload = fragment_size - RG_FRAGMENT_HEADLEN;
+  rg_length_t offset = index * payload;
+  rg_length_t size = (buflen - offset) < payload ? (buflen - offset) : payload;
+  rg_length_t length = RG_FRAGMENT_HEADLEN + size;
+  memcpy(ptr, &length, sizeof(length)); ptr+= sizeof(length);
+  memcpy(ptr, &type, sizeof(type)); ptr+= sizeof(type);
+  memcpy(ptr, &pid, sizeof(pid)); ptr+= sizeof(pid);
+  memcpy(ptr, &group, sizeof(group)); ptr+= sizeof(group);
+  memcpy(ptr, &index, sizeof(index)); ptr+= sizeof(index);
+  memcpy(ptr, &count, sizeof(count)); ptr+= sizeof(count);
+  memcpy(ptr, &buflen, sizeof(buflen)); ptr+= sizeof(buflen);
+  memcpy(ptr, buf + offset, size);
+  return length;
+}
+
+// Whether an encoded frame is a RG_EVENT_FRAGMENT
+int rg_fragment_p(const rg_byte_t *frame, const uint32_t len)
+{
+  return len >= RG_FRAGMENT_HEADLEN && frame[sizeof(rg_length_t)] == RG_EVENT_FRAGMENT;
+}
+
+// Whether a RG_EVENT_FRAGMENT frame is the last fragment of it's group
+int rg_fragment_last_p(const rg_byte_t *frame)
+{
+  const rg_byte_t *ptr = frame + sizeof(rg_length_t) + sizeof(rg_byte_t) + sizeof(rg_pid_t) + sizeof(rg_sequence_t);
+  // Index, then count
+  return ptr[0] + 1 >= ptr[1];
+}
+
+// Calculates the size of an unsigned LEB128 varint
+rg_byte_t rg_varint_size(uint64_t value)
+{
+  rg_byte_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+// Encodes an unsigned LEB128 varint - 7 bits per byte, high bit set on all but the last byte
+rg_byte_t rg_encode_varint(rg_byte_t *ptr, uint64_t value)
+{
+  rg_byte_t *offset = ptr;
+  while (value >= 0x80) {
+    *ptr++ = (rg_byte_t)(value | 0x80);
+    value >>= 7;
+  }
+  *ptr++ = (rg_byte_t)value;
+  return (rg_byte_t)(ptr - offset);
+}
+
+// Decodes an unsigned LEB128 varint, never reading past end. Returns the number of bytes consumed or 0 for a truncated or overlong varint
+rg_byte_t rg_decode_varint(const rg_byte_t *ptr, const rg_byte_t *end, uint64_t *value)
+{
+  const rg_byte_t *offset = ptr;
+  int shift = 0;
+  *value = 0;
+  while (ptr < end && shift < 64) {
+    *value |= (uint64_t)(*ptr & 0x7f) << shift;
+    if (!(*ptr++ & 0x80)) return (rg_byte_t)(ptr - offset);
+    shift += 7;
+  }
+  return 0;
+}
+
+// Timestamp deltas are signed (the wall clock the timestamper uses can step backwards) - zigzag maps small negative and positive deltas to small varints
+static inline uint64_t rg_zigzag_encode(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t rg_zigzag_decode(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// BEGIN and END qualify for a compact v3 record only if they carry no arguments or return value, which is always the case for the default build.
+// SQL and HTTP OUT only once their repeated strings are interned in the connection's string dictionary.
+int rg_encode_v3_compactable(const rg_event_t *event)
+{
+  switch ((rg_event_type_t)event->type) {
+  case RG_EVENT_BEGIN:
+    return event->data.begin.argc == 0;
+  case RG_EVENT_END:
+    return event->data.end.tail_call == 0 && event->data.end.returnvalue.type == RG_VT_VOID && event->data.end.returnvalue.length == 0 && event->data.end.returnvalue.name_length == 0;
+  case RG_EVENT_SQL_INFORMATION:
+    return event->data.sql.provider_id && event->data.sql.host_id && event->data.sql.database_id;
+  case RG_EVENT_HTTP_OUTGOING_INFORMATION:
+    return event->data.http_out.url_prefix_id && event->data.http_out.verb_id && event->data.http_out.url_prefix_length <= event->data.http_out.url.length;
+  default:
+    return 0;
+  }
+}
+
+// Calculates the size of an event appended to a RG_EVENT_BATCH_V3 batch - either a compact record relative to the batch's last compact record, or
+// the v2 encoded event (buflen bytes) embedded behind a record type byte
+rg_short_t rg_encode_v3_record_size(const rg_event_t *event, const rg_length_t buflen, const rg_byte_t instance_ids, const rg_event_batch_t *batch)
+{
+  rg_short_t size;
+  if (!rg_encode_v3_compactable(event) || (batch->tid && batch->tid != event->tid)) {
+    return 1 + buflen;
+  }
+  size = 1 + rg_varint_size(rg_zigzag_encode(batch->tid ? event->timestamp - batch->last_timestamp : 0));
+  switch ((rg_event_type_t)event->type) {
+  case RG_EVENT_BEGIN:
+    size += rg_varint_size(event->data.begin.function_id);
+    if (instance_ids) size += rg_varint_size(event->data.begin.instance_id);
+    break;
+  case RG_EVENT_SQL_INFORMATION:
+    size += rg_varint_size(rg_zigzag_encode(event->data.sql.duration)) +
+      rg_varint_size(event->data.sql.provider_id) +
+      rg_varint_size(event->data.sql.host_id) +
+      rg_varint_size(event->data.sql.database_id) +
+      sizeof(event->data.sql.query.encoding) +
+      rg_varint_size(event->data.sql.query.length) +
+      event->data.sql.query.length;
+    break;
+  case RG_EVENT_HTTP_OUTGOING_INFORMATION:
+    size += rg_varint_size(rg_zigzag_encode(event->data.http_out.duration)) +
+      rg_varint_size(event->data.http_out.status) +
+      rg_varint_size(event->data.http_out.verb_id) +
+      rg_varint_size(event->data.http_out.url_prefix_id) +
+      rg_varint_size(event->data.http_out.url.length - event->data.http_out.url_prefix_length) +
+      event->data.http_out.url.length - event->data.http_out.url_prefix_length;
+    break;
+  default:
+    size += rg_varint_size(event->data.end.function_id);
+  }
+  return size;
+}
+
+// Appends an event to a RG_EVENT_BATCH_V3 batch, compacting BEGIN, END and interned SQL and HTTP OUT of the batch's thread and embedding everything
+// else as-is.
+// Range checks are caller responsibility for overflow etc. - rg_encode_v3_record_size is the size this appends.
+//
+void rg_encode_v3_into_batch(const rg_byte_t *buf, const rg_length_t buflen, const rg_event_t *event, const rg_byte_t instance_ids, rg_event_batch_t *batch)
+{
+  rg_byte_t *ptr = batch->buf + batch->length;
+  rg_byte_t *offset = ptr;
+#ifdef RG_DEBUG
+  rg_short_t size = rg_encode_v3_record_size(event, buflen, instance_ids, batch);
+#endif
+  if (!rg_encode_v3_compactable(event) || (batch->tid && batch->tid != event->tid)) {
+    *ptr++ = RG_V3_RECORD_EMBEDDED;
+    memcpy(ptr, buf, buflen); ptr+= buflen;
+  } else {
+    // The first compact record pins the thread and base timestamp of the batch
+    if (!batch->tid) {
+      batch->tid = event->tid;
+      batch->timestamp = event->timestamp;
+      batch->last_timestamp = event->timestamp;
+    }
+    switch ((rg_event_type_t)event->type) {
+    case RG_EVENT_BEGIN:
+      *ptr++ = RG_V3_RECORD_BEGIN | (instance_ids ? RG_V3_RECORD_INSTANCE_ID : 0);
+      ptr+= rg_encode_varint(ptr, rg_zigzag_encode(event->timestamp - batch->last_timestamp));
+      ptr+= rg_encode_varint(ptr, event->data.begin.function_id);
+      if (instance_ids) ptr+= rg_encode_varint(ptr, event->data.begin.instance_id);
+      break;
+    case RG_EVENT_SQL_INFORMATION:
+      *ptr++ = RG_V3_RECORD_SQL;
+      ptr+= rg_encode_varint(ptr, rg_zigzag_encode(event->timestamp - batch->last_timestamp));
+      ptr+= rg_encode_varint(ptr, rg_zigzag_encode(event->data.sql.duration));
+      ptr+= rg_encode_varint(ptr, event->data.sql.provider_id);
+      ptr+= rg_encode_varint(ptr, event->data.sql.host_id);
+      ptr+= rg_encode_varint(ptr, event->data.sql.database_id);
+      *ptr++ = event->data.sql.query.encoding;
+      ptr+= rg_encode_varint(ptr, event->data.sql.query.length);
+      memcpy(ptr, event->data.sql.query.string, event->data.sql.query.length); ptr+= event->data.sql.query.length;
+      break;
+    case RG_EVENT_HTTP_OUTGOING_INFORMATION:
+      *ptr++ = RG_V3_RECORD_HTTP_OUT;
+      ptr+= rg_encode_varint(ptr, rg_zigzag_encode(event->timestamp - batch->last_timestamp));
+      ptr+= rg_encode_varint(ptr, rg_zigzag_encode(event->data.http_out.duration));
+      ptr+= rg_encode_varint(ptr, event->data.http_out.status);
+      ptr+= rg_encode_varint(ptr, event->data.http_out.verb_id);
+      ptr+= rg_encode_varint(ptr, event->data.http_out.url_prefix_id);
+      ptr+= rg_encode_varint(ptr, event->data.http_out.url.length - event->data.http_out.url_prefix_length);
+      memcpy(ptr, event->data.http_out.url.string + event->data.http_out.url_prefix_length, event->data.http_out.url.length - event->data.http_out.url_prefix_length);
+      ptr+= event->data.http_out.url.length - event->data.http_out.url_prefix_length;
+      break;
+    default:
+      *ptr++ = RG_V3_RECORD_END;
+      ptr+= rg_encode_varint(ptr, rg_zigzag_encode(event->timestamp - batch->last_timestamp));
+      ptr+= rg_encode_varint(ptr, event->data.end.function_id);
+    }
+    batch->last_timestamp = event->timestamp;
+  }
+#ifdef RG_DEBUG
+  assert((rg_short_t)(ptr - offset) == size);
+#endif
+  batch->length += (rg_length_t)(ptr - offset);
+  batch->count += 1;
+}
+
+// Allocates state for the stand-in decoder - the string dictionary of a single connection
+rg_decoder_t *rg_decoder_alloc()
+{
+  return calloc(1, sizeof(rg_decoder_t));
+}
+
+// Frees the stand-in decoder and any strings it learned
+void rg_decoder_free(rg_decoder_t *decoder)
+{
+  if (!decoder) return;
+  for (int i = 0; i <= RG_MAX_INTERNED_STRINGS; i++) free(decoder->strings[i]);
+  free(decoder);
+}
+
+// Learns (or redefines, which is the case on re-sync) a string dictionary entry from an embedded CT_STRING_DEFINITION. Returns 0 for a malformed
+// definition.
+static int rg_decoder_define_string(rg_decoder_t *decoder, const rg_byte_t *ptr, const rg_length_t size)
+{
+  rg_string_id_t string_id;
+  rg_encoded_string_t *value;
+  rg_length_t length;
+  if (size < RG_MIN_PAYLOAD + (rg_length_t)(sizeof(string_id) + sizeof(value->encoding) + sizeof(length))) return 0;
+  ptr+= RG_MIN_PAYLOAD;
+  memcpy(&string_id, ptr, sizeof(string_id)); ptr+= sizeof(string_id);
+  memcpy(&length, ptr + sizeof(value->encoding), sizeof(length));
+  if (!string_id || string_id > RG_MAX_INTERNED_STRINGS || length < 0 || length > RG_MAX_INTERNED_STRING_SIZE) return 0;
+  if (size != RG_MIN_PAYLOAD + (rg_length_t)(sizeof(string_id) + sizeof(value->encoding) + sizeof(length)) + length) return 0;
+  if (!(value = decoder->strings[string_id])) {
+    if (!(value = decoder->strings[string_id] = malloc(sizeof(rg_encoded_string_t)))) return 0;
+  }
+  memcpy(&value->encoding, ptr, sizeof(value->encoding)); ptr+= sizeof(value->encoding);
+  value->length = length; ptr+= sizeof(length);
+  memcpy(value->string, ptr, length);
+  return 1;
+}
+
+// Resolves a string dictionary ID referred to by a compact record, NULL if not defined (yet)
+static inline const rg_encoded_string_t *rg_decoder_string(const rg_decoder_t *decoder, const uint64_t string_id)
+{
+  if (!string_id || string_id > RG_MAX_INTERNED_STRINGS) return NULL;
+  return decoder->strings[string_id];
+}
+
+static inline void rg_decoder_copy_string(rg_encoded_string_t *dst, const rg_encoded_string_t *src)
+{
+  dst->encoding = src->encoding;
+  dst->length = src->length;
+  memcpy(dst->string, src->string, src->length);
+}
+
+// Reassembles a RG_EVENT_FRAGMENT frame into the event in flight and yields the event to the callback once all of it's fragments arrived. A
+// fragment of another group abandons the group in flight, which is counted as lost, as are groups skipped over in the group sequence.
+// Returns 1 when an event was reassembled, 0 while fragments are still missing and -1 on a malformed fragment.
+//
+static int rg_decode_fragment(rg_decoder_t *decoder, const rg_byte_t *buf, const rg_length_t buflen, int(*callback)(const rg_byte_t *encoded, const rg_length_t size, void *userdata), void *userdata)
+{
+  const rg_byte_t *ptr = buf;
+  rg_length_t length, total, offset, size;
+  rg_pid_t pid;
+  rg_sequence_t group;
+  rg_byte_t index, count;
+
+  if (buflen <= RG_FRAGMENT_HEADLEN) return -1;
+  memcpy(&length, ptr, sizeof(length)); ptr+= sizeof(length) + sizeof(rg_byte_t);
+  memcpy(&pid, ptr, sizeof(pid)); ptr+= sizeof(pid);
+  memcpy(&group, ptr, sizeof(group)); ptr+= sizeof(group);
+  memcpy(&index, ptr, sizeof(index)); ptr+= sizeof(index);
+  memcpy(&count, ptr, sizeof(count)); ptr+= sizeof(count);
+  memcpy(&total, ptr, sizeof(total)); ptr+= sizeof(total);
+  size = buflen - RG_FRAGMENT_HEADLEN;
+  // The reassembly buffer fits any positive rg_length_t
+  if (length != buflen || !count || index >= count || total < RG_MIN_PAYLOAD) return -1;
+
+  // A new group - abandon the one in flight and account for any groups that never showed up at all
+  if (!decoder->fragment_count || decoder->fragment_pid != pid || decoder->fragment_group != group) {
+    if (decoder->fragment_count) decoder->fragment_groups_lost++;
+    if (decoder->fragment_next_group && decoder->fragment_pid == pid && (int32_t)(group - decoder->fragment_next_group) > 0) {
+      decoder->fragment_groups_lost += group - decoder->fragment_next_group;
+    }
+    decoder->fragment_pid = pid;
+    decoder->fragment_group = group;
+    decoder->fragment_next_group = group + 1;
+    decoder->fragment_count = count;
+    decoder->fragments_received = 0;
+    decoder->fragment_length = total;
+    memset(decoder->fragment_received, 0, sizeof(decoder->fragment_received));
+  } else if (count != decoder->fragment_count || total != decoder->fragment_length) {
+    return -1;
+  }
+
+  // All fragments but the last are of the same size, the last one fills up the tail of the event
+  offset = (index == count - 1) ? total - size : index * size;
+  if (offset > total || size > total - offset) return -1;
+  // Duplicate datagram
+  if (decoder->fragment_received[index / 8] & (1 << (index % 8))) return 0;
+  decoder->fragment_received[index / 8] |= (1 << (index % 8));
+  decoder->fragments_received++;
+  memcpy(decoder->reassembled + offset, ptr, size);
+  if (decoder->fragments_received < decoder->fragment_count) return 0;
+
+  decoder->fragment_count = 0;
+  memcpy(&length, decoder->reassembled, sizeof(length));
+  if (length != total) return -1;
+  callback(decoder->reassembled, total, userdata);
+  return 1;
+}
+
+// Reads the next varint of a compact record into value or bails out of rg_decode_batch on a truncated record
+#define RG_DECODE_VARINT(value) \
+  if (!(consumed = rg_decode_varint(ptr, end, &(value)))) return -1; \
+  ptr+= consumed;
+
+// Stand-in decoder for the compact framing (the Agent owns the real one) that expands each command of a v2 or v3 batch back to it's v2 wire
+// representation and yields it to the callback. Used by tests to assert both framings describe the same stream of events. String definitions are
+// learned as they're seen and the decoder needs to be fed all batches of a connection, in order. Compressed batch frames are inflated first and
+// fragments are reassembled into the event they split up.
+// Returns the number of commands decoded or -1 on a malformed batch or a reference to an undefined string.
+//
+int rg_decode_batch(rg_decoder_t *decoder, const rg_byte_t *buf, const rg_length_t buflen, int(*callback)(const rg_byte_t *encoded, const rg_length_t size, void *userdata), void *userdata)
+{
+  rg_event_batch_t batch;
+  rg_event_t *event = &decoder->event;
+  const rg_encoded_string_t *string;
+  const rg_byte_t *ptr = buf, *end = buf + buflen;
+  rg_length_t size, headlen;
+  rg_byte_t record, consumed;
+  uint64_t value;
+  int count = 0;
+
+  if (buflen >= RG_BATCH_COMPRESSED_HEADLEN && buf[sizeof(batch.length)] == RG_EVENT_BATCH_COMPRESSED) {
+    memcpy(&batch.length, ptr, sizeof(batch.length)); ptr+= sizeof(batch.length) + sizeof(batch.type);
+    memcpy(&size, ptr, sizeof(size)); ptr+= sizeof(size);
+    // The inflate buffer fits any positive rg_length_t
+    if (batch.length != buflen || size < RG_BATCH_HEADLEN) return -1;
+    if (rg_decompress(ptr, buflen - RG_BATCH_COMPRESSED_HEADLEN, decoder->inflated, size) != size) return -1;
+    // Compressed frames don't nest
+    if (decoder->inflated[sizeof(batch.length)] == RG_EVENT_BATCH_COMPRESSED) return -1;
+    return rg_decode_batch(decoder, decoder->inflated, size, callback, userdata);
+  }
+
+  if (buflen >= RG_FRAGMENT_HEADLEN && buf[sizeof(batch.length)] == RG_EVENT_FRAGMENT) {
+    return rg_decode_fragment(decoder, buf, buflen, callback, userdata);
+  }
+
+  if (buflen < RG_BATCH_HEADLEN) return -1;
+  memcpy(&batch.length, ptr, sizeof(batch.length)); ptr+= sizeof(batch.length);
+  memcpy(&batch.type, ptr, sizeof(batch.type)); ptr+= sizeof(batch.type);
+  memcpy(&batch.count, ptr, sizeof(batch.count)); ptr+= sizeof(batch.count);
+  memcpy(&batch.sequence, ptr, sizeof(batch.sequence)); ptr+= sizeof(batch.sequence);
+  memcpy(&batch.pid, ptr, sizeof(batch.pid)); ptr+= sizeof(batch.pid);
+  headlen = rg_batch_headlen(&batch);
+  if (batch.length != buflen || buflen < headlen) return -1;
+  if (batch.type == RG_EVENT_BATCH_V3) {
+    memcpy(&batch.tid, ptr, sizeof(batch.tid)); ptr+= sizeof(batch.tid);
+    memcpy(&batch.timestamp, ptr, sizeof(batch.timestamp)); ptr+= sizeof(batch.timestamp);
+  } else if (batch.type != RG_EVENT_BATCH) {
+    return -1;
+  }
+  batch.last_timestamp = batch.timestamp;
+
+  while (ptr < end) {
+    record = RG_V3_RECORD_EMBEDDED;
+    if (batch.type == RG_EVENT_BATCH_V3) record = *ptr++;
+
+    if (record == RG_V3_RECORD_EMBEDDED) {
+      if (end - ptr < RG_MIN_PAYLOAD) return -1;
+      memcpy(&size, ptr, sizeof(size));
+      if (size < RG_MIN_PAYLOAD || size > end - ptr) return -1;
+      if (ptr[sizeof(size)] == RG_EVENT_STRING_DEFINITION && !rg_decoder_define_string(decoder, ptr, size)) return -1;
+      callback(ptr, size, userdata);
+      ptr+= size;
+    } else {
+      event->pid = batch.pid;
+      event->tid = batch.tid;
+      RG_DECODE_VARINT(value);
+      event->timestamp = batch.last_timestamp + rg_zigzag_decode(value);
+      batch.last_timestamp = event->timestamp;
+      switch (record & ~RG_V3_RECORD_INSTANCE_ID) {
+      case RG_V3_RECORD_BEGIN:
+        event->type = RG_EVENT_BEGIN;
+        RG_DECODE_VARINT(value);
+        event->data.begin.function_id = (rg_function_id_t)value;
+        event->data.begin.instance_id = 0;
+        event->data.begin.argc = 0;
+        if (record & RG_V3_RECORD_INSTANCE_ID) {
+          RG_DECODE_VARINT(value);
+          event->data.begin.instance_id = (rg_instance_id_t)value;
+        }
+        size = rg_encode_begin(decoder->buf + RG_MIN_PAYLOAD, event);
+        break;
+      case RG_V3_RECORD_END:
+        event->type = RG_EVENT_END;
+        RG_DECODE_VARINT(value);
+        event->data.end.function_id = (rg_function_id_t)value;
+        event->data.end.tail_call = 0;
+        memset(&event->data.end.returnvalue, 0, sizeof(event->data.end.returnvalue));
+        event->data.end.returnvalue.type = RG_VT_VOID;
+        size = rg_encode_end(decoder->buf + RG_MIN_PAYLOAD, event);
+        break;
+      case RG_V3_RECORD_SQL:
+        event->type = RG_EVENT_SQL_INFORMATION;
+        RG_DECODE_VARINT(value);
+        event->data.sql.duration = rg_zigzag_decode(value);
+        RG_DECODE_VARINT(value);
+        if (!(string = rg_decoder_string(decoder, value))) return -1;
+        rg_decoder_copy_string(&event->data.sql.provider, string);
+        RG_DECODE_VARINT(value);
+        if (!(string = rg_decoder_string(decoder, value))) return -1;
+        rg_decoder_copy_string(&event->data.sql.host, string);
+        RG_DECODE_VARINT(value);
+        if (!(string = rg_decoder_string(decoder, value))) return -1;
+        rg_decoder_copy_string(&event->data.sql.database, string);
+        if (ptr >= end) return -1;
+        event->data.sql.query.encoding = *ptr++;
+        RG_DECODE_VARINT(value);
+        if (value > RG_MAX_STRING_SIZE || (int64_t)value > end - ptr) return -1;
+        event->data.sql.query.length = (rg_length_t)value;
+        memcpy(event->data.sql.query.string, ptr, value); ptr+= value;
+        size = rg_encode_sql(decoder->buf + RG_MIN_PAYLOAD, event);
+        break;
+      case RG_V3_RECORD_HTTP_OUT:
+        event->type = RG_EVENT_HTTP_OUTGOING_INFORMATION;
+        RG_DECODE_VARINT(value);
+        event->data.http_out.duration = rg_zigzag_decode(value);
+        RG_DECODE_VARINT(value);
+        event->data.http_out.status = (uint16_t)value;
+        RG_DECODE_VARINT(value);
+        if (!(string = rg_decoder_string(decoder, value)) || string->length > UINT8_MAX) return -1;
+        event->data.http_out.verb.encoding = string->encoding;
+        event->data.http_out.verb.length = (rg_byte_t)string->length;
+        memcpy(event->data.http_out.verb.string, string->string, string->length);
+        RG_DECODE_VARINT(value);
+        if (!(string = rg_decoder_string(decoder, value))) return -1;
+        rg_decoder_copy_string(&event->data.http_out.url, string);
+        RG_DECODE_VARINT(value);
+        if (value > (uint64_t)(RG_MAX_STRING_SIZE - string->length) || (int64_t)value > end - ptr) return -1;
+        memcpy(event->data.http_out.url.string + string->length, ptr, value); ptr+= value;
+        event->data.http_out.url.length += (rg_length_t)value;
+        size = rg_encode_http_out(decoder->buf + RG_MIN_PAYLOAD, event);
+        break;
+      default:
+        return -1;
+      }
+      event->length = RG_MIN_PAYLOAD + size;
+      rg_encode_header_impl(decoder->buf, event);
+      callback(decoder->buf, event->length, userdata);
+    }
+    count++;
+  }
+  return count == batch.count ? count : -1;
+}
+
+#undef RG_DECODE_VARINT
+
 // Calculates the size of CT_PROCESS_FREQUENCY
 rg_short_t rg_encode_process_frequency_size(const rg_event_t *event)
 {
@@ -484,6 +1003,29 @@ int rg_begin_transaction(rg_context_t *context, void *userdata, rg_tid_t tid, rg
   return context->sink(context, userdata, &event, RG_MIN_PAYLOAD+size);
 }
 
+// Encodes the payload of CT_BEGIN_TRANSACTION into a template, for rg_begin_transaction_from_template to emit without encoding the strings again
+void rg_begin_transaction_template(rg_begin_transaction_template_t *begin_transaction, rg_encoded_string_t *api_key, rg_encoded_string_t *technology_type, rg_encoded_string_t *process_type)
+{
+  begin_transaction->event.type = RG_EVENT_BEGIN_TRANSACTION;
+  begin_transaction->event.data.begin_transaction.api_key = *api_key;
+  begin_transaction->event.data.begin_transaction.technology_type = *technology_type;
+  begin_transaction->event.data.begin_transaction.process_type = *process_type;
+  begin_transaction->size = rg_encode_begin_transaction(begin_transaction->payload, &begin_transaction->event);
+}
+
+// Emits CT_BEGIN_TRANSACTION from a template - only the header is encoded, the payload is copied as is. The template's event is reused and the
+// sink may only refer to it for the duration of the sink callback, as with any other event.
+int rg_begin_transaction_from_template(rg_context_t *context, void *userdata, rg_tid_t tid, rg_begin_transaction_template_t *begin_transaction)
+{
+  rg_event_t *event = &begin_transaction->event;
+  event->tid = tid;
+
+  memcpy(context->buf + RG_MIN_PAYLOAD, begin_transaction->payload, begin_transaction->size);
+  rg_encode_header(context, event, context->buf, RG_MIN_PAYLOAD + begin_transaction->size);
+
+  return context->sink(context, userdata, event, RG_MIN_PAYLOAD + begin_transaction->size);
+}
+
 // Helper function called from Ruby (but any generic implementation really) to encode and emit CT_END_TRANSACTION to the configured sink on context
 int rg_end_transaction(rg_context_t *context, void *userdata, rg_tid_t tid)
 {
@@ -615,7 +1157,7 @@ int rg_exception_thrown(rg_context_t *context, void *userdata, rg_tid_t tid, rg_
 }
 
 // Helper function called from Ruby (but any generic implementation really) to encode and emit CT_METHODINFO to the configured sink on context
-int rg_methodinfo(rg_context_t *context, void *userdata, rg_tid_t tid, rg_method_t *method, rg_encoded_string_t class_name, rg_encoded_string_t method_name)
+int rg_methodinfo(rg_context_t *context, void *userdata, rg_tid_t tid, rg_method_t *method, rg_arena_t *arena, rg_encoded_string_t class_name, rg_encoded_string_t method_name)
 {
   rg_event_t event;
   rg_length_t size;
@@ -629,12 +1171,30 @@ int rg_methodinfo(rg_context_t *context, void *userdata, rg_tid_t tid, rg_method
   rg_encode_header(context, &event, context->buf, RG_MIN_PAYLOAD + size);
 
   // Save a copy of the encoded event so we can emit it at intervals
-  // back to the agent by stubbing out the tid value of the timer thread
-  method->encoded_size = RG_MIN_PAYLOAD+size;
-  method->encoded = malloc(method->encoded_size);
-  memcpy(method->encoded, context->buf, method->encoded_size);
+  // back to the agent by stubbing out the tid value of the timer thread. Not saved (and thus not synced) on allocation failure.
+  method->encoded = rg_arena_dup(arena, context->buf, RG_MIN_PAYLOAD+size);
+  method->encoded_size = method->encoded ? RG_MIN_PAYLOAD+size : 0;
+
+  return context->sink(context, userdata, &event, RG_MIN_PAYLOAD+size);
+}
 
-  return context->sink(context, userdata, &event, method->encoded_size);
+// Helper function called from Ruby (but any generic implementation really) to encode and emit CT_STRING_DEFINITION to the configured sink on context.
+// Only the first value->length bytes of the string are read, callers are free to pass a truncated allocation.
+int rg_string_definition(rg_context_t *context, void *userdata, rg_tid_t tid, rg_string_id_t string_id, const rg_encoded_string_t *value)
+{
+  rg_event_t event;
+  rg_length_t size;
+  event.type = RG_EVENT_STRING_DEFINITION;
+  event.tid = tid;
+  event.data.string_definition.string_id = string_id;
+  event.data.string_definition.value.encoding = value->encoding;
+  event.data.string_definition.value.length = value->length;
+  memcpy(event.data.string_definition.value.string, value->string, value->length);
+
+  size = rg_encode_string_definition(context->buf + RG_MIN_PAYLOAD, &event);
+  rg_encode_header(context, &event, context->buf, RG_MIN_PAYLOAD + size);
+
+  return context->sink(context, userdata, &event, RG_MIN_PAYLOAD+size);
 }
 
 // Helper function called from Ruby (but any generic implementation really) to encode and emit CT_BEGIN to the configured sink on context
@@ -704,6 +1264,9 @@ rg_short_t rg_encode_size(const rg_event_t *event)
   case RG_EVENT_HTTP_OUTGOING_INFORMATION:
     return rg_encode_http_out_size(event);
   case RG_EVENT_BATCH:
+  case RG_EVENT_BATCH_V3:
+  case RG_EVENT_BATCH_COMPRESSED:
+  case RG_EVENT_FRAGMENT:
     // XXX not defined, picked up as failure in X compile flows
     return 0;//rg_encode_batch_size(event);
   case RG_EVENT_PROCESS_FREQUENCY:
@@ -716,6 +1279,8 @@ rg_short_t rg_encode_size(const rg_event_t *event)
     return rg_encode_begin_transaction_size(event);
   case RG_EVENT_THREAD_STARTED_2:
     return rg_encode_thread_started_size(event);
+  case RG_EVENT_STRING_DEFINITION:
+    return rg_encode_string_definition_size(event);
   case RG_EVENT_THREAD_ENDED:
   case RG_EVENT_PROCESS_ENDED:
   case RG_EVENT_END_TRANSACTION:
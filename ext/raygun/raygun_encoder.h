@@ -3,6 +3,7 @@
 
 #include "raygun_protocol.h"
 #include "raygun_platform.h"
+#include "raygun_arena.h"
 
 struct rg_context_t;
 
@@ -20,10 +21,32 @@ typedef struct rg_context {
   rg_byte_t buf[RG_ENCODER_SCRATCH_BUFFER_SIZE];
 } rg_context_t;
 
+// Stand-in decoder state for the compact framing - the string dictionary of a single connection as learned from CT_STRING_DEFINITION commands
+// and scratch space for expanding compact records back to v2 commands.
+typedef struct rg_decoder {
+  rg_encoded_string_t *strings[RG_MAX_INTERNED_STRINGS + 1];
+  rg_event_t event;
+  rg_byte_t buf[RG_ENCODER_SCRATCH_BUFFER_SIZE];
+  // The batch a RG_EVENT_BATCH_COMPRESSED frame inflates to
+  rg_byte_t inflated[RG_MAX_STREAM_BATCH_PACKET_SIZE];
+  // Reassembly of RG_EVENT_FRAGMENT frames - one fragment group (event) in flight at a time as the sink emits the fragments of a group
+  // back to back. Groups abandoned with fragments missing or skipped over entirely are counted as lost.
+  rg_pid_t fragment_pid;
+  rg_sequence_t fragment_group;
+  rg_sequence_t fragment_next_group;
+  rg_byte_t fragment_count;
+  rg_byte_t fragments_received;
+  rg_byte_t fragment_received[(RG_MAX_FRAGMENTS + 7) / 8];
+  rg_length_t fragment_length;
+  size_t fragment_groups_lost;
+  rg_byte_t reassembled[RG_MAX_STREAM_BATCH_PACKET_SIZE];
+} rg_decoder_t;
+
 // Core encoder API
 
 rg_short_t rg_encode_header(rg_context_t *context, rg_event_t *event, rg_byte_t *ptr, const rg_length_t size);
 rg_short_t rg_encode_header_impl(rg_byte_t *ptr, rg_event_t *event);
+void rg_encode_header_pid(rg_byte_t *ptr, const rg_pid_t pid);
 
 rg_short_t rg_encode_thread_started(rg_byte_t *ptr, rg_event_t *event);
 rg_short_t rg_encode_exception_thrown(rg_byte_t *ptr, rg_event_t *event);
@@ -34,15 +57,34 @@ rg_short_t rg_encode_end(rg_byte_t *ptr, rg_event_t *event);
 rg_short_t rg_encode_sql(rg_byte_t *ptr, rg_event_t *event);
 rg_short_t rg_encode_http_in(rg_byte_t *ptr, rg_event_t *event);
 rg_short_t rg_encode_http_out(rg_byte_t *ptr, rg_event_t *event);
+rg_short_t rg_encode_string_definition(rg_byte_t *ptr, rg_event_t *event);
 void rg_encode_batch_header(rg_event_batch_t *batch);
 void rg_encode_into_batch(const rg_byte_t *buf, const rg_length_t buflen, rg_event_batch_t *batch);
+rg_short_t rg_batch_headlen(const rg_event_batch_t *batch);
+rg_byte_t rg_fragment_count(const rg_length_t buflen, const rg_length_t fragment_size);
+int rg_fragment_p(const rg_byte_t *frame, const uint32_t len);
+int rg_fragment_last_p(const rg_byte_t *frame);
+rg_length_t rg_encode_fragment(rg_byte_t *frame, const rg_byte_t *buf, const rg_length_t buflen, const rg_length_t fragment_size, const rg_pid_t pid, const rg_sequence_t group, const rg_byte_t index);
 rg_short_t rg_encode_begin_transaction(rg_byte_t *ptr, rg_event_t *event);
 rg_short_t rg_encode_process_type(rg_byte_t *ptr, rg_event_t *event);
 rg_short_t rg_encode_size(const rg_event_t *event);
 
+// Compact framing (wire protocol v3) API
+
+rg_byte_t rg_varint_size(uint64_t value);
+rg_byte_t rg_encode_varint(rg_byte_t *ptr, uint64_t value);
+rg_byte_t rg_decode_varint(const rg_byte_t *ptr, const rg_byte_t *end, uint64_t *value);
+int rg_encode_v3_compactable(const rg_event_t *event);
+rg_short_t rg_encode_v3_record_size(const rg_event_t *event, const rg_length_t buflen, const rg_byte_t instance_ids, const rg_event_batch_t *batch);
+void rg_encode_v3_into_batch(const rg_byte_t *buf, const rg_length_t buflen, const rg_event_t *event, const rg_byte_t instance_ids, rg_event_batch_t *batch);
+rg_decoder_t *rg_decoder_alloc();
+void rg_decoder_free(rg_decoder_t *decoder);
+int rg_decode_batch(rg_decoder_t *decoder, const rg_byte_t *buf, const rg_length_t buflen, int(*callback)(const rg_byte_t *encoded, const rg_length_t size, void *userdata), void *userdata);
+
 // Context init
 
 rg_context_t *rg_context_alloc();
+void rg_context_forked(rg_context_t *context);
 
 // Event handler APIs - encodes to raw wire protocol and invokes the sink callback function
 
@@ -54,7 +96,8 @@ int rg_thread_started(rg_context_t *context, void *userdata, rg_thread_t *th);
 int rg_thread_ended(rg_context_t *context, void *userdata, rg_tid_t tid);
 
 int rg_exception_thrown(rg_context_t *context, void *userdata, rg_tid_t tid, rg_exception_instance_id_t exception, rg_encoded_string_t class_name, rg_encoded_string_t correlation_id);
-int rg_methodinfo(rg_context_t *context, void *userdata, rg_tid_t tid, rg_method_t *method, rg_encoded_string_t class_name, rg_encoded_string_t method_name);
+int rg_methodinfo(rg_context_t *context, void *userdata, rg_tid_t tid, rg_method_t *method, rg_arena_t *arena, rg_encoded_string_t class_name, rg_encoded_string_t method_name);
+int rg_string_definition(rg_context_t *context, void *userdata, rg_tid_t tid, rg_string_id_t string_id, const rg_encoded_string_t *value);
 #ifdef RB_RG_EMIT_ARGUMENTS
 int rg_begin(rg_context_t *context, void *userdata, rg_tid_t tid, rg_function_id_t func, rg_instance_id_t instance, rg_argc_t argc, rg_variable_info_t args[]);
 int rg_end(rg_context_t *context, void *userdata, rg_tid_t tid, rg_function_id_t func, rg_variable_info_t *returnvalue);
@@ -66,4 +109,7 @@ int rg_end(rg_context_t *context, void *userdata, rg_tid_t tid, rg_function_id_t
 int rg_begin_transaction(rg_context_t *context, void *userdata, rg_tid_t tid, rg_encoded_string_t api_key, rg_encoded_string_t technology_type, rg_encoded_string_t process_type);
 int rg_end_transaction(rg_context_t *context, void *userdata, rg_tid_t tid);
 
+void rg_begin_transaction_template(rg_begin_transaction_template_t *begin_transaction, rg_encoded_string_t *api_key, rg_encoded_string_t *technology_type, rg_encoded_string_t *process_type);
+int rg_begin_transaction_from_template(rg_context_t *context, void *userdata, rg_tid_t tid, rg_begin_transaction_template_t *begin_transaction);
+
 #endif
@@ -439,7 +439,14 @@ VALUE rb_rg_event_encoded(VALUE obj)
       rg_encode_header_impl(buf, event);
       rg_encode_exception_thrown(buf + RG_MIN_PAYLOAD, event);
       break;
+    case RG_EVENT_STRING_DEFINITION:
+      rg_encode_header_impl(buf, event);
+      rg_encode_string_definition(buf + RG_MIN_PAYLOAD, event);
+      break;
     case RG_EVENT_BATCH:
+    case RG_EVENT_BATCH_V3:
+    case RG_EVENT_BATCH_COMPRESSED:
+    case RG_EVENT_FRAGMENT:
       break;
     case RG_EVENT_THREAD_STARTED_2:
       rg_encode_header_impl(buf, event);
@@ -1,3 +1,4 @@
+#include "extconf.h"
 #include "raygun_ext.h"
 
 VALUE rb_mRaygun;
@@ -6,6 +7,11 @@ VALUE rb_mRaygunApm;
 // The main extension initializer called by the Ruby VM (Init_* convetion)
 void Init_raygun_ext()
 {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  // Tracers are usable from within any Ractor - all tracer state (encoder context, method and thread tables, sink) is per Tracer instance
+  // and Tracer instances are not shareable, thus each Ractor traces through it's own. Process wide state is immutable once initialized.
+  rb_ext_ractor_safe(true);
+#endif
   // Public Ruby API
   rb_mRaygun = rb_define_module("Raygun");
   rb_mRaygunApm = rb_define_module_under(rb_mRaygun, "Apm");
@@ -15,5 +21,6 @@ void Init_raygun_ext()
   _init_raygun_tracer();
   _init_raygun_event();
   _init_raygun_ringbuf();
+  _init_raygun_decoder();
   _init_raygun_errors();
 }
@@ -11,6 +11,7 @@ extern VALUE rb_mRaygunApm;
 #include "raygun_tracer.h"
 #include "raygun_event.h"
 #include "raygun_ringbuf.h"
+#include "raygun_decoder.h"
 #include "raygun_trace_context.h"
 
 #endif
@@ -0,0 +1,273 @@
+#include "raygun.h"
+#include "raygun_platform.h"
+#include "raygun_method_cache.h"
+
+typedef struct _rg_method_cache_entry_t {
+  uint64_t hash;
+  const unsigned char *name;
+  uint16_t length;
+  rg_byte_t classification;
+  rg_byte_t source;
+  uint16_t class_name_length;
+  uint16_t method_name_length;
+  // Position in the cache and then the log - of duplicate names, the last one wins
+  uint32_t order;
+} rg_method_cache_entry_t;
+
+static inline uint16_t rg_method_cache_u16(const rg_byte_t *p)
+{
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t rg_method_cache_u32(const rg_byte_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t rg_method_cache_u64(const rg_byte_t *p)
+{
+  return (uint64_t)rg_method_cache_u32(p) | ((uint64_t)rg_method_cache_u32(p + 4) << 32);
+}
+
+static inline void rg_method_cache_put_u16(rg_byte_t *p, const uint16_t value)
+{
+  p[0] = (rg_byte_t)value;
+  p[1] = (rg_byte_t)(value >> 8);
+}
+
+static inline void rg_method_cache_put_u32(rg_byte_t *p, const uint32_t value)
+{
+  rg_method_cache_put_u16(p, (uint16_t)value);
+  rg_method_cache_put_u16(p + 2, (uint16_t)(value >> 16));
+}
+
+static inline void rg_method_cache_put_u64(rg_byte_t *p, const uint64_t value)
+{
+  rg_method_cache_put_u32(p, (uint32_t)value);
+  rg_method_cache_put_u32(p + 4, (uint32_t)(value >> 32));
+}
+
+// FNV-1a - the hash is persisted, thus can't be Ruby's per process seeded string hash
+static uint64_t rg_method_cache_hash(const unsigned char *name, const size_t name_len)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < name_len; i++) {
+    hash ^= name[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Maps a cache file and validates it - the record bounds are checked up front so lookups can trust the mapped records. Returns NULL if the file does
+// not exist or is malformed.
+rg_method_cache_t *rg_method_cache_open(const char *path)
+{
+  rg_method_cache_t *cache;
+  const rg_byte_t *data, *record;
+  size_t size = 0;
+  uint32_t count, strings_size, i;
+
+  data = rg_map_file(path, &size);
+  if (!data) return NULL;
+  if (size < RG_METHOD_CACHE_HEADER_SIZE || memcmp(data, RG_METHOD_CACHE_MAGIC, 4) != 0 || data[4] != RG_METHOD_CACHE_FORMAT_VERSION) goto malformed;
+  count = rg_method_cache_u32(data + 8);
+  strings_size = rg_method_cache_u32(data + 12);
+  if ((size - RG_METHOD_CACHE_HEADER_SIZE) / RG_METHOD_CACHE_RECORD_SIZE < count) goto malformed;
+  if (size != RG_METHOD_CACHE_HEADER_SIZE + (size_t)count * RG_METHOD_CACHE_RECORD_SIZE + strings_size) goto malformed;
+  for (i = 0; i < count; i++) {
+    record = data + RG_METHOD_CACHE_HEADER_SIZE + (size_t)i * RG_METHOD_CACHE_RECORD_SIZE;
+    if ((size_t)rg_method_cache_u32(record + 8) + rg_method_cache_u16(record + 12) + rg_method_cache_u16(record + 16) + rg_method_cache_u16(record + 18) > strings_size) goto malformed;
+    if (record[14] != RG_BLACKLIST_WHITELISTED && record[14] != RG_BLACKLIST_BLACKLISTED) goto malformed;
+    if (rg_method_cache_u16(record + 16) > RG_MAX_STRING_SIZE || rg_method_cache_u16(record + 18) > RG_MAX_STRING_SIZE) goto malformed;
+  }
+
+  cache = calloc(1, sizeof(rg_method_cache_t));
+  if (!cache) goto malformed;
+  cache->data = data;
+  cache->size = size;
+  cache->count = count;
+  cache->records = data + RG_METHOD_CACHE_HEADER_SIZE;
+  cache->strings = cache->records + (size_t)count * RG_METHOD_CACHE_RECORD_SIZE;
+  cache->strings_size = strings_size;
+  return cache;
+
+malformed:
+  rg_unmap_file(data, size);
+  return NULL;
+}
+
+void rg_method_cache_close(rg_method_cache_t *cache)
+{
+  if (!cache) return;
+  rg_unmap_file(cache->data, cache->size);
+  free(cache);
+}
+
+// The mapped file is accounted for as well, although it's pages are shared with other processes that mapped it
+size_t rg_method_cache_size(const rg_method_cache_t *cache)
+{
+  if (!cache) return 0;
+  return sizeof(rg_method_cache_t) + cache->size;
+}
+
+// Binary search for the first record with the hash of the name, then compares names of the records with the same hash. Returns 1 and fills in the
+// classification, source and encoded class and method names (empty for blacklisted methods) if found, 0 otherwise. The encoding of the names is left
+// as is.
+int rg_method_cache_lookup(const rg_method_cache_t *cache, const unsigned char *name, const size_t name_len, rg_byte_t *classification, rg_byte_t *source, rg_encoded_string_t *class_name, rg_encoded_string_t *method_name)
+{
+  uint64_t hash = rg_method_cache_hash(name, name_len);
+  uint32_t low = 0, high = cache->count, mid;
+  const rg_byte_t *record, *strings;
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (rg_method_cache_u64(cache->records + (size_t)mid * RG_METHOD_CACHE_RECORD_SIZE) < hash) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  for (; low < cache->count; low++) {
+    record = cache->records + (size_t)low * RG_METHOD_CACHE_RECORD_SIZE;
+    if (rg_method_cache_u64(record) != hash) break;
+    strings = cache->strings + rg_method_cache_u32(record + 8);
+    if (rg_method_cache_u16(record + 12) == name_len && memcmp(strings, name, name_len) == 0) {
+      *classification = record[14];
+      *source = record[15];
+      class_name->length = (rg_length_t)rg_method_cache_u16(record + 16);
+      memcpy(class_name->string, strings + name_len, class_name->length);
+      method_name->length = (rg_length_t)rg_method_cache_u16(record + 18);
+      memcpy(method_name->string, strings + name_len + class_name->length, method_name->length);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Appends a classification to the log, with the encoded class and method names of whitelisted methods (NULL for blacklisted ones). Returns 0 if the
+// name is too long to persist or the log could not grow.
+int rg_method_cache_record(rg_method_cache_log_t *log, const unsigned char *name, const size_t name_len, const rg_byte_t classification, const rg_byte_t source, const rg_encoded_string_t *class_name, const rg_encoded_string_t *method_name)
+{
+  rg_byte_t *buf;
+  size_t capacity, length;
+  uint16_t class_name_length = class_name ? (uint16_t)class_name->length : 0, method_name_length = method_name ? (uint16_t)method_name->length : 0;
+  if (name_len > UINT16_MAX) return 0;
+  length = 8 + name_len + class_name_length + method_name_length;
+  if (log->length + length > log->capacity) {
+    capacity = log->capacity ? log->capacity * 2 : 4096;
+    while (capacity < log->length + length) capacity *= 2;
+    buf = realloc(log->buf, capacity);
+    if (!buf) return 0;
+    log->buf = buf;
+    log->capacity = capacity;
+  }
+  buf = log->buf + log->length;
+  buf[0] = classification;
+  buf[1] = source;
+  rg_method_cache_put_u16(buf + 2, (uint16_t)name_len);
+  rg_method_cache_put_u16(buf + 4, class_name_length);
+  rg_method_cache_put_u16(buf + 6, method_name_length);
+  memcpy(buf + 8, name, name_len);
+  if (class_name_length) memcpy(buf + 8 + name_len, class_name->string, class_name_length);
+  if (method_name_length) memcpy(buf + 8 + name_len + class_name_length, method_name->string, method_name_length);
+  log->length += length;
+  log->count++;
+  return 1;
+}
+
+void rg_method_cache_log_free(rg_method_cache_log_t *log)
+{
+  free(log->buf);
+  log->buf = NULL;
+  log->length = 0;
+  log->capacity = 0;
+  log->count = 0;
+}
+
+static int rg_method_cache_entry_cmp(const void *a, const void *b)
+{
+  const rg_method_cache_entry_t *x = (const rg_method_cache_entry_t *)a, *y = (const rg_method_cache_entry_t *)b;
+  int cmp;
+  if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+  if (x->length != y->length) return x->length < y->length ? -1 : 1;
+  cmp = memcmp(x->name, y->name, x->length);
+  if (cmp) return cmp;
+  return x->order < y->order ? -1 : (x->order > y->order ? 1 : 0);
+}
+
+// Serializes the records of the loaded cache (if any) merged with the classifications logged since. Returns a buffer to free, or NULL if there's
+// nothing to serialize or on allocation failure.
+rg_byte_t *rg_method_cache_serialize(const rg_method_cache_t *cache, const rg_method_cache_log_t *log, size_t *size)
+{
+  rg_method_cache_entry_t *entries;
+  const rg_byte_t *record, *ptr, *end;
+  rg_byte_t *buf, *out, *strings;
+  uint32_t count = 0, unique = 0, offset = 0, cached = cache ? cache->count : 0, i;
+  size_t strings_size = 0, length;
+
+  if (cached + log->count == 0) return NULL;
+  entries = malloc(sizeof(rg_method_cache_entry_t) * (cached + log->count));
+  if (!entries) return NULL;
+  for (i = 0; i < cached; i++, count++) {
+    record = cache->records + (size_t)i * RG_METHOD_CACHE_RECORD_SIZE;
+    entries[count].hash = rg_method_cache_u64(record);
+    entries[count].name = cache->strings + rg_method_cache_u32(record + 8);
+    entries[count].length = rg_method_cache_u16(record + 12);
+    entries[count].classification = record[14];
+    entries[count].source = record[15];
+    entries[count].class_name_length = rg_method_cache_u16(record + 16);
+    entries[count].method_name_length = rg_method_cache_u16(record + 18);
+    entries[count].order = count;
+  }
+  for (ptr = log->buf, end = log->buf + log->length; ptr < end; count++) {
+    entries[count].classification = ptr[0];
+    entries[count].source = ptr[1];
+    entries[count].length = rg_method_cache_u16(ptr + 2);
+    entries[count].class_name_length = rg_method_cache_u16(ptr + 4);
+    entries[count].method_name_length = rg_method_cache_u16(ptr + 6);
+    entries[count].name = ptr + 8;
+    entries[count].hash = rg_method_cache_hash(entries[count].name, entries[count].length);
+    entries[count].order = count;
+    ptr += 8 + entries[count].length + entries[count].class_name_length + entries[count].method_name_length;
+  }
+  qsort(entries, count, sizeof(rg_method_cache_entry_t), rg_method_cache_entry_cmp);
+
+  // Dedupe in place, keeping the last of each run of equal names
+  for (i = 0; i < count; i++) {
+    if (i + 1 < count && entries[i].hash == entries[i + 1].hash && entries[i].length == entries[i + 1].length && memcmp(entries[i].name, entries[i + 1].name, entries[i].length) == 0) continue;
+    entries[unique++] = entries[i];
+    strings_size += entries[i].length + entries[i].class_name_length + entries[i].method_name_length;
+  }
+  if (strings_size > UINT32_MAX) {
+    free(entries);
+    return NULL;
+  }
+
+  *size = RG_METHOD_CACHE_HEADER_SIZE + (size_t)unique * RG_METHOD_CACHE_RECORD_SIZE + strings_size;
+  buf = malloc(*size);
+  if (!buf) {
+    free(entries);
+    return NULL;
+  }
+  memcpy(buf, RG_METHOD_CACHE_MAGIC, 4);
+  buf[4] = RG_METHOD_CACHE_FORMAT_VERSION;
+  buf[5] = buf[6] = buf[7] = 0;
+  rg_method_cache_put_u32(buf + 8, unique);
+  rg_method_cache_put_u32(buf + 12, (uint32_t)strings_size);
+  out = buf + RG_METHOD_CACHE_HEADER_SIZE;
+  strings = out + (size_t)unique * RG_METHOD_CACHE_RECORD_SIZE;
+  for (i = 0; i < unique; i++, out += RG_METHOD_CACHE_RECORD_SIZE) {
+    // The encoded names directly follow the name, both in the cache and the log
+    length = entries[i].length + entries[i].class_name_length + entries[i].method_name_length;
+    rg_method_cache_put_u64(out, entries[i].hash);
+    rg_method_cache_put_u32(out + 8, offset);
+    rg_method_cache_put_u16(out + 12, entries[i].length);
+    out[14] = entries[i].classification;
+    out[15] = entries[i].source;
+    rg_method_cache_put_u16(out + 16, entries[i].class_name_length);
+    rg_method_cache_put_u16(out + 18, entries[i].method_name_length);
+    memcpy(strings + offset, entries[i].name, length);
+    offset += (uint32_t)length;
+  }
+  free(entries);
+  return buf;
+}
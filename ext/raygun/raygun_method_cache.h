@@ -0,0 +1,49 @@
+#ifndef RAYGUN_METHOD_CACHE_H
+#define RAYGUN_METHOD_CACHE_H
+
+// Method classifications (blacklisted or whitelisted, the method source and the encoded class and method names of whitelisted methods) persisted across
+// process restarts, keyed by fully qualified method name (Foo::Bar#baz). Function IDs are not persisted - they're still assigned by each process on first sighting of a method. The file name is keyed by the
+// app revision, blacklist and library paths (see lib/raygun/apm/method_cache.rb), the cache itself is only valid for the set of inputs it was built from.
+//
+// Layout (little endian):
+//
+//   header:  magic "RGMC", format version (1 byte), 3 reserved bytes, record count (4 bytes), string pool size (4 bytes)
+//   record:  FNV-1a hash of the name (8 bytes), offset of the name in the string pool (4 bytes), name length (2 bytes), RG_BLACKLIST_* value (1 byte),
+//            rg_method_source_t (1 byte), encoded class name length (2 bytes), encoded method name length (2 bytes)
+//   strings: the name of each record followed by it's encoded class and method names (empty for blacklisted methods), back to back
+//
+// Records are sorted by hash, and by name within the same hash, for binary search straight off the mapped file.
+#define RG_METHOD_CACHE_MAGIC "RGMC"
+#define RG_METHOD_CACHE_FORMAT_VERSION 2
+#define RG_METHOD_CACHE_HEADER_SIZE 16
+#define RG_METHOD_CACHE_RECORD_SIZE 20
+
+typedef struct _rg_method_cache_t {
+  // The mapped file
+  const rg_byte_t *data;
+  size_t size;
+  uint32_t count;
+  const rg_byte_t *records;
+  const rg_byte_t *strings;
+  uint32_t strings_size;
+} rg_method_cache_t;
+
+// Classifications made since the cache was loaded, appended as RG_BLACKLIST_* value (1 byte), source (1 byte), name length (2 bytes), encoded class
+// name length (2 bytes), encoded method name length (2 bytes), name, encoded class name, encoded method name
+typedef struct _rg_method_cache_log_t {
+  rg_byte_t *buf;
+  size_t length;
+  size_t capacity;
+  uint32_t count;
+} rg_method_cache_log_t;
+
+rg_method_cache_t *rg_method_cache_open(const char *path);
+void rg_method_cache_close(rg_method_cache_t *cache);
+size_t rg_method_cache_size(const rg_method_cache_t *cache);
+int rg_method_cache_lookup(const rg_method_cache_t *cache, const unsigned char *name, const size_t name_len, rg_byte_t *classification, rg_byte_t *source, rg_encoded_string_t *class_name, rg_encoded_string_t *method_name);
+
+int rg_method_cache_record(rg_method_cache_log_t *log, const unsigned char *name, const size_t name_len, const rg_byte_t classification, const rg_byte_t source, const rg_encoded_string_t *class_name, const rg_encoded_string_t *method_name);
+void rg_method_cache_log_free(rg_method_cache_log_t *log);
+rg_byte_t *rg_method_cache_serialize(const rg_method_cache_t *cache, const rg_method_cache_log_t *log, size_t *size);
+
+#endif
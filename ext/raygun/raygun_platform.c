@@ -1,5 +1,10 @@
 #include "raygun.h"
 #include "raygun_platform.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 // X platform getpid - works for Mac OS, ming32 and Linux
 rg_unsigned_int_t rg_getpid()
@@ -14,3 +19,34 @@ rg_timestamp_t rg_timestamp()
   gettimeofday(&time, NULL);
   return ((rg_timestamp_t)time.tv_sec * TIMESTAMP_UNITS_PER_SECOND + time.tv_usec);
 }
+
+// Maps a file read only into memory - pages are shared between processes mapping the same file and only faulted in when touched. Returns NULL if the
+// file does not exist, is empty or can't be mapped. Not supported on mingw32.
+const rg_byte_t *rg_map_file(const char *path, size_t *size)
+{
+#ifdef _WIN32
+  return NULL;
+#else
+  struct stat st;
+  void *data;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return NULL;
+  if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+  data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after closing the descriptor
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+  *size = (size_t)st.st_size;
+  return (const rg_byte_t *)data;
+#endif
+}
+
+void rg_unmap_file(const rg_byte_t *data, const size_t size)
+{
+#ifndef _WIN32
+  if (data) munmap((void *)data, size);
+#endif
+}
@@ -20,5 +20,7 @@
 
 rg_unsigned_int_t rg_getpid();
 rg_timestamp_t rg_timestamp();
+const rg_byte_t *rg_map_file(const char *path, size_t *size);
+void rg_unmap_file(const rg_byte_t *data, const size_t size);
 
 #endif
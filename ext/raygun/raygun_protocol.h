@@ -16,10 +16,28 @@
 #define RG_TIMER_THREAD_TICK_INTERVAL 1
 // How long to suspend the sink thread for if there's no data to send (microseconds)
 #define RG_SINK_THREAD_TICK_INTERVAL 100000
+// How long an idle sink thread blocks for at most if not woken up by a producer sealing a batch (seconds) - a safety net only, producers signal the
+// sink thread whenever there's something to dispatch
+#define RG_SINK_THREAD_IDLE_INTERVAL 5
+// How long a partial batch holding an END_TRANSACTION command lingers for more commands before it's sealed (microseconds) - PROTON_BATCH_IDLE_COUNTER
+#define RG_BATCH_LINGER 500
 // After how many ticks (seconds) to re-sync the methodinfo table
 #define RG_TIMER_THREAD_METHODINFO_TICK 30
-// UDP sink ring buffer size - what the encoder encodes too and the dispatcher feeds from
+// TCP sink - batches drained from the ring buffer in one go are coalesced into writes of up to this many bytes (plus the last batch appended)
+// to keep the dispatcher thread out of syscalls at high event rates
+#define RG_TCP_WRITE_SIZE 64 * 1024
+// Bytes queued across all sink lanes the UDP jitter buffer paces dispatch against
 #define RG_RINGBUF_SIZE 10 * 1024 * 1024
+// Queued bytes above which producers wake up a sink thread that is pacing dispatch (UDP jitter buffer)
+#define RG_RINGBUF_HIGH_WATERMARK (RG_RINGBUF_SIZE / 2)
+// Per sink lane ring buffer size - every traced thread queues sealed batches into a lane of it's own, besides the process wide lane for definitions
+#define RG_LANE_RINGBUF_SIZE 1024 * 1024
+// Upper bound for the number of sink lanes - threads with a higher TID share a lane with the TID modulo this value
+#define RG_MAX_SINK_LANES 1024
+// Producers hand the GVL off to the sink thread once this many batches were sealed since the last handoff, or on every event while the ring buffer
+// holds more than RG_HANDOFF_WATERMARK bytes (the sink thread falling behind)
+#define RG_HANDOFF_BATCHES 8
+#define RG_HANDOFF_WATERMARK 256 * 1024
 // First wrapper system frame for any given trace is constant function ID 1
 #define RG_TRACE_ENTRYPOINT_FRAME_ID 1
 #define RG_TRACE_ENTRYPOINT_FRAME_NAME "Ruby_APM_profiler_trace";
@@ -31,8 +49,12 @@
 #define RG_BLACKLIST_BLACKLISTED_NAMESPACE 4
 // Shadow thread specific
 #define RG_SHADOW_STACK_LIMIT 256
+// Frames of methods still pending classification a thread can have on the VM stack before discovery falls back to classifying inline
+#define RG_PENDING_FRAMES_LIMIT 32
 #define RG_THREAD_FRAMELESS -1
 #define RG_THREAD_ORPHANED 0
+// Fiber specific - suspended fiber shadow stacks kept around for reuse by the next suspending fiber
+#define RG_FIBER_STACK_POOL_SIZE 256
 
 // Max scratch buffer size - this is an intermediate static buffer that the encoder encodes to to facilitate the 0 alloc implementation
 #define RG_ENCODER_SCRATCH_BUFFER_SIZE 32 * 1024
@@ -42,9 +64,32 @@
 #define RG_BATCH_PACKET_SIZE 1400
 // Special case static buffer size for large events (SQL mostly) that exceeds RG_BATCH_PACKET_SIZE that we'd still pack into a sequenced batch
 #define RG_MAX_BATCH_PACKET_SIZE 4096
+// Bounds of the runtime batch size of a sink. Stream transports (TCP) are not MTU bound and batch up to the largest length the int16 length
+// field of the batch header can represent, which also fits the largest SQL event, so nothing is ever sent outside of a batch.
+#define RG_MIN_BATCH_PACKET_SIZE 512
+#define RG_MAX_STREAM_BATCH_PACKET_SIZE INT16_MAX
 #define RG_BATCH_HEADLEN 13
+// Batch header for the compact v3 framing - the v2 header plus the tid and base timestamp every compact record in the batch is relative to
+#define RG_BATCH_V3_HEADLEN 25
+// Header of a compressed batch frame - length, type and the length of the batch it inflates to
+#define RG_BATCH_COMPRESSED_HEADLEN 5
+// Header of a fragment of an event too large to fit a datagram - length, type, pid, group, fragment index, fragment count and the length of the
+// event it reassembles to
+#define RG_FRAGMENT_HEADLEN 15
+// Fragment indexes are a single byte
+#define RG_MAX_FRAGMENTS 255
 #define RG_SHUTDOWN_GRACE_SECONDS 5
 #define RG_MAX_BLACKLIST_NEEDLE_SIZE RG_MAX_STRING_SIZE + 1 + RG_MAX_STRING_SIZE + 1
+// Wire protocol versions. v2 is understood by all supported Agents, v3 (compact batch framing) only when the Agent reports support for it on boot
+#define RG_PROTOCOL_VERSION_2 2
+#define RG_PROTOCOL_VERSION_3 3
+// Max bytes an unsigned LEB128 varint of a 64 bit value can take up
+#define RG_VARINT_MAX_SIZE 10
+// Worst case size of a compact v3 BEGIN record: record type + timestamp delta + function ID + instance ID
+#define RG_V3_MAX_RECORD_SIZE 1 + RG_VARINT_MAX_SIZE + RG_VARINT_MAX_SIZE + RG_VARINT_MAX_SIZE
+// Per connection string dictionary bounds (wire protocol v3) - strings beyond these limits are sent inline as with v2
+#define RG_MAX_INTERNED_STRINGS 1024
+#define RG_MAX_INTERNED_STRING_SIZE 255
 
 // supported types
 
@@ -97,6 +142,7 @@ typedef uint64_t rg_instance_id_t;
 typedef int16_t rg_length_t;
 typedef uint32_t rg_sequence_t;
 typedef uint8_t rg_argc_t;
+typedef uint16_t rg_string_id_t;
 
 // variable type specific
 
@@ -188,10 +234,26 @@ typedef struct _rg_method_t {
   size_t encoded_size;
   rg_byte_t *encoded;
   rg_byte_t source;
-  char *name;
-  int length;
+  // The class name is interned and shared by all methods of the class, the method name is stored alongside the encoded methodinfo in the tracer's
+  // method arena
+  const char *class_name;
+  const char *method_name;
 } rg_method_t;
 
+// The shadow stack of a fiber that is suspended - saved off it's shadow thread on a fiber switch and restored when the fiber is resumed.
+// Pooled, the next link is only used while in the pool.
+
+typedef struct _rg_fiber_stack_t {
+  rg_int_t shadow_top;
+  rg_int_t vm_top;
+  rg_int_t level_deep_into_third_party_lib;
+  rg_int_t library_vm_top;
+  rg_int_t pending_count;
+  struct _rg_fiber_stack_t *next;
+  rg_function_id_t shadow_stack[RG_SHADOW_STACK_LIMIT];
+  rg_int_t pending_frames[RG_PENDING_FRAMES_LIMIT];
+} rg_fiber_stack_t;
+
 // Represents a shadow thread that observes the execution state of a Ruby thread
 
 typedef struct _rg_thread_t {
@@ -205,7 +267,20 @@ typedef struct _rg_thread_t {
   rg_int_t vm_top;
   // Optimization to not follow library frames to deep
   rg_int_t level_deep_into_third_party_lib;
+  // The VM stack depth of the outermost library frame, for the library depth to be balanced again on it's return. Library frames deeper than it are
+  // not pushed onto the shadow stack, thus may be evicted from the methodinfo table during the call and their returns not be recognized.
+  rg_int_t library_vm_top;
   rg_function_id_t shadow_stack[RG_SHADOW_STACK_LIMIT];
+  // VM stack depths of calls to methods that were still pending classification (deferred discovery) and thus not pushed onto the shadow stack.
+  // Their returns are skipped, even if the method got classified in the meantime.
+  rg_int_t pending_count;
+  rg_int_t pending_frames[RG_PENDING_FRAMES_LIMIT];
+  // The fiber (a Ruby VALUE) the shadow stack above belongs to and the saved shadow stacks of suspended fibers of this thread, keyed by fiber.
+  // Fibers suspended without any frames on their shadow stack are not tracked.
+  uintptr_t fiber;
+  struct st_table *fibers;
+  // Next pooled shadow thread - only used while in the tracer's pool
+  struct _rg_thread_t *next;
 } rg_thread_t;
 
 // Event structs to feed process state to the agent. We know in the spec they are represented as commands, but for the profiler we prefered to
@@ -230,9 +305,36 @@ typedef enum _rg_event_type_t {
   RG_EVENT_BEGIN_TRANSACTION = 0x10,
   RG_EVENT_END_TRANSACTION = 0x11,
   // Thread ancestry support
-  RG_EVENT_THREAD_STARTED_2 = 0x13
+  RG_EVENT_THREAD_STARTED_2 = 0x13,
+  // Compact framing (wire protocol v3) - per tid batch of varint encoded records
+  RG_EVENT_BATCH_V3 = 0xfb,
+  // String dictionary (wire protocol v3) - defines a string ID compact records can refer to
+  RG_EVENT_STRING_DEFINITION = 0x14,
+  // LZ4 compressed RG_EVENT_BATCH or RG_EVENT_BATCH_V3 - stream transports only, negotiated with the Agent
+  RG_EVENT_BATCH_COMPRESSED = 0xfc,
+  // Sequenced fragment of an event that exceeds the batch size of a datagram transport (wire protocol v3)
+  RG_EVENT_FRAGMENT = 0xfd
 } rg_event_type_t;
 
+// Record types for the contents of a RG_EVENT_BATCH_V3 batch. BEGIN and END without arguments or return values (the default build) are encoded
+// as a record type byte, a zigzag varint timestamp delta to the previous compact record in the batch and a varint function ID. BEGIN has an
+// optional varint instance ID, flagged by RG_V3_RECORD_INSTANCE_ID on the record type. Any other event is embedded as-is in v2 format, prefixed
+// by the RG_V3_RECORD_EMBEDDED record type.
+//
+// SQL and HTTP OUT events with their repeated strings interned refer to RG_EVENT_STRING_DEFINITION IDs instead:
+// * SQL: timestamp delta, varint duration, varint provider, host and database IDs, query encoding byte, varint query length and the query
+// * HTTP OUT: timestamp delta, varint duration, varint status, varint verb ID, varint URL prefix (scheme and authority) ID, varint URL
+//   suffix length and the suffix
+
+typedef enum _rg_v3_record_type_t {
+  RG_V3_RECORD_EMBEDDED = 0x0,
+  RG_V3_RECORD_BEGIN = 0x1,
+  RG_V3_RECORD_END = 0x2,
+  RG_V3_RECORD_SQL = 0x3,
+  RG_V3_RECORD_HTTP_OUT = 0x4,
+  RG_V3_RECORD_INSTANCE_ID = 0x80
+} rg_v3_record_type_t;
+
 // The type of whitelisted method instrumented - most would be user code or system
 
 typedef enum _rg_method_source_t {
@@ -316,6 +418,10 @@ typedef struct _rg_event_sql_t {
   rg_encoded_string_t database;
   rg_encoded_string_t query;
   rg_timestamp_t duration;
+  // Wire protocol v3 specific - string dictionary IDs of provider, host and database, 0 if not interned. Not encoded in v2 format.
+  rg_string_id_t provider_id;
+  rg_string_id_t host_id;
+  rg_string_id_t database_id;
 } rg_event_sql_t;
 
 // RG_EVENT_HTTP_INCOMING_INFORMATION
@@ -334,8 +440,20 @@ typedef struct _rg_event_http_out_t {
   rg_encoded_short_string_t verb;
   uint16_t status;
   rg_timestamp_t duration;
+  // Wire protocol v3 specific - string dictionary IDs of the URL prefix (url_prefix_length bytes of url) and the verb, 0 if not interned.
+  // Not encoded in v2 format.
+  rg_string_id_t url_prefix_id;
+  rg_length_t url_prefix_length;
+  rg_string_id_t verb_id;
 } rg_event_http_out_t;
 
+// RG_EVENT_STRING_DEFINITION
+
+typedef struct _rg_event_string_definition_t {
+  rg_string_id_t string_id;
+  rg_encoded_string_t value;
+} rg_event_string_definition_t;
+
 // Trace boundary specific - implemented Agent side to treat Ruby events as a stream and let the profiler explicitly mark the start and end of it
 
 // RG_EVENT_BEGIN_TRANSACTION
@@ -354,7 +472,8 @@ typedef struct _rg_event_thread_started_t {
 
 // RG_EVENT_BATCH
 
-// Only one of these exist per profiler instance, per process
+// One of these exist per sink lane (traced thread) of a profiler instance. The type is either RG_EVENT_BATCH or RG_EVENT_BATCH_V3 (compact framing)
+// and the tid and timestamp members are only encoded in the header of the latter.
 
 typedef struct _rg_event_batch_t {
   rg_length_t length;
@@ -362,7 +481,12 @@ typedef struct _rg_event_batch_t {
   rg_length_t count;
   rg_sequence_t sequence;
   rg_pid_t pid;
-  rg_byte_t buf[RG_MAX_BATCH_PACKET_SIZE];
+  // RG_EVENT_BATCH_V3 specific - the thread all compact records in this batch belong to, 0 until the first compact record is appended
+  rg_tid_t tid;
+  // RG_EVENT_BATCH_V3 specific - base timestamp of the batch and the timestamp of the last compact record for delta encoding
+  rg_timestamp_t timestamp;
+  rg_timestamp_t last_timestamp;
+  rg_byte_t buf[RG_MAX_STREAM_BATCH_PACKET_SIZE];
 } rg_event_batch_t;
 
 // A generic container for an Event that includes the wire protocol header fields and also allows for representing any type through the data member union
@@ -386,10 +510,20 @@ typedef struct _rg_event_t {
     rg_event_http_out_t http_out;
     rg_event_begin_transaction_t begin_transaction;
     rg_event_thread_started_t thread_started;
+    rg_event_string_definition_t string_definition;
 
     // polymorphic members suitable for more than one event
     rg_function_id_t function_id;
   } data;
 } rg_event_t;
 
+// A pre-encoded CT_BEGIN_TRANSACTION - the payload only depends on tracer configuration and is encoded once, the header (tid and timestamp) for
+// every transaction started
+
+typedef struct _rg_begin_transaction_template_t {
+  rg_event_t event;
+  rg_short_t size;
+  rg_byte_t payload[3 * (sizeof(rg_length_t) + RG_MAX_STRING_SIZE)];
+} rg_begin_transaction_template_t;
+
 #endif
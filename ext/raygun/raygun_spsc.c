@@ -0,0 +1,84 @@
+#include "raygun.h"
+
+// Allocates a ring of size bytes, which must be a power of two. Returns NULL on allocation failure.
+rg_spsc_t *rg_spsc_new(const uint32_t size)
+{
+  rg_spsc_t *ring;
+  if (!size || (size & (size - 1))) return NULL;
+  ring = calloc(1, sizeof(rg_spsc_t));
+  if (!ring) return NULL;
+  ring->buf = malloc(size);
+  if (!ring->buf) {
+    free(ring);
+    return NULL;
+  }
+  ring->size = size;
+  return ring;
+}
+
+void rg_spsc_free(rg_spsc_t *ring)
+{
+  if (!ring) return;
+  free(ring->buf);
+  free(ring);
+}
+
+// Producer side - copies a frame into the ring and publishes it to the consumer. Returns 0 if there's not enough room, frames are never split.
+int rg_spsc_offer(rg_spsc_t *ring, const rg_byte_t *frame, const uint32_t len)
+{
+  const uint32_t zero = 0;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  uint32_t pos = head & (ring->size - 1);
+  uint32_t framesize = RG_SPSC_FRAME_SIZE(len);
+  // A frame that does not fit the end of the buffer skips it
+  uint32_t padding = framesize > ring->size - pos ? ring->size - pos : 0;
+
+  if (!len || framesize + padding > ring->size - (head - tail)) return 0;
+  if (padding) {
+    memcpy(ring->buf + pos, &zero, sizeof(zero));
+    head += padding;
+    pos = 0;
+  }
+  memcpy(ring->buf + pos, &len, sizeof(len));
+  memcpy(ring->buf + pos + sizeof(len), frame, len);
+  // Publishes the frame - the consumer observes the new head only after the frame bytes are written
+  __atomic_store_n(&ring->head, head + framesize, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Consumer side - points to the oldest frame and sets len to it's size, or returns NULL if the ring is empty. The frame stays valid until consumed.
+rg_byte_t *rg_spsc_peek(rg_spsc_t *ring, uint32_t *len)
+{
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint32_t pos;
+
+  while (head != tail) {
+    pos = tail & (ring->size - 1);
+    memcpy(len, ring->buf + pos, sizeof(*len));
+    if (*len) return ring->buf + pos + sizeof(*len);
+    // Wrap marker, the next frame is at the start of the buffer
+    tail += ring->size - pos;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+// Consumer side - releases the frame returned by the last peek back to the producer
+void rg_spsc_consume(rg_spsc_t *ring, const uint32_t len)
+{
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->tail, tail + RG_SPSC_FRAME_SIZE(len), __ATOMIC_RELEASE);
+}
+
+// Bytes in use, wrap padding and length prefixes included. Only exact for the producer or consumer side - approximate for other observers.
+uint32_t rg_spsc_used(const rg_spsc_t *ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+uint32_t rg_spsc_unused(const rg_spsc_t *ring)
+{
+  return ring->size - rg_spsc_used(ring);
+}
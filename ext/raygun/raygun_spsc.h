@@ -0,0 +1,31 @@
+#ifndef RAYGUN_SPSC_H
+#define RAYGUN_SPSC_H
+
+// Single producer, single consumer ring buffer of variable length frames. The producer and consumer only ever write their own cursor and read the
+// other's with acquire / release semantics, thus a lane can be fed by a traced thread and drained by the sink thread without a lock. Frames are
+// stored contiguously behind a 4 byte length prefix - a zero length prefix marks the rest of the buffer as unused and the consumer wraps around.
+
+// Frames are 4 byte aligned so a length prefix or wrap marker always fits the end of the buffer
+#define RG_SPSC_ALIGN(size) (((size) + 3) & ~3U)
+// Space a frame of the given payload size occupies in the ring, without wrap padding
+#define RG_SPSC_FRAME_SIZE(size) RG_SPSC_ALIGN(sizeof(uint32_t) + (size))
+
+typedef struct _rg_spsc_t {
+  rg_byte_t *buf;
+  // Power of two, cursors are free running and masked on access
+  uint32_t size;
+  // Written by the producer only
+  uint32_t head;
+  // Written by the consumer only
+  uint32_t tail;
+} rg_spsc_t;
+
+rg_spsc_t *rg_spsc_new(const uint32_t size);
+void rg_spsc_free(rg_spsc_t *ring);
+int rg_spsc_offer(rg_spsc_t *ring, const rg_byte_t *frame, const uint32_t len);
+rg_byte_t *rg_spsc_peek(rg_spsc_t *ring, uint32_t *len);
+void rg_spsc_consume(rg_spsc_t *ring, const uint32_t len);
+uint32_t rg_spsc_used(const rg_spsc_t *ring);
+uint32_t rg_spsc_unused(const rg_spsc_t *ring);
+
+#endif
@@ -1,5 +1,32 @@
 #include "raygun_tracer.h"
 
+// A callback function invoked by st_foreach in rb_rg_trace_context_release_fibers that removes a fiber of the trace from the tracer's fiber table
+static int rb_rg_trace_context_fibers_release_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    st_delete(((struct rb_rg_tracer_t *)data)->fibertraces, &key, NULL);
+    return ST_DELETE;
+}
+
+// A callback function invoked by st_foreach in rb_rg_trace_context_mark that marks a fiber of the trace
+static int rb_rg_trace_context_fibers_mark_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    rb_gc_mark((VALUE)key);
+    return ST_CONTINUE;
+}
+
+// Makes a fiber part of the trace - the thread runs in the trace's Thread Group whenever it's resumed
+void rb_rg_trace_context_add_fiber(struct rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace_context, VALUE fiber)
+{
+    st_insert(trace_context->fibers, (st_data_t)fiber, 0);
+    st_insert(tracer->fibertraces, (st_data_t)fiber, (st_data_t)trace_context);
+}
+
+// Forgets the fibers of a trace - a fiber resumed after the trace ended is not part of any trace
+void rb_rg_trace_context_release_fibers(struct rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace_context)
+{
+    if (tracer->fibertraces) st_foreach(trace_context->fibers, rb_rg_trace_context_fibers_release_i, (st_data_t)tracer);
+}
+
 // Allocates a Trace Context. A Trace Context is a data structure that tracks the baseline state for a unit of work (request or background job)
 // It can also be viewed as "Everything that happens within a block of BEGIN and END transaction commands".
 // It tracks:
@@ -13,13 +40,30 @@
 // * A reference to the parent Ruby Thread which spawned the executing Ruby Thread for this trace. Typically the main thread, which itself spawned the pool of worker
 //   threads that serve requests.
 //
-// This allocator helper ensures a blank slate pristine trace context at the start of every trace.
+// This allocator helper ensures a blank slate pristine trace context at the start of every trace. Trace contexts of ended traces are pooled by the tracer
+// and reused with their (disabled) tracepoint, which saves the allocations for short units of work such as background jobs.
 //
 rb_rg_trace_context_t *rb_rg_trace_context_alloc(struct rb_rg_tracer_t *tracer, VALUE thread)
 {
     rb_rg_trace_context_t *trace_context;
-    rg_thread_t *th = rb_rg_thread(tracer, thread);
-    trace_context = ZALLOC(rb_rg_trace_context_t);
+    VALUE tracepoint = Qnil;
+    st_table *fibers = NULL;
+    unsigned long generation = 0;
+    rg_byte_t private_rg_thread;
+    rg_thread_t *th = rb_rg_trace_thread(tracer, thread, &private_rg_thread);
+    trace_context = tracer->trace_contexts;
+    if (trace_context) {
+      // Reuse a pooled trace context and it's tracepoint
+      tracer->trace_contexts = trace_context->next;
+      tracer->pooled_trace_contexts--;
+      tracer->trace_contexts_reused++;
+      tracepoint = trace_context->tracepoint;
+      fibers = trace_context->fibers;
+      generation = trace_context->generation;
+      MEMZERO(trace_context, rb_rg_trace_context_t, 1);
+    } else {
+      trace_context = ZALLOC(rb_rg_trace_context_t);
+    }
     if (trace_context == NULL) {
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
@@ -29,23 +73,36 @@ rb_rg_trace_context_t *rb_rg_trace_context_alloc(struct rb_rg_tracer_t *tracer,
         rb_raise(rb_eRaygunFatal, "Could not allocate trace context");
     }
     trace_context->tracer = tracer;
+    trace_context->generation = generation;
     // executing Ruby Thread
     trace_context->thread = thread;
     // Thread Group (an Ruby feature for tracking ancestry of spawned threads) - assigned in raygun_tracer.c as some heavier lifting is required and we keep
     // this allocator helper simple
     trace_context->thgroup = Qnil;
+    trace_context->parent_thgroup = Qnil;
     // Reset the shadow thread's observed state on starting a new trace
     th->shadow_top = RG_THREAD_FRAMELESS;
     // Reset the VM's observed state (current as of start of the trace) on starting a new trace
     th->vm_top = RG_THREAD_FRAMELESS;
     // An optimization to limit how deep we trace into the stack of third party libraries
     th->level_deep_into_third_party_lib = 0;
+    th->library_vm_top = RG_THREAD_FRAMELESS;
+    // Frames of methods pending classification of a previous trace never return into this one
+    th->pending_count = 0;
     // Technically not required as the ZALLOC would do the same, but lets be explicit about initialising to 0
     MEMZERO(th->shadow_stack, rg_function_id_t, RG_SHADOW_STACK_LIMIT);
+    // Shadow stacks of fibers suspended during a previous trace are stale - the current fiber owns the shadow stack from here on
+    rb_rg_release_fiber_stacks(tracer, th);
+#ifdef RUBY_EVENT_FIBER_SWITCH
+    th->fiber = (uintptr_t)rb_fiber_current();
+#endif
     // Cache the Ruby Thread <=> shadow thread mapping so it's only looked up once for the duration of the trace
     trace_context->rg_thread = th;
-    // Tracepoint reference - initialized in raygun_trace.c to keep this helper simple
-    trace_context->tracepoint = Qnil;
+    trace_context->private_rg_thread = private_rg_thread;
+    // Fibers part of the trace - registered in raygun_tracer.c, the table is reused from the pool if any
+    trace_context->fibers = fibers ? fibers : st_init_numtable();
+    // Tracepoint reference - initialized in raygun_trace.c to keep this helper simple, unless reused from the pool
+    trace_context->tracepoint = tracepoint;
     // Parent thread reference - assigned in raygun_tracer.c
     trace_context->parent_thread = Qnil;
 #ifdef RB_RG_DEBUG
@@ -56,6 +113,34 @@ rb_rg_trace_context_t *rb_rg_trace_context_alloc(struct rb_rg_tracer_t *tracer,
     return trace_context;
 }
 
+// Invoked at the end of a trace. Disables the tracepoint and keeps the trace context, and thus the tracepoint too, around for the next trace started.
+// Any Ruby objects only relevant to the ended trace are dropped so they can be collected.
+void rb_rg_trace_context_release(struct rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace_context)
+{
+    if (tracer->pooled_trace_contexts >= RB_RG_TRACE_CONTEXT_POOL_SIZE || NIL_P(trace_context->tracepoint)) {
+      rb_rg_trace_context_free(trace_context);
+      return;
+    }
+    if (rb_tracepoint_enabled_p(trace_context->tracepoint)) rb_tracepoint_disable(trace_context->tracepoint);
+    rb_rg_trace_context_release_fibers(tracer, trace_context);
+    if (trace_context->private_rg_thread) rb_rg_free_thread(tracer, trace_context->rg_thread);
+    trace_context->thread = Qnil;
+    trace_context->parent_thread = Qnil;
+    trace_context->thgroup = Qnil;
+    trace_context->parent_thgroup = Qnil;
+    trace_context->rg_thread = NULL;
+    trace_context->private_rg_thread = false;
+    // Thread caches may still refer to this trace context - only theirs are invalidated, the context's memory stays valid while pooled
+    trace_context->generation++;
+    trace_context->next = tracer->trace_contexts;
+    tracer->trace_contexts = trace_context;
+    tracer->pooled_trace_contexts++;
+#ifdef RB_RG_DEBUG
+    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_INFO && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
+      printf("[Raygun APM] Pooled trace context: %p\n", (void *)trace_context);
+#endif
+}
+
 // Helper invoked by the GC once determined that there's no more references to this Trace Context
 void rb_rg_trace_context_free(rb_rg_trace_context_t *trace_context)
 {
@@ -73,16 +158,28 @@ void rb_rg_trace_context_free(rb_rg_trace_context_t *trace_context)
     if (UNLIKELY(trace_context->tracer->loglevel >= RB_RG_TRACER_LOG_INFO && trace_context->tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
       printf("[Raygun APM] Freeing trace context: %p\n", (void *)trace_context);
 #endif
+    // The fibers of the trace and it's private shadow thread, if any - the context of a trace in progress is freed with the tracer or on fork
+    if (trace_context->fibers) {
+      rb_rg_trace_context_release_fibers(trace_context->tracer, trace_context);
+      st_free_table(trace_context->fibers);
+    }
+    if (trace_context->private_rg_thread) rb_rg_free_thread(trace_context->tracer, trace_context->rg_thread);
     // Finaly free the Trace Context struct and explicitly nullify
     xfree(trace_context);
     trace_context = NULL;
+    // Thread caches may still refer to this trace context, which can't be validated against it's generation anymore - only when the pool is full,
+    // and on tracer free and fork
+    rb_rg_invalidate_thread_caches();
 }
 
 // Size calculation for the Trace Context struct - simple in this case as the struct is mostly pointers and the shadow stack is otherwise factored into
 // struct size
 size_t rb_rg_trace_context_size(rb_rg_trace_context_t *trace_context)
 {
-    return sizeof(rb_rg_trace_context_t);
+    size_t size = sizeof(rb_rg_trace_context_t);
+    if (trace_context->fibers) size += st_memsize(trace_context->fibers);
+    if (trace_context->private_rg_thread) size += sizeof(rg_thread_t);
+    return size;
 }
 
 // Mark / tracing callback from the GC - we mark all the VALUEs (references to Ruby objects)
@@ -91,5 +188,8 @@ void rb_rg_trace_context_mark(rb_rg_trace_context_t *trace_context)
     rb_gc_mark(trace_context->tracepoint);
     rb_gc_mark_maybe(trace_context->thread);
     rb_gc_mark(trace_context->thgroup);
+    rb_gc_mark(trace_context->parent_thgroup);
     rb_gc_mark_maybe(trace_context->parent_thread);
+    // Fibers are kept alive for the duration of the trace, their addresses are not reused for fibers of other traces
+    if (trace_context->fibers) st_foreach(trace_context->fibers, rb_rg_trace_context_fibers_mark_i, 0);
 }
\ No newline at end of file
@@ -20,12 +20,28 @@ typedef struct _rb_rg_trace_context_t {
     VALUE parent_thread;
     // The Thread Group this context belongs to - important for threads ancestry tracking
     VALUE thgroup;
+    // The Thread Group the thread was in before the trace started - restored on trace end and while the thread runs fibers not part of the trace
+    VALUE parent_thgroup;
     // The Shadow Thread for this trace context
     rg_thread_t *rg_thread;
+    // Bumped whenever the trace ends - thread caches referring to this trace context are only valid for the generation they were filled in.
+    // Kept with the context when pooled.
+    unsigned long generation;
+    // Set if the shadow thread is private to this trace because a trace of another fiber on the same thread has the thread's own
+    rg_byte_t private_rg_thread;
+    // The fibers part of this trace - the one that started it and those first resumed within it. Kept with the context when pooled.
+    st_table *fibers;
+    // Next pooled trace context - only used while in the tracer's pool
+    struct _rb_rg_trace_context_t *next;
 } rb_rg_trace_context_t;
 
 // Allocation helper
 rb_rg_trace_context_t *rb_rg_trace_context_alloc(struct rb_rg_tracer_t *tracer, VALUE thread);
+// Returns the trace context of an ended trace to the tracer's pool, or frees it if the pool is full
+void rb_rg_trace_context_release(struct rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace_context);
+// Makes a fiber part of the trace and forgets all of them again on trace end
+void rb_rg_trace_context_add_fiber(struct rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace_context, VALUE fiber);
+void rb_rg_trace_context_release_fibers(struct rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace_context);
 
 // Garbage collection callbacks
 void rb_rg_trace_context_free(rb_rg_trace_context_t *trace_context);
@@ -31,11 +31,15 @@ static ID rb_rg_id_send,
     rb_rg_id_write,
     rb_rg_id_tcp_socket,
     rb_rg_id_new,
+    rb_rg_id_instance_method,
+    rb_rg_id_source_location,
     rb_rg_id_default;
 
 static VALUE rb_rg_cThGroup;
 static VALUE rb_rg_cTcpSocket;
 static VALUE rb_rg_DefaultThreadGroup;
+// The typed data type of Ruby threads, not exported by the VM - inferred from the main thread
+static const rb_data_type_t *rb_rg_thread_data_type;
 
 // The main typed data struct that helps to inform the VM (mostly the GC) on how to handle a wrapped structure
 // References https://github.com/ruby/ruby/blob/master/doc/extension.rdoc#encapsulate-c-data-into-a-ruby-object-
@@ -69,6 +73,8 @@ void __stack_chk_fail(void)
 #endif
 
 static VALUE rb_rg_tracer_initialise_tcp_socket(VALUE obj);
+static long rb_rg_resolve_pending_methods(rb_rg_tracer_t *tracer);
+static size_t rb_rg_evict_methodinfo(rb_rg_tracer_t *tracer);
 
 // Log errors silenced in timer and dispatch threads by rb_protect
 static void rb_rg_log_silenced_error()
@@ -91,19 +97,178 @@ rb_rg_current_thread_to_be_killed()
   return false;
 }
 
-// A helper for pausing the current thread for a specific period of time but with awareness of the thread state (to kill or killed), which skips any sleep
-// behaviour and lets the VM check for interrupts right away. Called from the timer thread which runs periodically and also from the UDP thread when the
-// dispatch ringbuffer is empty or when we infer a very fast growth rate of the ringbuffer, but have > 50% room left, which allows for introducing jitter in
-// the UDP dispatch thread in order to try to defer blowing through Kernel buffers too fast. It works OK, but isn't perfect, but better than nothing.
+// Blocks the sink thread until a producer signals there's something to dispatch, or the timeout elapsed. The dispatch condition is checked again
+// right before blocking - producers need the GVL, which this thread holds until it's marked as stopped, so no batch can be sealed in between and a
+// wakeup from rb_rg_signal_dispatcher can't be lost.
 //
-static void rb_rg_thread_wait_for(struct timeval tv){
+static void rb_rg_dispatcher_wait(rb_rg_sink_data_t *data, const rg_byte_t state, struct timeval tv)
+{
+  int idle;
   if (!rb_rg_current_thread_to_be_killed()) {
-    rb_thread_schedule();
-    rb_thread_wait_for(tv);
+    idle = !data->queued;
+    if (state == RB_RG_DISPATCHER_IDLE ? (idle && data->running) : (data->queued < RG_RINGBUF_HIGH_WATERMARK)) {
+      data->dispatcher_state = state;
+      rb_thread_wait_for(tv);
+      // Still in the state we blocked in, thus not signalled by a producer
+      if (data->dispatcher_state == state && !data->queued) data->idle_wakeups++;
+      data->dispatcher_state = RB_RG_DISPATCHER_BUSY;
+    }
   }
   rb_thread_check_ints();
 }
 
+// Wakes up a blocked sink thread. Protected as the thread may have been killed while blocked, which is no reason to raise into the producer.
+static void rb_rg_wakeup_dispatcher(rb_rg_sink_data_t *data)
+{
+  int status = 0;
+  data->dispatcher_state = RB_RG_DISPATCHER_BUSY;
+  rb_protect(rb_thread_wakeup, data->tracer->sink_thread, &status);
+  if (UNLIKELY(status)) {
+    rb_rg_log_silenced_error();
+    // Clearing error info to ignore the caught exception
+    rb_set_errinfo(Qnil);
+  }
+}
+
+// Wakes up the sink thread if it's blocked and there's now something for it to do - a sealed batch for an idle sink thread or a ring buffer past the
+// high watermark for a pacing one. Called by producers after offering to the ring buffer, costs a branch while the sink thread is busy. Returns 1 if
+// the sink thread was woken up.
+//
+static inline int rb_rg_signal_dispatcher(rb_rg_sink_data_t *data)
+{
+  if (LIKELY(data->dispatcher_state == RB_RG_DISPATCHER_BUSY)) return 0;
+  if (data->dispatcher_state == RB_RG_DISPATCHER_IDLE ? !data->queued : (data->queued < RG_RINGBUF_HIGH_WATERMARK)) return 0;
+  rb_rg_wakeup_dispatcher(data);
+  data->wakeups++;
+  return 1;
+}
+
+// Yields the GVL to the sink thread once RG_HANDOFF_BATCHES batches were sealed since the last handoff, or while the ring buffer fill level is above
+// RG_HANDOFF_WATERMARK. Sealing bumps the batch sequence number, which is what the sealed batch count is derived from. The ring buffer being
+// drained in larger chunks also plays well with coalesced TCP writes. A sink thread that was just woken up gets the GVL right away, as it would
+// otherwise wait for the VM's thread time slice to expire.
+//
+static inline void rb_rg_handoff_dispatcher(rb_rg_sink_data_t *data, const int woken)
+{
+  if (LIKELY(!woken && (rg_sequence_t)(data->sequence - data->handoff_sequence) < RG_HANDOFF_BATCHES && data->queued < RG_HANDOFF_WATERMARK)) return;
+  data->handoff_sequence = data->sequence;
+  data->handoffs++;
+  rb_thread_schedule();
+}
+
+// Resets a lane's batch for the wire protocol version negotiated with the Agent. The PID of the batch is preset from the encoder context - it's
+// not going to change moving forward.
+//
+static void rb_rg_reset_sink_lane(rb_rg_sink_data_t *sink_data, rb_rg_sink_lane_t *lane)
+{
+  lane->batch.type = sink_data->protocol_version == RG_PROTOCOL_VERSION_3 ? RG_EVENT_BATCH_V3 : RG_EVENT_BATCH;
+  lane->batch.pid = sink_data->tracer->context->pid;
+  lane->batch.length = rg_batch_headlen(&lane->batch);
+  lane->batch.count = 0;
+  lane->batch.tid = 0;
+  lane->linger_deadline = 0;
+}
+
+// Allocates the ring buffer of a lane. Returns 0 on allocation failure.
+static int rb_rg_init_sink_lane(rb_rg_sink_data_t *sink_data, rb_rg_sink_lane_t *lane, const rg_tid_t tid)
+{
+  lane->tid = tid;
+  lane->retired = false;
+  lane->ring = rg_spsc_new(RG_LANE_RINGBUF_SIZE);
+  if (!lane->ring) return 0;
+  rb_rg_reset_sink_lane(sink_data, lane);
+  return 1;
+}
+
+// Lazily creates the lane of a thread on it's first event, growing the lanes array if needed. Returns NULL on allocation failure, the event
+// is dropped in that case like on a full ring buffer.
+//
+static rb_rg_sink_lane_t *rb_rg_new_sink_lane(rb_rg_sink_data_t *sink_data, const rg_tid_t index, const rg_tid_t tid)
+{
+  rb_rg_sink_lane_t **lanes;
+  rb_rg_sink_lane_t *lane;
+  rg_tid_t capacity = sink_data->lanes_capacity ? sink_data->lanes_capacity : 16;
+  if (index >= sink_data->lanes_capacity) {
+    while (capacity <= index) capacity *= 2;
+    if (capacity > RG_MAX_SINK_LANES) capacity = RG_MAX_SINK_LANES;
+    lanes = realloc(sink_data->lanes, capacity * sizeof(rb_rg_sink_lane_t *));
+    if (!lanes) return NULL;
+    memset(lanes + sink_data->lanes_capacity, 0, (capacity - sink_data->lanes_capacity) * sizeof(rb_rg_sink_lane_t *));
+    sink_data->lanes = lanes;
+    sink_data->lanes_capacity = capacity;
+  }
+  lane = malloc(sizeof(rb_rg_sink_lane_t));
+  if (!lane) return NULL;
+  if (!rb_rg_init_sink_lane(sink_data, lane, tid)) {
+    free(lane);
+    return NULL;
+  }
+  sink_data->lanes[index] = lane;
+  return lane;
+}
+
+// Frees a drained lane of a thread that ended - called by the sink thread, the only consumer of the lane
+static void rb_rg_free_sink_lane(rb_rg_sink_data_t *sink_data, const rg_tid_t index)
+{
+  rb_rg_sink_lane_t *lane = sink_data->lanes[index];
+  sink_data->lanes[index] = NULL;
+  if (sink_data->fragment_lane == lane) sink_data->fragment_lane = NULL;
+  rg_spsc_free(lane->ring);
+  free(lane);
+}
+
+// Frees all lanes on tracer shutdown
+static void rb_rg_free_sink_lanes(rb_rg_sink_data_t *sink_data)
+{
+  for (rg_tid_t i = 0; i < sink_data->lanes_capacity; i++) {
+    if (sink_data->lanes[i]) rb_rg_free_sink_lane(sink_data, i);
+  }
+  free(sink_data->lanes);
+  sink_data->lanes = NULL;
+  sink_data->lanes_capacity = 0;
+  sink_data->fragment_lane = NULL;
+  rg_spsc_free(sink_data->process_lane.ring);
+  sink_data->process_lane.ring = NULL;
+}
+
+// Number of thread lanes currently allocated, for diagnostics
+static rg_tid_t rb_rg_sink_lanes(const rb_rg_sink_data_t *sink_data)
+{
+  rg_tid_t lanes = 0;
+  for (rg_tid_t i = 0; i < sink_data->lanes_capacity; i++) {
+    if (sink_data->lanes[i]) lanes++;
+  }
+  return lanes;
+}
+
+// The lane an event is queued in - process wide events and definitions go to the process lane, everything else to the lane of the thread
+// that emitted it. Threads with a TID beyond RG_MAX_SINK_LANES share lanes, compact records of another thread are embedded as-is in that case.
+//
+static inline rb_rg_sink_lane_t *rb_rg_sink_lane(rb_rg_sink_data_t *sink_data, const rg_event_t *event)
+{
+  rb_rg_sink_lane_t *lane;
+  rg_tid_t index;
+  switch ((rg_event_type_t)event->type) {
+  case RG_EVENT_METHODINFO_2:
+  case RG_EVENT_STRING_DEFINITION:
+  case RG_EVENT_PROCESS_ENDED:
+  case RG_EVENT_PROCESS_FREQUENCY:
+  case RG_EVENT_PROCESS_TYPE:
+  case RG_EVENT_THREAD_STARTED_2:
+    return &sink_data->process_lane;
+  default:
+    break;
+  }
+  index = event->tid % RG_MAX_SINK_LANES;
+  if (LIKELY(index < sink_data->lanes_capacity && sink_data->lanes[index])) {
+    lane = sink_data->lanes[index];
+    // An event for a thread that was reported as ended, don't free the lane from under it
+    lane->retired = false;
+    return lane;
+  }
+  return rb_rg_new_sink_lane(sink_data, index, event->tid);
+}
+
 extern rax *raxNew(void);
 
 // A callback function invoked by st_foreach in rb_rg_tracer_mark that marks the trace contexts table. VALUE object pointers in Ruby are Ruby heap allocated
@@ -117,22 +282,142 @@ static int rb_rg_trace_context_mark_i(st_data_t key, st_data_t val, st_data_t da
   return ST_CONTINUE;
 }
 
+// A callback function invoked by st_foreach in rb_rg_threadsinfo_mark_i that marks the fibers a shadow thread saved shadow stacks for
+static int rb_rg_fibers_mark_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rb_gc_mark_maybe((VALUE)key);
+  return ST_CONTINUE;
+}
+
+// Returns a shadow thread that is no longer needed to the pool, or frees it if the pool is full. Does not allocate, thus safe to call from the GC.
+void rb_rg_free_thread(rb_rg_tracer_t *tracer, rg_thread_t *th)
+{
+  if (th->fibers) {
+    rb_rg_release_fiber_stacks(tracer, th);
+    st_free_table(th->fibers);
+    th->fibers = NULL;
+  }
+  if (tracer->pooled_threads >= RB_RG_THREAD_POOL_SIZE) {
+    xfree(th);
+    return;
+  }
+  th->next = tracer->free_threads;
+  tracer->free_threads = th;
+  tracer->pooled_threads++;
+}
+
+// Determines if a Ruby thread in the threads info table is dead - the object is no longer a thread (the slot was reclaimed) or it finished running.
+static int rb_rg_thread_dead_p(VALUE thread)
+{
+  rb_thread_t *th;
+  if (SPECIAL_CONST_P(thread) || BUILTIN_TYPE(thread) != T_DATA || !RTYPEDDATA_P(thread) || RTYPEDDATA_TYPE(thread) != rb_rg_thread_data_type) return true;
+  th = (rb_thread_t *)RTYPEDDATA_DATA(thread);
+  return !th || th->status == THREAD_KILLED;
+}
+
+// A callback function invoked by st_foreach in rb_rg_reclaim_dead_threads_i and rb_rg_trace_thread that stops at the trace context the given shadow thread is the main thread of
+static int rb_rg_trace_context_thread_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rg_thread_t **th = (rg_thread_t **)data;
+  if (((rb_rg_trace_context_t *)val)->rg_thread != *th) return ST_CONTINUE;
+  *th = NULL;
+  return ST_STOP;
+}
+
 // A callback function invoked by st_foreach in rb_rg_tracer_mark that marks the threads info table. VALUE object pointers in Ruby are Ruby heap allocated
 // and as such the key (a Ruby thread) needs to be marked, but conditionally with rb_gc_mark_maybe as the thread might be already killed and reclaimed under
-// some circumstances. The value is a scalar integer value (TID in Raygun wire protocol and thus not a Ruby object)
+// some circumstances. The value is the shadow thread of the Ruby thread. Dead threads are marked too, until swept by rb_rg_reclaim_dead_threads.
 //
 static int rb_rg_threadsinfo_mark_i(st_data_t key, st_data_t val, st_data_t data)
 {
+  rg_thread_t *th = (rg_thread_t *)val;
   rb_gc_mark_maybe((VALUE)key);
+  // Suspended fibers with a saved shadow stack, same rules as for threads apply
+  if (th->fibers) st_foreach(th->fibers, rb_rg_fibers_mark_i, 0);
+  return ST_CONTINUE;
+}
+
+// A callback function invoked by st_foreach in rb_rg_reclaim_dead_threads that returns the shadow thread of a dead thread to the pool and removes
+// it from the threads info table
+static int rb_rg_reclaim_dead_threads_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rb_rg_tracer_t *tracer = (rb_rg_tracer_t *)data;
+  rg_thread_t *th = (rg_thread_t *)val;
+  rg_thread_t *traced = th;
+  if (LIKELY(!rb_rg_thread_dead_p((VALUE)key))) return ST_CONTINUE;
+  // Threads that died during a trace they started are still referenced by the trace context, leave them be
+  st_foreach(tracer->tracecontexts, rb_rg_trace_context_thread_i, (st_data_t)&traced);
+  if (!traced) return ST_CONTINUE;
+  rb_rg_free_thread(tracer, th);
+  tracer->threads_reclaimed++;
+  return ST_DELETE;
+}
+
+// Shadow threads are only freed when a thread ends during a trace, thus the entries of threads that died outside of a trace are swept periodically by
+// the timer thread. This keeps the table flat in processes where thread pools churn threads. Returns the amount of shadow threads reclaimed.
+//
+static size_t rb_rg_reclaim_dead_threads(rb_rg_tracer_t *tracer)
+{
+  size_t reclaimed = tracer->threads_reclaimed;
+  st_foreach(tracer->threadsinfo, rb_rg_reclaim_dead_threads_i, (st_data_t)tracer);
+  // Thread caches may still refer to the reclaimed shadow threads
+  if (UNLIKELY(reclaimed != tracer->threads_reclaimed)) rb_rg_invalidate_thread_caches();
+  return tracer->threads_reclaimed - reclaimed;
+}
+
+// A callback function invoked by st_foreach that frees a class info entry
+static int rb_rg_classinfo_free_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rb_rg_class_info_t *info = (rb_rg_class_info_t *)val;
+  xfree(info->encoded);
+  xfree(info);
+  return ST_DELETE;
+}
+
+// A callback function invoked by st_foreach in rb_rg_tracer_mark that marks a cached class and it's resolved path
+static int rb_rg_classinfo_mark_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rb_gc_mark((VALUE)key);
+  rb_gc_mark(((rb_rg_class_info_t *)val)->name);
+  return ST_CONTINUE;
+}
+
+// A callback function invoked by st_foreach in rb_rg_tracer_size that adds the size of a class info entry
+static int rb_rg_add_classinfo_size_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  size_t *size = (size_t *)data;
+  *size += sizeof(rb_rg_class_info_t) + ((rb_rg_class_info_t *)val)->encoded_length;
+  return ST_CONTINUE;
+}
+
+// A callback function invoked by st_foreach in rb_rg_tracer_mark that marks a cached source path
+static int rb_rg_library_paths_mark_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rb_gc_mark((VALUE)key);
+  return ST_CONTINUE;
+}
+
+// A callback function invoked by st_foreach that frees a method pending classification
+static int rb_rg_pending_methods_free_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  xfree((rb_rg_pending_method_t *)val);
+  return ST_DELETE;
+}
+
+// A callback function invoked by st_foreach in rb_rg_tracer_mark that marks the defined class and method name of a method pending classification
+static int rb_rg_pending_methods_mark_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rb_rg_pending_method_t *pending = (rb_rg_pending_method_t *)val;
+  rb_gc_mark(pending->namespace);
+  rb_gc_mark(pending->method_name);
   return ST_CONTINUE;
 }
 
 // The main GC hook that walks the struct that represents an instance of Raygun::Apm::Tracer during the tracing (mark) phase that verifies if objects are alive
 // or not. Mostly concerned with the trace contexts table, the threads table, callback sink metadata and the timer and sink threads
-//
 void rb_rg_tracer_mark(void *ptr)
 {
-  const rb_rg_tracer_t *tracer = (rb_rg_tracer_t *)ptr;
+  rb_rg_tracer_t *tracer = (rb_rg_tracer_t *)ptr;
   st_foreach(tracer->tracecontexts, rb_rg_trace_context_mark_i, 0);
   st_foreach(tracer->threadsinfo, rb_rg_threadsinfo_mark_i, 0);
   rb_gc_mark(tracer->sink_data.callback);
@@ -143,6 +428,15 @@ void rb_rg_tracer_mark(void *ptr)
   rb_gc_mark(tracer->sink_data.payload);
   rb_gc_mark(tracer->timer_thread);
   rb_gc_mark(tracer->sink_thread);
+  // Disabled tracepoints of pooled trace contexts
+  for (rb_rg_trace_context_t *trace_context = tracer->trace_contexts; trace_context; trace_context = trace_context->next)
+    rb_gc_mark(trace_context->tracepoint);
+  // Source paths with a cached library classification
+  st_foreach(tracer->library_paths, rb_rg_library_paths_mark_i, 0);
+  // Classes with cached class info
+  st_foreach(tracer->classinfo, rb_rg_classinfo_mark_i, 0);
+  // Methods pending classification
+  st_foreach(tracer->pending_methods, rb_rg_pending_methods_mark_i, 0);
 }
 
 // A callback function invoked by walking the trace contexts table in function rb_rg_tracer_free. Frees the trace context struct and data it references and
@@ -154,32 +448,114 @@ static int rb_rg_trace_context_free_i(st_data_t key, st_data_t val, st_data_t da
   return ST_DELETE;
 }
 
-// A callback function invoked by walking the trace contexts table in function rb_rg_tracer_free. Returns ST_DELETE, which instructs the Ruby symbol table
-// implementation to remove this trace context from the table too (the entry effectively). There's nothing to free because the key (Ruby Thread) is a VALUE
-// and the mark callback is a hint for the GC to collect it, or not. We're just concerned with removing dead threads from the symbol table otherwise it would
-// just grow unbounded.
+// A callback function invoked by walking the threads info table in function rb_rg_tracer_free. Frees the shadow thread and returns ST_DELETE, which instructs
+// the Ruby symbol table implementation to remove this thread from the table too (the entry effectively). The key (Ruby Thread) is a VALUE and the mark
+// callback is a hint for the GC to collect it, or not.
 //
 static int rb_rg_threadsinfo_free_i(st_data_t key, st_data_t val, st_data_t data)
 {
-  // Nothing to free, effectively just removes the entry
+  rg_thread_t *th = (rg_thread_t *)val;
+  // Suspended fiber shadow stacks go to the pool, which is freed after
+  if (th->fibers) {
+    rb_rg_release_fiber_stacks((rb_rg_tracer_t *)data, th);
+    st_free_table(th->fibers);
+  }
+  xfree(th);
   return ST_DELETE;
 }
 
-// A callback function invoked by walking the methodinfo table in function rb_rg_tracer_free. Frees the rg_method struct and data it references and
-// returns ST_DELETE, which instructs the Ruby symbol table implementation to remove this whitelisted shadow method from the table too (the entry effectively)
+// A callback function invoked by walking the methodinfo table in functions rb_rg_flush_caches and rb_rg_evict_methodinfo_i. Returns the rg_method struct
+// to the method slab, releases the data it references in the method arena and returns ST_DELETE, which instructs the Ruby symbol table implementation to
+// remove this whitelisted shadow method from the table too (the entry effectively). Interned class names are shared and only reclaimed on compaction.
 //
 int rb_rg_methodinfo_free_i(st_data_t key, st_data_t val, st_data_t data)
 {
+  rb_rg_tracer_t *tracer = (rb_rg_tracer_t *)data;
   rg_method_t *rg_method = (rg_method_t *)val;
   // Blacklisted
   if ((int)val == RG_BLACKLIST_BLACKLISTED) return ST_DELETE;
-  free(rg_method->encoded);
-  xfree(rg_method->name);
-  xfree(rg_method);
+  // Inherited from the parent process - freed with the inherited slab and arena at once
+  if (rg_method->function_id <= tracer->methods_inherited) return ST_DELETE;
+  if (rg_method->encoded) rg_arena_release(&tracer->method_arena, rg_method->encoded_size);
+  rg_arena_release(&tracer->method_arena, strlen(rg_method->method_name) + 1);
+  rg_slab_free(&tracer->method_slab, rg_method);
   rg_method = NULL;
   return ST_DELETE;
 }
 
+// Frees the methods inherited from the parent process, once no longer referenced by the methodinfo table
+static void rb_rg_free_inherited_methods(rb_rg_tracer_t *tracer)
+{
+  rg_slab_destroy(&tracer->inherited_method_slab);
+  rg_arena_free(&tracer->inherited_method_arena);
+  tracer->methods_inherited = 0;
+}
+
+// Grows the called bitmaps to fit the given function ID. Expects the method lock to be held. Returns false on allocation failure.
+static int rb_rg_reserve_methodinfo_called(rb_rg_tracer_t *tracer, const rg_function_id_t function_id)
+{
+  rg_byte_t *called, *called_previously;
+  size_t size = tracer->methodinfo_called_size ? tracer->methodinfo_called_size : RB_RG_METHODINFO_CAPACITY / 8;
+  if ((size_t)(function_id >> 3) < tracer->methodinfo_called_size) return true;
+  while (size <= (size_t)(function_id >> 3)) size *= 2;
+  called = realloc(tracer->methodinfo_called, size);
+  if (!called) return false;
+  tracer->methodinfo_called = called;
+  called_previously = realloc(tracer->methodinfo_called_previously, size);
+  if (!called_previously) return false;
+  tracer->methodinfo_called_previously = called_previously;
+  memset(called + tracer->methodinfo_called_size, 0, size - tracer->methodinfo_called_size);
+  memset(called_previously + tracer->methodinfo_called_size, 0, size - tracer->methodinfo_called_size);
+  tracer->methodinfo_called_size = size;
+  return true;
+}
+
+// Flags a whitelisted method as called in the current methodinfo table generation, which keeps it from being evicted
+static inline void rb_rg_methodinfo_called(rb_rg_tracer_t *tracer, const rg_function_id_t function_id)
+{
+  rg_byte_t *byte = tracer->methodinfo_called + (function_id >> 3), bit = (rg_byte_t)(1 << (function_id & 7));
+  if (UNLIKELY(!(*byte & bit))) *byte |= bit;
+}
+
+// Whether a whitelisted method was called in the current or previous methodinfo table generation
+static inline int rb_rg_methodinfo_recently_called(const rb_rg_tracer_t *tracer, const rg_function_id_t function_id)
+{
+  rg_byte_t bit = (rg_byte_t)(1 << (function_id & 7));
+  return (tracer->methodinfo_called[function_id >> 3] & bit) || (tracer->methodinfo_called_previously[function_id >> 3] & bit);
+}
+
+// Starts a new methodinfo table generation - methods not called since the previous one are cold from the next one on
+static void rb_rg_next_methodinfo_generation(rb_rg_tracer_t *tracer)
+{
+  rg_byte_t *called = tracer->methodinfo_called_previously;
+  tracer->methodinfo_called_previously = tracer->methodinfo_called;
+  if (called) memset(called, 0, tracer->methodinfo_called_size);
+  tracer->methodinfo_called = called;
+  tracer->methodinfo_generation++;
+}
+
+// Interns a class name, which must be NUL terminated at length, in the given arena and class names table. Returns NULL on allocation failure.
+static const char *rb_rg_intern_class_name(rg_arena_t *arena, st_table *class_names, const char *class_name, const size_t length)
+{
+  st_data_t entry;
+  char *interned;
+  if (st_lookup(class_names, (st_data_t)class_name, &entry)) return (const char *)entry;
+  interned = rg_arena_dup(arena, class_name, length + 1);
+  if (!interned) return NULL;
+  st_insert(class_names, (st_data_t)interned, (st_data_t)interned);
+  return interned;
+}
+
+// Drops the persisted method classifications and the ones recorded since, and stops recording - the cache is keyed by the blacklist and library paths
+// it was built with
+static void rb_rg_drop_method_cache(rb_rg_tracer_t *tracer)
+{
+  rg_method_cache_close(tracer->method_cache);
+  tracer->method_cache = NULL;
+  rg_method_cache_log_free(&tracer->method_cache_log);
+  tracer->method_cache_recording = false;
+}
+
 // The main GC callback from the typed data (https://github.com/ruby/ruby/blob/master/doc/extension.rdoc#encapsulate-c-data-into-a-ruby-object-) struct.
 // Typically it's the responsibility of this method to walk all struct members with data to free so that at the end of this function, if we free the profiler
 // struct, there's nothing dangling about on the heap.
@@ -198,37 +574,77 @@ void rb_rg_tracer_free(void *ptr)
   // one on insert and delete)
   rb_nativethread_lock_destroy(&tracer->method_lock);
   rb_nativethread_lock_destroy(&tracer->thread_lock);
-  // Free for UDP and other transport oriented sinks - no bipbuf allocated for callback sink
+  // Free for UDP and other transport oriented sinks - no lanes allocated for callback sink
   if ((tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP))
-    bipbuf_free(tracer->sink_data.ringbuf.bipbuf);
+    rb_rg_free_sink_lanes(&tracer->sink_data);
 
   // Free the source of truth for the radix trees
   raxFree(tracer->blacklist);
   raxFree(tracer->blacklist_fq);
   raxFree(tracer->blacklist_paths);
   raxFree(tracer->blacklist_methods);
-  // Free the source of truth for external libraries
+  // And the automaton compiled from them
+  rg_blacklist_free(tracer->filters);
+  // Free the source of truth for external libraries, the index compiled from it and the source path classification cache
   raxFree(tracer->libraries);
+  rg_prefix_index_free(tracer->library_index);
+  st_free_table(tracer->library_paths);
+  // Free the string dictionary and the interned strings it refers to
+  raxFree(tracer->sink_data.strings);
+  for (rg_string_id_t i = 0; i < tracer->sink_data.interned_count; i++) free(tracer->sink_data.interned[i]);
   // Clean up trace contexts
   st_foreach(tracer->tracecontexts, rb_rg_trace_context_free_i, 0);
   // ... then free the symbol table too
   st_free_table(tracer->tracecontexts);
   // Explicitly nullify
   tracer->tracecontexts = NULL;
+  // Fibers of the trace contexts freed above
+  st_free_table(tracer->fibertraces);
+  tracer->fibertraces = NULL;
+  // Pooled trace contexts
+  while (tracer->trace_contexts) {
+    rb_rg_trace_context_t *trace_context = tracer->trace_contexts;
+    tracer->trace_contexts = trace_context->next;
+    rb_rg_trace_context_free(trace_context);
+  }
+  tracer->pooled_trace_contexts = 0;
+  // Pre-encoded BEGIN_TRANSACTION
+  xfree(tracer->begin_transaction);
+  tracer->begin_transaction = NULL;
 
   // Thread ID mappings
-  st_foreach(tracer->threadsinfo, rb_rg_threadsinfo_free_i, 0);
+  st_foreach(tracer->threadsinfo, rb_rg_threadsinfo_free_i, (st_data_t)tracer);
   // ... then free the symbol table too
   st_free_table(tracer->threadsinfo);
   // Explicitly nullify
   tracer->threadsinfo = NULL;
 
-  // Global methodinfo table
-  st_foreach(tracer->methodinfo, rb_rg_methodinfo_free_i, 0);
-  // ... then free the symbol table too
+  // Global methodinfo table - the whitelisted methods it points to are freed with the method slab and arena below
   st_free_table(tracer->methodinfo);
   // Explicitly nullify
   tracer->methodinfo = NULL;
+  rg_slab_destroy(&tracer->method_slab);
+  rg_arena_free(&tracer->method_arena);
+  rb_rg_free_inherited_methods(tracer);
+  st_free_table(tracer->method_class_names);
+  tracer->method_class_names = NULL;
+  free(tracer->methodinfo_called);
+  free(tracer->methodinfo_called_previously);
+  tracer->methodinfo_called = NULL;
+  tracer->methodinfo_called_previously = NULL;
+
+  // Class info cache
+  st_foreach(tracer->classinfo, rb_rg_classinfo_free_i, 0);
+  st_free_table(tracer->classinfo);
+  tracer->classinfo = NULL;
+
+  // Methods pending classification
+  st_foreach(tracer->pending_methods, rb_rg_pending_methods_free_i, 0);
+  st_free_table(tracer->pending_methods);
+  tracer->pending_methods = NULL;
+
+  // Persisted method classifications
+  rb_rg_drop_method_cache(tracer);
 
   // Free the special builtin method handler table - nothing allocated, st_free_table drains the static entries
   if (tracer->builtin_translator->num_entries == RB_RG_TRACER_BUILTIN_METHODS_TRANSLATED) {
@@ -242,6 +658,22 @@ void rb_rg_tracer_free(void *ptr)
   // Explicitly nullify
   tracer->synchronization_methods = NULL;
 
+  // Pooled shadow threads
+  while (tracer->free_threads) {
+    rg_thread_t *th = tracer->free_threads;
+    tracer->free_threads = th->next;
+    xfree(th);
+  }
+  tracer->pooled_threads = 0;
+
+  // Pooled fiber shadow stacks
+  while (tracer->fiber_stacks) {
+    rg_fiber_stack_t *stack = tracer->fiber_stacks;
+    tracer->fiber_stacks = stack->next;
+    xfree(stack);
+  }
+  tracer->pooled_fiber_stacks = 0;
+
 #ifdef RB_RG_EMIT_ARGUMENTS
   rb_gc_unregister_address(&tracer->returnvalue_str);
   rb_gc_unregister_address(&tracer->catch_all_arg);
@@ -256,6 +688,8 @@ void rb_rg_tracer_free(void *ptr)
   // Unregister for UDP or other transport oriented sinks only
   if ((tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP))
     rb_gc_unregister_address(&tracer->sink_data.payload);
+  // Thread caches may still refer to this tracer
+  rb_rg_invalidate_thread_caches();
   // Finally free the tracer
   xfree(tracer);
   // Explicitly nullify
@@ -265,7 +699,11 @@ void rb_rg_tracer_free(void *ptr)
 // Required on any changes to the blacklist - rebuild the table from scratch for consistency
 static void rb_rg_flush_caches(rb_rg_tracer_t *tracer)
 {
-  st_foreach(tracer->methodinfo, rb_rg_methodinfo_free_i, 0);
+  st_foreach(tracer->methodinfo, rb_rg_methodinfo_free_i, (st_data_t)tracer);
+  // Nothing in the method arena is referenced anymore
+  st_clear(tracer->method_class_names);
+  rg_arena_free(&tracer->method_arena);
+  rb_rg_free_inherited_methods(tracer);
 }
 
 // A helper function to calculate the size in bytes of the trace context table values (accumulator)
@@ -276,19 +714,13 @@ static int rb_rg_add_trace_context_size_i(st_data_t key, st_data_t val, st_data_
   return ST_CONTINUE;
 }
 
-// A helper function to calculate the size in bytes of the method info table values (accumulator)
-static int rb_rg_add_methodinfo_size_i(st_data_t key, st_data_t val, st_data_t data)
+// A callback function invoked by st_foreach in rb_rg_tracer_size that adds the size of a shadow thread and the shadow stacks of it's suspended fibers
+static int rb_rg_add_threadsinfo_size_i(st_data_t key, st_data_t val, st_data_t data)
 {
   size_t *size = (size_t *)data;
-  rg_method_t *rg_method = (rg_method_t *)val;
-  // Blacklisted, count the int and early return
-  if ((int)val == RG_BLACKLIST_BLACKLISTED) {
-    *size += sizeof(int);
-    return ST_CONTINUE;
-  }
-  *size += sizeof(rg_method_t);
-  *size += rg_method->encoded_size;
-  *size += rg_method->length;
+  rg_thread_t *th = (rg_thread_t *)val;
+  *size += sizeof(rg_thread_t);
+  if (th->fibers) *size += st_memsize(th->fibers) + th->fibers->num_entries * sizeof(rg_fiber_stack_t);
   return ST_CONTINUE;
 }
 
@@ -307,17 +739,46 @@ size_t rb_rg_tracer_size(const void *ptr)
           raxSize(tracer->blacklist_fq) +
           raxSize(tracer->blacklist_paths) +
           raxSize(tracer->blacklist_methods) +
+          rg_blacklist_size(tracer->filters) +
           raxSize(tracer->libraries) +
+          rg_prefix_index_size(tracer->library_index) +
+          st_memsize(tracer->library_paths) +
+          raxSize(tracer->sink_data.strings) +
           // calculate the memory size of the individual symbol table too (just the key value pairs as represented, NOT what they point to)
           st_memsize(tracer->tracecontexts) +
+          st_memsize(tracer->fibertraces) +
           st_memsize(tracer->methodinfo) +
+          st_memsize(tracer->method_class_names) +
+          st_memsize(tracer->classinfo) +
+          st_memsize(tracer->pending_methods) +
           st_memsize(tracer->threadsinfo);
-  // Add the ringbuffer allocated size, for transport oriented sinks
-  if (tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP) size += bipbuf_size(tracer->sink_data.ringbuf.bipbuf);
+  // Add the lanes and their ring buffers, for transport oriented sinks
+  if (tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP) {
+    size += tracer->sink_data.process_lane.ring->size + tracer->sink_data.lanes_capacity * sizeof(rb_rg_sink_lane_t *);
+    for (rg_tid_t i = 0; i < tracer->sink_data.lanes_capacity; i++) {
+      if (tracer->sink_data.lanes[i]) size += sizeof(rb_rg_sink_lane_t) + tracer->sink_data.lanes[i]->ring->size;
+    }
+  }
   // Now add the values of the trace contexts table as well
   st_foreach(tracer->tracecontexts, rb_rg_add_trace_context_size_i, (st_data_t)&size);
-  // Now add the values of the methodinfo table as well
-  st_foreach(tracer->methodinfo, rb_rg_add_methodinfo_size_i, (st_data_t)&size);
+  // Now add the whitelisted methods the methodinfo table points to as well - blacklisted methods are stored in the table itself
+  size += rg_slab_size(&tracer->method_slab) + rg_arena_size(&tracer->method_arena);
+  size += rg_slab_size(&tracer->inherited_method_slab) + rg_arena_size(&tracer->inherited_method_arena);
+  size += tracer->methodinfo_called_size * 2;
+  // And the class info cache
+  st_foreach(tracer->classinfo, rb_rg_add_classinfo_size_i, (st_data_t)&size);
+  size += tracer->pending_methods->num_entries * sizeof(rb_rg_pending_method_t);
+  // The persisted method classifications and those recorded since
+  size += rg_method_cache_size(tracer->method_cache) + tracer->method_cache_log.capacity;
+  // The shadow threads, suspended fiber shadow stacks and the pool of fiber shadow stacks
+  st_foreach(tracer->threadsinfo, rb_rg_add_threadsinfo_size_i, (st_data_t)&size);
+  size += tracer->pooled_fiber_stacks * sizeof(rg_fiber_stack_t);
+  size += tracer->pooled_threads * sizeof(rg_thread_t);
+  // Pooled trace contexts and the BEGIN_TRANSACTION template
+  size += tracer->pooled_trace_contexts * sizeof(rb_rg_trace_context_t);
+  if (tracer->begin_transaction) size += sizeof(rg_begin_transaction_template_t);
+  // And the interned strings of the string dictionary
+  for (rg_string_id_t i = 0; i < tracer->sink_data.interned_count; i++) size += offsetof(rg_encoded_string_t, string) + tracer->sink_data.interned[i]->length;
   return size;
 }
 
@@ -356,6 +817,8 @@ static const char* rb_rg_event_type_to_str(const rg_event_t *event)
       return "BEGIN_TRANSACTION";
    case RG_EVENT_END_TRANSACTION:
       return "END_TRANSACTION";
+    case RG_EVENT_STRING_DEFINITION:
+      return "STRING_DEFINITION";
     default:
       return "UNKNOWN";
   }
@@ -445,50 +908,148 @@ static int rb_rg_callback_sink(rg_context_t *context, void *userdata, const rg_e
   return 1;
 }
 
-// Peek into the transport specific ring buffer for the next expected message size we can consume
-static inline rg_length_t rg_ringbuf_next_message_size(const rg_ringbuf_t *ringbuf)
+#ifdef RB_RG_DEBUG
+static inline char* rb_rg_tracer_sink_name(rb_rg_sink_data_t *sink_data)
 {
-  // XXX dereference instead of memcpy?
-  rg_length_t size;
-  unsigned char *buf = NULL;
-  buf = bipbuf_peek(ringbuf->bipbuf, (unsigned int)sizeof(size));
-  if(buf)
-  {
-    memcpy(&size, buf, sizeof(size));
-  } else
-  {
-    return 0;
-  }  
-  return size;
+  switch(sink_data->type){
+    case RB_RG_TRACER_SINK_TCP:
+          return "TCP";
+    case RB_RG_TRACER_SINK_UDP:
+          return "UDP";
+  }
 }
+#endif
 
-// Resets the batch struct on sink data to a fresh state. We don't touch the sequence number, just reset it's length to the header
+// Resets the batch of a lane to a fresh state. The sequence number is assigned sink wide on seal, here we just reset it's length to the header
 // size (which is a space reservation as we fill it in on handoff to the ring buffer for dispatch with rg_encode_batch_header)
-// and resets the commands count for the current batch to 0
+// and resets the commands count for the current batch to 0. For the compact framing the thread and base timestamp is pinned again
+// by the first compact record appended to the fresh batch.
 //
-static inline void rb_rg_spawn_new_batch(rb_rg_sink_data_t *sink_data)
+static inline void rb_rg_spawn_new_batch(rb_rg_sink_data_t *sink_data, rb_rg_sink_lane_t *lane)
 {
-    sink_data->batch.length = RG_BATCH_HEADLEN;
-    sink_data->batch.count = 0;
+    lane->batch.length = rg_batch_headlen(&lane->batch);
+    lane->batch.count = 0;
+    lane->batch.tid = 0;
+    // Any END_TRANSACTION commands lingering in the batch were just sealed
+    lane->linger_deadline = 0;
     sink_data->resets++;
     sink_data->batches++;
 }
 
+// Queues a frame into the ring buffer of a lane for the sink thread. Returns 0 if the lane's ring buffer is full and the frame was dropped.
+static inline int rb_rg_lane_offer(rb_rg_sink_data_t *sink_data, rb_rg_sink_lane_t *lane, const rg_byte_t *buf, const rg_length_t len)
+{
+  if (UNLIKELY(!rg_spsc_offer(lane->ring, buf, len))) return 0;
+  __atomic_add_fetch(&sink_data->queued, len, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static int rb_rg_seal_lane(rb_rg_sink_data_t *sink_data, rb_rg_sink_lane_t *lane);
+
+// Seals a partial batch of the process lane before anything is queued in a thread lane - the sink thread drains the process lane first, thus
+// methodinfo and string definitions are always dispatched ahead of the commands that reference them.
+//
+static inline void rb_rg_seal_process_lane(rb_rg_sink_data_t *sink_data, const rb_rg_sink_lane_t *lane)
+{
+  if (lane != &sink_data->process_lane && sink_data->process_lane.batch.count) rb_rg_seal_lane(sink_data, &sink_data->process_lane);
+}
+
+// Finalizes the current batch of a lane and queues it for dispatch. Batch header is always encoded last as it needs the batch to be finalized
+// before being able to generate a represetantive header.
+//
+static int rb_rg_seal_lane(rb_rg_sink_data_t *sink_data, rb_rg_sink_lane_t *lane)
+{
+  int retval;
+  rb_rg_seal_process_lane(sink_data, lane);
+  lane->batch.sequence = sink_data->sequence;
+  rg_encode_batch_header(&lane->batch);
+  sink_data->sequence = lane->batch.sequence;
+  sink_data->batches++;
+  // Add the batch to the lane's ring buffer for emission
+  retval = rb_rg_lane_offer(sink_data, lane, lane->batch.buf, lane->batch.length);
 #ifdef RB_RG_DEBUG
-static inline char* rb_rg_tracer_sink_name(rb_rg_sink_data_t *sink_data)
+  const struct rb_rg_tracer_t *tracer = sink_data->tracer;
+  if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
+    if (UNLIKELY(retval == 0)) {
+      printf("[Raygun APM] %s sink lane %u batch %u overflow wanted:%i used:%u unused:%u!\n", rb_rg_tracer_sink_name(sink_data), lane->tid, lane->batch.sequence, lane->batch.length, rg_spsc_used(lane->ring), rg_spsc_unused(lane->ring));
+    } else {
+      printf("[Raygun APM] %s sink lane %u batch %u queued:%i used:%u unused:%u\n", rb_rg_tracer_sink_name(sink_data), lane->tid, lane->batch.sequence, lane->batch.length, rg_spsc_used(lane->ring), rg_spsc_unused(lane->ring));
+    }
+  }
+#endif
+  // Reset the batch back to 0 batch count
+  rb_rg_spawn_new_batch(sink_data, lane);
+  return retval;
+}
+
+// Seals the partial batches of all lanes, process lane first. Returns 0 if nothing was sealed.
+static int rb_rg_seal_lanes(rb_rg_sink_data_t *sink_data)
 {
-  switch(sink_data->type){
-    case RB_RG_TRACER_SINK_TCP:
-          return "TCP";
-    case RB_RG_TRACER_SINK_UDP:
-          return "UDP";
+  int sealed = 0;
+  if (sink_data->process_lane.batch.count) {
+    rb_rg_seal_lane(sink_data, &sink_data->process_lane);
+    sealed++;
+  }
+  for (rg_tid_t i = 0; i < sink_data->lanes_capacity; i++) {
+    if (sink_data->lanes[i] && sink_data->lanes[i]->batch.count) {
+      rb_rg_seal_lane(sink_data, sink_data->lanes[i]);
+      sealed++;
+    }
   }
+  return sealed;
 }
-#endif
 
-// Sink that emits a UDP packet. This callback could be more generic, perhaps rb_rg_batched_sink as it ensures a stream
-// of MTU sized batches and could also be directly usable by a TCP transport by just changing the naming and having a TCP
-// dispatcher thread.
+// The size an event occupies once appended to the current batch. Same as the encoded size for v2 batches, but BEGIN and END shrink
+// to a handful of bytes with the compact v3 framing.
+//
+static inline rg_length_t rb_rg_batch_record_size(const rb_rg_sink_data_t *sink_data, const rb_rg_sink_lane_t *lane, const rg_event_t *event, const rg_length_t buflen)
+{
+  if (lane->batch.type == RG_EVENT_BATCH_V3) {
+    return rg_encode_v3_record_size(event, buflen, sink_data->instance_ids, &lane->batch);
+  }
+  return buflen;
+}
+
+// Appends the event encoded in the encoder scratch buffer to the current batch of a lane, in the framing negotiated with the Agent
+static inline void rb_rg_encode_into_batch(rg_context_t *context, rb_rg_sink_data_t *sink_data, rb_rg_sink_lane_t *lane, const rg_event_t *event, const rg_length_t buflen)
+{
+  if (lane->batch.type == RG_EVENT_BATCH_V3) {
+    rg_encode_v3_into_batch(context->buf, buflen, event, sink_data->instance_ids, &lane->batch);
+  } else {
+    rg_encode_into_batch(context->buf, buflen, &lane->batch);
+  }
+  sink_data->encoded_batched++;
+}
+
+// Whether events that don't fit a batch are fragmented by the sink - only datagram transports need to and only Agents that understand the
+// compact v3 framing reassemble fragments
+static inline int rb_rg_sink_fragments(const rb_rg_sink_data_t *sink_data)
+{
+  return sink_data->type == RB_RG_TRACER_SINK_UDP && sink_data->protocol_version == RG_PROTOCOL_VERSION_3;
+}
+
+// Splits the event encoded in the encoder scratch buffer into fragments of at most the batch size and queues them for dispatch. All fragments
+// of an event are queued or none at all, as a partial group is useless to the Agent. One extra fragment worth of space covers wrap padding.
+//
+static int rb_rg_fragment_event(rg_context_t *context, rb_rg_sink_data_t *sink_data, rb_rg_sink_lane_t *lane, const rg_length_t buflen)
+{
+  rg_byte_t frame[RG_MAX_BATCH_PACKET_SIZE];
+  rg_byte_t count = rg_fragment_count(buflen, sink_data->batch_size);
+  rg_length_t length;
+
+  if (UNLIKELY(!count || rg_spsc_unused(lane->ring) < (count + 1) * RG_SPSC_FRAME_SIZE(sink_data->batch_size))) return 0;
+  for (rg_byte_t index = 0; index < count; index++) {
+    length = rg_encode_fragment(frame, context->buf, buflen, sink_data->batch_size, context->pid, sink_data->fragment_group, index);
+    rb_rg_lane_offer(sink_data, lane, frame, length);
+  }
+  sink_data->fragment_group++;
+  sink_data->fragmented++;
+  return 1;
+}
+
+// Sink that batches encoded events for the UDP and TCP transports. Each thread appends to the batch of it's own lane, thus BEGIN and END commands
+// of concurrent threads never interleave in a batch and sealed batches are queued in the lane's own ring buffer for the sink thread to merge.
+// The encoder scratch buffer is still shared - events are encoded and copied into a batch within the same sink call.
 //
 static int rb_rg_batched_sink(rg_context_t *context, void *userdata, const rg_event_t *event, const rg_length_t buflen)
 {
@@ -496,122 +1057,91 @@ static int rb_rg_batched_sink(rg_context_t *context, void *userdata, const rg_ev
 #ifdef RB_RG_DEBUG
   const struct rb_rg_tracer_t *tracer = sink_data->tracer;
 #endif
+  rb_rg_sink_lane_t *lane;
   int retval = 1;
-  size_t buf_used = bipbuf_used(sink_data->ringbuf.bipbuf);
+  rg_length_t reclen;
 
-  // Tracks the maximum size of the ring buffer used to facilitate the jitter buffer feature for UDP sinks and also used in telemetry when the
+  // Tracks the maximum bytes queued across lanes to facilitate the jitter buffer feature for UDP sinks and also used in telemetry when the
   // RAYGUN_DIAGNOSTICS env var is set
-  if (buf_used > sink_data->max_buf_used) {
-     sink_data->max_buf_used = buf_used;
+  if (sink_data->queued > sink_data->max_buf_used) {
+     sink_data->max_buf_used = sink_data->queued;
   }
 
-  // The most frequent path most encoded events pass through - the batch is still smaller than MTU size, append to batch
-  if (LIKELY(event && (sink_data->batch.length + buflen) <= RG_BATCH_PACKET_SIZE))
+  // The only time we expect a NULL event is from the timer thread on tick to force flush any partial batches at a 1s cadence so we don't have cruft accumulating
+  // and delay traces from being finalized at the Agent layer.
+  // Do not attempt to flush empty batches though
+  //
+  if (!event) {
+    if (!rb_rg_seal_lanes(sink_data)) {
+#ifdef RB_RG_DEBUG
+      if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
+        printf("[Raygun APM] Not flushing empty batches\n");
+#endif
+      return retval;
+    }
+    rb_rg_handoff_dispatcher(sink_data, rb_rg_signal_dispatcher(sink_data));
+    return retval;
+  }
+
+  lane = rb_rg_sink_lane(sink_data, event);
+  if (UNLIKELY(!lane)) return 0;
+  reclen = rb_rg_batch_record_size(sink_data, lane, event, buflen);
+
+  // The most frequent path most encoded events pass through - the batch is still smaller than the sink's batch size, append to batch
+  if (LIKELY((lane->batch.length + reclen) <= sink_data->batch_size))
   {
     // room for extra data in current batch, encode in batch
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-      printf("[Raygun APM] %s sink batch %u, smaller than batch packet size %u, room in current batch, encode %s into batch\n", rb_rg_tracer_sink_name(sink_data), sink_data->batch.sequence, RG_BATCH_PACKET_SIZE, rb_rg_event_type_to_str(event));
+      printf("[Raygun APM] %s sink lane %u, smaller than batch packet size %d, room in current batch, encode %s into batch\n", rb_rg_tracer_sink_name(sink_data), lane->tid, sink_data->batch_size, rb_rg_event_type_to_str(event));
 #endif
     // Append a command to the current batch
-    rg_encode_into_batch(context->buf, buflen, &sink_data->batch);
-    sink_data->encoded_batched++;
-  } else if (!event || (RG_BATCH_HEADLEN+buflen <= RG_BATCH_PACKET_SIZE))
+    rb_rg_encode_into_batch(context, sink_data, lane, event, buflen);
+  } else if (rg_batch_headlen(&lane->batch) + reclen <= sink_data->batch_size)
   {
-    // The only time we expect a NULL event is from the timer thread on tick to force flush any partial batches at a 1s cadence so we don't have cruft accumulating
-    // and delay traces from being finalized at the Agent layer.
-    // Do not attempt to flush empty batches though
-    //
-    if (sink_data->batch.length == RG_BATCH_HEADLEN) {
+    // room in a new batch so dispatch current + encode in a new batch
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-      printf("[Raygun APM] Not flushing empty batch\n");
-#endif
-      return retval;
-    }
-    // flush batch (null event)
-    // or room in a new batch so dispatch current + encode in a new batch
-#ifdef RB_RG_DEBUG
-    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
-      if (!event) {
-        printf("[Raygun APM] %s sink batch %u, null event, finalize batch\n", rb_rg_tracer_sink_name(sink_data), sink_data->batch.sequence);
-      } else {
-        printf("[Raygun APM] %s sink batch %u, smaller than batch packet size %u, room in a new batch so dispatch current, encode %s into batch\n", rb_rg_tracer_sink_name(sink_data), sink_data->batch.sequence, RG_BATCH_PACKET_SIZE, rb_rg_event_type_to_str(event));
-      }
-    }
-#endif
-    // Batch header is always encoded last as it needs the batch to be finalized before being able to generate a represetantive header
-    rg_encode_batch_header(&sink_data->batch);
-    sink_data->batches++;
-
-    // Add the batch to the dispatch ring buffer for emission
-    retval = bipbuf_offer(sink_data->ringbuf.bipbuf, (unsigned char*)sink_data->batch.buf, (int)(sink_data->batch.length));
-#ifdef RB_RG_DEBUG
-    if (UNLIKELY(retval == 0))
-    {
-      if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
-        printf("[Raygun APM] %s sink batch %u overflow wanted:%i used:%i unused:%i!\n", rb_rg_tracer_sink_name(sink_data), sink_data->batch.sequence, buflen, bipbuf_used(sink_data->ringbuf.bipbuf), bipbuf_unused(sink_data->ringbuf.bipbuf));
-        assert(retval == 0);
-      }
-    } else
-    {
-      if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-        printf("[Raygun APM] %s sink batch %u queued:%i used:%i unused:%i\n", rb_rg_tracer_sink_name(sink_data), sink_data->batch.sequence, buflen, bipbuf_used(sink_data->ringbuf.bipbuf), bipbuf_unused(sink_data->ringbuf.bipbuf));
-    }
-#endif
-    // Reset the batch back to 0 batch count, retain sequence number
-    rb_rg_spawn_new_batch(sink_data);
-#ifdef RB_RG_DEBUG
-      if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-        printf("[Raygun APM] %s sink - reset batch\n", rb_rg_tracer_sink_name(sink_data));
+      printf("[Raygun APM] %s sink lane %u, smaller than batch packet size %d, room in a new batch so dispatch current, encode %s into batch\n", rb_rg_tracer_sink_name(sink_data), lane->tid, sink_data->batch_size, rb_rg_event_type_to_str(event));
 #endif
-    // encode in batch
-    if (event) {
-      // Append a command to the current batch
-      rg_encode_into_batch(context->buf, buflen, &sink_data->batch);
-      sink_data->encoded_batched++;
-    }
+    retval = rb_rg_seal_lane(sink_data, lane);
+    // Append a command to the fresh batch
+    rb_rg_encode_into_batch(context, sink_data, lane, event, buflen);
   } else
   {
-    // buflen exceeds RG_MAX_BATCH_PACKET_SIZE, send as-is - best effort delivery depending on transport, probably :boom: for UDP, likely delivered for TCP
-    if (buflen >= RG_MAX_BATCH_PACKET_SIZE - 2) {
+    // Dispatch any commands pending in the current batch first, they'd be dropped by the batch reset below otherwise
+    if (lane->batch.count) {
+      rb_rg_seal_lane(sink_data, lane);
+    } else {
+      rb_rg_seal_process_lane(sink_data, lane);
+    }
+    // buflen exceeds the batch size of a fragmenting transport or the max batch size of the transport (UDP only, stream transports batch the largest
+    // events). Fragmented if the Agent can reassemble fragments, otherwise send as-is - best effort delivery, probably :boom: for UDP
+    if (rb_rg_sink_fragments(sink_data)) {
+      retval = rb_rg_fragment_event(context, sink_data, lane, buflen);
+    } else if (rg_batch_headlen(&lane->batch) + reclen > sink_data->max_batch_size) {
       // make no attempt to wrap it into a batch command
-      retval = bipbuf_offer(sink_data->ringbuf.bipbuf, (unsigned char*)context->buf, (int)(buflen));
-      // Reset the batch back to 0 batch count, retain sequence number
-      rb_rg_spawn_new_batch(sink_data);
+      retval = rb_rg_lane_offer(sink_data, lane, context->buf, buflen);
       sink_data->encoded_raw++;
     } else {
-      // Flush current batch but also spawn a new batch for the payload that exceeds the default batch size
-      // These are edge cases for SQL queries etc.
-      rg_encode_batch_header(&sink_data->batch);
-      sink_data->batches++;
-      bipbuf_offer(sink_data->ringbuf.bipbuf, (unsigned char*)sink_data->batch.buf, (int)(sink_data->batch.length));
-
-      // Spawn the new batch with the event sized > MTU but smaller than RG_BATCH_PACKET_SIZE (typically a SQL query event)
-      rb_rg_spawn_new_batch(sink_data);
-      // Append a command to the current batch
-      rg_encode_into_batch(context->buf, buflen, &sink_data->batch);
-      // Batch header is always encoded last as it needs the batch to be finalized before being able to generate a represetantive header
-      rg_encode_batch_header(&sink_data->batch);
-      retval = bipbuf_offer(sink_data->ringbuf.bipbuf, (unsigned char*)sink_data->batch.buf, (int)(sink_data->batch.length));
-
-      // Spawn a fresh empty batch for subsequent commands that follow the large SQL query
-      rb_rg_spawn_new_batch(sink_data);
+      // Spawn the new batch with the event sized > batch size but smaller than the max batch size (typically a SQL query event) and
+      // dispatch it right away, subsequent commands that follow the large SQL query get a fresh empty batch
+      rb_rg_encode_into_batch(context, sink_data, lane, event, buflen);
+      retval = rb_rg_seal_lane(sink_data, lane);
     }
 #ifdef RB_RG_DEBUG
-    if (retval == 0)
-    {
-      if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-        printf("[Raygun APM] %s sink batch %u overflow wanted:%i used:%i unused:%i!\n", rb_rg_tracer_sink_name(sink_data), sink_data->batch.sequence, buflen, bipbuf_used(sink_data->ringbuf.bipbuf), bipbuf_unused(sink_data->ringbuf.bipbuf));
-    } else
-    {
-      if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-        printf("[Raygun APM] %s sink batch %u queued:%i used:%i unused:%i\n", rb_rg_tracer_sink_name(sink_data), sink_data->batch.sequence, buflen, bipbuf_used(sink_data->ringbuf.bipbuf), bipbuf_unused(sink_data->ringbuf.bipbuf));
+    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
+      if (retval == 0) {
+        printf("[Raygun APM] %s sink lane %u oversized event overflow wanted:%i used:%u unused:%u!\n", rb_rg_tracer_sink_name(sink_data), lane->tid, buflen, rg_spsc_used(lane->ring), rg_spsc_unused(lane->ring));
+      } else {
+        printf("[Raygun APM] %s sink lane %u oversized event queued:%i used:%u unused:%u\n", rb_rg_tracer_sink_name(sink_data), lane->tid, buflen, rg_spsc_used(lane->ring), rg_spsc_unused(lane->ring));
+      }
     }
 #endif
   }
-  // Give the transport specific sender thread a slice since we generally fill faster than consume
-  rb_thread_schedule();
+  // Wake up the sink thread if it's blocked waiting for a sealed batch and give it a slice if it was woken up, has enough to work with or is falling
+  // behind - not a GVL handoff per traced call
+  rb_rg_handoff_dispatcher(sink_data, rb_rg_signal_dispatcher(sink_data));
   return retval;
 }
 
@@ -639,6 +1169,25 @@ static VALUE rb_rg_tcp_sink_send(VALUE ptr)
   return rb_funcall(data->sock, rb_rg_id_write, 1, data->payload);
 }
 
+// Compresses a batch polled from the ring buffer into the sink's compression buffer. Raw oversized events and batches that don't compress are sent as-is.
+// Returns the size to send and points ptr to the compressed frame if the batch was compressed.
+//
+static rg_short_t rb_rg_compress_batch(rb_rg_sink_data_t *data, unsigned char **ptr, const rg_short_t size)
+{
+  rg_byte_t type = (*ptr)[sizeof(rg_length_t)];
+  rg_length_t length;
+  if (type != RG_EVENT_BATCH && type != RG_EVENT_BATCH_V3) return size;
+  data->compressed_in += size;
+  length = rg_compress_batch((const rg_byte_t *)*ptr, size, data->compressed, (int)sizeof(data->compressed));
+  if (!length) {
+    data->compressed_out += size;
+    return size;
+  }
+  data->compressed_out += length;
+  *ptr = data->compressed;
+  return length;
+}
+
 // Force flush a batched sink with a special case NULL event
 static void rb_rg_flush_batched_sink(const rb_rg_tracer_t *tracer)
 {
@@ -665,6 +1214,8 @@ static int rb_rg_async_emit_methodinfo_i(st_data_t key, st_data_t val, st_data_t
 #endif
   // Copy the already encoded methodinfo event back into the encoder scratch buffer for handoff to the transport dispatch thread
   memcpy(tracer->context->buf, rg_method->encoded, rg_method->encoded_size);
+  // Encoded by the parent for methods inherited by a forked child
+  rg_encode_header_pid(tracer->context->buf, tracer->context->pid);
   tracer->context->sink(tracer->context, (void *)&tracer->sink_data, &event, rg_method->encoded_size);
   return ST_CONTINUE;
 }
@@ -690,13 +1241,22 @@ static void rb_rg_process_type(const rb_rg_tracer_t *tracer)
   rg_process_type(tracer->context, (void *)&tracer->sink_data, 0, technology_type_string, process_type_string);
 }
 
+// Re-sends the definitions of the string dictionary, so the Agent can resolve string IDs of compact records again after a restart or reconnect
+static void rb_rg_async_emit_strings(const rb_rg_tracer_t *tracer) {
+  for (rg_string_id_t i = 0; i < tracer->sink_data.interned_count; i++) {
+    rg_string_definition(tracer->context, (void *)&tracer->sink_data, 0, i + 1, tracer->sink_data.interned[i]);
+  }
+}
+
 // Re-syncs the current global method table (whitelisted methods this process has seen) with the Agent, in case the Agent died and comes back up,
 // effectively orphaned from any previously methodinfo table state.
 static void rb_rg_async_emit_methodinfos(const rb_rg_tracer_t *tracer) {
-  // No need to emit anything if the methodinfo table is empty
-  if (UNLIKELY(tracer->methodinfo->num_entries == 0)) return;
   // No need to emit anything if we're not using a transport oriented sink
   if (UNLIKELY(!(tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP))) return;
+  // The string dictionary is synced alongside, independent of any methods observed yet
+  rb_rg_async_emit_strings(tracer);
+  // No need to emit anything if the methodinfo table is empty
+  if (UNLIKELY(tracer->methodinfo->num_entries == 0)) return;
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_INFO && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
       printf("[Raygun APM] Syncing the global whitelisted method table with the Agent\n");
@@ -708,9 +1268,86 @@ static void rb_rg_async_emit_methodinfos(const rb_rg_tracer_t *tracer) {
   st_foreach(tracer->methodinfo, rb_rg_async_emit_methodinfo_i, (st_data_t)tracer);
 }
 
-// A timer thread spawned to handle period work, one of two units:
+// Blocks the timer thread until the next tick or the linger deadline, whichever comes first. Producers arming an earlier linger deadline cut the wait
+// short - like for the sink threads, the deadline can't change between computing the timeout and the thread being marked as stopped as producers
+// need the GVL.
+//
+static void rb_rg_timer_wait(rb_rg_sink_data_t *data, rg_timestamp_t until)
+{
+  struct timeval tv;
+  rg_timestamp_t now = rg_timestamp();
+  if (data->linger_deadline && data->linger_deadline < until) until = data->linger_deadline;
+  if (!rb_rg_current_thread_to_be_killed() && until > now) {
+    tv.tv_sec = (until - now) / TIMESTAMP_UNITS_PER_SECOND;
+    tv.tv_usec = (until - now) % TIMESTAMP_UNITS_PER_SECOND;
+    data->timer_waiting = true;
+    rb_thread_wait_for(tv);
+    data->timer_waiting = false;
+  }
+  rb_thread_check_ints();
+}
+
+// Cuts the wait of the timer thread short if it's waiting for the next tick or linger deadline
+static void rb_rg_wakeup_timer_thread(rb_rg_tracer_t *tracer)
+{
+  int status = 0;
+  if (!tracer->sink_data.timer_waiting) return;
+  tracer->sink_data.timer_waiting = false;
+  rb_protect(rb_thread_wakeup, tracer->timer_thread, &status);
+  if (UNLIKELY(status)) {
+    rb_rg_log_silenced_error();
+    // Clearing error info to ignore the caught exception
+    rb_set_errinfo(Qnil);
+  }
+}
+
+// Called when a trace ends - seals the partial batch of the thread's lane right away without a linger time configured, or arms the linger deadline
+// for it unless an earlier END_TRANSACTION in the same batch already did. Under load the batch typically fills up and is sealed before the deadline.
+//
+static void rb_rg_linger_batched_sink(rb_rg_tracer_t *tracer, const rg_tid_t tid)
+{
+  rb_rg_sink_data_t *data = &tracer->sink_data;
+  rb_rg_sink_lane_t *lane;
+  rg_tid_t index = tid % RG_MAX_SINK_LANES;
+  if (data->type != RB_RG_TRACER_SINK_UDP && data->type != RB_RG_TRACER_SINK_TCP) return;
+  if (index >= data->lanes_capacity || !data->lanes[index]) return;
+  lane = data->lanes[index];
+  if (!lane->batch.count || lane->linger_deadline) return;
+  if (!data->linger) {
+    rb_rg_seal_lane(data, lane);
+    rb_rg_handoff_dispatcher(data, rb_rg_signal_dispatcher(data));
+    return;
+  }
+  lane->linger_deadline = rg_timestamp() + data->linger;
+  // The timer thread only waits for the earliest deadline of all lanes
+  if (data->linger_deadline && data->linger_deadline <= lane->linger_deadline) return;
+  data->linger_deadline = lane->linger_deadline;
+  rb_rg_wakeup_timer_thread(tracer);
+}
+
+// Seals the partial batches of lanes with a trace that ended linger microseconds ago and re-arms the timer thread for the earliest deadline left
+static void rb_rg_seal_lingering_lanes(rb_rg_sink_data_t *data, const rg_timestamp_t now)
+{
+  rb_rg_sink_lane_t *lane;
+  int sealed = 0;
+  data->linger_deadline = 0;
+  for (rg_tid_t i = 0; i < data->lanes_capacity; i++) {
+    lane = data->lanes[i];
+    if (!lane || !lane->linger_deadline) continue;
+    if (now >= lane->linger_deadline) {
+      rb_rg_seal_lane(data, lane);
+      sealed++;
+    } else if (!data->linger_deadline || lane->linger_deadline < data->linger_deadline) {
+      data->linger_deadline = lane->linger_deadline;
+    }
+  }
+  if (sealed) rb_rg_handoff_dispatcher(data, rb_rg_signal_dispatcher(data));
+}
+
+// A timer thread spawned to handle period work, one of three units:
 // * Flush any partial batches typically left over at the end of a unit of work to ensure a constant and correct flow of data to the Agent
 // * Periodic sync of the methodinfo table with the Agent
+// * Classify methods pending discovery with deferred discovery enabled - the tracepoint hook wakes it up for those
 // Exits when the tracer shuts down (data->running is set to false and the main loop quits)
 // 
 static VALUE rb_rg_timer_thread(void *ptr)
@@ -718,16 +1355,29 @@ static VALUE rb_rg_timer_thread(void *ptr)
   int status = 0;
   rb_rg_sink_data_t *data = (rb_rg_sink_data_t *)ptr;
   rb_rg_tracer_t *tracer = data->tracer;
-  // XXX to get from tracer config, static default of PROTON_BATCH_IDLE_COUNTER=500 to start with
-  struct timeval tv;
-  tv.tv_sec = RG_TIMER_THREAD_TICK_INTERVAL;
-  tv.tv_usec = 0;
+  rg_timestamp_t now, next_tick = rg_timestamp() + RG_TIMER_THREAD_TICK_INTERVAL * TIMESTAMP_UNITS_PER_SECOND;
   int methodinfo_sync_ticks = 0;
   while(data->running) {
-    rb_rg_thread_wait_for(tv);
+    rb_rg_timer_wait(data, next_tick);
+    // Classify newly seen methods off the threads that observed them
+    if (tracer->pending_methods->num_entries) rb_rg_resolve_pending_methods(tracer);
+    now = rg_timestamp();
+    // Seal partial batches with a trace that ended linger microseconds ago
+    if (data->linger_deadline && now >= data->linger_deadline) {
+      rb_rg_seal_lingering_lanes(data, now);
+    }
+    // Woken up early by a linger deadline, not a tick (also guards against the wall clock moving backwards)
+    if (now < next_tick && next_tick - now <= RG_TIMER_THREAD_TICK_INTERVAL * TIMESTAMP_UNITS_PER_SECOND) continue;
+    next_tick = now + RG_TIMER_THREAD_TICK_INTERVAL * TIMESTAMP_UNITS_PER_SECOND;
     // Flush out any commands still in a partial batch periodically to ensure a constant flow of data to the Agent
     rb_rg_flush_batched_sink(tracer);
+    // Sweep shadow threads of threads that died outside of a trace
+    rb_rg_reclaim_dead_threads(tracer);
+    // Keep the methodinfo table within bounds
+    if (UNLIKELY(tracer->methodinfo->num_entries > tracer->methodinfo_capacity)) rb_rg_evict_methodinfo(tracer);
     if (UNLIKELY(methodinfo_sync_ticks == RG_TIMER_THREAD_METHODINFO_TICK)) {
+      // Methods not called since the previous sync are cold from the next one on
+      rb_rg_next_methodinfo_generation(tracer);
       // Sync the methodinfo table periodically with the Agent
       rb_rg_async_emit_methodinfos(tracer);
       methodinfo_sync_ticks = 0;
@@ -742,79 +1392,109 @@ static VALUE rb_rg_timer_thread(void *ptr)
         printf("[Raygun APM] TCP socket %s:%d not yet connected in timer thread, reconnecting in %d seconds\n", RSTRING_PTR(tracer->sink_data.host), NUM2INT(tracer->sink_data.port), RG_SINK_THREAD_TICK_INTERVAL / 100000);
       } else {
         printf("[Raygun APM] TCP socket %s:%d connected in timer thread\n", RSTRING_PTR(tracer->sink_data.host), NUM2INT(tracer->sink_data.port));
+        // A new connection (and possibly a restarted Agent) - re-sync methodinfos and the string dictionary immediately instead of on the next sync tick
+        rb_rg_async_emit_methodinfos(tracer);
       }
     }
   }
   return Qtrue;
 }
 
-// The main sink thread that is responsible for driving UDP dispatch. This thread is the other end of the bipbuf (ring buffer)
-// and is the only consumer of it. The dispatch main loop balances sending as fast as possible when the buffer has data to send
-// but also periodically goes to sleep for up to 1s in order to not negatively impact CPU when the profiler isn't doing any work.
+// Merges the lanes for dispatch - points to the next frame of the process lane if there is one, otherwise of the next thread lane round robin
+// from the lane cursor, one frame per lane per turn so a busy thread can't starve the others. The exception are fragments - once the first
+// fragment of a group is dispatched, the rest of the group follows before fragments of any other lane, as the Agent reassembles one group at
+// a time. Lanes of threads that ended are freed once drained. Returns NULL when all lanes are empty. The frame stays valid until consumed with
+// rb_rg_dispatcher_consume.
+//
+static rg_byte_t *rb_rg_dispatcher_next(rb_rg_sink_data_t *data, rb_rg_sink_lane_t **lane, uint32_t *len)
+{
+  rg_byte_t *ptr;
+  rg_tid_t index;
+  *lane = &data->process_lane;
+  if ((ptr = rg_spsc_peek(data->process_lane.ring, len))) return ptr;
+  if (data->fragment_lane) {
+    *lane = data->fragment_lane;
+    if ((ptr = rg_spsc_peek((*lane)->ring, len))) {
+      if (rg_fragment_last_p(ptr)) data->fragment_lane = NULL;
+      return ptr;
+    }
+  }
+  for (rg_tid_t i = 0; i < data->lanes_capacity; i++) {
+    index = (data->lane_cursor + i) % data->lanes_capacity;
+    *lane = data->lanes[index];
+    if (!*lane) continue;
+    if ((ptr = rg_spsc_peek((*lane)->ring, len))) {
+      if (rg_fragment_p(ptr, *len)) {
+        // Another group is in flight, it's rest is still being queued
+        if (data->fragment_lane) continue;
+        if (!rg_fragment_last_p(ptr)) data->fragment_lane = *lane;
+      }
+      data->lane_cursor = index + 1;
+      return ptr;
+    }
+    if ((*lane)->retired && !(*lane)->batch.count) rb_rg_free_sink_lane(data, index);
+  }
+  return NULL;
+}
+
+// Releases a dispatched frame back to it's lane
+static inline void rb_rg_dispatcher_consume(rb_rg_sink_data_t *data, rb_rg_sink_lane_t *lane, const uint32_t len)
+{
+  rg_spsc_consume(lane->ring, len);
+  __atomic_sub_fetch(&data->queued, len, __ATOMIC_RELEASE);
+}
+
+// The main sink thread that is responsible for driving UDP dispatch. This thread is the other end of the lane ring buffers
+// and is the only consumer of them. The dispatch main loop sends as fast as possible when the buffer has data to send and blocks once
+// it's drained, until a producer seals the next batch, in order to not negatively impact CPU when the profiler isn't doing any work.
 //
 static VALUE rb_rg_udp_sink_thread(void *ptr)
 {
   int status = 0;
   int bytes_to_send_on_wakeup = 0;
   rg_short_t size;
+  uint32_t len;
+  rg_byte_t *frame;
+  rb_rg_sink_lane_t *lane;
   rb_rg_sink_data_t *data = (rb_rg_sink_data_t *)ptr;
-  struct timeval tv;
+  struct timeval tv, idle_tv;
   tv.tv_sec = 0;
   tv.tv_usec = RG_SINK_THREAD_TICK_INTERVAL;
+  idle_tv.tv_sec = RG_SINK_THREAD_IDLE_INTERVAL;
+  idle_tv.tv_usec = 0;
 #ifdef RB_RG_DEBUG
   const struct rb_rg_tracer_t *tracer = data->tracer;
 #endif
 
   // data->running is set to false on profiler shutdown which terminates this main loop and allows this thread to exit
-  while(data->running || !bipbuf_is_empty(data->ringbuf.bipbuf))
+  while(data->running || data->queued)
   {
     bytes_to_send_on_wakeup = 0;
 
-    // On each wakeup try to flush the queue, if there's anything to flush
-    while(!bipbuf_is_empty(data->ringbuf.bipbuf))
+    // On each wakeup try to flush the queue, if there's anything to flush - the next frame of the lanes merged
+    while((frame = rb_rg_dispatcher_next(data, &lane, &len)))
     {
-      // Peek into the bipbuf to determine the next expected message size to send
-      size = rg_ringbuf_next_message_size(&data->ringbuf);
+      size = (rg_short_t)len;
       bytes_to_send_on_wakeup += size;
 
-      // On empty next buffered message, terminate this UDP thread
-      if (UNLIKELY(!(size > 0))) {
-        data->running = false;
-#ifdef RB_RG_DEBUG
-        if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-          printf("[Raygun APM] UDP thread terminating - next buffered message is empty\n");
-#endif
-        break;
-      }
-      // As above, but moves the ring buffer cursor
-      unsigned char *ptr = bipbuf_poll(data->ringbuf.bipbuf, (unsigned int)size);
-      if (UNLIKELY(!ptr)) {
-        data->running = false;
-#ifdef RB_RG_DEBUG
-        if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-          printf("[Raygun APM] UDP thread terminating - NULL message on polling buffer\n");
-#endif
-        break;
-      }
-
-      // Introduce slight jitter and preempt the dispatch thread if we're still under half of the bipbuf capacity
+      // Introduce slight jitter and preempt the dispatch thread if we're still under half of the queued bytes budget
       // and receive buffer defaults (Linux net.core.rmem_default=212992 etc.) has not been exceeded. This jitter
-      // buffer feature slows the dispatch down somewhat under high bipbuf growth AS LONG AS there's buffer capacity
+      // buffer feature slows the dispatch down somewhat under high lane growth AS LONG AS there's buffer capacity
       // available.
       //
       if (bytes_to_send_on_wakeup >= data->receive_buffer_size) {
-        if (bipbuf_used(data->ringbuf.bipbuf) <= (RG_RINGBUF_SIZE / 2)) {
-          rb_rg_thread_wait_for(tv);
+        if (data->queued <= RG_RINGBUF_HIGH_WATERMARK) {
+          rb_rg_dispatcher_wait(data, RB_RG_DISPATCHER_PACING, tv);
           data->jittered_sends++;
 #ifdef RB_RG_DEBUG
         if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_WARNING && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-          printf("PID [%u] JITTERED jitters: %lu bipbuf: %u bytes_to_send_on_wakeup: %u Agent receive_buffer_size: %u\n", data->tracer->context->pid, data->jittered_sends, bipbuf_used(data->ringbuf.bipbuf), bytes_to_send_on_wakeup, data->receive_buffer_size);
+          printf("PID [%u] JITTERED jitters: %lu queued: %lu bytes_to_send_on_wakeup: %u Agent receive_buffer_size: %u\n", data->tracer->context->pid, data->jittered_sends, (unsigned long)data->queued, bytes_to_send_on_wakeup, data->receive_buffer_size);
 #endif
           bytes_to_send_on_wakeup = 0;
         } else {
 #ifdef RB_RG_DEBUG
         if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_WARNING && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-          printf("PID [%u] No jitter, buffer fill rate too high: %u of %u\n", data->tracer->context->pid, bipbuf_used(data->ringbuf.bipbuf), RG_RINGBUF_SIZE);
+          printf("PID [%u] No jitter, buffer fill rate too high: %lu of %u\n", data->tracer->context->pid, (unsigned long)data->queued, RG_RINGBUF_SIZE);
 #endif
         }
       }
@@ -822,7 +1502,8 @@ static VALUE rb_rg_udp_sink_thread(void *ptr)
       // Reset and fill the pre-allocated Ruby String buffer. This object is always considered as "marked" (in use) by the GC, won't be recycled until the profiler
       // shuts down and this pattern saves on Ruby heap allocation overhead per UDP packet (batch or exceptional oversized) sent
       rb_str_set_len(data->payload, 0);
-      rb_str_buf_cat(data->payload, (const char *)ptr, size);
+      rb_str_buf_cat(data->payload, (const char *)frame, size);
+      rb_rg_dispatcher_consume(data, lane, len);
 
       // Call the actual UDP send function with rb_protect, which prevents raising a runtime exception - we catch the status and reset Ruby error info to NULL to prevent
       // an exception raised for the caught exception (if any). We increment the failed_sends telemetry counter which can be inspected when the PROTON_DIAGNOSTICS env
@@ -841,16 +1522,17 @@ static VALUE rb_rg_udp_sink_thread(void *ptr)
         data->failed_sends++;
       } else {
         data->bytes_sent += size;
+        data->writes++;
 #ifdef RB_RG_DEBUG
       if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-        printf("[Raygun APM] UDP sent:%i used:%i unused:%i\n", size, bipbuf_used(data->ringbuf.bipbuf), bipbuf_unused(data->ringbuf.bipbuf));
+        printf("[Raygun APM] UDP sent:%i queued:%lu\n", size, (unsigned long)data->queued);
 #endif
       }
     }
     if (LIKELY(data->running))
     {
-      // While not instructed to exit, take a small pause to not burn CPU unecessary
-      rb_rg_thread_wait_for(tv);
+      // While not instructed to exit, block until a producer seals a batch to not burn CPU unecessary
+      rb_rg_dispatcher_wait(data, RB_RG_DISPATCHER_IDLE, idle_tv);
     } else
     {
 #ifdef RB_RG_DEBUG
@@ -862,59 +1544,50 @@ static VALUE rb_rg_udp_sink_thread(void *ptr)
   return Qtrue;
 }
 
-// The main sink thread that is responsible for driving TCP dispatch. This thread is the other end of the bipbuf (ring buffer)
-// and is the only consumer of it. The dispatch main loop balances sending as fast as possible when the buffer has data to send
-// but also periodically goes to sleep for up to 1s in order to not negatively impact CPU when the profiler isn't doing any work.
+// The main sink thread that is responsible for driving TCP dispatch. This thread is the other end of the lane ring buffers
+// and is the only consumer of them. The dispatch main loop sends as fast as possible when the buffer has data to send and blocks once
+// it's drained, until a producer seals the next batch, in order to not negatively impact CPU when the profiler isn't doing any work.
 //
 static VALUE rb_rg_tcp_sink_thread(void *ptr)
 {
   int status = 0;
   int bytes_to_send_on_wakeup = 0;
   rg_short_t size;
+  uint32_t len;
+  rg_byte_t *frame;
+  rb_rg_sink_lane_t *lane;
   rb_rg_sink_data_t *data = (rb_rg_sink_data_t *)ptr;
-  struct timeval tv;
-  tv.tv_sec = 0;
-  tv.tv_usec = RG_SINK_THREAD_TICK_INTERVAL;
+  struct timeval idle_tv;
+  idle_tv.tv_sec = RG_SINK_THREAD_IDLE_INTERVAL;
+  idle_tv.tv_usec = 0;
 #ifdef RB_RG_DEBUG
   const struct rb_rg_tracer_t *tracer = data->tracer;
 #endif
 
   // data->running is set to false on profiler shutdown which terminates this main loop and allows this thread to exit
-  while(data->running || !bipbuf_is_empty(data->ringbuf.bipbuf))
+  while(data->running || data->queued)
   {
     bytes_to_send_on_wakeup = 0;
 
-    // On each wakeup try to flush the queue, if there's anything to flush
-    while(!bipbuf_is_empty(data->ringbuf.bipbuf))
+    // On each wakeup try to flush the queue, if there's anything to flush - the next frame of the lanes merged
+    while((frame = rb_rg_dispatcher_next(data, &lane, &len)))
     {
-      // Peek into the bipbuf to determine the next expected message size to send
-      size = rg_ringbuf_next_message_size(&data->ringbuf);
+      size = (rg_short_t)len;
       bytes_to_send_on_wakeup += size;
 
-      // On empty next buffered message, terminate this UDP thread
-      if (UNLIKELY(!(size > 0))) {
-        data->running = false;
-#ifdef RB_RG_DEBUG
-        if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-          printf("[Raygun APM] TCP thread terminating - next buffered message is empty\n");
-#endif
-        break;
-      }
-      // As above, but moves the ring buffer cursor
-      unsigned char *ptr = bipbuf_poll(data->ringbuf.bipbuf, (unsigned int)size);
-      if (UNLIKELY(!ptr)) {
-        data->running = false;
-#ifdef RB_RG_DEBUG
-        if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-          printf("[Raygun APM] TCP thread terminating - NULL message on polling buffer\n");
-#endif
-        break;
+      // Compress on the dispatcher thread only, request threads never pay for it
+      if (data->compression) {
+        size = rb_rg_compress_batch(data, &frame, size);
       }
 
-      // Reset and fill the pre-allocated Ruby String buffer. This object is always considered as "marked" (in use) by the GC, won't be recycled until the profiler
-      // shuts down and this pattern saves on Ruby heap allocation overhead per UDP packet (batch or exceptional oversized) sent
-      rb_str_set_len(data->payload, 0);
-      rb_str_buf_cat(data->payload, (const char *)ptr, size);
+      // Fill the pre-allocated Ruby String buffer. This object is always considered as "marked" (in use) by the GC, won't be recycled until the profiler
+      // shuts down and this pattern saves on Ruby heap allocation overhead per write. Batches are coalesced into a single write for as long as
+      // the lanes have more to drain, up to RG_TCP_WRITE_SIZE - the stream is length prefixed so the Agent reads the same sequence of batches
+      // either way, but with a fraction of the syscalls.
+      //
+      rb_str_buf_cat(data->payload, (const char *)frame, size);
+      rb_rg_dispatcher_consume(data, lane, len);
+      if (RSTRING_LEN(data->payload) < RG_TCP_WRITE_SIZE && data->queued) continue;
 
       // Call the actual TCP send function with rb_protect, which prevents raising a runtime exception - we catch the status and reset Ruby error info to NULL to prevent
       // an exception raised for the caught exception (if any). We increment the failed_sends telemetry counter which can be inspected when the PROTON_DIAGNOSTICS env
@@ -934,17 +1607,19 @@ static VALUE rb_rg_tcp_sink_thread(void *ptr)
         rb_set_errinfo(Qnil);
         data->failed_sends++;
       } else {
-        data->bytes_sent += size;
+        data->bytes_sent += RSTRING_LEN(data->payload);
+        data->writes++;
 #ifdef RB_RG_DEBUG
       if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_DEBUG && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-        printf("[Raygun APM] TCP sent:%i used:%i unused:%i\n", size, bipbuf_used(data->ringbuf.bipbuf), bipbuf_unused(data->ringbuf.bipbuf));
+        printf("[Raygun APM] TCP sent:%li queued:%lu\n", RSTRING_LEN(data->payload), (unsigned long)data->queued);
 #endif
       }
+      rb_str_set_len(data->payload, 0);
     }
     if (LIKELY(data->running))
     {
-      // While not instructed to exit, take a small pause to not burn CPU unecessary
-      rb_rg_thread_wait_for(tv);
+      // While not instructed to exit, block until a producer seals a batch to not burn CPU unecessary
+      rb_rg_dispatcher_wait(data, RB_RG_DISPATCHER_IDLE, idle_tv);
     } else
     {
 #ifdef RB_RG_DEBUG
@@ -1156,14 +1831,56 @@ matched:
   return blacklisted;
 }
 
-// Helpers for generating class paths. All of the next 3 methods are only called during initial method discovery, isn't cheap, but once off. rb_class_path_cached
-// is crucial here as it piggy backs off Ruby's internal class resolution cache, For fall through, rb_class_path would set the path for the next cached lookup.
+// Classifies a method with the compiled blacklist automaton, which is (re)compiled from the radix trees on first use after any rule changes. Falls back
+// to the radix trees when debugging the blacklist (for the match reporting), when the automaton is disabled or could not be compiled.
 //
-static VALUE rb_rg_class_path(VALUE klass) {
+static long rb_rg_classify_method(rb_rg_tracer_t *tracer, unsigned char *fully_qualified, size_t fully_qualified_len, unsigned char *path, size_t path_len, unsigned char *method, size_t method_len)
+{
+  if (LIKELY(tracer->compiled_blacklist && !tracer->debug_blacklist)) {
+    if (UNLIKELY(!tracer->filters)) {
+      tracer->filters = rg_blacklist_compile(tracer->blacklist_fq, tracer->blacklist_paths, tracer->blacklist_methods);
+#ifdef RB_RG_DEBUG
+      if (UNLIKELY(!tracer->filters && tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
+        printf("[Raygun APM] Could not compile the blacklist, falling back to the radix trees\n");
+      }
+#endif
+    }
+    // The automaton expects the path to be followed by the separator and method in the fully qualified name
+    if (LIKELY(tracer->filters && fully_qualified_len == path_len + 1 + method_len))
+      return rg_blacklist_match(tracer->filters, fully_qualified, fully_qualified_len, path_len);
+  }
+  return rb_rg_blacklisted_method_p(tracer, fully_qualified, fully_qualified_len, path, path_len, method, method_len, tracer->debug_blacklist);
+}
+
+// Classifies a source path as library code or not. Cached per path String, which all methods of a source file share, and otherwise matched against the
+// library paths prefix index - compiled on first use after libraries got registered. Falls back to the radix tree if the index could not be compiled.
+// Called with the method lock held.
+//
+static int rb_rg_library_path_p(rb_rg_tracer_t *tracer, VALUE path)
+{
+  st_data_t library;
+  if (LIKELY(st_lookup(tracer->library_paths, (st_data_t)path, &library))) return (int)library;
+  if (UNLIKELY(!tracer->library_index)) tracer->library_index = rg_prefix_index_compile(tracer->libraries);
+  if (LIKELY(tracer->library_index != NULL)) {
+    library = (st_data_t)rg_prefix_index_match(tracer->library_index, (unsigned char*)StringValueCStr(path), RSTRING_LEN(path));
+  } else {
+    library = (st_data_t)(rb_rg_blacklisted_string_p(tracer->libraries, (unsigned char*)StringValueCStr(path), RSTRING_LEN(path)) == RG_BLACKLIST_WHITELISTED);
+  }
+  if (UNLIKELY(tracer->library_paths->num_entries >= RB_RG_LIBRARY_PATHS_CACHE_SIZE)) st_clear(tracer->library_paths);
+  st_insert(tracer->library_paths, (st_data_t)path, library);
+  return (int)library;
+}
+
+// Helpers for generating class paths. All of the next 3 methods are only called during initial method discovery of a class, isn't cheap, but once off.
+// rb_class_path_cached is crucial here as it piggy backs off Ruby's internal class resolution cache, For fall through, rb_class_path would set the path
+// for the next cached lookup. Permanent is cleared for anonymous classes and temporary paths, which may still change.
+//
+static VALUE rb_rg_class_path(VALUE klass, int *permanent) {
   VALUE cached_path = rb_class_path_cached(klass);
   if (!NIL_P(cached_path)) {
     return cached_path;
   }
+  *permanent = false;
   return rb_class_path(klass);
 }
 
@@ -1172,26 +1889,85 @@ static VALUE rb_rg_singleton_object(VALUE singleton_class) {
   return rb_iv_get(singleton_class, "__attached__");
 }
 
-// Coerces the given class to a fully qualified path. Works with modules and singleton classes too
-static VALUE rb_rg_class_to_str(VALUE klass) {
+// Coerces the given class to a fully qualified path. Works with modules and singleton classes too. Sets cacheable if the path is permanent for this class.
+static VALUE rb_rg_class_to_str(VALUE klass, int *cacheable) {
+  *cacheable = true;
   while (FL_TEST(klass, FL_SINGLETON)) {
     klass = rb_rg_singleton_object(klass);
     if (!RB_TYPE_P(klass, T_MODULE) && !RB_TYPE_P(klass, T_CLASS)) {
       // singleton of an instance
       klass = rb_obj_class(klass);
+      *cacheable = false;
     }
   }
-  return rb_rg_class_path(klass);
+  return rb_rg_class_path(klass, cacheable);
 }
 
-// Helper function to populate pointers to class and method Ruby String objects, with awareness of the builtin translator table
-inline static void rb_rg_fill_class_and_method(rb_rg_tracer_t *tracer, VALUE namespace, rb_trace_arg_t *tparg, rb_event_flag_t flag, VALUE *class_name, VALUE *method_name)
+// Resolves the fully qualified path of a class, with awareness of the builtin translator table, and optionally it's wire encoded bytes. Both are cached per
+// class, so discovering many methods of the same class resolves and encodes it's path only once.
+//
+static VALUE rb_rg_class_name(rb_rg_tracer_t *tracer, VALUE namespace, rg_encoded_string_t *encoded)
 {
+  st_data_t entry;
+  rb_rg_class_info_t *info;
+  rg_encoded_string_t scratch;
+  VALUE class_name;
   char *replacement = NULL;
-  *class_name = rb_rg_class_to_str(namespace);
-  if (st_lookup(tracer->builtin_translator, (st_data_t)StringValueCStr(*class_name), (st_data_t *)&replacement)) {
-    *class_name = rb_str_new2(replacement);
+  int cacheable;
+
+  rb_nativethread_lock_lock(&tracer->method_lock);
+  if (LIKELY(st_lookup(tracer->classinfo, (st_data_t)namespace, &entry))) {
+    info = (rb_rg_class_info_t *)entry;
+    // Encoded in the encoding requested on the first miss, to date always ASCII
+    if (encoded && LIKELY(encoded->encoding == info->encoding)) {
+      encoded->length = info->encoded_length;
+      memcpy(encoded->string, info->encoded, info->encoded_length);
+      encoded = NULL;
+    }
+    class_name = info->name;
+    rb_nativethread_lock_unlock(&tracer->method_lock);
+    if (UNLIKELY(encoded != NULL)) rb_rg_encode_string(encoded, class_name, Qnil);
+    return class_name;
   }
+  rb_nativethread_lock_unlock(&tracer->method_lock);
+
+  class_name = rb_rg_class_to_str(namespace, &cacheable);
+  if (st_lookup(tracer->builtin_translator, (st_data_t)StringValueCStr(class_name), (st_data_t *)&replacement)) {
+    class_name = rb_str_new2(replacement);
+  }
+  if (!encoded) {
+    if (!cacheable) return class_name;
+    scratch.encoding = RG_STRING_ENCODING_ASCII;
+    encoded = &scratch;
+  }
+  rb_rg_encode_string(encoded, class_name, Qnil);
+  if (cacheable) {
+    info = ZALLOC(rb_rg_class_info_t);
+    info->name = class_name;
+    info->encoding = encoded->encoding;
+    info->encoded_length = encoded->length;
+    info->encoded = xmalloc(encoded->length ? encoded->length : 1);
+    memcpy(info->encoded, encoded->string, encoded->length);
+    rb_nativethread_lock_lock(&tracer->method_lock);
+    if (UNLIKELY(tracer->classinfo->num_entries >= RB_RG_CLASS_INFO_CACHE_SIZE)) st_foreach(tracer->classinfo, rb_rg_classinfo_free_i, 0);
+    // Another thread may have resolved the same class in the meantime
+    if (st_lookup(tracer->classinfo, (st_data_t)namespace, &entry)) {
+      rb_rg_classinfo_free_i(0, (st_data_t)info, 0);
+      class_name = ((rb_rg_class_info_t *)entry)->name;
+    } else {
+      st_insert(tracer->classinfo, (st_data_t)namespace, (st_data_t)info);
+    }
+    rb_nativethread_lock_unlock(&tracer->method_lock);
+  }
+  RB_GC_GUARD(class_name);
+  return class_name;
+}
+
+// Helper function to populate pointers to class and method Ruby String objects, with awareness of the builtin translator table. The encoded class name
+// is filled in too if given.
+inline static void rb_rg_fill_class_and_method(rb_rg_tracer_t *tracer, VALUE namespace, rb_trace_arg_t *tparg, rb_event_flag_t flag, VALUE *class_name, VALUE *method_name, rg_encoded_string_t *class_name_string)
+{
+  *class_name = rb_rg_class_name(tracer, namespace, class_name_string);
 #ifdef RB_RG_TRACE_BLOCKS
   if UNLIKELY((flag == RUBY_EVENT_B_CALL)) {
     *method_name = rb_rg_block_name(tparg);
@@ -1222,14 +1998,21 @@ static inline st_index_t rb_rg_method_id_production(VALUE namespace, VALUE metho
 
 // A much slow String based implementation for development environments in Rails which supports code reloading and can introduce drift between
 // actual and previously discovered methods in the methodinfo table. String hashes are also a lot more expensive than the numeric ones.
-static inline st_index_t rb_rg_method_id_development(rb_rg_tracer_t *tracer, VALUE namespace, rb_trace_arg_t *tparg, rb_event_flag_t flag)
+static inline st_index_t rb_rg_method_id_names(VALUE class_name, VALUE method_name)
 {
   st_index_t method_id;
-  VALUE class_name, method_name;
-  rb_rg_fill_class_and_method(tracer, namespace, tparg, flag, &class_name, &method_name);
   method_id = rb_hash_start(rb_str_hash(class_name));
   method_id = rb_hash_uint(method_id, rb_str_hash(method_name));
   method_id = rb_hash_end(method_id);
+  return method_id;
+}
+
+static inline st_index_t rb_rg_method_id_development(rb_rg_tracer_t *tracer, VALUE namespace, rb_trace_arg_t *tparg, rb_event_flag_t flag)
+{
+  st_index_t method_id;
+  VALUE class_name, method_name;
+  rb_rg_fill_class_and_method(tracer, namespace, tparg, flag, &class_name, &method_name, NULL);
+  method_id = rb_rg_method_id_names(class_name, method_name);
   RB_GC_GUARD(class_name);
   RB_GC_GUARD(method_name);
   return method_id;
@@ -1264,6 +2047,22 @@ static inline st_index_t rb_rg_method_id(rb_rg_tracer_t *tracer, VALUE namespace
 #endif
 }
 
+// Marks the lane of a thread that ended as retired, after sealing any partial batch in it. Lanes shared by TIDs beyond RG_MAX_SINK_LANES
+// are retired too, but revived by the next event of another thread in the same lane.
+//
+static void rb_rg_retire_sink_lane(rb_rg_sink_data_t *sink_data, const rg_tid_t tid)
+{
+  rb_rg_sink_lane_t *lane;
+  rg_tid_t index = tid % RG_MAX_SINK_LANES;
+  if (index >= sink_data->lanes_capacity || !sink_data->lanes[index]) return;
+  lane = sink_data->lanes[index];
+  if (lane->batch.count) {
+    rb_rg_seal_lane(sink_data, lane);
+    rb_rg_handoff_dispatcher(sink_data, rb_rg_signal_dispatcher(sink_data));
+  }
+  lane->retired = true;
+}
+
 // Callback function invoked from the Ruby Tracepoint handler when an existing Thread terminates. Causes can be either clean shutdown or an exception raised
 // that killed the thread.
 //
@@ -1276,8 +2075,11 @@ static void rb_rg_thread_ended(const rb_rg_tracer_t *tracer, VALUE thread)
 #endif
   // Invoke the encoder counterpart to emit this event to the callback sink
   rg_thread_ended(tracer->context, (void *)&tracer->sink_data, th->tid);
-  // Free the shadow thread for this Ruby Thread
-  xfree(th);
+  // Seal what's left in the thread's lane and let the sink thread free it once drained
+  if (tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP)
+    rb_rg_retire_sink_lane((rb_rg_sink_data_t *)&tracer->sink_data, th->tid);
+  // Return the shadow thread for this Ruby Thread, and the shadow stacks of any fibers still suspended, to the pool
+  rb_rg_free_thread((rb_rg_tracer_t *)tracer, th);
   // Native thread lock around the shared threadsinfo symbol table. Technically it's not needed for this delete operation as threads
   // only ever delete themselves from ths table (the Tracepoint is a "safepoint", so no concurrent execution happens there because of the interpreter lock)
   rb_nativethread_lock_lock((rb_nativethread_lock_t*)&tracer->thread_lock);
@@ -1285,6 +2087,8 @@ static void rb_rg_thread_ended(const rb_rg_tracer_t *tracer, VALUE thread)
   // lead to all kinds of fail
   st_delete(tracer->threadsinfo, (st_data_t *)&thread, NULL);
   rb_nativethread_lock_unlock((rb_nativethread_lock_t*)&tracer->thread_lock);
+  // The shadow thread may still be referenced by thread caches
+  rb_rg_invalidate_thread_caches();
   RB_GC_GUARD(thread);
 }
 
@@ -1312,6 +2116,10 @@ static void rb_rg_thread_started(rb_rg_tracer_t *tracer, VALUE parent_thread, VA
   th->parent_tid = (parent_th ? parent_th->tid : RG_THREAD_ORPHANED);
   th->shadow_top = RG_THREAD_FRAMELESS;
   th->vm_top = RG_THREAD_FRAMELESS;
+#ifdef RUBY_EVENT_FIBER_SWITCH
+  // RUBY_EVENT_THREAD_BEGIN fires on the new thread itself, thus this is it's root fiber
+  th->fiber = (uintptr_t)rb_fiber_current();
+#endif
   // Map the Ruby Thread to the shadow thread
   st_insert(tracer->threadsinfo, (st_data_t)thread, (st_data_t)th);
   rb_nativethread_lock_unlock(&tracer->thread_lock);
@@ -1327,19 +2135,23 @@ static void rb_rg_thread_started(rb_rg_tracer_t *tracer, VALUE parent_thread, VA
 // Invoked when a new Trace is started. Mostly delegates to the encoder specific begin transaction helper
 // and sets the API key, technology type and process type fields.
 //
-static void rb_rg_begin_transaction(const rb_rg_tracer_t *tracer, rg_tid_t tid)
+static void rb_rg_begin_transaction(rb_rg_tracer_t *tracer, rg_tid_t tid)
 {
   rg_encoded_string_t api_key_string, technology_type_string, process_type_string;
-  api_key_string.encoding = RG_STRING_ENCODING_ASCII;
-  technology_type_string.encoding = RG_STRING_ENCODING_ASCII;
-  process_type_string.encoding = RG_STRING_ENCODING_ASCII;
 
-  // XXX possible to memoize this per trace, but negligible overhead
-  rb_rg_encode_string(&api_key_string, tracer->api_key, Qnil);
-  rb_rg_encode_string(&technology_type_string, tracer->technology_type, Qnil);
-  rb_rg_encode_string(&process_type_string, tracer->process_type, Qnil);
+  // The strings only change with the API key, so encode them once and only the header for every transaction
+  if (UNLIKELY(!tracer->begin_transaction)) {
+    api_key_string.encoding = RG_STRING_ENCODING_ASCII;
+    technology_type_string.encoding = RG_STRING_ENCODING_ASCII;
+    process_type_string.encoding = RG_STRING_ENCODING_ASCII;
+    rb_rg_encode_string(&api_key_string, tracer->api_key, Qnil);
+    rb_rg_encode_string(&technology_type_string, tracer->technology_type, Qnil);
+    rb_rg_encode_string(&process_type_string, tracer->process_type, Qnil);
+    tracer->begin_transaction = ALLOC(rg_begin_transaction_template_t);
+    rg_begin_transaction_template(tracer->begin_transaction, &api_key_string, &technology_type_string, &process_type_string);
+  }
   // Invoke the encoder counterpart to emit this event to the callback sink
-  rg_begin_transaction(tracer->context, (void *)&tracer->sink_data, tid, api_key_string, technology_type_string, process_type_string);
+  rg_begin_transaction_from_template(tracer->context, (void *)&tracer->sink_data, tid, tracer->begin_transaction);
 }
 
 // Ruby specific wrapper for the end transaction command - mostly just invokes the encoder counterpart.
@@ -1371,6 +2183,31 @@ static void rb_rg_end(const rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace
   rg_end(tracer->context, (void *)&tracer->sink_data, tid, function_id, returnvalue);
 }
 
+// Body of Method#source_location for a method of a defined class, invoked with rb_protect
+static VALUE rb_rg_method_path0(VALUE args)
+{
+  VALUE *argv = (VALUE *)args;
+  VALUE location = rb_funcall(rb_funcall(argv[0], rb_rg_id_instance_method, 1, argv[1]), rb_rg_id_source_location, 0);
+  return RB_TYPE_P(location, T_ARRAY) ? rb_ary_entry(location, 0) : Qnil;
+}
+
+// Source path of a method classified off the tracepoint (deferred discovery), looked up through it's method object instead. Nil if the method can't be
+// resolved anymore, for example when removed since it was called.
+static VALUE rb_rg_method_path(VALUE namespace, VALUE method_name)
+{
+  int status = 0;
+  VALUE path, args[2] = {namespace, method_name};
+  path = rb_protect(rb_rg_method_path0, (VALUE)args, &status);
+  if (UNLIKELY(status)) {
+    // Clearing error info to ignore the caught exception
+    rb_set_errinfo(Qnil);
+    return Qnil;
+  }
+  RB_GC_GUARD(namespace);
+  RB_GC_GUARD(method_name);
+  return path;
+}
+
 // The main workorse function for emitting method information to the Raygun APM agent.
 // 
 // There's 2 data structures that keep (and inform) state to track:
@@ -1378,27 +2215,30 @@ static void rb_rg_end(const rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace
 // 1) [mostly fixed] The radix tree on the tracer struct (source of truth for black and whitelisted method patterns)
 // 2) [mostly fixed] The methodinfo symbol table on the tracer which trakcs both discovered whitelisted and blacklisted methods
 //
-static rg_method_t *rb_rg_methodinfo(rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace_context, rg_tid_t tid, VALUE namespace, st_index_t method, rb_event_flag_t flag, rb_trace_arg_t *tparg)
+// Invoked without a tracepoint argument (and trace context) for methods classified by the timer thread with deferred discovery.
+//
+static rg_method_t *rb_rg_methodinfo0(rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace_context, rg_tid_t tid, VALUE namespace, st_index_t method, VALUE class_name, rg_encoded_string_t *class_name_string, VALUE method_name, rb_trace_arg_t *tparg)
 {
   int ret;
-  VALUE class_name, method_name, path;
+  VALUE path;
   st_data_t entry;
-  rg_encoded_string_t method_name_string, class_name_string;
+  rg_encoded_string_t method_name_string;
   rg_method_t *rg_method = NULL;
   // Default to user method source
   rg_method_source_t source = RG_METHOD_SOURCE_USER_CODE;
   // XXX pending encoded string support in spec (methods and classes can be unicode)
   method_name_string.encoding = RG_STRING_ENCODING_ASCII;
-  class_name_string.encoding = RG_STRING_ENCODING_ASCII;
   static const char *entrypoint = RG_TRACE_ENTRYPOINT_FRAME_NAME;
 
   // Needle to lookup blacklist state with - we chose a larger 4kb buffer
   // as it's aligned with max string sizes the agent accepts and generally
   // should be large enough for most use cases, but to revisit.
   unsigned char blacklist_needle[RG_MAX_BLACKLIST_NEEDLE_SIZE];
-
-  // May transition to wait for sync source
-  rb_rg_fill_class_and_method(tracer, namespace, tparg, flag, &class_name, &method_name);
+  // Classification and encoded names persisted by a previous process, if any
+  rg_byte_t classification, cached_source = RG_METHOD_SOURCE_USER_CODE;
+  rg_encoded_string_t cached_class_name_string;
+  int cached = false;
+  unsigned char needle_separator;
 
   RB_GC_GUARD(namespace);
   RB_GC_GUARD(class_name);
@@ -1412,14 +2252,27 @@ static rg_method_t *rb_rg_methodinfo(rb_rg_tracer_t *tracer, rb_rg_trace_context
   size_t blacklist_needle_size = class_name_length + 1 + method_name_length + 1;
   snprintf((char *)blacklist_needle, blacklist_needle_size, "%s#%s", StringValueCStr(class_name), StringValueCStr(method_name));
 
+  // Look the needle above up in the persisted method cache first, which also has the source and encoded names of whitelisted methods - skips the
+  // expensive source path lookup, library classification and transcoding below
+  if (tracer->method_cache) {
+    cached = rg_method_cache_lookup(tracer->method_cache, blacklist_needle, blacklist_needle_size - 1, &classification, &cached_source, &cached_class_name_string, &method_name_string);
+  }
   // Query the blacklist radix tree for the needle above
-  if (rb_rg_blacklisted_method_p(tracer, blacklist_needle, blacklist_needle_size - 1, (unsigned char *)StringValueCStr(class_name), class_name_length, (unsigned char *)StringValueCStr(method_name), method_name_length, tracer->debug_blacklist) != RG_BLACKLIST_BLACKLISTED) {
+  if (!cached) {
+    classification = rb_rg_classify_method(tracer, blacklist_needle, blacklist_needle_size - 1, (unsigned char *)StringValueCStr(class_name), class_name_length, (unsigned char *)StringValueCStr(method_name), method_name_length) == RG_BLACKLIST_BLACKLISTED ? RG_BLACKLIST_BLACKLISTED : RG_BLACKLIST_WHITELISTED;
+  }
+  if (classification != RG_BLACKLIST_BLACKLISTED) {
     // This method is not to be blacklisted, add it to the trace context methodinfo table and emit to the agent.
-    rb_rg_encode_string(&method_name_string, method_name, Qnil);
-    rb_rg_encode_string(&class_name_string, class_name, Qnil);
+    // The class name was encoded (or fetched from the class info cache) on resolving it
+    if (cached) {
+      cached_class_name_string.encoding = class_name_string->encoding;
+      class_name_string = &cached_class_name_string;
+    } else {
+      rb_rg_encode_string(&method_name_string, method_name, Qnil);
+    }
 
     // Expensive, but one time during discovery and never called again for this particular method
-    path = rb_tracearg_path(tparg);
+    path = cached ? Qnil : (tparg ? rb_tracearg_path(tparg) : rb_rg_method_path(namespace, method_name));
     RB_GC_GUARD(path);
     // Lock the methodinfo table as a good practice to prevent touching shared state (symbol table and the function ID monotonic counter)
     rb_nativethread_lock_lock(&tracer->method_lock);
@@ -1431,35 +2284,55 @@ static rg_method_t *rb_rg_methodinfo(rb_rg_tracer_t *tracer, rb_rg_trace_context
       return rg_method;
       // Add the method in a write lock to the symbol table
     } else {
-      rg_method = ZALLOC(rg_method_t);
+      rg_method = rg_slab_alloc(&tracer->method_slab);
+      // Names and the encoded methodinfo live in the method arena as Ruby Strings will be reclaimed by the GC and we don't want to deal with that rabbit
+      // hole. The class name is interned, thus shared by all methods of the class - the needle is temporarily terminated after it for the lookup.
+      if (LIKELY(rg_method != NULL)) {
+        needle_separator = blacklist_needle[class_name_length];
+        blacklist_needle[class_name_length] = '\0';
+        rg_method->class_name = rb_rg_intern_class_name(&tracer->method_arena, tracer->method_class_names, (const char *)blacklist_needle, class_name_length);
+        blacklist_needle[class_name_length] = needle_separator;
+        rg_method->method_name = rg_arena_dup(&tracer->method_arena, blacklist_needle + class_name_length + 1, blacklist_needle_size - class_name_length - 1);
+      }
+      // Out of memory - not traced until discovered again on a next call
+      if (UNLIKELY(rg_method == NULL || rg_method->class_name == NULL || rg_method->method_name == NULL || !rb_rg_reserve_methodinfo_called(tracer, tracer->methods + 1))) {
+        if (rg_method) {
+          if (rg_method->method_name) rg_arena_release(&tracer->method_arena, blacklist_needle_size - class_name_length - 1);
+          rg_slab_free(&tracer->method_slab, rg_method);
+        }
+        rb_nativethread_lock_unlock(&tracer->method_lock);
+        return NULL;
+      }
       tracer->methods++;
       rg_method->function_id = tracer->methods;
       rg_method->source = source;
+      rb_rg_methodinfo_called(tracer, rg_method->function_id);
       // Flag synchronization methods (Thread#sleep, mutexes etc.)
       if (st_lookup(tracer->synchronization_methods, (st_data_t)blacklist_needle, NULL)) {
         rg_method->source = RG_METHOD_SOURCE_WAIT_FOR_SYNCHRONIZATION;
       }
       // Check if this method is invoked from a known library
-      if (rb_rg_blacklisted_string_p(tracer->libraries, (unsigned char*)StringValueCStr(path), RSTRING_LEN(path)) == RG_BLACKLIST_WHITELISTED) {
+      if (!NIL_P(path) && rb_rg_library_path_p(tracer, path)) {
         if (!rg_method->source) rg_method->source = (rg_method_source_t)RG_METHOD_SOURCE_KNOWN_LIBRARY;
       }
 
-      // Allocate the fully qualified name on the malloc heap as Ruby Strings will be reclaimed by the GC and we don't want to deal with that rabbit hole
-      rg_method->name = xmalloc(blacklist_needle_size);
-      memcpy(rg_method->name, blacklist_needle, blacklist_needle_size);
-      rg_method->length = blacklist_needle_size;
-
       // only the entrypoint frame (frame 1) is considered a system source frame at present
       if (UNLIKELY(strcmp(entrypoint, StringValueCStr(method_name)) == 0)) {
         rg_method->source = RG_METHOD_SOURCE_SYSTEM;
       }
+      if (cached) {
+        rg_method->source = cached_source;
+      } else if (tracer->method_cache_recording) {
+        rg_method_cache_record(&tracer->method_cache_log, blacklist_needle, blacklist_needle_size - 1, RG_BLACKLIST_WHITELISTED, rg_method->source, class_name_string, &method_name_string);
+      }
       // Insert in into the methodinfo table and unlock
       ret = st_insert(tracer->methodinfo, (st_data_t)method, (st_data_t)rg_method);
       // XXX there's a lot going on in this lock - evaluate if we can reduce the locked scope
       rb_nativethread_lock_unlock(&tracer->method_lock);
     }
-    // Call the encoder helper
-    rg_methodinfo(tracer->context, (void *)&tracer->sink_data, tid, rg_method, class_name_string, method_name_string);
+    // Call the encoder helper - the encoded copy is allocated from the method arena outside of the lock, which is fine as the arena is otherwise only
+    // touched with the GVL held too
+    rg_methodinfo(tracer->context, (void *)&tracer->sink_data, tid, rg_method, &tracer->method_arena, *class_name_string, method_name_string);
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel == RB_RG_TRACER_LOG_BLACKLIST)) {
       if (ret == 0) {
@@ -1480,6 +2353,9 @@ static rg_method_t *rb_rg_methodinfo(rb_rg_tracer_t *tracer, rb_rg_trace_context
       rb_nativethread_lock_lock(&tracer->method_lock);
       tracer->blacklisted++;
       ret = st_insert(tracer->methodinfo, (st_data_t)method, RG_BLACKLIST_BLACKLISTED);
+      if (!cached && tracer->method_cache_recording) {
+        rg_method_cache_record(&tracer->method_cache_log, blacklist_needle, blacklist_needle_size - 1, RG_BLACKLIST_BLACKLISTED, RG_METHOD_SOURCE_USER_CODE, NULL, NULL);
+      }
       rb_nativethread_lock_unlock(&tracer->method_lock);
 #ifdef RB_RG_DEBUG
       if (UNLIKELY(tracer->loglevel == RB_RG_TRACER_LOG_BLACKLIST)) {
@@ -1495,6 +2371,231 @@ static rg_method_t *rb_rg_methodinfo(rb_rg_tracer_t *tracer, rb_rg_trace_context
   }
 }
 
+// Classifies a method seen for the first time by the tracepoint hook, inline
+static rg_method_t *rb_rg_methodinfo(rb_rg_tracer_t *tracer, rb_rg_trace_context_t *trace_context, rg_tid_t tid, VALUE namespace, st_index_t method, rb_event_flag_t flag, rb_trace_arg_t *tparg)
+{
+  VALUE class_name, method_name;
+  rg_encoded_string_t class_name_string;
+  rg_method_t *rg_method;
+  class_name_string.encoding = RG_STRING_ENCODING_ASCII;
+  // May transition to wait for sync source
+  rb_rg_fill_class_and_method(tracer, namespace, tparg, flag, &class_name, &method_name, &class_name_string);
+  rg_method = rb_rg_methodinfo0(tracer, trace_context, tid, namespace, method, class_name, &class_name_string, method_name, tparg);
+  RB_GC_GUARD(class_name);
+  RB_GC_GUARD(method_name);
+  return rg_method;
+}
+
+// Queues a method seen for the first time for classification by the timer thread (deferred discovery), unless already pending. Returns false if too
+// many methods are pending already, for the caller to classify it inline instead.
+static int rb_rg_defer_methodinfo(rb_rg_tracer_t *tracer, VALUE namespace, st_index_t method, rb_trace_arg_t *tparg)
+{
+  rb_rg_pending_method_t *pending;
+  int wakeup;
+  VALUE method_name = rb_tracearg_method_id(tparg);
+  rb_nativethread_lock_lock(&tracer->method_lock);
+  if (st_lookup(tracer->pending_methods, (st_data_t)method, NULL)) {
+    rb_nativethread_lock_unlock(&tracer->method_lock);
+    return true;
+  }
+  if (UNLIKELY(tracer->pending_methods->num_entries >= RB_RG_PENDING_METHODS_LIMIT)) {
+    rb_nativethread_lock_unlock(&tracer->method_lock);
+    return false;
+  }
+  pending = ALLOC(rb_rg_pending_method_t);
+  pending->method = method;
+  pending->namespace = namespace;
+  pending->method_name = method_name;
+  // The timer thread keeps classifying until there's nothing pending, so only the first method queued needs to wake it up
+  wakeup = (tracer->pending_methods->num_entries == 0);
+  st_insert(tracer->pending_methods, (st_data_t)method, (st_data_t)pending);
+  rb_nativethread_lock_unlock(&tracer->method_lock);
+  if (wakeup) rb_rg_wakeup_timer_thread(tracer);
+  RB_GC_GUARD(method_name);
+  return true;
+}
+
+// A callback function invoked by st_foreach in rb_rg_resolve_pending_methods that picks the first method pending classification
+static int rb_rg_pending_methods_first_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  *(rb_rg_pending_method_t **)data = (rb_rg_pending_method_t *)val;
+  return ST_STOP;
+}
+
+// Classifies methods pending discovery until none are left - called on the timer thread, or Tracer#resolve_pending_methods. One method at a time and it stays pending until classified,
+// as classification calls into Ruby and may switch to threads that queue more methods or call it pending. Returns the amount of methods classified.
+static long rb_rg_resolve_pending_methods(rb_rg_tracer_t *tracer)
+{
+  rb_rg_pending_method_t *pending;
+  st_data_t key, entry;
+  st_index_t method = 0;
+  VALUE namespace = Qnil, method_name = Qnil, class_name;
+  rg_encoded_string_t class_name_string;
+  long resolved = 0;
+  class_name_string.encoding = RG_STRING_ENCODING_ASCII;
+  while (true) {
+    pending = NULL;
+    rb_nativethread_lock_lock(&tracer->method_lock);
+    st_foreach(tracer->pending_methods, rb_rg_pending_methods_first_i, (st_data_t)&pending);
+    // Copied off as a concurrent call of this function may classify and free the same method meanwhile
+    if (pending) {
+      method = pending->method;
+      namespace = pending->namespace;
+      method_name = pending->method_name;
+    }
+    rb_nativethread_lock_unlock(&tracer->method_lock);
+    if (!pending) break;
+    class_name = rb_rg_class_name(tracer, namespace, &class_name_string);
+    rb_rg_methodinfo0(tracer, NULL, 0, namespace, method, class_name, &class_name_string, rb_sym2str(method_name), NULL);
+    rb_nativethread_lock_lock(&tracer->method_lock);
+    key = (st_data_t)method;
+    if (st_delete(tracer->pending_methods, &key, &entry)) xfree((rb_rg_pending_method_t *)entry);
+    rb_nativethread_lock_unlock(&tracer->method_lock);
+    resolved++;
+    RB_GC_GUARD(namespace);
+    RB_GC_GUARD(method_name);
+    RB_GC_GUARD(class_name);
+  }
+  return resolved;
+}
+
+// Methodinfo table eviction state - the function IDs on shadow stacks and whether to evict blacklisted methods as well
+typedef struct _rb_rg_methodinfo_eviction_t {
+  rb_rg_tracer_t *tracer;
+  st_table *live;
+  int blacklisted;
+  size_t evicted;
+} rb_rg_methodinfo_eviction_t;
+
+// A callback function invoked by st_foreach in rb_rg_live_functions_i that collects the function IDs on the saved shadow stack of a suspended fiber
+static int rb_rg_live_fiber_functions_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rg_fiber_stack_t *stack = (rg_fiber_stack_t *)val;
+  for (rg_int_t i = 0; i <= stack->shadow_top; i++) st_insert((st_table *)data, (st_data_t)stack->shadow_stack[i], 0);
+  return ST_CONTINUE;
+}
+
+// A callback function invoked by st_foreach in rb_rg_evict_methodinfo that collects the function IDs on the shadow stack of a shadow thread and it's
+// suspended fibers - their returns are still to be observed
+static int rb_rg_live_functions_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rg_thread_t *th = (rg_thread_t *)val;
+  for (rg_int_t i = 0; i <= th->shadow_top; i++) st_insert((st_table *)data, (st_data_t)th->shadow_stack[i], 0);
+  if (th->fibers) st_foreach(th->fibers, rb_rg_live_fiber_functions_i, data);
+  return ST_CONTINUE;
+}
+
+// A callback function invoked by st_foreach in rb_rg_evict_methodinfo that frees and removes a cold method
+static int rb_rg_evict_methodinfo_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rb_rg_methodinfo_eviction_t *eviction = (rb_rg_methodinfo_eviction_t *)data;
+  rg_method_t *rg_method = (rg_method_t *)val;
+  if ((int)val == RG_BLACKLIST_BLACKLISTED) {
+    if (!eviction->blacklisted) return ST_CONTINUE;
+  } else {
+    // The entrypoint frame is emitted by every trace
+    if (rg_method->source == RG_METHOD_SOURCE_SYSTEM) return ST_CONTINUE;
+    if (rg_method->function_id <= eviction->tracer->methods_inherited) return ST_CONTINUE;
+    if (rb_rg_methodinfo_recently_called(eviction->tracer, rg_method->function_id)) return ST_CONTINUE;
+    if (st_lookup(eviction->live, (st_data_t)rg_method->function_id, NULL)) return ST_CONTINUE;
+  }
+  eviction->evicted++;
+  return rb_rg_methodinfo_free_i(key, val, (st_data_t)eviction->tracer);
+}
+
+// Method arena compaction state - the arena and class names table the live methods are copied to
+typedef struct _rb_rg_method_arena_compaction_t {
+  rg_arena_t arena;
+  st_table *class_names;
+  rg_function_id_t methods_inherited;
+  int failed;
+} rb_rg_method_arena_compaction_t;
+
+// A callback function invoked by st_foreach in rb_rg_compact_method_arena that copies the names and encoded methodinfo of a whitelisted method to
+// the new arena. The new arena is sized to fit all live blocks in a single chunk, thus only the very first copy can fail and the method is only
+// updated once all of it's blocks were copied.
+//
+static int rb_rg_compact_method_arena_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rb_rg_method_arena_compaction_t *compaction = (rb_rg_method_arena_compaction_t *)data;
+  rg_method_t *rg_method = (rg_method_t *)val;
+  const char *class_name, *method_name;
+  rg_byte_t *encoded = NULL;
+  if ((int)val == RG_BLACKLIST_BLACKLISTED) return ST_CONTINUE;
+  // Inherited from the parent process, thus in the inherited arena
+  if (rg_method->function_id <= compaction->methods_inherited) return ST_CONTINUE;
+  class_name = rb_rg_intern_class_name(&compaction->arena, compaction->class_names, rg_method->class_name, strlen(rg_method->class_name));
+  method_name = rg_arena_dup(&compaction->arena, rg_method->method_name, strlen(rg_method->method_name) + 1);
+  if (rg_method->encoded) encoded = rg_arena_dup(&compaction->arena, rg_method->encoded, rg_method->encoded_size);
+  if (UNLIKELY(!class_name || !method_name || (rg_method->encoded && !encoded))) {
+    compaction->failed = true;
+    return ST_STOP;
+  }
+  rg_method->class_name = class_name;
+  rg_method->method_name = method_name;
+  rg_method->encoded = encoded;
+  return ST_CONTINUE;
+}
+
+// Copies the blocks of whitelisted methods still in the methodinfo table to a new method arena and frees the old one, once more than half of it was
+// released by evicted methods. Interned class names of evicted classes are dropped too. Methods inherited from the parent process are left as is, in
+// the inherited arena. Expects the method lock to be held.
+//
+static void rb_rg_compact_method_arena(rb_rg_tracer_t *tracer)
+{
+  rb_rg_method_arena_compaction_t compaction;
+  rg_arena_t *arena = &tracer->method_arena;
+  if (arena->released < arena->chunk_size || arena->released * 2 < arena->used) return;
+  rg_arena_init(&compaction.arena, arena->used - arena->released);
+  compaction.class_names = st_init_strtable();
+  compaction.methods_inherited = tracer->methods_inherited;
+  compaction.failed = false;
+  st_foreach(tracer->methodinfo, rb_rg_compact_method_arena_i, (st_data_t)&compaction);
+  if (UNLIKELY(compaction.failed)) {
+    rg_arena_free(&compaction.arena);
+    st_free_table(compaction.class_names);
+    return;
+  }
+  rg_arena_free(arena);
+  st_free_table(tracer->method_class_names);
+  *arena = compaction.arena;
+  arena->chunk_size = RB_RG_METHOD_ARENA_CHUNK_SIZE;
+  tracer->method_class_names = compaction.class_names;
+}
+
+// Evicts cold methods from a methodinfo table over capacity - whitelisted methods not called in the current or previous generation and not on any
+// shadow stack, then blacklisted methods (which don't track when they were last called) if that wasn't enough. Whitelisted methods inherited from the
+// parent process are never evicted. An evicted method called again is discovered again, and announced to the Agent with a new function ID. Returns the
+// amount of methods evicted.
+//
+static size_t rb_rg_evict_methodinfo(rb_rg_tracer_t *tracer)
+{
+  rb_rg_methodinfo_eviction_t eviction;
+  if (tracer->methodinfo->num_entries <= tracer->methodinfo_capacity) return 0;
+  eviction.tracer = tracer;
+  eviction.live = st_init_numtable();
+  eviction.blacklisted = false;
+  eviction.evicted = 0;
+  st_foreach(tracer->threadsinfo, rb_rg_live_functions_i, (st_data_t)eviction.live);
+  rb_nativethread_lock_lock(&tracer->method_lock);
+  st_foreach(tracer->methodinfo, rb_rg_evict_methodinfo_i, (st_data_t)&eviction);
+  if (tracer->methodinfo->num_entries > tracer->methodinfo_capacity) {
+    eviction.blacklisted = true;
+    st_foreach(tracer->methodinfo, rb_rg_evict_methodinfo_i, (st_data_t)&eviction);
+  }
+  rb_rg_compact_method_arena(tracer);
+  rb_nativethread_lock_unlock(&tracer->method_lock);
+  st_free_table(eviction.live);
+  tracer->methodinfo_evictions++;
+  tracer->methodinfo_evicted += eviction.evicted;
+#ifdef RB_RG_DEBUG
+    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_INFO && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
+      printf("[Raygun APM] Evicted %lu cold methods from the methodinfo table, %lu left\n", (unsigned long)eviction.evicted, (unsigned long)tracer->methodinfo->num_entries);
+    }
+#endif
+  return eviction.evicted;
+}
+
 // Callback function invoked from the Ruby Tracepoint handler when a new exceptino is thrown. Delegates to the wire protocol encoding helper but also
 // generates a unique correlation ID for this exception for the raygun4ruby Crash Reporter integration.
 //
@@ -1535,7 +2636,7 @@ static void rb_rg_process_ended(VALUE obj)
 {
   int status = 0;
   rb_rg_get_tracer(obj);
-  // First flush any left over bits in the bipbuf ring buffer
+  // First flush any left over bits in partial batches of the sink lanes
   rb_rg_flush_batched_sink(tracer);
   // Let the Agent know we died
   rg_process_ended(tracer->context, (void *)&tracer->sink_data, 0);
@@ -1547,6 +2648,8 @@ static void rb_rg_process_ended(VALUE obj)
 #endif
     // Sets the termination condition for the timer thread too.
     tracer->sink_data.running = false;
+    // Don't wait out the idle timeout of a blocked sink thread
+    if (tracer->sink_data.dispatcher_state != RB_RG_DISPATCHER_BUSY) rb_rg_wakeup_dispatcher(&tracer->sink_data);
     // Give it a small grace period (but happy path is almost always immediate) to terminate
     rb_protect(rb_rg_join_sink_thread, tracer->sink_thread, &status);
     if (UNLIKELY(status)) {
@@ -1582,13 +2685,127 @@ static inline rg_function_id_t rb_rg_stack_peek(rg_thread_t *thread)
   return thread->shadow_stack[thread->shadow_top];
 }
 
+// Takes a shadow stack for a suspending fiber off the tracer's pool, or allocates a new one if the pool is drained
+static rg_fiber_stack_t *rb_rg_fiber_stack_get(rb_rg_tracer_t *tracer)
+{
+  rg_fiber_stack_t *stack = tracer->fiber_stacks;
+  if (LIKELY(stack != NULL)) {
+    tracer->fiber_stacks = stack->next;
+    tracer->pooled_fiber_stacks--;
+    return stack;
+  }
+  return ALLOC(rg_fiber_stack_t);
+}
+
+// Returns the shadow stack of a resumed fiber to the tracer's pool - anything beyond RG_FIBER_STACK_POOL_SIZE pooled stacks is freed instead
+static void rb_rg_fiber_stack_put(rb_rg_tracer_t *tracer, rg_fiber_stack_t *stack)
+{
+  if (UNLIKELY(tracer->pooled_fiber_stacks >= RG_FIBER_STACK_POOL_SIZE)) {
+    xfree(stack);
+    return;
+  }
+  stack->next = tracer->fiber_stacks;
+  tracer->fiber_stacks = stack;
+  tracer->pooled_fiber_stacks++;
+}
+
+// A callback function invoked by st_foreach in rb_rg_release_fiber_stacks - returns a saved fiber shadow stack to the pool and removes the entry
+static int rb_rg_fiber_stacks_release_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rb_rg_fiber_stack_put((rb_rg_tracer_t *)data, (rg_fiber_stack_t *)val);
+  return ST_DELETE;
+}
+
+// Releases the saved shadow stacks of all suspended fibers of a shadow thread - on trace start (fibers suspended in a previous trace are stale) and thread end
+void rb_rg_release_fiber_stacks(rb_rg_tracer_t *tracer, rg_thread_t *th)
+{
+  if (!th->fibers) return;
+  st_foreach(th->fibers, rb_rg_fiber_stacks_release_i, (st_data_t)tracer);
+}
+
+// Callback function invoked from the Ruby Tracepoint handler when the current thread switches fibers. Each fiber has it's own VM stack and thus
+// needs it's own shadow stack too, otherwise the frames of the fiber we switch to would be matched against the frames of the fiber we switch from.
+// The shadow stack of the suspending fiber is saved off the shadow thread and the resumed fiber's restored (or a frameless one started for a new
+// fiber) - the hot path of the shadow thread thus always works with an inline stack.
+//
+static void rb_rg_fiber_switch(rb_rg_tracer_t *tracer, rg_thread_t *th, VALUE fiber)
+{
+  rg_fiber_stack_t *stack = NULL;
+  st_data_t key = (st_data_t)fiber;
+  if (UNLIKELY(th->fiber == (uintptr_t)fiber)) return;
+  tracer->fiber_switches++;
+  // Only save the outgoing shadow stack if we know which fiber it belongs to and there's some frames to come back to
+  if (th->fiber && (th->shadow_top != RG_THREAD_FRAMELESS || th->vm_top != RG_THREAD_FRAMELESS)) {
+    if (!th->fibers) th->fibers = st_init_numtable();
+    stack = rb_rg_fiber_stack_get(tracer);
+    stack->shadow_top = th->shadow_top;
+    stack->vm_top = th->vm_top;
+    stack->level_deep_into_third_party_lib = th->level_deep_into_third_party_lib;
+    stack->library_vm_top = th->library_vm_top;
+    stack->pending_count = th->pending_count;
+    if (th->shadow_top >= 0) MEMCPY(stack->shadow_stack, th->shadow_stack, rg_function_id_t, th->shadow_top + 1);
+    if (th->pending_count) MEMCPY(stack->pending_frames, th->pending_frames, rg_int_t, th->pending_count);
+    st_insert(th->fibers, (st_data_t)th->fiber, (st_data_t)stack);
+    tracer->fiber_stacks_saved++;
+  }
+  // Restore the shadow stack of the fiber resumed ...
+  if (th->fibers && st_delete(th->fibers, &key, (st_data_t *)&stack)) {
+    th->shadow_top = stack->shadow_top;
+    th->vm_top = stack->vm_top;
+    th->level_deep_into_third_party_lib = stack->level_deep_into_third_party_lib;
+    th->library_vm_top = stack->library_vm_top;
+    th->pending_count = stack->pending_count;
+    if (stack->shadow_top >= 0) MEMCPY(th->shadow_stack, stack->shadow_stack, rg_function_id_t, stack->shadow_top + 1);
+    if (stack->pending_count) MEMCPY(th->pending_frames, stack->pending_frames, rg_int_t, stack->pending_count);
+    rb_rg_fiber_stack_put(tracer, stack);
+  } else {
+    // ... or start with a frameless one for a new fiber, or one that suspended without frames
+    th->shadow_top = RG_THREAD_FRAMELESS;
+    th->vm_top = RG_THREAD_FRAMELESS;
+    th->level_deep_into_third_party_lib = 0;
+    th->library_vm_top = RG_THREAD_FRAMELESS;
+    th->pending_count = 0;
+  }
+  th->fiber = (uintptr_t)fiber;
+}
+
+// Callback function invoked from the Ruby Tracepoint handler when the current thread switches fibers, ahead of the thread noise filter. Traces are
+// scoped to fibers by moving the thread into the Thread Group of the trace the resumed fiber is part of:
+//
+// * A fiber that started a trace, or joined one, resumes in it's trace's group
+// * A new fiber (nothing on it's VM stack yet) joins the trace of the fiber it was first resumed from, if any - eg. an Enumerator in a request
+// * Any other fiber, eg. the reactor of an async server that resumes a fiber per request, is not part of the trace of the fiber it was resumed
+//   from and resumes in the group the thread was in before that trace started
+//
+// Every trace's hook observes the switch and the outcome only depends on the resumed fiber, thus the first one to run does the move.
+//
+#ifdef RUBY_EVENT_FIBER_SWITCH
+static void rb_rg_fiber_switch_trace(rb_rg_tracer_t *tracer, rb_thread_t *th, VALUE fiber)
+{
+  rb_rg_trace_context_t *trace_context = NULL;
+  VALUE frame;
+  int line;
+  if (st_lookup(tracer->fibertraces, (st_data_t)fiber, (st_data_t *)&trace_context)) {
+    rb_rg_thread_group_add(trace_context->thgroup, th);
+    return;
+  }
+  // The trace of the fiber we switch from, if any
+  if (!st_lookup(tracer->tracecontexts, (st_data_t)rb_rg_thread_group(th), (st_data_t *)&trace_context)) return;
+  if (rb_profile_frames(0, 1, &frame, &line) == 0) {
+    rb_rg_trace_context_add_fiber(tracer, trace_context, fiber);
+  } else if (trace_context->thread == th->self) {
+    rb_rg_thread_group_add(trace_context->parent_thgroup, th);
+  }
+}
+#endif
+
 // Callback from the Ruby tracepoint API - try to do as little work as possible here, BUT unfortunately there's a lot going on
 // As a future optimization it may make sense to have distinct callbacks per event eg. RUBY_EVENT_THREAD_BEGIN would have it's own
 // to reduce code size of the callback and remove branches + the switch statement.
 //
 static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
 {
-  VALUE exception, namespace, thread, thgroup;
+  VALUE exception, namespace, thread;
   st_data_t entry;
   st_index_t method;
 #ifdef RB_RG_EMIT_ARGUMENTS
@@ -1596,11 +2813,9 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
   rg_variable_info_t args[RG_MAX_ARGS_LENGTH];
   VALUE retval, params, binding;
   rg_variable_info_t return_value;
-  // Fixed NULL value return, let it be static so we can init it once
-  static rg_variable_info_t return_value;
 #else
-// Fixed NULL value return, let it be static so we can init it once
-   static rg_void_return_t return_value;
+  // Fixed NULL value return - on the stack and not static as hooks of tracers in different Ractors run in parallel
+  rg_void_return_t return_value;
 #endif
   rg_instance_id_t instance;
   rg_function_id_t function_id;
@@ -1608,6 +2823,7 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
   rb_rg_tracer_t *tracer = (rb_rg_tracer_t *)trace_context->tracer;
   rg_method_t *rg_method = NULL;
   rg_thread_t *rg_thread = trace_context->rg_thread;
+  rb_rg_thread_cache_t *thread_cache;
 
   // Grab a reference to the current executing thread
   thread = rb_thread_current();
@@ -1619,6 +2835,11 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
   rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
   rb_event_flag_t flag = rb_tracearg_event_flag(tparg);
 
+#ifdef RUBY_EVENT_FIBER_SWITCH
+  // The resumed fiber may be part of another trace, or none
+  if (UNLIKELY(flag == RUBY_EVENT_FIBER_SWITCH)) rb_rg_fiber_switch_trace(tracer, GET_THREAD(), rb_fiber_current());
+#endif
+
   // Let the trace context's parent thread be the current thread UNLESS we're processing the RUBY_EVENT_THREAD_BEGIN event
   if (UNLIKELY(flag ^ RUBY_EVENT_THREAD_BEGIN)) {
     trace_context->parent_thread = thread;
@@ -1626,14 +2847,16 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
 
   // A thread noise filter for traces - we only care about the thread that started the trace (typically a worker thread)
   // OR any threads that has the same Thread Group assigned, meaning they were spawned by the thread that is pinned to the
-  // trace context.
-  if (UNLIKELY(thread != trace_context->thread)) {
-    thgroup = rb_rg_thread_group(GET_THREAD());
-    if (LIKELY(thgroup != rb_rg_DefaultThreadGroup && thgroup == trace_context->thgroup)) {
+  // trace context. The thread that started the trace leaves it's group while running fibers not part of the trace.
+  if (UNLIKELY(thread != trace_context->thread || GET_THREAD()->thgroup != trace_context->thgroup)) {
+    // The trace context of the current thread's group, cached per native thread
+    thread_cache = rb_rg_current_thread_cache(tracer, GET_THREAD());
+    if (LIKELY(thread_cache->trace_context == trace_context)) {
       // Let tid be that of the current executing thread as it's part of the trace context's thread
       // group and thus it was spawned within the trace context transaction boundaries and thus we
       // care about instrumenting it
-      rg_thread = rb_rg_thread(tracer, thread);
+      if (UNLIKELY(!thread_cache->rg_thread)) thread_cache->rg_thread = rb_rg_thread(tracer, thread);
+      rg_thread = thread_cache->rg_thread;
     } else {
       // Don't process threads that do not belong to the same group as the trace context's thread. This filters out
       // transient housekeeping threads like connection pool cleanups etc. which just adds noise.
@@ -1666,10 +2889,17 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
       if (((void*)entry) == NULL || (int)entry == RG_BLACKLIST_BLACKLISTED) return;
       // Cast to a rg_method_t struct otherwise
       rg_method = (rg_method_t *)entry;
+      // Keeps the method from being evicted
+      rb_rg_methodinfo_called(tracer, rg_method->function_id);
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_VERBOSE && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
         printf("[Raygun APM] methodinfo table method ctx: %p tid: %u namespace: %p method: %lu function_id: %u\n", (void *)trace_context, rg_thread->tid, (void *)namespace, method, rg_method->function_id);
 #endif
+    } else if (tracer->deferred_discovery && LIKELY(flag == RUBY_EVENT_CALL && rg_thread->pending_count < RG_PENDING_FRAMES_LIMIT) && rb_rg_defer_methodinfo(tracer, namespace, method, tparg)) {
+      // We haven't seen this method yet, but classification is deferred to the timer thread - not traced until classified, remember the frame to
+      // skip it's return as well
+      rg_thread->pending_frames[rg_thread->pending_count++] = rg_thread->vm_top;
+      return;
     } else {
       // We haven't seen this method yet, attempt to add it to the methodinfo table. This called fuction determines the white or blacklised status
       // of this method
@@ -1684,6 +2914,7 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
       if (rg_thread->level_deep_into_third_party_lib > 1){
         return;
       }
+      rg_thread->library_vm_top = rg_thread->vm_top;
     }
     //if we are deep into 3rd party libs, do not report sync activity like mutex synchronise, mutex lock / unlock
     //as it will cause method to have children that span for longer than method itself
@@ -1710,7 +2941,7 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
     instance = (rg_instance_id_t)rb_tracearg_self(tparg);
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_VERBOSE && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-      printf("[Raygun APM] BEGIN %u ctx: %p tid: %u namespace: %p method: %lu function_id: %u %s#%s\n", rg_method->function_id, (void *)trace_context, rg_thread->tid, (void *)namespace, method, rg_method->function_id, RSTRING_PTR(rb_rg_class_to_str(namespace)), RSTRING_PTR(rb_sym2str(rb_tracearg_method_id(tparg))));
+      printf("[Raygun APM] BEGIN %u ctx: %p tid: %u namespace: %p method: %lu function_id: %u %s#%s\n", rg_method->function_id, (void *)trace_context, rg_thread->tid, (void *)namespace, method, rg_method->function_id, RSTRING_PTR(rb_rg_class_name((rb_rg_tracer_t *)tracer, namespace, NULL)), RSTRING_PTR(rb_sym2str(rb_tracearg_method_id(tparg))));
 #endif
 
     // Push this whitelisted method onto the shadow stack
@@ -1735,6 +2966,11 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
     {
     // Decrements the stack depth of the Ruby VM frames - this can exceed the shadown stack top as we back out after 255 frames deep into a trace
     rg_thread->vm_top--;
+    // The call of this frame was to a method pending classification and not traced
+    if (UNLIKELY(rg_thread->pending_count && rg_thread->pending_frames[rg_thread->pending_count - 1] == rg_thread->vm_top + 1)) {
+      rg_thread->pending_count--;
+      return;
+    }
     if (UNLIKELY(rg_thread->vm_top >= RG_SHADOW_STACK_LIMIT - 1)) return;
     if (UNLIKELY(rg_thread->shadow_top == -1)) return;
 
@@ -1745,8 +2981,10 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
 
     // Calculate the numeric method ID for the method being called
     method = rb_rg_method_id(tracer, namespace, tparg, flag, RUBY_EVENT_RETURN);
-    // Lookup into the method info table to determine if we've already discovered this method and if true, if it's white or blacklisted
-    st_lookup(tracer->methodinfo, (st_data_t)method, &entry);
+    // Lookup into the method info table to determine if we've already discovered this method and if true, if it's white or blacklisted. Methods on
+    // a shadow stack are not evicted, a miss is a cold library frame too deep to be pushed that got evicted during the call - the library depth is
+    // balanced again on the return of the outermost library frame below.
+    if (UNLIKELY(!st_lookup(tracer->methodinfo, (st_data_t)method, &entry))) return;
 
     // Early return if this method is blacklisted
     if (((void*)entry) == NULL || (int)entry == RG_BLACKLIST_BLACKLISTED) return;
@@ -1756,6 +2994,7 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
     // An optimization that only goes 1 level deep into library specific method frames to cleanup traces from uncessary library internals noise
     if (rg_method->source == (rg_method_source_t)(RG_METHOD_SOURCE_KNOWN_LIBRARY)) {
       rg_thread->level_deep_into_third_party_lib--;
+      if (UNLIKELY(rg_thread->vm_top + 1 == rg_thread->library_vm_top)) rg_thread->level_deep_into_third_party_lib = 0;
       if (rg_thread->level_deep_into_third_party_lib > 0){
         return;
       }
@@ -1779,19 +3018,14 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
       retval = rb_tracearg_return_value(tparg);
       return_value = rb_rg_tracepoint_return_value(tracer, retval);
 #else
-      // static variable "return_value" is initialized in function rb_rg_variable_info_init
-      // and passed by reference. Gate multiple useless inits with a type check and the static
-      // return value is initialized only once with the init function
-      if (UNLIKELY(return_value.type != RG_VT_VOID)) {
-        return_value.type = RG_VT_VOID;
-        return_value.length = 0;
-        return_value.name_length = 0;
-      }
+      return_value.type = RG_VT_VOID;
+      return_value.length = 0;
+      return_value.name_length = 0;
 #endif
 
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_VERBOSE && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST))
-      printf("[Raygun APM] END %u ctx: %p tid: %u namespace: %p method: %lu function_id: %u %s#%s\n", function_id, (void *)trace_context, rg_thread->tid, (void *)namespace, method, function_id, RSTRING_PTR(rb_rg_class_to_str(namespace)), RSTRING_PTR(rb_sym2str(rb_tracearg_method_id(tparg))));
+      printf("[Raygun APM] END %u ctx: %p tid: %u namespace: %p method: %lu function_id: %u %s#%s\n", function_id, (void *)trace_context, rg_thread->tid, (void *)namespace, method, function_id, RSTRING_PTR(rb_rg_class_name((rb_rg_tracer_t *)tracer, namespace, NULL)), RSTRING_PTR(rb_sym2str(rb_tracearg_method_id(tparg))));
 #endif
 
 #ifdef RB_RG_DEBUG_SHADOW_STACK
@@ -1835,6 +3069,12 @@ static void rb_rg_tracing_hook_i(VALUE tpval, void *data)
     // Callback that invokes the encoder and pushes a wire protocol event out to the sink
     rb_rg_thread_ended(tracer, thread);
     break;
+#ifdef RUBY_EVENT_FIBER_SWITCH
+  // Handler for when the current thread resumes or yields to another fiber
+  case RUBY_EVENT_FIBER_SWITCH:
+    rb_rg_fiber_switch(tracer, rg_thread, rb_fiber_current());
+    break;
+#endif
   }
   RB_GC_GUARD(exception);
   RB_GC_GUARD(namespace);
@@ -1988,7 +3228,7 @@ static VALUE rb_rg_tracer_udp_sink_set(int argc, VALUE* argv, VALUE obj)
   // * Get the value of the SO_RCVBUF socket option
   // * This value corresponds to the net.rmem_default value on Linux systems
   //
-  // We use this value in the jitter buffer implementation on high load dispatch while the bipbuf is still not using much space.
+  // We use this value in the jitter buffer implementation on high load dispatch while the lanes are still not using much space.
   //
   receive_buffer_size = rb_hash_aref(kwargs, ID2SYM(rb_rg_id_receive_buffer_size));
   if (!RB_TYPE_P(receive_buffer_size, T_FIXNUM)) {
@@ -2012,16 +3252,15 @@ static VALUE rb_rg_tracer_udp_sink_set(int argc, VALUE* argv, VALUE obj)
   tracer->sink_data.host = host;
   tracer->sink_data.port = port;
   tracer->sink_data.receive_buffer_size = NUM2INT(receive_buffer_size);
-  // Allocates the ring buffer used for communication between the encoder and the UDP dispatch thread to completely decouple the tracer
-  // from the network in the hot path of any other executing thread.
-  tracer->sink_data.ringbuf.bipbuf = bipbuf_new(RG_RINGBUF_SIZE);
-  if(!tracer->sink_data.ringbuf.bipbuf) {
+  // Allocates the process lane used for communication between the encoder and the UDP dispatch thread to completely decouple the tracer
+  // from the network in the hot path of any other executing thread. Thread lanes are allocated on the first event of a thread.
+  if(!rb_rg_init_sink_lane(&tracer->sink_data, &tracer->sink_data.process_lane, 0)) {
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
-      printf("[Raygun APM] Could not allocate bipbuf\n");
+      printf("[Raygun APM] Could not allocate sink lane\n");
     }
 #endif
-    rb_raise(rb_eRaygunFatal, "Could not allocate bipbuf");
+    rb_raise(rb_eRaygunFatal, "Could not allocate sink lane");
   }
 
   // Pre-allocates a Ruby String object of a predefined max packet size and let the GC know we're using it to not have it recycled
@@ -2058,6 +3297,9 @@ static VALUE rb_rg_tracer_udp_sink_set(int argc, VALUE* argv, VALUE obj)
     }
 #endif
   tracer->sink_data.type = RB_RG_TRACER_SINK_UDP;
+  // Methods classified ahead of time by Tracer#warmup! were encoded before there was a transport to emit to - sync them now instead of on the next
+  // sync tick
+  rb_rg_async_emit_methodinfos(tracer);
   return socket;
 }
 
@@ -2121,20 +3363,19 @@ static VALUE rb_rg_tracer_tcp_sink_set(int argc, VALUE* argv, VALUE obj)
   tracer->sink_data.host = host;
   tracer->sink_data.port = port;
   tracer->sink_data.receive_buffer_size = 0;
-  // Allocates the ring buffer used for communication between the encoder and the TCP dispatch thread to completely decouple the tracer
-  // from the network in the hot path of any other executing thread.
-  tracer->sink_data.ringbuf.bipbuf = bipbuf_new(RG_RINGBUF_SIZE);
-  if(!tracer->sink_data.ringbuf.bipbuf) {
+  // Allocates the process lane used for communication between the encoder and the TCP dispatch thread to completely decouple the tracer
+  // from the network in the hot path of any other executing thread. Thread lanes are allocated on the first event of a thread.
+  if(!rb_rg_init_sink_lane(&tracer->sink_data, &tracer->sink_data.process_lane, 0)) {
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
-      printf("[Raygun APM] Could not allocate bipbuf\n");
+      printf("[Raygun APM] Could not allocate sink lane\n");
     }
 #endif
-    rb_raise(rb_eRaygunFatal, "Could not allocate bipbuf");
+    rb_raise(rb_eRaygunFatal, "Could not allocate sink lane");
   }
 
-  // Pre-allocates a Ruby String object of a predefined max packet size and let the GC know we're using it to not have it recycled
-  tracer->sink_data.payload = rb_str_buf_new(RG_BATCH_PACKET_SIZE);
+  // Pre-allocates a Ruby String object large enough for a coalesced write and let the GC know we're using it to not have it recycled
+  tracer->sink_data.payload = rb_str_buf_new(RG_TCP_WRITE_SIZE + RG_MAX_STREAM_BATCH_PACKET_SIZE);
   rb_gc_register_address(&tracer->sink_data.payload);
   // Set the sink status to running
   tracer->sink_data.running = true;
@@ -2165,6 +3406,8 @@ static VALUE rb_rg_tracer_tcp_sink_set(int argc, VALUE* argv, VALUE obj)
     }
 #endif
   tracer->sink_data.type = RB_RG_TRACER_SINK_TCP;
+  // Not MTU bound - oversized events are batched too, the batch size can be raised at runtime
+  tracer->sink_data.max_batch_size = RG_MAX_STREAM_BATCH_PACKET_SIZE;
 
   // attempt to connect on startup, but fail fast
   tracer->sink_data.sock = rb_protect(rb_rg_tracer_initialise_tcp_socket, (VALUE)tracer, &status);
@@ -2175,14 +3418,49 @@ static VALUE rb_rg_tracer_tcp_sink_set(int argc, VALUE* argv, VALUE obj)
     rb_set_errinfo(Qnil);
   } else {
     printf("[Raygun APM] TCP socket %s:%d connected without timer thread\n", RSTRING_PTR(tracer->sink_data.host), NUM2INT(tracer->sink_data.port));
+    // As for the UDP sink, sync methods classified ahead of time by Tracer#warmup! right away
+    rb_rg_async_emit_methodinfos(tracer);
   }
   return Qtrue;
 }
 
+// Spawns the timer thread - on allocation and again in a forked child, as threads other than the forking one don't survive a fork
+static void rb_rg_start_timer_thread(rb_rg_tracer_t *tracer)
+{
+  int status = 0;
+  // Spawn the timer thread in a safe manner with rb_protect - fatal error if we couldn't
+  tracer->timer_thread = rb_protect(rb_rg_tracer_create_timer_thread, (VALUE)&tracer->sink_data, &status);
+  if (UNLIKELY(status)) {
+    rb_rg_log_silenced_error();
+    // Clearing error info to ignore the caught exception
+    rb_set_errinfo(Qnil);
+    // Fatal error if we cannot start the timer thread
+#ifdef RB_RG_DEBUG
+    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
+      printf("[Raygun APM] Could not start the timer thread\n");
+    }
+#endif
+    rb_raise(rb_eRaygunFatal, "Could not start the timer thread");
+  }
+
+  // Attempt to set the timer thread name - no biggy if this fails
+  rb_protect(rb_rg_tracer_timer_thread_set_name, tracer->timer_thread, &status);
+  if (UNLIKELY(status)) {
+    rb_rg_log_silenced_error();
+    // Clearing error info to ignore the caught exception
+    rb_set_errinfo(Qnil);
+    // Not fatal if we cannot set the thread name, continue
+  }
+#ifdef RB_RG_DEBUG
+    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_INFO && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
+      printf("[Raygun APM] timer thread started\n");
+    }
+#endif
+}
+
 // The custom allocator function for the Tracer instance
 static VALUE rb_rg_tracer_alloc(VALUE obj)
 {
-  int status = 0;
   /* allocate the raw tracer struct wrapped by the Ruby object */
   rb_rg_tracer_t *tracer = ZALLOC(rb_rg_tracer_t);
   // Allocate the encoder context - fatal error if this fails
@@ -2202,8 +3480,25 @@ static VALUE rb_rg_tracer_alloc(VALUE obj)
   tracer->sink_data.type = RB_RG_TRACER_SINK_NONE;
   // Default to not wanting to debug the blacklist
   tracer->debug_blacklist = false;
+  tracer->filters = NULL;
+  tracer->compiled_blacklist = true;
   // Initializes the symbol table for tracking method info discovered during tracing.
   tracer->methodinfo = st_init_numtable();
+  tracer->methodinfo_capacity = RB_RG_METHODINFO_CAPACITY;
+  tracer->methodinfo_generation = 0;
+  tracer->methodinfo_called = NULL;
+  tracer->methodinfo_called_previously = NULL;
+  tracer->methodinfo_called_size = 0;
+  rg_slab_init(&tracer->method_slab, sizeof(rg_method_t), RB_RG_METHOD_SLAB_CHUNK);
+  rg_arena_init(&tracer->method_arena, RB_RG_METHOD_ARENA_CHUNK_SIZE);
+  tracer->method_class_names = st_init_strtable();
+  tracer->methods_inherited = 0;
+  rg_slab_init(&tracer->inherited_method_slab, sizeof(rg_method_t), RB_RG_METHOD_SLAB_CHUNK);
+  rg_arena_init(&tracer->inherited_method_arena, RB_RG_METHOD_ARENA_CHUNK_SIZE);
+  tracer->classinfo = st_init_numtable();
+  // Classify newly seen methods inline by default
+  tracer->deferred_discovery = false;
+  tracer->pending_methods = st_init_numtable();
   // Allocates the main Radix tree used by the blacklisting implementation - fatal error if this fails
   tracer->blacklist = raxNew();
   if (!tracer->blacklist) {
@@ -2254,9 +3549,13 @@ static VALUE rb_rg_tracer_alloc(VALUE obj)
 #endif
     rb_raise(rb_eRaygunFatal, "Could not allocate libraries radix tree");
   }
+  tracer->library_index = NULL;
+  tracer->library_paths = st_init_numtable();
 
   // Allocate the symbol table of trace contexts keyed by ThreadGroup (VALUE).
   tracer->tracecontexts = st_init_numtable();
+  // And the fibers of traces in progress, keyed by Fiber (VALUE)
+  tracer->fibertraces = st_init_numtable();
 
   // For coercion internal function hooks to avoid the overhead of RUBY_EVENT_C_CALL which would absolutely kill tracer performance.
   // Special case and used during method discovery
@@ -2324,11 +3623,32 @@ static VALUE rb_rg_tracer_alloc(VALUE obj)
   tracer->sink_data.sock = Qnil;
   tracer->sink_data.host = Qnil;
   tracer->sink_data.port = Qnil;
-  // Initialize the batch struct reused for dispatch
-  tracer->sink_data.batch.type = RG_EVENT_BATCH;
-  tracer->sink_data.batch.length = RG_BATCH_HEADLEN;
-  // Preset the PID of the batch struct from the encoder context - it's not going to change moving forward
-  tracer->sink_data.batch.pid = tracer->context->pid;
+  // Default to the v2 wire protocol until the Agent reports support for the compact framing
+  tracer->sink_data.protocol_version = RG_PROTOCOL_VERSION_2;
+  tracer->sink_data.instance_ids = true;
+  // Allocates the string dictionary used with the v3 wire protocol - fatal error if this fails
+  tracer->sink_data.strings = raxNew();
+  if (!tracer->sink_data.strings) {
+#ifdef RB_RG_DEBUG
+    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
+      printf("[Raygun APM] Could not allocate string dictionary radix tree\n");
+    }
+#endif
+    rb_raise(rb_eRaygunFatal, "Could not allocate string dictionary radix tree");
+  }
+  tracer->sink_data.interned_count = 0;
+  // Batches are sent uncompressed unless the Agent reports support for compressed frames
+  tracer->sink_data.compression = false;
+  // MTU sized batches by default, stream transports can opt into larger ones
+  tracer->sink_data.batch_size = RG_BATCH_PACKET_SIZE;
+  tracer->sink_data.linger = RG_BATCH_LINGER;
+  tracer->sink_data.max_batch_size = RG_MAX_BATCH_PACKET_SIZE;
+  // The process lane is allocated by the UDP and TCP sinks, thread lanes on the first event of a thread
+  tracer->sink_data.lanes = NULL;
+  tracer->sink_data.lanes_capacity = 0;
+  tracer->sink_data.lane_cursor = 0;
+  tracer->sink_data.queued = 0;
+  tracer->sink_data.sequence = 0;
 
   // Set a running default state - very important for the timer thread we're about to spawn
   tracer->sink_data.running = true;
@@ -2341,112 +3661,124 @@ static VALUE rb_rg_tracer_alloc(VALUE obj)
     }
 #endif
 
-  // Spawn the timer thread in a safe manner with rb_protect - fatal error if we couldn't
-  tracer->timer_thread = rb_protect(rb_rg_tracer_create_timer_thread, (VALUE)&tracer->sink_data, &status);
-  if (UNLIKELY(status)) {
-    rb_rg_log_silenced_error();
-    // Clearing error info to ignore the caught exception
-    rb_set_errinfo(Qnil);
-    // Fatal error if we cannot start the timer thread
-#ifdef RB_RG_DEBUG
-    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
-      printf("[Raygun APM] Could not start the timer thread\n");
-    }
-#endif
-    rb_raise(rb_eRaygunFatal, "Could not start the timer thread");
-  }
+  rb_rg_start_timer_thread(tracer);
 
-  // Attempt to set the timer thread name - no biggy if this fails
-  rb_protect(rb_rg_tracer_timer_thread_set_name, tracer->timer_thread, &status);
-  if (UNLIKELY(status)) {
-    rb_rg_log_silenced_error();
-    // Clearing error info to ignore the caught exception
-    rb_set_errinfo(Qnil);
-    // Not fatal if we cannot set the thread name, continue
-  }
+  // Returns the wrapped Ruby object
+  return TypedData_Wrap_Struct(obj, &rb_rg_tracer_type, tracer);
+}
+
+// Inserts a rule into one of the fully qualified, paths or methods radix trees and the all-of-the-things one
+static void rb_rg_tracer_blacklist_insert(rb_rg_tracer_t *tracer, rax *tree, unsigned char *needle, size_t needle_len, long data, const char *error_msg)
+{
+  int res;
+  res = raxInsert(tree, needle, needle_len, (void *)(uintptr_t)data, NULL);
+  if (res == 0 && errno == ENOMEM) goto error;
+  // Fall through - set in the all-of-the-things radix tree
+  res = raxInsert(tracer->blacklist, needle, needle_len, (void *)(uintptr_t)data, NULL);
+  if (res == 0 && errno == ENOMEM) goto error;
+  return;
+error:
 #ifdef RB_RG_DEBUG
-    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_INFO && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
-      printf("[Raygun APM] timer thread started\n");
-    }
+  if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
+    printf("[Raygun APM] %s\n", error_msg);
+  }
 #endif
+  rb_raise(rb_eRaygunFatal, "%s", error_msg);
+}
 
-  // Returns the wrapped Ruby object
-  return TypedData_Wrap_Struct(obj, &rb_rg_tracer_type, tracer);
+// Required on any changes to the blacklist rules - the compiled automaton is stale and recompiled on next use, and the methodinfo table is reset.
+static void rb_rg_tracer_blacklist_changed(rb_rg_tracer_t *tracer)
+{
+  // Compiling on first use rather than here keeps registering rules one by one linear
+  rg_blacklist_free(tracer->filters);
+  tracer->filters = NULL;
+  rb_nativethread_lock_lock(&tracer->method_lock);
+  rb_rg_drop_method_cache(tracer);
+  rb_nativethread_lock_unlock(&tracer->method_lock);
+  // To reduce complexity and bug surface potential, let the method discovery mechanism in the tracepoint callback just rebuild the methodinfo table.
+  rb_rg_flush_caches(tracer);
 }
 
-// A common function and the only interface for adding to the various radix trees used for blacklisting
+// A common function and the only interface for adding single rules to the various radix trees used for blacklisting
 static VALUE rb_rg_tracer_blacklist_add0(VALUE obj, VALUE path, VALUE method, long data, const char *error_msg, const char *scope)
 {
   rb_rg_get_tracer(obj);
   VALUE args[2];
-  int res;
   VALUE needle = Qnil;
+  rax *tree;
   // Return if we don't have path of method set
   if (!RTEST(path) && !RTEST(method)) return Qfalse;
-  // If both path and method is set, add it to the radix tree that tracks the fully qualified paths rules
-  if (RTEST(path) && RTEST(method)) {
-    args[0] = path;
-    args[1] = method;
-    needle = rb_str_format(2, args, rb_str_new2("%s#%s"));
-    res = raxInsert(tracer->blacklist_fq, (unsigned char*)StringValueCStr(needle), RSTRING_LEN(needle), (void *)(uintptr_t)data, NULL);
-    if (res == 0 && errno == ENOMEM )
-    {
-#ifdef RB_RG_DEBUG
-    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
-      printf("[Raygun APM] %s\n", error_msg);
-    }
-#endif
-      rb_raise(rb_eRaygunFatal, "%s", error_msg);
-    }
-  // If only path is set and method is not, add it to the radix tree that tracks the paths rules
-  } else if (RTEST(path) && !RTEST(method)) {
-    needle = path;
-    res = raxInsert(tracer->blacklist_paths, (unsigned char*)StringValueCStr(needle), RSTRING_LEN(needle), (void *)(uintptr_t)data, NULL);
-    if (res == 0 && errno == ENOMEM )
-    {
-#ifdef RB_RG_DEBUG
-    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
-      printf("[Raygun APM] %s\n", error_msg);
-    }
-#endif
-      rb_raise(rb_eRaygunFatal, "%s", error_msg);
-    }
-  // If only method is set and path is not, add it to the radix tree that tracks the methods rules
-  } else if (RTEST(method) && !RTEST(path)) {
-    needle = method;
-    res = raxInsert(tracer->blacklist_methods, (unsigned char*)StringValueCStr(needle), RSTRING_LEN(needle), (void *)(uintptr_t)data, NULL);
-    if (res == 0 && errno == ENOMEM )
-    {
-#ifdef RB_RG_DEBUG
-    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
-      printf("[Raygun APM] %s\n", error_msg);
-    }
-#endif
-      rb_raise(rb_eRaygunFatal, "%s", error_msg);
-    }
-  }
-  // Fall through - set in the all-of-the-things radix tree
-  res = raxInsert(tracer->blacklist, (unsigned char*)StringValueCStr(needle), RSTRING_LEN(needle), (void *)(uintptr_t)data, NULL);
-  if (res == 0 && errno == ENOMEM )
-  {
-#ifdef RB_RG_DEBUG
-    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_ERROR && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
-      printf("[Raygun APM] %s\n", error_msg);
-    }
-#endif
-    rb_raise(rb_eRaygunFatal, "%s", error_msg);
+  // If both path and method is set, add it to the radix tree that tracks the fully qualified paths rules
+  if (RTEST(path) && RTEST(method)) {
+    args[0] = path;
+    args[1] = method;
+    needle = rb_str_format(2, args, rb_str_new2("%s#%s"));
+    tree = tracer->blacklist_fq;
+  // If only path is set and method is not, add it to the radix tree that tracks the paths rules
+  } else if (RTEST(path) && !RTEST(method)) {
+    needle = path;
+    tree = tracer->blacklist_paths;
+  // If only method is set and path is not, add it to the radix tree that tracks the methods rules
+  } else {
+    needle = method;
+    tree = tracer->blacklist_methods;
   }
+  rb_rg_tracer_blacklist_insert(tracer, tree, (unsigned char*)StringValueCStr(needle), RSTRING_LEN(needle), data, error_msg);
 #ifdef RB_RG_DEBUG
   if (UNLIKELY(tracer->loglevel == RB_RG_TRACER_LOG_BLACKLIST))
     printf("[Raygun APM] %s pattern %s\n", scope, RSTRING_PTR(needle));
 #endif
-  // Resets the methodinfo table as the classification rules changed and to reduce complexity and bug surface potential, let the method discovery
-  // mechanism in the tracepoint callback just rebuild it.
-  rb_rg_flush_caches(tracer);
+  rb_rg_tracer_blacklist_changed(tracer);
   RB_GC_GUARD(needle);
   return Qtrue;
 }
 
+// Inserts a rule of a blacklist snapshot, with the same semantics as rb_rg_tracer_blacklist_add0
+static void rb_rg_tracer_load_blacklist_i(const rg_byte_t data, const unsigned char *path, const uint16_t path_len, const unsigned char *method, const uint16_t method_len, void *ctx)
+{
+  rb_rg_tracer_t *tracer = (rb_rg_tracer_t *)ctx;
+  unsigned char needle[RG_MAX_BLACKLIST_NEEDLE_SIZE];
+  const char *error_msg = (data == RG_BLACKLIST_WHITELISTED) ? "Could not allocate room for whitelisted entry" : "Could not allocate room for blacklisted entry";
+  if (path && method) {
+    // Method discovery truncates class and method names to RG_MAX_STRING_SIZE, so a longer rule could never match anyway
+    if ((size_t)path_len + 1 + method_len > RG_MAX_BLACKLIST_NEEDLE_SIZE) return;
+    memcpy(needle, path, path_len);
+    needle[path_len] = '#';
+    memcpy(needle + path_len + 1, method, method_len);
+    rb_rg_tracer_blacklist_insert(tracer, tracer->blacklist_fq, needle, path_len + 1 + method_len, data, error_msg);
+  } else if (path) {
+    rb_rg_tracer_blacklist_insert(tracer, tracer->blacklist_paths, (unsigned char *)path, path_len, data, error_msg);
+  } else {
+    rb_rg_tracer_blacklist_insert(tracer, tracer->blacklist_methods, (unsigned char *)method, method_len, data, error_msg);
+  }
+}
+
+// Bulk loads the rules of a blacklist snapshot (see Raygun::Apm::Blacklist::Snapshot) - the snapshot of the default blacklist embedded at build time if
+// none given. Rules are inserted in order, as if added one by one, but the caches are only flushed once. Returns false if the extension was built
+// without an embedded snapshot and raises ArgumentError for a malformed snapshot, in which case no rules were loaded.
+static VALUE rb_rg_tracer_load_blacklist(int argc, VALUE* argv, VALUE obj)
+{
+  VALUE snapshot;
+  const rg_byte_t *data;
+  size_t size;
+  rb_rg_get_tracer(obj);
+  rb_scan_args(argc, argv, "01", &snapshot);
+  if (NIL_P(snapshot)) {
+    if (!rg_blacklist_snapshot) return Qfalse;
+    data = rg_blacklist_snapshot;
+    size = rg_blacklist_snapshot_size;
+  } else {
+    StringValue(snapshot);
+    data = (const rg_byte_t *)RSTRING_PTR(snapshot);
+    size = RSTRING_LEN(snapshot);
+  }
+  if (!rg_blacklist_snapshot_each(data, size, NULL, NULL)) rb_raise(rb_eArgError, "malformed blacklist snapshot");
+  rg_blacklist_snapshot_each(data, size, rb_rg_tracer_load_blacklist_i, (void *)tracer);
+  rb_rg_tracer_blacklist_changed(tracer);
+  RB_GC_GUARD(snapshot);
+  return Qtrue;
+}
+
 // Adds a blacklist rule
 static VALUE rb_rg_tracer_add_blacklist(VALUE obj, VALUE path, VALUE method)
 {
@@ -2481,7 +3813,7 @@ static VALUE rb_rg_tracer_blacklisted_p(VALUE obj, VALUE fully_qualified, VALUE
   RB_GC_GUARD(fully_qualified);
   RB_GC_GUARD(path);
   RB_GC_GUARD(method);
-  res = rb_rg_blacklisted_method_p(tracer, (unsigned char*)StringValueCStr(fully_qualified), RSTRING_LEN(fully_qualified), (unsigned char*)StringValueCStr(path), RSTRING_LEN(path), (unsigned char*)StringValueCStr(method), RSTRING_LEN(method), true);
+  res = rb_rg_classify_method(tracer, (unsigned char*)StringValueCStr(fully_qualified), RSTRING_LEN(fully_qualified), (unsigned char*)StringValueCStr(path), RSTRING_LEN(path), (unsigned char*)StringValueCStr(method), RSTRING_LEN(method));
   return (res == RG_BLACKLIST_BLACKLISTED) ? Qtrue : Qfalse;
 }
 
@@ -2493,7 +3825,7 @@ static VALUE rb_rg_tracer_whitelisted_p(VALUE obj, VALUE fully_qualified, VALUE
   RB_GC_GUARD(fully_qualified);
   RB_GC_GUARD(path);
   RB_GC_GUARD(method);
-  res = rb_rg_blacklisted_method_p(tracer, (unsigned char*)StringValueCStr(fully_qualified), RSTRING_LEN(fully_qualified), (unsigned char*)StringValueCStr(path), RSTRING_LEN(path), (unsigned char*)StringValueCStr(method), RSTRING_LEN(method), true);
+  res = rb_rg_classify_method(tracer, (unsigned char*)StringValueCStr(fully_qualified), RSTRING_LEN(fully_qualified), (unsigned char*)StringValueCStr(path), RSTRING_LEN(path), (unsigned char*)StringValueCStr(method), RSTRING_LEN(method));
   return (res == RG_BLACKLIST_WHITELISTED || res == RG_BLACKLIST_UNLISTED) ? Qtrue : Qfalse;
 }
 
@@ -2517,6 +3849,13 @@ static VALUE rb_rg_tracer_register_libraries(VALUE obj, VALUE libraries)
       rb_raise(rb_eRaygunFatal, "Could not allocate room for library entry");
     }
   }
+  // Recompiled on next method discovery, and any cached classifications are stale
+  rb_nativethread_lock_lock(&tracer->method_lock);
+  rg_prefix_index_free(tracer->library_index);
+  tracer->library_index = NULL;
+  st_clear(tracer->library_paths);
+  rb_rg_drop_method_cache(tracer);
+  rb_nativethread_lock_unlock(&tracer->method_lock);
   return Qtrue;
 }
 
@@ -2586,6 +3925,245 @@ static VALUE rb_rg_tracer_debug_blacklist_equals(VALUE obj, VALUE debug)
   return Qtrue;
 }
 
+// Toggles between classifying methods with the compiled blacklist automaton (the default) and the radix trees it's compiled from
+static VALUE rb_rg_tracer_compiled_blacklist_equals(VALUE obj, VALUE compiled)
+{
+  rb_rg_get_tracer(obj);
+  tracer->compiled_blacklist = RTEST(compiled) ? true : false;
+  return Qtrue;
+}
+
+// Predicate for whether methods are classified with the compiled blacklist automaton
+static VALUE rb_rg_tracer_compiled_blacklist_p(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  if (tracer->compiled_blacklist) return Qtrue;
+  return Qfalse;
+}
+
+// Toggles classifying newly seen methods on the timer thread instead of inline in the tracepoint hook. Calls to a method are not traced until it's
+// classified, which typically only affects the first request of a freshly booted process.
+static VALUE rb_rg_tracer_deferred_discovery_equals(VALUE obj, VALUE deferred)
+{
+  rb_rg_get_tracer(obj);
+  tracer->deferred_discovery = RTEST(deferred) ? true : false;
+  return Qtrue;
+}
+
+// Predicate for whether method classification is deferred to the timer thread
+static VALUE rb_rg_tracer_deferred_discovery_p(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  if (tracer->deferred_discovery) return Qtrue;
+  return Qfalse;
+}
+
+// Maps the method classifications persisted by a previous process at the given path, if the file exists and is valid, and starts recording the
+// classifications of methods not in it for Tracer#method_cache_snapshot. Returns true if loaded.
+static VALUE rb_rg_tracer_load_method_cache(VALUE obj, VALUE path)
+{
+  rg_method_cache_t *cache;
+  rb_rg_get_tracer(obj);
+  cache = rg_method_cache_open(StringValueCStr(path));
+  rb_nativethread_lock_lock(&tracer->method_lock);
+  rb_rg_drop_method_cache(tracer);
+  tracer->method_cache = cache;
+  tracer->method_cache_recording = true;
+  rb_nativethread_lock_unlock(&tracer->method_lock);
+  return cache ? Qtrue : Qfalse;
+}
+
+// Serializes the loaded method classifications merged with the ones recorded since into a new cache file body. Returns nil if nothing was recorded
+// since the cache was loaded, as the cache is then up to date.
+static VALUE rb_rg_tracer_method_cache_snapshot(VALUE obj)
+{
+  rg_byte_t *buf = NULL;
+  size_t size = 0;
+  VALUE snapshot;
+  rb_rg_get_tracer(obj);
+  rb_nativethread_lock_lock(&tracer->method_lock);
+  if (tracer->method_cache_recording && tracer->method_cache_log.count) buf = rg_method_cache_serialize(tracer->method_cache, &tracer->method_cache_log, &size);
+  rb_nativethread_lock_unlock(&tracer->method_lock);
+  if (!buf) return Qnil;
+  snapshot = rb_str_new((const char *)buf, size);
+  free(buf);
+  return snapshot;
+}
+
+// Classifies a method ahead of it being called, for Tracer#warmup! - with the same method ID the tracepoint hook computes for it's call events. The method
+// name is the one the method was originally defined with, as reported by call events for aliases too. Returns true if the method was not known yet.
+static VALUE rb_rg_tracer_warmup_method(VALUE obj, VALUE namespace, VALUE method_name)
+{
+  st_index_t method;
+  int seen;
+  VALUE class_name, name;
+  rg_encoded_string_t class_name_string;
+  rb_rg_get_tracer(obj);
+  Check_Type(method_name, T_SYMBOL);
+  // Excluded by the tracepoint hook
+  if (namespace == rb_cRaygunTracer) return Qfalse;
+  class_name_string.encoding = RG_STRING_ENCODING_ASCII;
+  class_name = rb_rg_class_name(tracer, namespace, &class_name_string);
+  name = rb_sym2str(method_name);
+  if (LIKELY(tracer->environment == RB_RG_TRACER_ENV_PRODUCTION)) {
+    method = rb_rg_method_id_production(namespace, method_name);
+  } else {
+    method = rb_rg_method_id_names(class_name, name);
+  }
+  rb_nativethread_lock_lock(&tracer->method_lock);
+  seen = st_lookup(tracer->methodinfo, (st_data_t)method, NULL);
+  rb_nativethread_lock_unlock(&tracer->method_lock);
+  if (seen) return Qfalse;
+  rb_rg_methodinfo0(tracer, NULL, 0, namespace, method, class_name, &class_name_string, name, NULL);
+  RB_GC_GUARD(class_name);
+  RB_GC_GUARD(name);
+  return Qtrue;
+}
+
+// Classifies any methods pending discovery on the calling thread instead of waiting for the timer thread. Returns the amount of methods classified.
+static VALUE rb_rg_tracer_resolve_pending_methods(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return LONG2NUM(rb_rg_resolve_pending_methods(tracer));
+}
+
+// A callback function invoked by st_foreach in rb_rg_tracer_reset_after_fork that returns the shadow threads of the parent's threads to the pool
+static int rb_rg_threadsinfo_forked_i(st_data_t key, st_data_t val, st_data_t data)
+{
+  rb_rg_free_thread((rb_rg_tracer_t *)data, (rg_thread_t *)val);
+  return ST_DELETE;
+}
+
+// Resets the process specific state of a tracer inherited by a forked child, for it to be used by the child instead of building a tracer of it's own. The
+// method tables, class info and library classification caches and the blacklist are kept as is - warmed up by the parent. The whitelisted methods
+// inherited are set aside in the inherited method slab and arena, which the child never allocates from, evicts from or compacts, nor writes to when the
+// methods are called - their pages stay shared with the parent (and other children) copy-on-write. The methodinfo table itself is still inserted into
+// for methods discovered by the child. Only what doesn't survive a fork is set up again:
+//
+// * The timer and sink threads - threads other than the forking one are gone in the child
+// * The sink lanes - batches queued by the parent are for the parent to send. Transport sinks are reset for the child to set up it's own connection,
+//   events go to the blackhole sink until then. A callback sink is kept.
+// * Traces in progress and shadow threads of the parent's threads
+// * The pid, and the locks which may have been held by a parent thread at fork time
+//
+// Returns false if called in the process the tracer was created in (or reset for already).
+static VALUE rb_rg_tracer_reset_after_fork(VALUE obj)
+{
+  rb_rg_sink_data_t *sink_data;
+  rb_rg_get_tracer(obj);
+  if (tracer->context->pid == rg_getpid()) return Qfalse;
+  sink_data = &tracer->sink_data;
+  rb_nativethread_lock_initialize(&tracer->method_lock);
+  rb_nativethread_lock_initialize(&tracer->thread_lock);
+  rg_context_forked(tracer->context);
+
+  // Set the whitelisted methods discovered so far aside, along with those the parent inherited itself if forked off from another process
+  rg_slab_merge(&tracer->inherited_method_slab, &tracer->method_slab);
+  rg_arena_merge(&tracer->inherited_method_arena, &tracer->method_arena);
+  tracer->methods_inherited = tracer->methods;
+
+  st_foreach(tracer->tracecontexts, rb_rg_trace_context_free_i, 0);
+  st_foreach(tracer->threadsinfo, rb_rg_threadsinfo_forked_i, (st_data_t)tracer);
+  rb_rg_invalidate_thread_caches();
+
+  if (sink_data->type == RB_RG_TRACER_SINK_UDP || sink_data->type == RB_RG_TRACER_SINK_TCP) {
+    rb_rg_free_sink_lanes(sink_data);
+    rb_gc_unregister_address(&sink_data->payload);
+    sink_data->sock = Qnil;
+    sink_data->host = Qnil;
+    sink_data->port = Qnil;
+    sink_data->type = RB_RG_TRACER_SINK_NONE;
+  } else if (sink_data->type == RB_RG_TRACER_SINK_CALLBACK) {
+    tracer->context->sink = rb_rg_callback_sink;
+  }
+  tracer->sink_thread = Qfalse;
+  sink_data->lane_cursor = 0;
+  sink_data->queued = 0;
+  sink_data->sequence = 0;
+  sink_data->handoff_sequence = 0;
+  sink_data->dispatcher_state = RB_RG_DISPATCHER_BUSY;
+  sink_data->linger_deadline = 0;
+  sink_data->timer_waiting = false;
+  sink_data->running = true;
+  rb_rg_start_timer_thread(tracer);
+#ifdef RB_RG_DEBUG
+    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_INFO && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
+      printf("[Raygun APM] Tracer reset after fork in pid %u, inherited %lu methods\n", tracer->context->pid, (unsigned long)tracer->methodinfo->num_entries);
+    }
+#endif
+  return Qtrue;
+}
+
+// Sets the amount of methodinfo table entries beyond which cold methods are evicted
+static VALUE rb_rg_tracer_methodinfo_capacity_equals(VALUE obj, VALUE capacity)
+{
+  long methodinfo_capacity;
+  rb_rg_get_tracer(obj);
+  Check_Type(capacity, T_FIXNUM);
+  methodinfo_capacity = NUM2LONG(capacity);
+  if (methodinfo_capacity < 1) {
+    rb_raise(rb_eArgError, "invalid methodinfo capacity %ld, expected a positive number of methods", methodinfo_capacity);
+  }
+  tracer->methodinfo_capacity = (size_t)methodinfo_capacity;
+  return Qtrue;
+}
+
+static VALUE rb_rg_tracer_methodinfo_capacity(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return SIZET2NUM(tracer->methodinfo_capacity);
+}
+
+// Number of whitelisted and blacklisted methods in the methodinfo table
+static VALUE rb_rg_tracer_methodinfo_size(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return SIZET2NUM(tracer->methodinfo->num_entries);
+}
+
+// Number of eviction passes over the methodinfo table thus far
+static VALUE rb_rg_tracer_methodinfo_evictions(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return SIZET2NUM(tracer->methodinfo_evictions);
+}
+
+// Number of methods evicted from the methodinfo table thus far
+static VALUE rb_rg_tracer_methodinfo_evicted(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return SIZET2NUM(tracer->methodinfo_evicted);
+}
+
+// Starts a new methodinfo table generation and evicts cold methods if over capacity, as the timer thread does on methodinfo sync. Returns the amount of
+// methods evicted.
+static VALUE rb_rg_tracer_evict_methodinfo(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  rb_rg_next_methodinfo_generation(tracer);
+  return SIZET2NUM(rb_rg_evict_methodinfo(tracer));
+}
+
+// Digest of the methods inherited from the parent process and their names and encoded methodinfo, which a forked child is not to write to. Zero if no
+// methods were inherited.
+static VALUE rb_rg_tracer_inherited_methods_digest(VALUE obj)
+{
+  uint64_t digest = 14695981039346656037ULL;
+  rb_rg_get_tracer(obj);
+  if (!tracer->methods_inherited) return INT2FIX(0);
+  digest = rg_slab_digest(&tracer->inherited_method_slab, digest);
+  digest = rg_arena_digest(&tracer->inherited_method_arena, digest);
+  return ULL2NUM(digest);
+}
+
+// Reclaims the shadow threads of threads that died outside of a trace, as the timer thread does on every tick. Returns the amount of shadow threads
+// reclaimed.
+static VALUE rb_rg_tracer_reclaim_dead_threads(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return SIZET2NUM(rb_rg_reclaim_dead_threads(tracer));
+}
+
 // Sets the API Key for this tracer instance (included in BEGIN_TRANSACTION commmands in a field if set)
 static VALUE rb_rg_tracer_api_key_equals(VALUE obj, VALUE api_key)
 {
@@ -2593,9 +4171,150 @@ static VALUE rb_rg_tracer_api_key_equals(VALUE obj, VALUE api_key)
   Check_Type(api_key, T_STRING);
   tracer->api_key = api_key;
   rb_gc_register_address(&tracer->api_key);
+  // Re-encoded on the next BEGIN_TRANSACTION
+  xfree(tracer->begin_transaction);
+  tracer->begin_transaction = NULL;
+  return Qtrue;
+}
+
+// Sets the wire protocol version negotiated with the Agent. Any partial batch is flushed in the framing it was started with before switching over.
+static VALUE rb_rg_tracer_protocol_version_equals(VALUE obj, VALUE version)
+{
+  rg_byte_t protocol_version;
+  rb_rg_get_tracer(obj);
+
+  Check_Type(version, T_FIXNUM);
+  protocol_version = (rg_byte_t)NUM2INT(version);
+  // Raises argument error if we don't konw about this protocol version
+  if (protocol_version < RG_PROTOCOL_VERSION_2 || protocol_version > RG_PROTOCOL_VERSION_3) {
+    rb_raise(rb_eArgError, "invalid protocol version");
+  }
+  if (tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP) {
+    rb_rg_flush_batched_sink(tracer);
+  }
+  tracer->sink_data.protocol_version = protocol_version;
+  if (tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP) {
+    rb_rg_reset_sink_lane(&tracer->sink_data, &tracer->sink_data.process_lane);
+    for (rg_tid_t i = 0; i < tracer->sink_data.lanes_capacity; i++) {
+      if (tracer->sink_data.lanes[i]) rb_rg_reset_sink_lane(&tracer->sink_data, tracer->sink_data.lanes[i]);
+    }
+  }
+  return Qtrue;
+}
+
+static VALUE rb_rg_tracer_protocol_version(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return INT2NUM(tracer->sink_data.protocol_version);
+}
+
+// Toggles instance IDs on compact BEGIN records - the Agent reports if it wants them as they're the largest varint in the record
+static VALUE rb_rg_tracer_instance_ids_equals(VALUE obj, VALUE instance_ids)
+{
+  rb_rg_get_tracer(obj);
+  tracer->sink_data.instance_ids = RTEST(instance_ids) ? true : false;
+  return Qtrue;
+}
+
+// Toggles LZ4 compression of batches for the TCP sink - the Agent reports if it can inflate them
+static VALUE rb_rg_tracer_compression_equals(VALUE obj, VALUE compression)
+{
+  rb_rg_get_tracer(obj);
+  tracer->sink_data.compression = RTEST(compression) ? true : false;
+  return Qtrue;
+}
+
+static VALUE rb_rg_tracer_compression(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return tracer->sink_data.compression ? Qtrue : Qfalse;
+}
+
+// Bytes sent relative to the batch bytes the dispatcher compressed thus far, 1.0 if nothing was compressed yet
+static VALUE rb_rg_tracer_compression_ratio(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  if (!tracer->sink_data.compressed_in) return DBL2NUM(1.0);
+  return DBL2NUM((double)tracer->sink_data.compressed_out / (double)tracer->sink_data.compressed_in);
+}
+
+// Number of writes (syscalls) the dispatcher thread issued to the transport thus far
+static VALUE rb_rg_tracer_writes(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return SIZET2NUM(tracer->sink_data.writes);
+}
+
+// Number of times producers yielded the GVL to the sink thread thus far
+static VALUE rb_rg_tracer_handoffs(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return SIZET2NUM(tracer->sink_data.handoffs);
+}
+
+// For tests and benchmarks only - compresses an encoded batch the same way the TCP dispatcher does. Returns the input if it does not compress.
+static VALUE rb_rg_tracer_compress_batch(VALUE klass, VALUE batch)
+{
+  VALUE frame;
+  rg_length_t length;
+  Check_Type(batch, T_STRING);
+  if (RSTRING_LEN(batch) < RG_BATCH_HEADLEN || RSTRING_LEN(batch) > RG_MAX_STREAM_BATCH_PACKET_SIZE) rb_raise(rb_eArgError, "not a batch");
+  frame = rb_str_buf_new(RG_BATCH_COMPRESSED_HEADLEN + RG_LZ4_COMPRESS_BOUND(RSTRING_LEN(batch)));
+  length = rg_compress_batch((const rg_byte_t *)RSTRING_PTR(batch), (rg_length_t)RSTRING_LEN(batch), (rg_byte_t *)RSTRING_PTR(frame), (int)rb_str_capacity(frame));
+  RB_GC_GUARD(batch);
+  if (!length) return batch;
+  rb_str_set_len(frame, length);
+  return frame;
+}
+
+// Sets the size batches are dispatched at. UDP batches are MTU bound and can't exceed MAX_BATCH_PACKET_SIZE, stream transports (TCP) may use
+// batches of up to MAX_STREAM_BATCH_PACKET_SIZE to reduce the number of writes and batch headers. Any partial batch is flushed first.
+static VALUE rb_rg_tracer_batch_size_equals(VALUE obj, VALUE size)
+{
+  int batch_size;
+  rb_rg_get_tracer(obj);
+
+  Check_Type(size, T_FIXNUM);
+  batch_size = NUM2INT(size);
+  // Raises argument error if the batch size is out of range for the transport
+  if (batch_size < RG_MIN_BATCH_PACKET_SIZE || batch_size > tracer->sink_data.max_batch_size) {
+    rb_raise(rb_eArgError, "invalid batch size %d for sink, expected %d to %d", batch_size, RG_MIN_BATCH_PACKET_SIZE, tracer->sink_data.max_batch_size);
+  }
+  if (tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP) {
+    rb_rg_flush_batched_sink(tracer);
+  }
+  tracer->sink_data.batch_size = (rg_length_t)batch_size;
+  return Qtrue;
+}
+
+static VALUE rb_rg_tracer_batch_size(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return INT2NUM(tracer->sink_data.batch_size);
+}
+
+// Sets how long (microseconds) a partial batch may linger for more commands once a trace ended - 0 seals it on end_trace. Beyond the timer thread
+// tick interval the periodic flush seals it first anyway.
+static VALUE rb_rg_tracer_batch_linger_equals(VALUE obj, VALUE linger)
+{
+  long value;
+  rb_rg_get_tracer(obj);
+
+  Check_Type(linger, T_FIXNUM);
+  value = NUM2LONG(linger);
+  if (value < 0 || value > RG_TIMER_THREAD_TICK_INTERVAL * TIMESTAMP_UNITS_PER_SECOND) {
+    rb_raise(rb_eArgError, "invalid batch linger %ld, expected 0 to %d microseconds", value, RG_TIMER_THREAD_TICK_INTERVAL * TIMESTAMP_UNITS_PER_SECOND);
+  }
+  tracer->sink_data.linger = (rg_timestamp_t)value;
   return Qtrue;
 }
 
+static VALUE rb_rg_tracer_batch_linger(VALUE obj)
+{
+  rb_rg_get_tracer(obj);
+  return LONG2NUM((long)tracer->sink_data.linger);
+}
+
 // XXX not exposed from Ruby at present but should be, renamed to no clashed if eventually exposed from MRI core
 VALUE rb_rg_thread_group(rb_thread_t *th)
 {
@@ -2615,7 +4334,8 @@ VALUE rb_rg_thread_group_add(VALUE thgroup, rb_thread_t *th)
 }
 
 // Start a trace context. Could be a single script/console application that has start+stop
-// wrapped around or could be a web request. Initializes any per trace context.
+// wrapped around or could be a web request. Initializes any per trace context. Traces are scoped to the fiber
+// they're started in, thus requests served by fibers of the same thread each get a trace of their own.
 //
 static VALUE rb_rg_tracer_start_trace(VALUE obj)
 {
@@ -2634,6 +4354,10 @@ static VALUE rb_rg_tracer_start_trace(VALUE obj)
 #ifdef RB_RG_TRACE_BLOCKS
   events |= RUBY_EVENT_B_RETURN | RUBY_EVENT_B_CALL;
 #endif
+#ifdef RUBY_EVENT_FIBER_SWITCH
+  // Swaps shadow stacks when the traced thread switches fibers
+  events |= RUBY_EVENT_FIBER_SWITCH;
+#endif
 
     // Allocates the trace context used for this trace
     trace_context = rb_rg_trace_context_alloc(tracer, thread);
@@ -2641,10 +4365,15 @@ static VALUE rb_rg_tracer_start_trace(VALUE obj)
 
     // XXX ruby c api does not expose the ThreadGroup api so have to go through Ruby land, unfortunately.
     // Add trace main (invoking) thread to a thread group so we could identify spawned child threads.
+    trace_context->parent_thgroup = current_thread->thgroup;
     trace_context->thgroup = rb_obj_alloc(rb_rg_cThGroup);
     rb_rg_thread_group_add(trace_context->thgroup, current_thread);
     // Insert into the trace contexts table, keyed by thread group
     st_insert(tracer->tracecontexts, (st_data_t)trace_context->thgroup, (st_data_t)trace_context);
+#ifdef RUBY_EVENT_FIBER_SWITCH
+    // The thread is in the trace's group only while running this fiber, or fibers first resumed within the trace
+    rb_rg_trace_context_add_fiber(tracer, trace_context, rb_fiber_current());
+#endif
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_INFO && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
       printf("[Raygun APM] THREAD GROUP allocated for context %p thread: %ld thgroup: %ld\n", (void *)trace_context, thread, trace_context->thgroup);
@@ -2659,7 +4388,9 @@ static VALUE rb_rg_tracer_start_trace(VALUE obj)
 
     // Start a tracepoint specifically for this trace context. Doing so ONLY during actual trace execution removes excess idle / discarded anyways
     // overhead from running tracepoints in contexts we don't care about anyways.
-    trace_context->tracepoint = rb_tracepoint_new(Qnil, events, rb_rg_tracing_hook_i, (void *)trace_context);
+    // A pooled trace context brings it's own - the hook data pointer is the trace context itself and thus still valid
+    if (NIL_P(trace_context->tracepoint))
+      trace_context->tracepoint = rb_tracepoint_new(Qnil, events, rb_rg_tracing_hook_i, (void *)trace_context);
     // Immediately enable the tracepoint as well
     rb_tracepoint_enable(trace_context->tracepoint);
 #ifdef RB_RG_DEBUG
@@ -2684,15 +4415,22 @@ static VALUE rb_rg_tracer_end_trace(VALUE obj)
     {
       // Emit the END_TRANSACTION command via the encoder
       rb_rg_end_transaction(tracer, trace_context->rg_thread->tid);
+      // Bound how long the END_TRANSACTION command may sit in a partial batch
+      rb_rg_linger_batched_sink(tracer, trace_context->rg_thread->tid);
       // XXX delete before free on purpose to avoid races on st_lookup
       st_delete(tracer->tracecontexts, (st_data_t *)&thgroup, NULL);
+      // Back to the group the thread was in before the trace, where another fiber's trace may have been started from as well
+      rb_rg_thread_group_add(trace_context->parent_thgroup, current_thread);
+      // A private shadow thread is not used again, seal what's left in it's lane
+      if (trace_context->private_rg_thread && (tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP))
+        rb_rg_retire_sink_lane(&tracer->sink_data, trace_context->rg_thread->tid);
 #ifdef RB_RG_DEBUG
     if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_INFO && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
       printf("[Raygun APM] Trace ENDED for context %p\n", (void *)trace_context);
     }
 #endif
-      // Frees the trace context
-      rb_rg_trace_context_free(trace_context);
+      // Disables the tracepoint and returns the trace context to the pool
+      rb_rg_trace_context_release(tracer, trace_context);
       return Qtrue;
     } else
 #ifdef RB_RG_DEBUG
@@ -2712,6 +4450,96 @@ static VALUE rb_rg_tracer_now(VALUE obj)
   return LL2NUM(tracer->context->timestamper());
 }
 
+// Looks up the string dictionary ID of a repeated extended event string, assigning the next ID and emitting it's definition to the Agent on first
+// use. With the UDP sink, definitions older than RB_RG_UDP_STRING_REDEFINE_INTERVAL are emitted again ahead of the event at the given timestamp, as
+// a lost datagram would otherwise leave the string undefined until the next methodinfo sync. Returns 0 for strings sent inline instead - those
+// larger than RG_MAX_INTERNED_STRING_SIZE or any new string once the dictionary is full.
+//
+static rg_string_id_t rb_rg_intern_string(rb_rg_tracer_t *tracer, rg_tid_t tid, rg_timestamp_t timestamp, rg_byte_t encoding, const char *string, rg_length_t length)
+{
+  rb_rg_sink_data_t *sink_data = &tracer->sink_data;
+  unsigned char key[1 + RG_MAX_INTERNED_STRING_SIZE];
+  rg_encoded_string_t *value;
+  rg_string_id_t id;
+  void *data;
+  if (length < 0 || length > RG_MAX_INTERNED_STRING_SIZE) return 0;
+  // The same bytes in a different encoding are a different string
+  key[0] = encoding;
+  memcpy(key + 1, string, length);
+  data = raxFind(sink_data->strings, key, 1 + length);
+  if (LIKELY(data != raxNotFound)) {
+    id = (rg_string_id_t)(uintptr_t)data;
+    if (sink_data->type == RB_RG_TRACER_SINK_UDP && timestamp - sink_data->interned_defined[id - 1] >= RB_RG_UDP_STRING_REDEFINE_INTERVAL * TIMESTAMP_UNITS_PER_SECOND) {
+      sink_data->interned_defined[id - 1] = timestamp;
+      rg_string_definition(tracer->context, (void *)sink_data, tid, id, sink_data->interned[id - 1]);
+    }
+    return id;
+  }
+  if (UNLIKELY(sink_data->interned_count == RG_MAX_INTERNED_STRINGS)) return 0;
+  // Only allocate the used portion of the string buffer - rg_string_definition reads no further than the length
+  value = malloc(offsetof(rg_encoded_string_t, string) + length);
+  if (UNLIKELY(!value)) return 0;
+  value->encoding = encoding;
+  value->length = length;
+  memcpy(value->string, string, length);
+  if (UNLIKELY(!raxInsert(sink_data->strings, key, 1 + length, (void *)(uintptr_t)(sink_data->interned_count + 1), NULL))) {
+    free(value);
+    return 0;
+  }
+  sink_data->interned_defined[sink_data->interned_count] = timestamp;
+  sink_data->interned[sink_data->interned_count++] = value;
+#ifdef RB_RG_DEBUG
+    if (UNLIKELY(tracer->loglevel >= RB_RG_TRACER_LOG_VERBOSE && tracer->loglevel < RB_RG_TRACER_LOG_BLACKLIST)) {
+      printf("[Raygun APM] Interned string %u '%.*s'\n", sink_data->interned_count, (int)length, string);
+    }
+#endif
+  // Define the string ahead of the event that refers to it
+  rg_string_definition(tracer->context, (void *)sink_data, tid, sink_data->interned_count, value);
+  return sink_data->interned_count;
+}
+
+// The scheme and authority of an URL (https://example.com:8080 of https://example.com:8080/path?query) - the part repeated across outgoing requests
+static rg_length_t rb_rg_url_prefix_length(const rg_encoded_string_t *url)
+{
+  rg_length_t i;
+  for (i = 0; i + 2 < url->length; i++) {
+    if (url->string[i] == ':' && url->string[i + 1] == '/' && url->string[i + 2] == '/') break;
+  }
+  if (i + 2 >= url->length) return 0;
+  for (i += 3; i < url->length && url->string[i] != '/'; i++);
+  return i;
+}
+
+// Assigns string dictionary IDs to the provider, host and database of SQL and the URL prefix and verb of HTTP OUT extended events when the compact
+// v3 framing is in use, which allows the batched sink to refer to them by ID. The v2 encoding of the event is not affected.
+static void rb_rg_intern_event_strings(rb_rg_tracer_t *tracer, rg_event_t *event)
+{
+  int interning = tracer->sink_data.protocol_version == RG_PROTOCOL_VERSION_3 && (tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP);
+  switch ((rg_event_type_t)event->type) {
+  case RG_EVENT_SQL_INFORMATION:
+    if (!interning) {
+      event->data.sql.provider_id = event->data.sql.host_id = event->data.sql.database_id = 0;
+      return;
+    }
+    event->data.sql.provider_id = rb_rg_intern_string(tracer, event->tid, event->timestamp, event->data.sql.provider.encoding, event->data.sql.provider.string, event->data.sql.provider.length);
+    event->data.sql.host_id = rb_rg_intern_string(tracer, event->tid, event->timestamp, event->data.sql.host.encoding, event->data.sql.host.string, event->data.sql.host.length);
+    event->data.sql.database_id = rb_rg_intern_string(tracer, event->tid, event->timestamp, event->data.sql.database.encoding, event->data.sql.database.string, event->data.sql.database.length);
+    break;
+  case RG_EVENT_HTTP_OUTGOING_INFORMATION:
+    if (!interning) {
+      event->data.http_out.url_prefix_id = event->data.http_out.verb_id = 0;
+      event->data.http_out.url_prefix_length = 0;
+      return;
+    }
+    event->data.http_out.url_prefix_length = rb_rg_url_prefix_length(&event->data.http_out.url);
+    event->data.http_out.url_prefix_id = rb_rg_intern_string(tracer, event->tid, event->timestamp, event->data.http_out.url.encoding, event->data.http_out.url.string, event->data.http_out.url_prefix_length);
+    event->data.http_out.verb_id = rb_rg_intern_string(tracer, event->tid, event->timestamp, event->data.http_out.verb.encoding, event->data.http_out.verb.string, event->data.http_out.verb.length);
+    break;
+  default:
+    break;
+  }
+}
+
 // Emits a given extended event constructed in Ruby land via the encoder sink interface
 static VALUE rb_rg_tracer_emit(VALUE obj, VALUE evt)
 {
@@ -2723,6 +4551,8 @@ static VALUE rb_rg_tracer_emit(VALUE obj, VALUE evt)
   // Expect a Raygun::Apm::Event instance
   if (!rb_obj_is_kind_of(evt, rb_cRaygunEvent)) rb_raise(rb_eRaygunFatal, "Invalid extended event - cannot decode");
   rb_rg_get_event(evt);
+  // Any string definitions are emitted before the event is copied to the encoder scratch buffer they're encoded to
+  rb_rg_intern_event_strings(tracer, event);
   encoded = rb_rg_event_encoded(evt);
   memcpy(tracer->context->buf, RSTRING_PTR(encoded), RSTRING_LEN(encoded));
   tracer->context->sink(tracer->context, (void *)&tracer->sink_data, event, (const rg_length_t)RSTRING_LEN(encoded));
@@ -2740,7 +4570,7 @@ static int rb_rg_methodinfo_table_dump_i(st_data_t key, st_data_t val, st_data_t
 {
   rg_method_t *rg_method = (rg_method_t *)val;
   if ((int)val != RG_BLACKLIST_BLACKLISTED) {
-    printf("[WL] %p %s -> %u\n", (void *)key, rg_method->name, rg_method->function_id);
+    printf("[WL] %p %s#%s -> %u\n", (void *)key, rg_method->class_name, rg_method->method_name, rg_method->function_id);
   }
   return ST_CONTINUE;
 }
@@ -2771,13 +4601,24 @@ static VALUE rb_rg_tracer_diagnostics(VALUE obj)
   rg_thread_t *th = rb_rg_thread(tracer, thread);
   printf("#### APM Tracer PID %d obj: %p size: %lu bytes\n", tracer->context->pid, (void *)obj, (unsigned long)rb_rg_tracer_size(tracer));
   printf("Methods: %d threads: %d nooped: %d\n", tracer->methods, tracer->threads, tracer->noop);
-  printf("[Pointers] encoder context: %p threadsinfo: %p methodinfo: %p sink_data: %p batch: %p bipbuf: %p\n", (void *)tracer->context, (void *)tracer->threadsinfo, (void *)tracer->methodinfo, (void *)&tracer->sink_data, (void *)&tracer->sink_data.batch, (void *)tracer->sink_data.ringbuf.bipbuf);
+  printf("[Pointers] encoder context: %p threadsinfo: %p methodinfo: %p sink_data: %p lanes: %p\n", (void *)tracer->context, (void *)tracer->threadsinfo, (void *)tracer->methodinfo, (void *)&tracer->sink_data, (void *)tracer->sink_data.lanes);
   printf("[Execution context] Raygun thread: %d Ruby current thread: %p thread group: %p\n", th->tid, (void *)thread, (void *)rb_rg_thread_group(GET_THREAD()));
   printf("[Ruby threads] timer thread: %p sink thread: %p\n", (void *)tracer->timer_thread, (void *)tracer->sink_thread);
+  printf("[Threads] observed: %u live: %lu pooled: %d reclaimed: %lu\n", tracer->threads, (unsigned long)tracer->threadsinfo->num_entries, tracer->pooled_threads, (unsigned long)tracer->threads_reclaimed);
+  printf("[Trace contexts] pooled: %d reused: %lu\n", tracer->pooled_trace_contexts, (unsigned long)tracer->trace_contexts_reused);
+  printf("[Fibers] switches: %lu stacks saved: %lu pooled stacks: %d\n", (unsigned long)tracer->fiber_switches, (unsigned long)tracer->fiber_stacks_saved, tracer->pooled_fiber_stacks);
+  printf("[Methodinfo] entries: %lu capacity: %lu generation: %u evictions: %lu evicted: %lu\n", (unsigned long)tracer->methodinfo->num_entries, (unsigned long)tracer->methodinfo_capacity, tracer->methodinfo_generation, (unsigned long)tracer->methodinfo_evictions, (unsigned long)tracer->methodinfo_evicted);
+  printf("[Method storage] slab: %lu bytes (%lu methods) arena: %lu bytes (%lu used, %lu released) class names: %lu\n", (unsigned long)rg_slab_size(&tracer->method_slab), (unsigned long)tracer->method_slab.used, (unsigned long)rg_arena_size(&tracer->method_arena), (unsigned long)tracer->method_arena.used, (unsigned long)tracer->method_arena.released, (unsigned long)tracer->method_class_names->num_entries);
+  printf("[Method storage] inherited: %lu methods, slab: %lu bytes arena: %lu bytes\n", (unsigned long)tracer->methods_inherited, (unsigned long)rg_slab_size(&tracer->inherited_method_slab), (unsigned long)rg_arena_size(&tracer->inherited_method_arena));
   if (tracer->sink_data.type == RB_RG_TRACER_SINK_UDP || tracer->sink_data.type == RB_RG_TRACER_SINK_TCP) {
     printf("[Encoder] batched: %lu raw: %lu flushed: %lu resets: %lu batches: %lu\n", (unsigned long) tracer->sink_data.encoded_batched, (unsigned long) tracer->sink_data.encoded_raw, (unsigned long) tracer->sink_data.flushed, (unsigned long) tracer->sink_data.resets, (unsigned long)tracer->sink_data.batches);
-    printf("[Dispatch] batch count: %d sequence: %d batch pid: %d sink running: %d bytes sent: %lu failed sends: %lu jittered_sends: %lu\n", tracer->sink_data.batch.count, tracer->sink_data.batch.length, tracer->sink_data.batch.pid, tracer->sink_data.running, (unsigned long) tracer->sink_data.bytes_sent, (unsigned long) tracer->sink_data.failed_sends, (unsigned long) tracer->sink_data.jittered_sends);
-    printf("[Buffer] size: %d max used: %lu used: %d unused: %d\n", bipbuf_size(tracer->sink_data.ringbuf.bipbuf), (unsigned long) tracer->sink_data.max_buf_used, bipbuf_used(tracer->sink_data.ringbuf.bipbuf), bipbuf_unused(tracer->sink_data.ringbuf.bipbuf));
+    printf("[Dispatch] sequence: %u batch pid: %d sink running: %d bytes sent: %lu writes: %lu failed sends: %lu jittered_sends: %lu\n", tracer->sink_data.sequence, tracer->sink_data.process_lane.batch.pid, tracer->sink_data.running, (unsigned long) tracer->sink_data.bytes_sent, (unsigned long) tracer->sink_data.writes, (unsigned long) tracer->sink_data.failed_sends, (unsigned long) tracer->sink_data.jittered_sends);
+    printf("[Protocol] version: %d instance ids: %d interned strings: %u\n", tracer->sink_data.protocol_version, tracer->sink_data.instance_ids, tracer->sink_data.interned_count);
+    printf("[Batching] size: %d max: %d linger: %lu\n", tracer->sink_data.batch_size, tracer->sink_data.max_batch_size, (unsigned long)tracer->sink_data.linger);
+    printf("[Dispatcher] state: %d wakeups: %lu idle wakeups: %lu handoffs: %lu\n", tracer->sink_data.dispatcher_state, (unsigned long)tracer->sink_data.wakeups, (unsigned long)tracer->sink_data.idle_wakeups, (unsigned long)tracer->sink_data.handoffs);
+    printf("[Compression] enabled: %d in: %lu out: %lu\n", tracer->sink_data.compression, (unsigned long)tracer->sink_data.compressed_in, (unsigned long)tracer->sink_data.compressed_out);
+    printf("[Fragmentation] enabled: %d fragmented events: %lu\n", rb_rg_sink_fragments(&tracer->sink_data), (unsigned long)tracer->sink_data.fragmented);
+    printf("[Buffer] lane size: %d lanes: %u max used: %lu queued: %lu\n", RG_LANE_RINGBUF_SIZE, rb_rg_sink_lanes(&tracer->sink_data), (unsigned long) tracer->sink_data.max_buf_used, (unsigned long) tracer->sink_data.queued);
   }
   printf("#### Method table:\n");
   st_foreach(tracer->methodinfo, rb_rg_methodinfo_table_dump_i, 0);
@@ -2792,7 +4633,13 @@ static VALUE rb_rg_tracer_diagnostics(VALUE obj)
 static VALUE rb_rg_get_thread_id(VALUE obj, VALUE thread)
 {
   rg_thread_t *th = NULL;
+  rb_rg_thread_cache_t *thread_cache;
   rb_rg_get_tracer(obj);
+  // The current thread may be running the fiber of a trace with a private shadow thread
+  if (thread == rb_thread_current()) {
+    thread_cache = rb_rg_current_thread_cache(tracer, GET_THREAD());
+    if (thread_cache->trace_context && thread_cache->trace_context->thread == thread) return ULONG2NUM(thread_cache->trace_context->rg_thread->tid);
+  }
   th = rb_rg_thread(tracer, thread);
   return ULONG2NUM(th->tid);
 }
@@ -2818,11 +4665,85 @@ static VALUE rb_rg_tracer_memory_address(VALUE tracer, VALUE obj)
   return ULL2NUM(obj);
 }
 
+// The thread cache of the native thread the code runs on and the epoch all thread caches are validated against. Tracers of different Ractors run in
+// parallel, thus the epoch is bumped and read atomically.
+static RB_RG_THREAD_LOCAL rb_rg_thread_cache_t rb_rg_thread_cache;
+static unsigned long rb_rg_thread_cache_epoch = 1;
+
+void rb_rg_invalidate_thread_caches(void)
+{
+  __atomic_add_fetch(&rb_rg_thread_cache_epoch, 1, __ATOMIC_RELEASE);
+}
+
+rb_rg_thread_cache_t *rb_rg_current_thread_cache(rb_rg_tracer_t *tracer, rb_thread_t *th)
+{
+  rb_rg_thread_cache_t *cache = &rb_rg_thread_cache;
+  VALUE thgroup = rb_rg_thread_group(th);
+  unsigned long epoch = __atomic_load_n(&rb_rg_thread_cache_epoch, __ATOMIC_ACQUIRE);
+  // Happy path - same tracer, Ruby thread and thread group as last time, the trace didn't end and nothing went away since
+  if (LIKELY(cache->epoch == epoch && cache->tracer == tracer && cache->thread == th->self && cache->thgroup == thgroup &&
+    (!cache->trace_context || cache->generation == cache->trace_context->generation))) return cache;
+  cache->tracer = tracer;
+  cache->thread = th->self;
+  cache->thgroup = thgroup;
+  cache->epoch = epoch;
+  cache->trace_context = NULL;
+  cache->rg_thread = NULL;
+  // Threads in the default group are never part of a trace
+  if (thgroup != rb_rg_DefaultThreadGroup && st_lookup(tracer->tracecontexts, (st_data_t)thgroup, (st_data_t *)&cache->trace_context))
+    cache->generation = cache->trace_context->generation;
+  return cache;
+}
+
+// Allocates a frameless shadow thread with the next TID, reusing the shadow thread of a dead thread if any. The thread lock must be held.
+static rg_thread_t *rb_rg_alloc_thread(rb_rg_tracer_t *tracer)
+{
+  rg_thread_t *th = tracer->free_threads;
+  tracer->threads++;
+  if (th) {
+    tracer->free_threads = th->next;
+    tracer->pooled_threads--;
+    MEMZERO(th, rg_thread_t, 1);
+  } else {
+    th = ZALLOC(rg_thread_t);
+  }
+  th->tid = tracer->threads;
+  th->shadow_top = RG_THREAD_FRAMELESS;
+  th->vm_top = RG_THREAD_FRAMELESS;
+  return th;
+}
+
+// The shadow thread for a trace started on the current thread. Traces are scoped to the fiber that started them, thus a thread can have several
+// in progress, eg. a request per fiber on an async reactor. The first one gets the thread's own shadow thread, any other one a private one with a
+// TID of it's own, parented to the thread's. Private shadow threads are returned to the pool on trace end.
+//
+rg_thread_t *rb_rg_trace_thread(rb_rg_tracer_t *tracer, VALUE thread, rg_byte_t *private_rg_thread)
+{
+  rg_thread_t *th = rb_rg_thread(tracer, thread);
+  rg_thread_t *traced = th;
+  *private_rg_thread = false;
+  st_foreach(tracer->tracecontexts, rb_rg_trace_context_thread_i, (st_data_t)&traced);
+  if (LIKELY(traced != NULL)) return th;
+  rb_nativethread_lock_lock(&tracer->thread_lock);
+  traced = rb_rg_alloc_thread(tracer);
+  rb_nativethread_lock_unlock(&tracer->thread_lock);
+  traced->parent_tid = th->tid;
+#ifdef RUBY_EVENT_FIBER_SWITCH
+  traced->fiber = (uintptr_t)rb_fiber_current();
+#endif
+  *private_rg_thread = true;
+  return traced;
+}
+
 // The main interface for mapping Ruby Threads to shadow threads
 rg_thread_t *rb_rg_thread(rb_rg_tracer_t *tracer, VALUE thread)
 {
   rg_thread_t *th = NULL;
+  rb_rg_thread_cache_t *cache = &rb_rg_thread_cache;
   RB_GC_GUARD(thread);
+  // Happiest path - the current thread, already resolved through the thread cache
+  if (LIKELY(cache->thread == thread && cache->tracer == tracer && cache->rg_thread && cache->epoch == __atomic_load_n(&rb_rg_thread_cache_epoch, __ATOMIC_ACQUIRE)))
+    return cache->rg_thread;
   // Happy path - we're aware of this thread already
   if (st_lookup(tracer->threadsinfo, (st_data_t)thread, (st_data_t *)&th))
   {
@@ -2833,9 +4754,7 @@ rg_thread_t *rb_rg_thread(rb_rg_tracer_t *tracer, VALUE thread)
     // Register unknown/new threads lazily as we observe them
     rb_nativethread_lock_lock(&tracer->thread_lock);
 
-    tracer->threads++;
-    th = ZALLOC(rg_thread_t);
-    th->tid = tracer->threads;
+    th = rb_rg_alloc_thread(tracer);
 /*
   I'm wondering about the scenario where the profiler observers a spurious thread for the first time in a trace, one that likely
   started on framework or application boot and wakes up at X intervals doing X work. We did not explicitly see it coming to life
@@ -2849,8 +4768,10 @@ rg_thread_t *rb_rg_thread(rb_rg_tracer_t *tracer, VALUE thread)
   How would the parent of this thread be "computed" with the .NET profiler?
 */
     th->parent_tid = RG_THREAD_ORPHANED;
-    th->shadow_top = RG_THREAD_FRAMELESS;
-    th->vm_top = RG_THREAD_FRAMELESS;
+#ifdef RUBY_EVENT_FIBER_SWITCH
+    // The shadow stack belongs to the fiber the thread is observed on - without one, the first fiber switch would drop it
+    if (thread == rb_thread_current()) th->fiber = (uintptr_t)rb_fiber_current();
+#endif
     st_insert(tracer->threadsinfo, (st_data_t)thread, (st_data_t)th);
     rb_nativethread_lock_unlock(&tracer->thread_lock);
     return th;
@@ -2871,6 +4792,8 @@ void _init_raygun_tracer()
 #endif
   rb_rg_id_invalid = rb_intern("invalid");
   rb_rg_id_replace = rb_intern("replace");
+  rb_rg_id_instance_method = rb_intern("instance_method");
+  rb_rg_id_source_location = rb_intern("source_location");
   rb_rg_id_config = rb_intern("config");
   rb_rg_id_loglevel = rb_intern("loglevel");
   rb_rg_id_th_group = rb_intern("ThreadGroup");
@@ -2890,6 +4813,7 @@ void _init_raygun_tracer()
   rb_rg_cThGroup = rb_const_get(rb_cObject, rb_rg_id_th_group);
   rb_rg_cTcpSocket = rb_const_get(rb_cObject, rb_rg_id_tcp_socket);
   rb_rg_DefaultThreadGroup = rb_const_get(rb_rg_cThGroup, rb_rg_id_default);
+  rb_rg_thread_data_type = RTYPEDDATA_TYPE(rb_thread_current());
 
   // Defines the tracer instance which everything else attaches to
   rb_cRaygunTracer = rb_define_class_under(rb_mRaygunApm, "Tracer", rb_cObject);
@@ -2920,8 +4844,16 @@ void _init_raygun_tracer()
   rg_tracer_const("METHOD_SOURCE_JIT_COMPILATION", RG_METHOD_SOURCE_JIT_COMPILATION);
   rg_tracer_const("METHOD_SOURCE_GARBAGE_COLLECTION", RG_METHOD_SOURCE_GARBAGE_COLLECTION);
 
+  // Default methodinfo table capacity
+  rg_tracer_const("METHODINFO_CAPACITY", RB_RG_METHODINFO_CAPACITY);
+
   // For network transports
   rg_tracer_const("BATCH_PACKET_SIZE", RG_BATCH_PACKET_SIZE);
+  rg_tracer_const("MIN_BATCH_PACKET_SIZE", RG_MIN_BATCH_PACKET_SIZE);
+  rg_tracer_const("MAX_BATCH_PACKET_SIZE", RG_MAX_BATCH_PACKET_SIZE);
+  rg_tracer_const("MAX_STREAM_BATCH_PACKET_SIZE", RG_MAX_STREAM_BATCH_PACKET_SIZE);
+  rg_tracer_const("PROTOCOL_VERSION_2", RG_PROTOCOL_VERSION_2);
+  rg_tracer_const("PROTOCOL_VERSION_3", RG_PROTOCOL_VERSION_3);
 
   // Sinks
   rg_tracer_const("SINK_NONE", RB_RG_TRACER_SINK_NONE);
@@ -2949,6 +4881,15 @@ void _init_raygun_tracer()
   rb_define_const(rb_cRaygunTracer, "FEATURE_TRACE_BLOCKS", Qfalse);
 #endif
 
+#ifdef RUBY_EVENT_FIBER_SWITCH
+  rb_define_const(rb_cRaygunTracer, "FEATURE_FIBER_STACKS", Qtrue);
+#else
+  rb_define_const(rb_cRaygunTracer, "FEATURE_FIBER_STACKS", Qfalse);
+#endif
+
+  // Digest of the default blacklist the embedded snapshot was compiled from, nil if built without one
+  rb_define_const(rb_cRaygunTracer, "BLACKLIST_SNAPSHOT_DIGEST", rg_blacklist_snapshot_digest ? rb_obj_freeze(rb_str_new_cstr(rg_blacklist_snapshot_digest)) : Qnil);
+
   // Hook up the custom allocator the Raygun::Apm::Tracer class
   rb_define_alloc_func(rb_cRaygunTracer, rb_rg_tracer_alloc);
 
@@ -2958,6 +4899,36 @@ void _init_raygun_tracer()
   rb_define_method(rb_cRaygunTracer, "environment=", rb_rg_tracer_environment_equals, 1);
   rb_define_method(rb_cRaygunTracer, "api_key=", rb_rg_tracer_api_key_equals, 1);
   rb_define_method(rb_cRaygunTracer, "debug_blacklist=", rb_rg_tracer_debug_blacklist_equals, 1);
+  rb_define_method(rb_cRaygunTracer, "compiled_blacklist=", rb_rg_tracer_compiled_blacklist_equals, 1);
+  rb_define_method(rb_cRaygunTracer, "compiled_blacklist?", rb_rg_tracer_compiled_blacklist_p, 0);
+  rb_define_method(rb_cRaygunTracer, "deferred_discovery=", rb_rg_tracer_deferred_discovery_equals, 1);
+  rb_define_method(rb_cRaygunTracer, "deferred_discovery?", rb_rg_tracer_deferred_discovery_p, 0);
+  rb_define_method(rb_cRaygunTracer, "resolve_pending_methods", rb_rg_tracer_resolve_pending_methods, 0);
+  rb_define_method(rb_cRaygunTracer, "methodinfo_capacity=", rb_rg_tracer_methodinfo_capacity_equals, 1);
+  rb_define_method(rb_cRaygunTracer, "methodinfo_capacity", rb_rg_tracer_methodinfo_capacity, 0);
+  rb_define_method(rb_cRaygunTracer, "methodinfo_size", rb_rg_tracer_methodinfo_size, 0);
+  rb_define_method(rb_cRaygunTracer, "methodinfo_evictions", rb_rg_tracer_methodinfo_evictions, 0);
+  rb_define_method(rb_cRaygunTracer, "methodinfo_evicted", rb_rg_tracer_methodinfo_evicted, 0);
+  rb_define_method(rb_cRaygunTracer, "evict_methodinfo", rb_rg_tracer_evict_methodinfo, 0);
+  rb_define_method(rb_cRaygunTracer, "reclaim_dead_threads", rb_rg_tracer_reclaim_dead_threads, 0);
+  rb_define_method(rb_cRaygunTracer, "inherited_methods_digest", rb_rg_tracer_inherited_methods_digest, 0);
+  rb_define_method(rb_cRaygunTracer, "load_method_cache", rb_rg_tracer_load_method_cache, 1);
+  rb_define_private_method(rb_cRaygunTracer, "warmup_method", rb_rg_tracer_warmup_method, 2);
+  rb_define_private_method(rb_cRaygunTracer, "reset_after_fork", rb_rg_tracer_reset_after_fork, 0);
+  rb_define_method(rb_cRaygunTracer, "method_cache_snapshot", rb_rg_tracer_method_cache_snapshot, 0);
+  rb_define_method(rb_cRaygunTracer, "protocol_version=", rb_rg_tracer_protocol_version_equals, 1);
+  rb_define_method(rb_cRaygunTracer, "protocol_version", rb_rg_tracer_protocol_version, 0);
+  rb_define_method(rb_cRaygunTracer, "instance_ids=", rb_rg_tracer_instance_ids_equals, 1);
+  rb_define_method(rb_cRaygunTracer, "compression=", rb_rg_tracer_compression_equals, 1);
+  rb_define_method(rb_cRaygunTracer, "compression", rb_rg_tracer_compression, 0);
+  rb_define_method(rb_cRaygunTracer, "compression_ratio", rb_rg_tracer_compression_ratio, 0);
+  rb_define_method(rb_cRaygunTracer, "writes", rb_rg_tracer_writes, 0);
+  rb_define_method(rb_cRaygunTracer, "handoffs", rb_rg_tracer_handoffs, 0);
+  rb_define_singleton_method(rb_cRaygunTracer, "compress_batch", rb_rg_tracer_compress_batch, 1);
+  rb_define_method(rb_cRaygunTracer, "batch_size=", rb_rg_tracer_batch_size_equals, 1);
+  rb_define_method(rb_cRaygunTracer, "batch_size", rb_rg_tracer_batch_size, 0);
+  rb_define_method(rb_cRaygunTracer, "batch_linger=", rb_rg_tracer_batch_linger_equals, 1);
+  rb_define_method(rb_cRaygunTracer, "batch_linger", rb_rg_tracer_batch_linger, 0);
   rb_define_method(rb_cRaygunTracer, "process_ended", rb_rg_tracer_process_ended, 0);
   rb_define_method(rb_cRaygunTracer, "start_trace", rb_rg_tracer_start_trace, 0);
   rb_define_method(rb_cRaygunTracer, "end_trace", rb_rg_tracer_end_trace, 0);
@@ -2969,6 +4940,7 @@ void _init_raygun_tracer()
   rb_define_method(rb_cRaygunTracer, "add_blacklist", rb_rg_tracer_add_blacklist, 2);
   rb_define_method(rb_cRaygunTracer, "add_whitelist", rb_rg_tracer_add_whitelist, 2);
   rb_define_method(rb_cRaygunTracer, "show_filters", rb_rg_tracer_show_filters, 0);
+  rb_define_method(rb_cRaygunTracer, "load_blacklist", rb_rg_tracer_load_blacklist, -1);
   rb_define_method(rb_cRaygunTracer, "register_libraries", rb_rg_tracer_register_libraries, 1);
   rb_define_method(rb_cRaygunTracer, "blacklisted?", rb_rg_tracer_blacklisted_p, 3);
   rb_define_method(rb_cRaygunTracer, "whitelisted?", rb_rg_tracer_whitelisted_p, 3);
@@ -8,9 +8,18 @@
 #include "raygun_ringbuf.h"
 
 #include "rax.h"
+#include "raygun_blacklist.h"
+#include "raygun_method_cache.h"
 
 #define UNUSED(x) (__attribute__((x))
 
+// Storage class specifier for native thread local variables
+#ifdef _MSC_VER
+#define RB_RG_THREAD_LOCAL __declspec(thread)
+#else
+#define RB_RG_THREAD_LOCAL __thread
+#endif
+
 extern VALUE rb_mRaygunApm;
 extern VALUE rb_cRaygunTracer;
 
@@ -38,6 +47,26 @@ enum rb_rg_tracer_environment_t
 
 #define RB_RG_TRACER_BUILTIN_METHODS_TRANSLATED 5
 
+// Trace contexts (and their tracepoints) kept around for reuse by the next trace started
+#define RB_RG_TRACE_CONTEXT_POOL_SIZE 16
+// Shadow threads of dead threads kept around for reuse by the next thread observed
+#define RB_RG_THREAD_POOL_SIZE 64
+// Source paths with a cached library classification - the cache is reset once full, as eval'ed code can make for an unbounded amount of paths
+#define RB_RG_LIBRARY_PATHS_CACHE_SIZE 8192
+// Classes with cached class info - also reset once full, as code reloading in development replaces classes
+#define RB_RG_CLASS_INFO_CACHE_SIZE 8192
+// Methods pending classification by the timer thread with deferred discovery - beyond this, discovery falls back to classifying inline
+#define RB_RG_PENDING_METHODS_LIMIT 4096
+// Methodinfo table entries beyond which cold methods are evicted - metaprogramming (anonymous classes, define_method, singleton methods) can otherwise
+// grow the table for as long as the process runs
+#define RB_RG_METHODINFO_CAPACITY 65536
+// Whitelisted method entries per slab chunk and the chunk size of the arena for method names and pre-encoded methodinfo events
+#define RB_RG_METHOD_SLAB_CHUNK 512
+#define RB_RG_METHOD_ARENA_CHUNK_SIZE 65536
+
+// Seconds after which a string dictionary definition is repeated ahead of the next event referring to it, for the UDP sink
+#define RB_RG_UDP_STRING_REDEFINE_INTERVAL 1
+
 // Sink type used by the tracer
 
 enum rb_rg_tracer_sink_t
@@ -48,14 +77,47 @@ enum rb_rg_tracer_sink_t
   RB_RG_TRACER_SINK_TCP = 0x4
 };
 
+// Sink thread states producers inspect to decide whether the sink thread needs a wakeup
+
+enum rb_rg_dispatcher_state_t
+{
+  // Draining the ring buffer, no signal needed
+  RB_RG_DISPATCHER_BUSY = 0x0,
+  // Blocked on an empty ring buffer, woken up by the next sealed batch
+  RB_RG_DISPATCHER_IDLE = 0x1,
+  // Pacing dispatch (UDP jitter buffer), woken up once the ring buffer crosses the high watermark
+  RB_RG_DISPATCHER_PACING = 0x2
+};
+
 struct rb_rg_tracer_t;
 
+// A lane into the batched sink - every traced thread appends to a batch of it's own and queues it into it's own ring buffer once sealed,
+// which the sink thread drains. Process wide events (methodinfo, string definitions etc.) go through a dedicated lane that is always
+// sealed and dispatched ahead of thread lanes, thus definitions reach the Agent before the commands referencing them.
+
+typedef struct _rb_rg_sink_lane_t {
+    rg_tid_t tid;
+    rg_spsc_t *ring;
+    // The thread ended - the sink thread frees the lane once drained
+    bool retired;
+    // Set by the first END_TRANSACTION appended to the current batch
+    rg_timestamp_t linger_deadline;
+    rg_event_batch_t batch;
+} rb_rg_sink_lane_t;
+
 // Container that represents the profiler's chosen sink state
 
 typedef struct _rb_rg_sink_data_t {
     struct rb_rg_tracer_t *tracer;
     rg_byte_t type;
-    rg_ringbuf_t ringbuf;
+    // The process wide lane and the per thread lanes, indexed by TID and grown on demand. The sink thread merges lanes round robin from
+    // lane_cursor and tracks the bytes queued across all of them. Batch sequence numbers are assigned sink wide on seal.
+    rb_rg_sink_lane_t process_lane;
+    rb_rg_sink_lane_t **lanes;
+    rg_tid_t lanes_capacity;
+    rg_tid_t lane_cursor;
+    size_t queued;
+    rg_sequence_t sequence;
     bool running;
     // XXX this should probably be an union
     // The UDP socket used by the UDP sink
@@ -74,13 +136,72 @@ typedef struct _rb_rg_sink_data_t {
     size_t batches;
     size_t max_buf_used;
     size_t bytes_sent;
+    size_t writes;
+    // Event driven sink thread wakeups - the sink thread blocks when there's nothing to dispatch and producers signal it as per the states above.
+    // Wakeups by a producer signal and blocking waits that timed out with nothing to dispatch are tracked for diagnostics.
+    rg_byte_t dispatcher_state;
+    size_t wakeups;
+    size_t idle_wakeups;
+    // Trace delivery latency - a partial batch is sealed at most linger microseconds after a trace ended. Lane deadlines are armed by the first
+    // END_TRANSACTION of a batch and cleared once the batch is sealed. The earliest one is enforced by the timer thread, which producers wake up
+    // while it waits.
+    rg_timestamp_t linger;
+    rg_timestamp_t linger_deadline;
+    bool timer_waiting;
+    // GVL handoffs from producers to the sink thread and the batch sequence number as of the last one
+    size_t handoffs;
+    rg_sequence_t handoff_sequence;
     size_t failed_sends;
     size_t jittered_sends;
     // Max Kernel buffer we can rely on - set by calling option SO_RCVBUF on the UDP socket
     int receive_buffer_size;
-    rg_event_batch_t batch;
+    // Batches are dispatched once they reach batch_size bytes. Events too large for a batch of that size get a batch of their own up to
+    // max_batch_size (transport specific) and are sent as-is beyond that.
+    rg_length_t batch_size;
+    rg_length_t max_batch_size;
+    // Wire protocol version negotiated with the Agent - v2 unless the Agent reports support for the compact v3 batch framing
+    rg_byte_t protocol_version;
+    // v3 specific - whether compact BEGIN records carry the instance ID (always included with v2)
+    rg_byte_t instance_ids;
+    // v3 specific - string dictionary of this connection for repeated SQL and HTTP OUT strings. The radix tree maps the encoding byte and string
+    // to it's ID and the interned array (indexed by ID - 1) retains the definitions for re-sending on methodinfo sync and reconnect.
+    rax *strings;
+    rg_encoded_string_t *interned[RG_MAX_INTERNED_STRINGS];
+    // UDP specific - timestamp of the event a string was last defined ahead of. A dropped definition datagram leaves every event referring to
+    // the string undecodable until it's defined again, thus definitions are repeated at most every RB_RG_UDP_STRING_REDEFINE_INTERVAL seconds.
+    rg_timestamp_t interned_defined[RG_MAX_INTERNED_STRINGS];
+    rg_string_id_t interned_count;
+    // TCP specific - LZ4 compression of batches by the dispatcher thread, negotiated with the Agent. Bytes of batches before and after
+    // compression are tracked for the compression ratio.
+    rg_byte_t compression;
+    size_t compressed_in;
+    size_t compressed_out;
+    rg_byte_t compressed[RG_BATCH_COMPRESSED_HEADLEN + RG_LZ4_COMPRESS_BOUND(RG_MAX_STREAM_BATCH_PACKET_SIZE)];
+    // UDP specific (v3) - events that don't fit a batch are split into sequenced fragments of at most batch_size bytes instead of relying
+    // on IP fragmentation. Each fragmented event gets the next fragment group sequence number. The Agent reassembles one group at a time, thus
+    // the sink thread stays on the lane of a group it started dispatching (the fragment lane) until it's last fragment went out.
+    rg_sequence_t fragment_group;
+    rb_rg_sink_lane_t *fragment_lane;
+    size_t fragmented;
 } rb_rg_sink_data_t;
 
+// Class information resolved once per class on method discovery - the fully qualified path (after builtin translation) and it's wire encoded bytes.
+// Only classes with a permanent name are cached, as anonymous classes may still be assigned to a constant and singleton classes of instances come and go.
+typedef struct _rb_rg_class_info_t {
+  VALUE name;
+  rg_byte_t encoding;
+  rg_length_t encoded_length;
+  char *encoded;
+} rb_rg_class_info_t;
+
+// A method seen for the first time with deferred discovery enabled, queued for classification by the timer thread. The defined class and method name
+// Symbol are marked while pending, as classification needs them long after the tracepoint event.
+typedef struct _rb_rg_pending_method_t {
+  st_index_t method;
+  VALUE namespace;
+  VALUE method_name;
+} rb_rg_pending_method_t;
+
 // The primary Tracer struct
 
 typedef struct rb_rg_tracer_t {
@@ -106,14 +227,58 @@ typedef struct rb_rg_tracer_t {
   rax *blacklist_paths;
   // Container for the methods blacklist - matches eg. #baz
   rax *blacklist_methods;
+  // The fully qualified, paths and methods blacklists compiled into a single pass automaton - lazily (re)compiled on method discovery after rule changes
+  rg_blacklist_t *filters;
+  // Classify methods with the compiled automaton instead of the radix trees - defaults to true
+  rg_byte_t compiled_blacklist;
   // Container for the paths considered library code
   rax *libraries;
+  // The library paths compiled into a prefix index - lazily (re)compiled on method discovery after libraries are registered
+  rg_prefix_index_t *library_index;
+  // Source path (VALUE) => library classification cache. All methods of a source file share the same path String, which is marked to not be reclaimed
+  // (and it's address reused) while cached.
+  st_table *library_paths;
   // Symbol table for methodinfo - tracks entries for both whitelisted and blacklisted methods
   st_table *methodinfo;
+  // Soft bound of the methodinfo table, enforced by the timer thread evicting cold methods. The generation is bumped on every methodinfo sync with the
+  // Agent.
+  size_t methodinfo_capacity;
+  rg_unsigned_int_t methodinfo_generation;
+  // Whitelisted methods called in the current and the previous generation, as bitmaps indexed by function ID (of methodinfo_called_size bytes each).
+  // Kept off rg_method_t for the methods of a tracer inherited by a forked child to not be written to when called.
+  rg_byte_t *methodinfo_called;
+  rg_byte_t *methodinfo_called_previously;
+  size_t methodinfo_called_size;
+  // Telemetry specific - eviction passes over the methodinfo table and the amount of methods evicted
+  size_t methodinfo_evictions;
+  size_t methodinfo_evicted;
+  // Storage for whitelisted methods - entries from a slab, method names and pre-encoded methodinfo events from an arena. Class names are interned in
+  // the arena too, through the class names table (C string => C string). The arena is compacted once mostly released by evicted methods.
+  rg_slab_t method_slab;
+  rg_arena_t method_arena;
+  st_table *method_class_names;
+  // Methods with a function ID up to this one were inherited from the parent process, along with the slab and arena they live in. Neither is allocated
+  // from, evicted from or compacted by a forked child - their pages stay shared with the parent copy-on-write.
+  rg_function_id_t methods_inherited;
+  rg_slab_t inherited_method_slab;
+  rg_arena_t inherited_method_arena;
+  // Class (VALUE) => rb_rg_class_info_t cache for method discovery. Cached classes are marked to not be reclaimed (and their address reused) while cached.
+  st_table *classinfo;
+  // Classify newly seen methods on the timer thread instead of inline in the tracepoint hook - defaults to false
+  rg_byte_t deferred_discovery;
+  // Method ID => rb_rg_pending_method_t for methods queued for classification. Calls to pending methods are not traced.
+  st_table *pending_methods;
+  // Method classifications persisted by a previous process (mapped file) and the classifications made since, recorded while the cache is in use.
+  // Both are dropped once the blacklist or library paths change, as the cache is only valid for the ones it was built with.
+  rg_method_cache_t *method_cache;
+  rg_method_cache_log_t method_cache_log;
+  rg_byte_t method_cache_recording;
   // Symbol table for observed threads
   st_table *threadsinfo;
   // Symbol table for trace contexts - a trace context represents a unit of work being instrumented and is setup at the start of eg. a request and torn down at the end
   st_table *tracecontexts;
+  // Symbol table for the fibers of traces in progress - each fiber maps to the trace context it's part of, for traces to be scoped to fibers
+  st_table *fibertraces;
   // Mutex for when incrementing the function IDs observed
   rb_nativethread_lock_t method_lock;
   // Mutex for when incrementing the thread IDs observed
@@ -143,6 +308,21 @@ typedef struct rb_rg_tracer_t {
   st_table *builtin_translator;
   // Lookup table for method paths to be classified as synchronization method sources
   st_table *synchronization_methods;
+  // Pool of shadow stacks for suspended fibers, fiber switches observed and how many switches had a shadow stack to save
+  rg_fiber_stack_t *fiber_stacks;
+  int pooled_fiber_stacks;
+  size_t fiber_switches;
+  size_t fiber_stacks_saved;
+  // Pool of trace contexts of ended traces, with their tracepoints disabled, and how many traces reused a pooled trace context
+  rb_rg_trace_context_t *trace_contexts;
+  int pooled_trace_contexts;
+  size_t trace_contexts_reused;
+  // Pool of shadow threads of dead threads and how many shadow threads of threads that died outside of a trace were reclaimed by the GC sweep
+  rg_thread_t *free_threads;
+  int pooled_threads;
+  size_t threads_reclaimed;
+  // BEGIN_TRANSACTION pre-encoded on first use, rebuilt if the API key changes
+  rg_begin_transaction_template_t *begin_transaction;
 } rb_rg_tracer_t;
 
 // Garbage collector specific callbacks
@@ -152,10 +332,43 @@ size_t rb_rg_tracer_size(const void *ptr);
 
 // Optimized API to infer the Thread Group from a thread - skips a Ruby method call
 VALUE rb_rg_thread_group(rb_thread_t *th);
+VALUE rb_rg_thread_group_add(VALUE thgroup, rb_thread_t *th);
 
 // Lookup and coercion helper for Ruby Thread -> Shadow Thread
 rg_thread_t *rb_rg_thread(rb_rg_tracer_t *tracer, VALUE thread);
 
+// Returns the saved shadow stacks of a shadow thread's suspended fibers to the pool
+void rb_rg_release_fiber_stacks(rb_rg_tracer_t *tracer, rg_thread_t *th);
+
+// The shadow thread for a trace started on the current thread - private to the trace if a trace of another fiber has the thread's own
+rg_thread_t *rb_rg_trace_thread(rb_rg_tracer_t *tracer, VALUE thread, rg_byte_t *private_rg_thread);
+
+// Returns a shadow thread no longer needed to the pool
+void rb_rg_free_thread(rb_rg_tracer_t *tracer, rg_thread_t *th);
+
+// A per native thread cache of the trace context and shadow thread of the Ruby thread last seen running on it, for a given tracer. Saves the
+// threadsinfo and tracecontexts table lookups for every event of threads other than a trace's main thread. Valid for as long as the Ruby thread
+// stays in the same thread group, the trace context's generation is the one cached and the epoch doesn't change. The generation is bumped when
+// the trace ends, the epoch only whenever trace contexts, shadow threads or tracers are freed.
+
+typedef struct _rb_rg_thread_cache_t {
+  const struct rb_rg_tracer_t *tracer;
+  VALUE thread;
+  VALUE thgroup;
+  unsigned long epoch;
+  // NULL if the thread's group is not traced
+  rb_rg_trace_context_t *trace_context;
+  unsigned long generation;
+  // Lazily resolved
+  rg_thread_t *rg_thread;
+} rb_rg_thread_cache_t;
+
+// Lookup helper for the thread cache of the current Ruby Thread - refreshed on a miss
+rb_rg_thread_cache_t *rb_rg_current_thread_cache(rb_rg_tracer_t *tracer, rb_thread_t *th);
+
+// Invalidates the thread caches of all native threads
+void rb_rg_invalidate_thread_caches(void);
+
 // Coerces a Ruby heap object to a tracer struct (Ruby object backed by the tracer struct)
 extern const rb_data_type_t rb_rg_tracer_type;
 #define rb_rg_get_tracer(obj) \
@@ -166,10 +379,10 @@ extern const rb_data_type_t rb_rg_tracer_type;
 // Lookup helper for the current Trace Context from the running Ruby Thread
 #define rb_rg_get_current_thread_trace_context() \
   rb_thread_t *current_thread = GET_THREAD(); \
-  rb_rg_trace_context_t *trace_context = NULL; \
+  rb_rg_thread_cache_t *thread_cache = rb_rg_current_thread_cache(tracer, current_thread); \
+  rb_rg_trace_context_t *trace_context = thread_cache->trace_context; \
   VALUE thread = current_thread->self; \
-  VALUE thgroup = rb_rg_thread_group(current_thread); \
-  st_lookup(tracer->tracecontexts, (st_data_t)thgroup, (st_data_t *)&trace_context); \
+  VALUE thgroup = thread_cache->thgroup; \
   RB_GC_GUARD(thread); \
   RB_GC_GUARD(thgroup); \
 
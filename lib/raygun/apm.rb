@@ -10,9 +10,12 @@ rescue LoadError
   require "raygun/raygun_ext"
 end
 
+require "raygun/apm/cache_folder"
 require "raygun/apm/config"
 require "raygun/apm/diagnostics"
 require "raygun/apm/blacklist/parser"
 require "raygun/apm/blacklist/translator"
+require "raygun/apm/blacklist/snapshot"
+require "raygun/apm/method_cache"
 require "raygun/apm/tracer"
 require "raygun/apm/event"
@@ -468,8 +468,13 @@ module Raygun
         @@extended_blacklist ||= []
       end
 
+      # The defaults compiled into the blacklist snapshot embedded in the extension
+      def self.default_entries
+        DEFAULT_RUBY + PROFILER + INTERNALS + HTTP_OUT + QUERIES + RAYGUN4RUBY
+      end
+
       def self.resolve_entries
-        DEFAULT_RUBY + PROFILER + INTERNALS + HTTP_OUT + QUERIES + RAYGUN4RUBY + self.extended_blacklist.flatten
+        default_entries + self.extended_blacklist.flatten
       end
     end
   end
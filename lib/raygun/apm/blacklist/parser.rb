@@ -18,19 +18,29 @@ module Raygun
           show_filters
         end
 
-        private
-        def add_filter(filter)
+        # Translates a filter to a [:whitelist | :blacklist, [path, method]] rule, nil for comments and blank lines
+        def rule(filter)
           if filter =~ COMMENT && filter !~ ANONYMOUS
             return 
           end
           if filter.start_with?('+')
-            @tracer.add_whitelist *translate(filter[1..-1])
+            [:whitelist, translate(filter[1..-1])]
           elsif filter.start_with?('-')
-            @tracer.add_blacklist *translate(filter[1..-1])
+            [:blacklist, translate(filter[1..-1])]
           elsif filter.start_with?('L-')
-            @tracer.add_blacklist *translate(filter[2..-1])
+            [:blacklist, translate(filter[2..-1])]
           elsif filter.size > 0
-            @tracer.add_blacklist *translate(filter)
+            [:blacklist, translate(filter)]
+          end
+        end
+
+        private
+        def add_filter(filter)
+          kind, translated = rule(filter)
+          if kind == :whitelist
+            @tracer.add_whitelist *translated
+          elsif kind == :blacklist
+            @tracer.add_blacklist *translated
           end
         rescue => e
           puts "Failed to add line '#{filter}' to the blacklist (#{e}) #{e.backtrace.join("\n")}"
@@ -0,0 +1,113 @@
+require 'digest'
+require 'raygun/apm/version'
+require 'raygun/apm/cache_folder'
+require 'raygun/apm/blacklist'
+require 'raygun/apm/blacklist/parser'
+require 'raygun/apm/blacklist/translator'
+
+module Raygun
+  module Apm
+    module Blacklist
+      # Blacklist filters compiled to a binary snapshot of translated rules, which Tracer#load_blacklist bulk inserts in a single call. The default
+      # blacklist is compiled at build time and embedded in the extension, user override files are compiled once and cached on disk, keyed by a
+      # hash of their contents.
+      #
+      # Layout (little endian):
+      #
+      #   header: magic "RGBL", format version (1 byte), 3 reserved bytes, rule count (4 bytes)
+      #   rule:   RG_BLACKLIST_* value (1 byte), flags (1 byte), path length (2 bytes), method length (2 bytes), path, method
+      #
+      # The flags indicate if the rule has a path (0x1) and / or a method (0x2), mirroring Tracer#add_blacklist / Tracer#add_whitelist arguments.
+      module Snapshot
+        MAGIC = "RGBL"
+        FORMAT_VERSION = 1
+        # Mirrors RG_BLACKLIST_WHITELISTED and RG_BLACKLIST_BLACKLISTED
+        WHITELISTED = 1
+        BLACKLISTED = 2
+        HAS_PATH = 0x1
+        HAS_METHOD = 0x2
+        HEADER = "a4Cx3V"
+        RULE = "CCvv"
+        CACHE_PREFIX = "raygun-apm-blacklist"
+
+        class << self
+          # Compiles a list of filters in the blacklist file format to a snapshot
+          def compile(filters)
+            parser = Parser.new(nil)
+            rules = filters.map do |filter|
+              begin
+                kind, translated = parser.rule(filter.strip)
+              rescue => e
+                puts "Failed to add line '#{filter}' to the blacklist (#{e})"
+                next
+              end
+              # Comments, blank lines and filters the tracer would ignore
+              next if !kind || !translated || translated.compact.empty?
+              path, method = translated
+              flags = (path ? HAS_PATH : 0) | (method ? HAS_METHOD : 0)
+              path, method = path.to_s.b, method.to_s.b
+              [kind == :whitelist ? WHITELISTED : BLACKLISTED, flags, path.bytesize, method.bytesize].pack(RULE) << path << method
+            end.compact
+            [MAGIC, FORMAT_VERSION, rules.size].pack(HEADER) << rules.join
+          end
+
+          # Digest of the default blacklist, to detect if the snapshot embedded in the extension is stale (changed since the extension was built)
+          def default_digest
+            @default_digest ||= digest(Blacklist.default_entries.join("\n"))
+          end
+
+          # The default blacklist snapshot embedded in the extension can be used
+          def embedded?
+            Tracer::BLACKLIST_SNAPSHOT_DIGEST == default_digest
+          end
+
+          # Returns the compiled snapshot for a blacklist override file, from the on disk cache if the same contents was compiled before. Only snapshots
+          # written by this user are loaded (see CacheFolder), without a cache folder nothing is cached.
+          def cached(contents, dir = CacheFolder.default)
+            return compile(contents.lines) unless dir
+            path = File.join(dir, "#{CACHE_PREFIX}-#{digest(contents)}.bin")
+            return File.binread(path) if CacheFolder.trusted?(path)
+            snapshot = compile(contents.lines)
+            # Many workers may boot at once
+            CacheFolder.write(path, snapshot)
+            snapshot
+          rescue SystemCallError
+            # Read only or missing cache directory - just don't cache
+            snapshot || compile(contents.lines)
+          end
+
+          # Removes a cached snapshot, for example if it failed to load
+          def evict(contents, dir = CacheFolder.default)
+            File.delete(File.join(dir, "#{CACHE_PREFIX}-#{digest(contents)}.bin")) if dir
+          rescue SystemCallError
+          end
+
+          # Generates the C header embedding the default blacklist snapshot, used by extconf.rb
+          def c_header
+            snapshot = compile(Blacklist.default_entries)
+            bytes = snapshot.bytes.each_slice(16).map{|slice| "  " + slice.map{|b| "0x%02x" % b }.join(", ") }.join(",\n")
+            <<~HEADER
+              // Generated by extconf.rb from lib/raygun/apm/blacklist.rb - do not edit
+              #ifndef RAYGUN_BLACKLIST_SNAPSHOT_H
+              #define RAYGUN_BLACKLIST_SNAPSHOT_H
+
+              #define RG_BLACKLIST_SNAPSHOT_DIGEST "#{default_digest}"
+
+              static const rg_byte_t rg_blacklist_snapshot_data[] = {
+              #{bytes}
+              };
+
+              #endif
+            HEADER
+          end
+
+          private
+          # Keyed by the gem and snapshot format versions too, as the translation rules may change between releases
+          def digest(contents)
+            Digest::SHA256.hexdigest("#{Raygun::Apm::VERSION}:#{FORMAT_VERSION}:#{contents}")
+          end
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,54 @@
+require 'tmpdir'
+
+module Raygun
+  module Apm
+    # On disk caches (compiled blacklist overrides, method classifications) are loaded as trusted input, thus only files written by the user the
+    # process runs as are read back. The default folder is private to that user, instead of the world writable temporary directory itself.
+    module CacheFolder
+      PREFIX = "raygun-apm"
+
+      class << self
+        # A per user folder in the temporary directory, created on first use. Returns nil if it exists but can't be trusted - someone else owns it or
+        # may write to it.
+        def default
+          dir = File.join(Dir.tmpdir, "#{PREFIX}-#{Process.euid}")
+          begin
+            Dir.mkdir(dir, 0700)
+          rescue Errno::EEXIST
+          end
+          stat = File.lstat(dir)
+          stat.directory? && owned?(stat) ? dir : nil
+        rescue SystemCallError
+          nil
+        end
+
+        # Whether a cache file exists and was written by this user - a regular file, not a symlink
+        def trusted?(path)
+          stat = File.lstat(path)
+          stat.file? && owned?(stat)
+        rescue SystemCallError
+          false
+        end
+
+        # Writes to a unique temporary file and renames it in place, as many processes may write at once. The temporary file is created exclusively, thus
+        # never follows a planted symlink.
+        def write(path, data)
+          tmp = "#{path}.#{Process.pid}.tmp"
+          File.open(tmp, File::WRONLY | File::CREAT | File::EXCL | File::BINARY, 0600) {|file| file.write(data) }
+          File.rename(tmp, path)
+        rescue SystemCallError
+          File.delete(tmp) if tmp && File.exist?(tmp) rescue nil
+          raise
+        end
+
+        private
+        # Owned by the effective user and not writable by the group or others. Ownership is not tracked the same way on Windows, where only the file
+        # type is checked.
+        def owned?(stat)
+          return true if Gem.win_platform?
+          stat.uid == Process.euid && (stat.mode & 0022) == 0
+        end
+      end
+    end
+  end
+end
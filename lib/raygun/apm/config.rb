@@ -1,3 +1,5 @@
+require 'raygun/apm/cache_folder'
+
 module Raygun
   module Apm
     class Config
@@ -45,7 +47,8 @@ module Raygun
               self.class.cast_to_boolean(x)
             end
           else
-            opts[:default]
+            # Defaults are given as they'd be set in the environment - 'False' is truthy otherwise
+            opts[:as] == :boolean ? self.class.cast_to_boolean(opts[:default]) : opts[:default]
           end
           blk ? blk.call(val) : val
         end
@@ -70,9 +73,24 @@ module Raygun
       config_var 'PROTON_UDP_PORT', as: Integer, default: UDP_SINK_PORT
       config_var 'PROTON_TCP_HOST', as: String, default: TCP_SINK_HOST
       config_var 'PROTON_TCP_PORT', as: Integer, default: TCP_SINK_PORT
+      config_var 'PROTON_TCP_BATCH_SIZE', as: Integer, default: Tracer::MAX_STREAM_BATCH_PACKET_SIZE
+      config_var 'PROTON_COMPACT_PROTOCOL', as: :boolean, default: 'True'
+      config_var 'PROTON_TCP_COMPRESSION', as: :boolean, default: 'True'
       ## Conditional hooks
       config_var 'PROTON_HOOK_REDIS', as: :boolean, default: 'True'
       config_var 'PROTON_HOOK_INTERNALS', as: :boolean, default: 'True'
+      ## Compiled blacklist override files are cached in - a folder private to the user in the temporary directory by default
+      config_var('PROTON_BLACKLIST_CACHE_FOLDER', as: String) {|folder| folder || CacheFolder.default }
+      ## Classify methods seen for the first time on the timer thread instead of the request thread
+      config_var 'PROTON_DEFERRED_DISCOVERY', as: :boolean, default: 'False'
+      ## Persist method classifications across restarts, keyed by the app revision (the REVISION file in the working directory if not set)
+      config_var 'PROTON_METHOD_CACHE', as: :boolean, default: 'False'
+      config_var('PROTON_METHOD_CACHE_FOLDER', as: String) {|folder| folder || CacheFolder.default }
+      config_var 'PROTON_APP_REVISION', as: String
+      ## Methods beyond which cold (not recently called) methods are evicted from the method table
+      config_var 'PROTON_METHODINFO_CAPACITY', as: Integer, default: Tracer::METHODINFO_CAPACITY
+      ## Workers forked from a preloaded app (Puma, Unicorn) inherit the tracer of the parent
+      config_var 'PROTON_FORK_AWARE', as: :boolean, default: 'False'
 
       def proton_udp_host
         if proton_use_multicast == 'True'
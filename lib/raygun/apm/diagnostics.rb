@@ -29,6 +29,7 @@ module Raygun
           elsif response['Status'] == 0
             puts AGENT_STATE_UP_MISCONFIGURED
           end
+          negotiate_protocol(tracer, response)
         end
       rescue Errno::ECONNREFUSED
         puts AGENT_STATE_DOWN
@@ -37,6 +38,18 @@ module Raygun
       end
 
       private
+      # Agents that understand the compact batch framing report the highest wire protocol version they support, and if they can inflate compressed
+      # batches on the TCP transport
+      def negotiate_protocol(tracer, response)
+        if tracer.config.proton_compact_protocol && response['ProtocolVersion'].to_i >= Tracer::PROTOCOL_VERSION_3
+          tracer.protocol_version = Tracer::PROTOCOL_VERSION_3
+          tracer.instance_ids = !!response['InstanceIds']
+        end
+        if tracer.config.proton_tcp_compression && tracer.config.proton_network_mode == "Tcp" && response['Compression']
+          tracer.compression = true
+        end
+      end
+
       def socket
         @socket ||= s = TCPSocket.new(@host, @port)
       end
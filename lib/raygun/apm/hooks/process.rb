@@ -0,0 +1,17 @@
+module Raygun
+  module Apm
+    module Hooks
+      # Sets up the inherited tracer right after fork in the child, instead of on it's first lookup - wrappers holding on to the tracer of the parent
+      # keep using it. Process._fork is only available with Ruby 3.1 and later.
+      module Process
+        def _fork
+          pid = super
+          Raygun::Apm::Tracer.instance if pid == 0
+          pid
+        end
+      end
+    end
+  end
+end
+
+Raygun::Apm::Tracer.patch(::Process.singleton_class, Raygun::Apm::Hooks::Process) if ::Process.respond_to?(:_fork)
@@ -0,0 +1,51 @@
+require 'digest'
+require 'raygun/apm/version'
+require 'raygun/apm/cache_folder'
+require 'raygun/apm/blacklist/snapshot'
+
+module Raygun
+  module Apm
+    # Method classifications persisted across restarts, so workers booted after a deploy don't rediscover and classify the same methods all over again
+    # - see ext/raygun/raygun_method_cache.h for the layout. A cache file is only valid for the app revision, blacklist and library paths it was built
+    # with, which it's file name is keyed by. Tracers map it on boot and write it back merged with the methods they classified since on exit.
+    module MethodCache
+      FORMAT_VERSION = 2
+      CACHE_PREFIX = "raygun-apm-methods"
+
+      class << self
+        # Deploy revision of the app - explicitly configured, or from the REVISION file Capistrano and similar tools leave in the release directory
+        def revision(config, dir = Dir.pwd)
+          return config.proton_app_revision unless config.proton_app_revision.to_s.empty?
+          file = File.join(dir, "REVISION")
+          File.read(file).strip if File.file?(file)
+        end
+
+        def path(dir, revision, blacklist, libraries, environment)
+          File.join(dir, "#{CACHE_PREFIX}-#{digest(revision, blacklist, libraries, environment)}.bin")
+        end
+
+        # Loads the cache into the tracer, if written by this user (see CacheFolder)
+        def load(tracer, path)
+          CacheFolder.trusted?(path) && tracer.load_method_cache(path)
+        end
+
+        # Writes the tracer's classifications merged with the loaded cache, unless nothing was classified since. Renamed in place, as many workers may
+        # exit at once - processes that mapped the previous file keep reading it.
+        def persist(tracer, path)
+          snapshot = tracer.method_cache_snapshot
+          return false unless snapshot
+          CacheFolder.write(path, snapshot)
+          true
+        rescue SystemCallError
+          # Read only or missing cache directory - just don't cache
+          false
+        end
+
+        private
+        def digest(revision, blacklist, libraries, environment)
+          Digest::SHA256.hexdigest([Raygun::Apm::VERSION, FORMAT_VERSION, revision, Blacklist::Snapshot.default_digest, blacklist.join, libraries.join("\n"), environment].join(":"))
+        end
+      end
+    end
+  end
+end
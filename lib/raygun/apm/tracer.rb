@@ -5,6 +5,7 @@ module Raygun
   module Apm
     class Tracer
       @__mutex = Mutex.new
+      MAIN_RACTOR = Ractor.current if defined?(Ractor)
 
       @__pids ||= {}
       class << self
@@ -12,14 +13,33 @@ module Raygun
           @__mutex.synchronize { block.call }
         end
 
+        # Tracers are not shareable between Ractors - non-main Ractors keep their own in Ractor local storage
         def instance
-          @__pids[Process.pid]
+          return Ractor.current[:raygun_apm_tracer] if ractor?
+          @__pids[Process.pid] || inherit
         end
 
         def instance=(tracer)
+          return Ractor.current[:raygun_apm_tracer] = tracer if ractor?
           @__pids[Process.pid] = tracer
         end
 
+        # A worker forked from a preloaded app inherits the tracer of the parent instead of building one of it's own - methods discovered and warmed
+        # up in the parent are not discovered again and stay shared with the parent copy-on-write. The tables indexing them (methodinfo, class info and
+        # library caches) are still inserted into by the child, thus only partially shared.
+        def inherit
+          return unless (tracer = @__pids.values.last) && tracer.config.proton_fork_aware
+          synchronize do
+            @__pids.clear
+            tracer.after_fork!
+            @__pids[Process.pid] = tracer
+          end
+        end
+
+        def ractor?
+          defined?(Ractor) && !Ractor.current.equal?(MAIN_RACTOR)
+        end
+
         def patch(concern, hook)
           concern.prepend(hook) unless concern.ancestors.include?(hook)
         end
@@ -31,6 +51,7 @@ module Raygun
         configure(env)
         initialize_blacklist
         register_known_library_paths
+        initialize_method_cache
         run_agent_connectivity_diagnostics
         require_hooks
         ObjectSpace.define_finalizer(self, proc{ disable_tracepoints })
@@ -41,6 +62,7 @@ module Raygun
       end
 
       def udp_sink!
+        @transport_sink = :udp_sink!
         sock = UDPSocket.new
         # For UDP sockets, SO_SNDBUF is the max packet size and NOT send buffer as with a connection oriented transport
         sock.setsockopt(Socket::SOL_SOCKET, Socket::SO_SNDBUF, Tracer::BATCH_PACKET_SIZE)
@@ -56,15 +78,43 @@ module Raygun
       end
 
       def tcp_sink!
+        @transport_sink = :tcp_sink!
         self.tcp_sink(
           host: config.proton_tcp_host,
           port: config.proton_tcp_port
         )
+        # Stream transports aren't MTU bound - fewer, larger writes
+        self.batch_size = config.proton_tcp_batch_size
       rescue => e
         # XXX works for the middleware wrapped case, not for standalone - revisit
         raise Raygun::Apm::FatalError, "Raygun APM TCP sink could not be initialized: #{e.message} #{e.backtrace.join("\n")}"
       end
 
+      # Writes the method classifications back to the cache, merged with the ones made since it was loaded. Also called on exit.
+      def persist_method_cache
+        Raygun::Apm::MethodCache.persist(self, @method_cache_path) if @method_cache_path
+      end
+
+      # Classifies the methods of all loaded classes and modules ahead of them being called, to be run once the app is loaded. Saves requests from
+      # paying for the discovery of the methods they call first. Returns the amount of methods classified and the time it took in seconds.
+      def warmup!
+        started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        classified = 0
+        # Singleton classes are yielded as well, thus class methods are covered too
+        ObjectSpace.each_object(Module) do |namespace|
+          classified += warmup_namespace(namespace)
+        end
+        {:classified => classified, :elapsed => Process.clock_gettime(Process::CLOCK_MONOTONIC) - started}
+      end
+
+      # Sets up the tracer inherited by a forked child for the child - the timer thread is started again and a transport sink connects anew, while
+      # the method tables warmed up in the parent are kept. Returns false if not in a forked child.
+      def after_fork!
+        return false unless reset_after_fork
+        send(@transport_sink) if @transport_sink
+        true
+      end
+
       def enable_sink!
         if config.proton_network_mode == "Udp"
           udp_sink!
@@ -80,19 +130,34 @@ module Raygun
         self.log_level = config.loglevel
         self.environment = config.environment
         self.api_key = config.proton_api_key
+        # Microseconds a partial batch lingers for more commands once a trace ended
+        self.batch_linger = config.proton_batch_idle_counter
+        # Don't classify newly seen methods on the request thread
+        self.deferred_discovery = config.proton_deferred_discovery
+        self.methodinfo_capacity = config.proton_methodinfo_capacity
       end
 
       def initialize_blacklist
         @blacklist_parser = Raygun::Apm::Blacklist::Parser.new(self)
         file = @config.blacklist_file
-        @blacklist = if file && File.exist?(file)
-          File.readlines(file)
+        overrides = File.read(file) if file && File.exist?(file)
+        @blacklist = overrides ? overrides.lines : []
+        # Defaults - bulk loaded from the snapshot embedded in the extension at build time, unless the defaults changed since
+        if Raygun::Apm::Blacklist::Snapshot.embedded? && load_blacklist
+          @blacklist_parser.add_filters Raygun::Apm::Blacklist.extended_blacklist.flatten
         else
-          []
+          @blacklist_parser.add_filters Raygun::Apm::Blacklist.resolve_entries
         end
-        # Defaults
-        @blacklist_parser.add_filters Raygun::Apm::Blacklist.resolve_entries
-        # From file
+        # From file - compiled once and cached on disk by a hash of it's contents
+        load_blacklist_overrides(overrides) if overrides
+        show_filters if config.loglevel == Tracer::LOG_BLACKLIST
+      end
+
+      def load_blacklist_overrides(overrides)
+        load_blacklist Raygun::Apm::Blacklist::Snapshot.cached(overrides, config.proton_blacklist_cache_folder)
+      rescue ArgumentError
+        # A corrupt cache entry - evict and parse the file as before
+        Raygun::Apm::Blacklist::Snapshot.evict(overrides, config.proton_blacklist_cache_folder)
         @blacklist_parser.add_filters @blacklist
       end
 
@@ -102,8 +167,34 @@ module Raygun
           libs.delete(Dir.getwd)
           self.register_libraries libs
         else
-          self.register_libraries [RbConfig::CONFIG['rubylibdir']]
+          self.register_libraries(libs = [RbConfig::CONFIG['rubylibdir']])
+        end
+        @libraries = libs
+      end
+
+      def initialize_method_cache
+        return unless config.proton_method_cache
+        # Without a revision to key it by, a cache would outlive changes to the code it classified
+        return unless revision = Raygun::Apm::MethodCache.revision(config)
+        return unless dir = config.proton_method_cache_folder
+        @method_cache_path = Raygun::Apm::MethodCache.path(dir, revision, @blacklist, @libraries, config.environment)
+        Raygun::Apm::MethodCache.load(self, @method_cache_path)
+        at_exit { persist_method_cache }
+      end
+
+      def warmup_namespace(namespace)
+        classified = 0
+        (namespace.instance_methods(false) + namespace.private_instance_methods(false)).each do |name|
+          begin
+            method = namespace.instance_method(name)
+          rescue NameError
+            next
+          end
+          # Methods of ancestors are warmed up with their owner, native methods are not traced
+          next unless method.owner.equal?(namespace) && method.source_location
+          classified += 1 if warmup_method(namespace, method.original_name)
         end
+        classified
       end
 
       def run_agent_connectivity_diagnostics
@@ -113,6 +204,7 @@ module Raygun
 
       def require_hooks
         require "raygun/apm/hooks/internals" if @config.proton_hook_internals
+        require "raygun/apm/hooks/process" if @config.proton_fork_aware
         require "raygun/apm/hooks/net_http"
         # conditionally required - may not be bundled
         conditional_hooks = %w(httpclient excon mongodb)
@@ -2,6 +2,28 @@ $LOAD_PATH.unshift File.expand_path("../../lib", __FILE__)
 require "raygun/apm"
 require 'subject'
 
+# A batch of BEGIN and END commands as the batched sinks would dispatch it
+def begin_end_batch(size: Raygun::Apm::Tracer::BATCH_PACKET_SIZE)
+  commands = "".b
+  count = 0
+  function_id = 100
+  timestamp = Raygun::Apm::Tracer.new.now
+  while commands.bytesize < size - 13 - 64
+    [Raygun::Apm::Event::Begin, Raygun::Apm::Event::End].each do |klass|
+      event = klass.new
+      event[:pid] = Process.pid
+      event[:tid] = 1
+      event[:timestamp] = timestamp += 3
+      event[:function_id] = function_id
+      event[:instance_id] = 0x7f00_dead_0000 + function_id if klass == Raygun::Apm::Event::Begin
+      commands << event.encoded
+      count += 1
+    end
+    function_id = 100 + (function_id + 7) % 40
+  end
+  [13 + commands.bytesize, 0xfa, count, 1, Process.pid].pack("s<Cs<L<L<") + commands
+end
+
 def rails_prelude(tracer_enabled: false)
   orig_gemfile = ENV["BUNDLE_GEMFILE"]
   rails_path = File.expand_path(File.join(File.dirname(orig_gemfile), 'test', 'rails_5.2.2'))
@@ -141,6 +141,345 @@ class Raygun::ApmTest < Raygun::Test
     assert_equal Raygun::Apm::Tracer::METHOD_SOURCE_KNOWN_LIBRARY, library_methodinfo[:method_source]
   end
 
+  def test_library_classification_cached_per_source_path
+    tracer = Raygun::Apm::Tracer.new
+    events = []
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+    # Treat the test suite as library code
+    tracer.register_libraries [File.expand_path('..', __dir__)]
+
+    tracer.start_trace
+    @subject.float_return
+    @subject.simple_call(:foo)
+    tracer.end_trace
+
+    methodinfos = events.select{|e| Raygun::Apm::Event::Methodinfo === e }
+    assert_equal %w(float_return simple_call), methodinfos.map{|e| e[:method_name] }
+    assert methodinfos.all?{|e| e[:method_source] == Raygun::Apm::Tracer::METHOD_SOURCE_KNOWN_LIBRARY }
+  end
+
+  def test_class_info_cache
+    tracer = Raygun::Apm::Tracer.new
+    events = []
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+    anonymous = Class.new do
+      def foo; end
+      def bar; end
+    end
+
+    tracer.start_trace
+    @subject.float_return
+    @subject.simple_call(:foo)
+    # Blacklisted as anonymous (#<Class:0x...>) and must not be cached as such
+    anonymous.new.foo
+    Object.const_set(:ClassInfoCacheNamedLater, anonymous)
+    anonymous.new.bar
+    tracer.end_trace
+
+    methodinfos = events.select{|e| Raygun::Apm::Event::Methodinfo === e }
+    assert_equal [["Subject", "float_return"], ["Subject", "simple_call"], ["ClassInfoCacheNamedLater", "bar"]], methodinfos.map{|e| [e[:class_name], e[:method_name]] }
+  ensure
+    Object.send(:remove_const, :ClassInfoCacheNamedLater) if Object.const_defined?(:ClassInfoCacheNamedLater)
+  end
+
+  def test_deferred_discovery
+    tracer = Raygun::Apm::Tracer.new
+    refute tracer.deferred_discovery?
+    tracer.deferred_discovery = true
+    assert tracer.deferred_discovery?
+    events = []
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+
+    # Methods seen for the first time are pending classification and not traced, including their returns
+    tracer.start_trace
+    @subject.block_method { @subject.simple_call(:foo) }
+    tracer.end_trace
+    assert_equal 0, events.count{|e| Raygun::Apm::Event::Begin === e || Raygun::Apm::Event::End === e }
+
+    # Classified on the timer thread, unless it got to them already
+    tracer.resolve_pending_methods
+    methodinfos = events.select{|e| Raygun::Apm::Event::Methodinfo === e }.map{|e| [e[:method_name], e[:function_id]] }.to_h
+    assert methodinfos["block_method"]
+    assert methodinfos["simple_call"]
+    assert_equal 0, tracer.resolve_pending_methods
+
+    events.clear
+    tracer.start_trace
+    @subject.block_method { @subject.simple_call(:foo) }
+    tracer.end_trace
+    begins = events.select{|e| Raygun::Apm::Event::Begin === e }.map{|e| e[:function_id] }
+    ends = events.select{|e| Raygun::Apm::Event::End === e }.map{|e| e[:function_id] }
+    assert_equal [methodinfos["block_method"], methodinfos["simple_call"]], begins
+    assert_equal begins, ends.reverse
+    assert_equal 0, events.count{|e| Raygun::Apm::Event::Methodinfo === e }
+  end
+
+  def test_method_cache
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "methods.bin")
+      tracer = Raygun::Apm::Tracer.new
+      tracer.add_blacklist("Subject", "blacklist1")
+      refute tracer.load_method_cache(path)
+      tracer.callback_sink = Proc.new{|event| }
+      tracer.start_trace
+      @subject.simple_call(:foo)
+      @subject.blacklist1
+      tracer.end_trace
+      snapshot = tracer.method_cache_snapshot
+      assert_equal "RGMC", snapshot[0, 4]
+      File.binwrite(path, snapshot)
+
+      # Classified from the cache - Subject#blacklist1 stays blacklisted without the rule
+      events = []
+      tracer = Raygun::Apm::Tracer.new
+      assert tracer.load_method_cache(path)
+      tracer.callback_sink = Proc.new do |event|
+        events << event
+      end
+      tracer.start_trace
+      @subject.simple_call(:foo)
+      @subject.blacklist1
+      tracer.end_trace
+      # With the encoded names persisted too
+      assert_equal [["Subject", "simple_call"]], events.select{|e| Raygun::Apm::Event::Methodinfo === e }.map{|e| [e[:class_name], e[:method_name]] }
+      # Nothing classified beyond the cache
+      assert_nil tracer.method_cache_snapshot
+
+      tracer.start_trace
+      @subject.float_return
+      tracer.end_trace
+      assert_operator tracer.method_cache_snapshot.bytesize, :>, snapshot.bytesize
+
+      # Rule changes invalidate the cache
+      tracer.add_blacklist("Subject", "blacklist2")
+      assert_nil tracer.method_cache_snapshot
+    end
+  end
+
+  def test_warmup
+    tracer = Raygun::Apm::Tracer.new
+    events = []
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+    result = tracer.warmup!
+    assert_operator result[:classified], :>, 0
+    assert_kind_of Numeric, result[:elapsed]
+    methodinfos = events.select{|e| Raygun::Apm::Event::Methodinfo === e }
+    simple_call = methodinfos.find{|e| e[:class_name] == "Subject" && e[:method_name] == "simple_call" }
+    assert simple_call
+    # Nothing left to classify the second time around
+    assert_equal 0, tracer.warmup![:classified]
+
+    # Traced with the function ID assigned on warmup
+    events.clear
+    tracer.start_trace
+    @subject.simple_call(:foo)
+    tracer.end_trace
+    assert_equal 0, events.count{|e| Raygun::Apm::Event::Methodinfo === e }
+    assert_equal [simple_call[:function_id]], events.select{|e| Raygun::Apm::Event::Begin === e }.map{|e| e[:function_id] }
+  end
+
+  def test_after_fork
+    skip "fork not supported" unless Process.respond_to?(:fork)
+    tracer = Raygun::Apm::Tracer.new
+    events = []
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+    refute tracer.after_fork!
+    tracer.start_trace
+    @subject.simple_call(:foo)
+    tracer.end_trace
+    function_id = events.find{|e| Raygun::Apm::Event::Methodinfo === e && e[:method_name] == "simple_call" }[:function_id]
+
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      events.clear
+      forked = tracer.after_fork!
+      digest = tracer.inherited_methods_digest
+      tracer.start_trace
+      @subject.simple_call(:foo)
+      tracer.end_trace
+      begins = events.select{|e| Raygun::Apm::Event::Begin === e }
+      methodinfos = events.count{|e| Raygun::Apm::Event::Methodinfo === e }
+      # Discovery, eviction and compaction in the child leave the inherited methods as is
+      tracer.start_trace
+      @subject.float_return
+      tracer.end_trace
+      tracer.methodinfo_capacity = 1
+      2.times { tracer.evict_methodinfo }
+      writer.write Marshal.dump([forked, tracer.after_fork!, methodinfos, begins.map{|e| e[:function_id] }, begins.map{|e| e[:pid] }.uniq, Process.pid, digest, tracer.inherited_methods_digest])
+      writer.close
+      exit!(0)
+    end
+    writer.close
+    forked, again, methodinfos, function_ids, pids, child, digest, digest_after = Marshal.load(reader.read)
+    Process.wait(pid)
+    assert forked
+    refute again
+    # Methods discovered by the parent are not discovered again, events are attributed to the child
+    assert_equal 0, methodinfos
+    assert_equal [function_id], function_ids
+    assert_equal [child], pids
+    assert_equal 0, tracer.inherited_methods_digest
+    refute_equal 0, digest
+    assert_equal digest, digest_after
+  end
+
+  def test_methodinfo_eviction
+    tracer = Raygun::Apm::Tracer.new
+    assert_equal Raygun::Apm::Tracer::METHODINFO_CAPACITY, tracer.methodinfo_capacity
+    assert_raises(ArgumentError) { tracer.methodinfo_capacity = 0 }
+    events = []
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+    tracer.start_trace
+    @subject.simple_call(:foo)
+    @subject.float_return
+    tracer.end_trace
+    function_id = events.find{|e| Raygun::Apm::Event::Methodinfo === e && e[:method_name] == "simple_call" }[:function_id]
+    # Within capacity, nothing to evict
+    assert_equal 0, tracer.evict_methodinfo
+    assert_equal 0, tracer.methodinfo_evictions
+
+    # Over capacity, but only methods not called in the current or previous generation are cold
+    tracer.methodinfo_capacity = 1
+    evicted = tracer.evict_methodinfo
+    tracer.start_trace
+    @subject.float_return
+    tracer.end_trace
+    size = tracer.methodinfo_size
+    evicted += tracer.evict_methodinfo
+    assert_operator tracer.methodinfo_size, :<, size
+    # The timer thread evicts from a table over capacity on it's ticks too
+    assert_operator tracer.methodinfo_evicted, :>=, evicted
+    assert_operator tracer.methodinfo_evictions, :>=, 2
+
+    # Discovered and announced again with a new function ID
+    events.clear
+    tracer.start_trace
+    @subject.simple_call(:foo)
+    @subject.float_return
+    tracer.end_trace
+    methodinfos = events.select{|e| Raygun::Apm::Event::Methodinfo === e }.map{|e| e[:method_name] }
+    assert_equal ["simple_call"], methodinfos
+    refute_equal function_id, events.find{|e| Raygun::Apm::Event::Methodinfo === e }[:function_id]
+  end
+
+  def test_methodinfo_eviction_during_a_library_call
+    tracer = Raygun::Apm::Tracer.new
+    events = []
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+    # Treat the test suite as library code
+    tracer.register_libraries [File.expand_path('..', __dir__)]
+    library = Class.new do
+      def outer(tracer)
+        inner(tracer)
+      end
+
+      # Too deep into the library to be pushed onto the shadow stack, thus evicted before it returns
+      def inner(tracer)
+        tracer.methodinfo_capacity = 1
+        tracer.evict_methodinfo
+        tracer.evict_methodinfo
+      end
+    end.new
+
+    tracer.start_trace
+    library.outer(tracer)
+    @subject.float_return
+    tracer.end_trace
+
+    methodinfos = events.select{|e| Raygun::Apm::Event::Methodinfo === e }
+    outer = methodinfos.find{|e| e[:method_name] == "outer" }[:function_id]
+    float_return = methodinfos.find{|e| e[:method_name] == "float_return" }[:function_id]
+    begins = events.select{|e| Raygun::Apm::Event::Begin === e }.map{|e| e[:function_id] }
+    ends = events.select{|e| Raygun::Apm::Event::End === e }.map{|e| e[:function_id] }
+    # Back out of the library once the outermost library frame returns
+    assert_includes ends, outer
+    assert_includes begins, float_return
+    assert_equal begins.sort, ends.sort
+  end
+
+  def test_inherited_methods_are_not_evicted_after_fork
+    skip "fork not supported" unless Process.respond_to?(:fork)
+    tracer = Raygun::Apm::Tracer.new
+    events = []
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+    tracer.start_trace
+    @subject.simple_call(:foo)
+    tracer.end_trace
+    function_id = events.find{|e| Raygun::Apm::Event::Methodinfo === e && e[:method_name] == "simple_call" }[:function_id]
+
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      tracer.after_fork!
+      tracer.start_trace
+      @subject.float_return
+      tracer.end_trace
+      # Over capacity, with both the inherited and the child's own method cold
+      tracer.methodinfo_capacity = 1
+      evicted = tracer.evict_methodinfo + tracer.evict_methodinfo
+      events.clear
+      tracer.start_trace
+      @subject.simple_call(:foo)
+      @subject.float_return
+      tracer.end_trace
+      begins = events.select{|e| Raygun::Apm::Event::Begin === e }
+      writer.write Marshal.dump([evicted, events.select{|e| Raygun::Apm::Event::Methodinfo === e }.map{|e| e[:method_name] }, begins.map{|e| e[:function_id] }])
+      writer.close
+      exit!(0)
+    end
+    writer.close
+    evicted, methodinfos, function_ids = Marshal.load(reader.read)
+    Process.wait(pid)
+    # Only the child's own method was evicted and discovered again, the inherited one kept it's function ID
+    assert_operator evicted, :>=, 1
+    assert_equal ["float_return"], methodinfos
+    assert_includes function_ids, function_id
+  end
+
+  def test_method_storage
+    require 'objspace'
+    tracer = Raygun::Apm::Tracer.new
+    events = []
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+    size = ObjectSpace.memsize_of(tracer)
+    tracer.start_trace
+    @subject.simple_call(:foo)
+    @subject.float_return
+    tracer.end_trace
+    # Whitelisted methods are accounted for by the method slab and arena
+    assert_operator ObjectSpace.memsize_of(tracer), :>, size
+
+    # A blacklist change resets the method storage, methods discovered again are stored and encoded afresh
+    tracer.add_blacklist("Subject", "float_return")
+    events.clear
+    tracer.start_trace
+    @subject.simple_call(:foo)
+    @subject.float_return
+    tracer.end_trace
+    methodinfos = events.select{|e| Raygun::Apm::Event::Methodinfo === e }.map{|e| [e[:class_name], e[:method_name]] }
+    assert_includes methodinfos, ["Subject", "simple_call"]
+    refute_includes methodinfos, ["Subject", "float_return"]
+  end
+
   def test_tracer_gc
     tracer = Raygun::Apm::Tracer.new
     assert tracer.start_trace
@@ -315,6 +654,102 @@ class Raygun::ApmTest < Raygun::Test
     tracer.end_trace
   end
 
+  def test_fiber_switch_keeps_shadow_stacks_apart
+    skip unless Raygun::Apm::Tracer::FEATURE_FIBER_STACKS
+    events = []
+    tracer = Raygun::Apm::Tracer.new
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+
+    tracer.start_trace
+    # Fills the shadow stack of the fiber and suspends it at the bottom
+    fiber = Fiber.new { @subject.recursive_fiber_yield(300) }
+    fiber.resume
+    # Runs on the shadow stack of the main fiber, which has plenty of room left
+    @subject.simple_call(:foo)
+    fiber.resume
+    tracer.end_trace
+
+    methodinfos = events.select{|e| Raygun::Apm::Event::Methodinfo === e }.map{|e| [e[:method_name], e[:function_id]] }.to_h
+    begins = events.select{|e| Raygun::Apm::Event::Begin === e }.map{|e| e[:function_id] }
+    ends = events.select{|e| Raygun::Apm::Event::End === e }.map{|e| e[:function_id] }
+
+    assert_equal 256, begins.count(methodinfos["recursive_fiber_yield"])
+    assert_equal 256, ends.count(methodinfos["recursive_fiber_yield"])
+    assert_equal 1, begins.count(methodinfos["simple_call"])
+    assert_equal 1, ends.count(methodinfos["simple_call"])
+    # The simple call is entered and exited while the fiber is suspended, between it's frames
+    assert_equal [methodinfos["simple_call"]] * 2, events.select{|e| Raygun::Apm::Event::Begin === e || Raygun::Apm::Event::End === e }[256, 2].map{|e| e[:function_id] }
+  end
+
+  def test_fibers_of_the_same_thread_trace_apart
+    skip unless Raygun::Apm::Tracer::FEATURE_FIBER_STACKS
+    events = []
+    tracer = Raygun::Apm::Tracer.new
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+
+    # Requests served by fibers of an async reactor, interleaved on the same thread
+    first = Fiber.new do
+      tracer.start_trace
+      @subject.simple_call(:first)
+      Fiber.yield
+      @subject.simple_call(:first)
+      tracer.end_trace
+    end
+    second = Fiber.new do
+      tracer.start_trace
+      Fiber.yield
+      @subject.simple_call(:second)
+      tracer.end_trace
+    end
+    first.resume
+    second.resume
+    # Ends the first trace while the second is still in progress
+    first.resume
+    second.resume
+
+    begin_transactions = events.select{|e| Raygun::Apm::Event::BeginTransaction === e }
+    end_transactions = events.select{|e| Raygun::Apm::Event::EndTransaction === e }
+    assert_equal 2, begin_transactions.size
+    assert_equal begin_transactions.map{|e| e[:tid] }, end_transactions.map{|e| e[:tid] }
+    first_tid, second_tid = begin_transactions.map{|e| e[:tid] }
+    refute_equal first_tid, second_tid
+
+    methodinfo = events.find{|e| Raygun::Apm::Event::Methodinfo === e && e[:method_name] == "simple_call" }
+    begins = events.select{|e| Raygun::Apm::Event::Begin === e && e[:function_id] == methodinfo[:function_id] }
+    ends = events.select{|e| Raygun::Apm::Event::End === e && e[:function_id] == methodinfo[:function_id] }
+    assert_equal [first_tid, first_tid, second_tid], begins.map{|e| e[:tid] }
+    assert_equal [first_tid, first_tid, second_tid], ends.map{|e| e[:tid] }
+  end
+
+  def test_consecutive_traces_reuse_trace_contexts
+    events = []
+    tracer = Raygun::Apm::Tracer.new
+    tracer.api_key = "first"
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+
+    3.times do |i|
+      # Re-encodes the pre-encoded BEGIN_TRANSACTION
+      tracer.api_key = "second" if i == 2
+      assert tracer.start_trace
+      @subject.simple_call(:foo)
+      assert tracer.end_trace
+    end
+
+    begin_transactions = events.select{|e| Raygun::Apm::Event::BeginTransaction === e }
+    assert_equal ["first", "first", "second"], begin_transactions.map{|e| e[:api_key] }
+    assert_equal 1, begin_transactions.map{|e| e[:tid] }.uniq.size
+    # The pooled tracepoint is enabled again for every trace
+    methodinfo = events.find{|e| Raygun::Apm::Event::Methodinfo === e && e[:method_name] == "simple_call" }
+    assert_equal 3, events.count{|e| Raygun::Apm::Event::Begin === e && e[:function_id] == methodinfo[:function_id] }
+    assert_equal 3, events.count{|e| Raygun::Apm::Event::EndTransaction === e }
+  end
+
   def test_vm_stack_overflow
     ruby_vm_max_frames = 0
     begin
@@ -410,6 +845,29 @@ class Raygun::ApmTest < Raygun::Test
 
   end
 
+  def test_compiled_blacklist_matches_radix_trees
+    tracer = Raygun::Apm::Tracer.new
+    assert tracer.compiled_blacklist?
+    tracer.add_blacklist("ActiveStorage::Blob", nil)
+    tracer.add_whitelist("ActiveStorage::Blob", "upload")
+    tracer.add_blacklist(nil, "after_remove_for_")
+
+    corpus = ObjectSpace.each_object(Module).select{|mod| String === mod.name }.flat_map do |mod|
+      (mod.instance_methods(false) + mod.private_instance_methods(false)).map{|method| ["#{mod.name}##{method}", mod.name, method.to_s] }
+    end
+    corpus += [["ActiveStorage::Blob#upload", "ActiveStorage::Blob", "upload"], ["ActiveStorage::Blob#build_after_upload", "ActiveStorage::Blob", "build_after_upload"], ["Post#after_remove_for_comments", "Post", "after_remove_for_comments"]]
+    compiled = corpus.map{|entry| tracer.blacklisted?(*entry) }
+    tracer.compiled_blacklist = false
+    refute tracer.compiled_blacklist?
+    assert_equal corpus.map{|entry| tracer.blacklisted?(*entry) }, compiled
+
+    # Rules added after the automaton was compiled take effect
+    tracer.compiled_blacklist = true
+    refute tracer.blacklisted?("Subject#blacklist1", "Subject", "blacklist1")
+    tracer.add_blacklist("Subject", "blacklist1")
+    assert tracer.blacklisted?("Subject#blacklist1", "Subject", "blacklist1")
+  end
+
   def test_sink_setters
     tracer = Raygun::Apm::Tracer.new
     assert_fatal_error(/Expected a Proc callback as sink/) do
@@ -898,6 +1356,77 @@ class Raygun::ApmTest < Raygun::Test
     Raygun::Apm::Blacklist.extended_blacklist.clear
   end
 
+  def test_blacklist_snapshot
+    tracer = Raygun::Apm::Tracer.new
+    refute tracer.blacklisted?("Subject#blacklist1", "Subject", "blacklist1")
+    snapshot = Raygun::Apm::Blacklist::Snapshot.compile(["# comment", "", "Subject#blacklist1", "+Subject#blacklist2", "Subject::Nested"])
+    assert tracer.load_blacklist(snapshot)
+    assert tracer.blacklisted?("Subject#blacklist1", "Subject", "blacklist1")
+    assert tracer.whitelisted?("Subject#blacklist2", "Subject", "blacklist2")
+    assert tracer.blacklisted?("Subject::Nested#foo", "Subject::Nested", "foo")
+
+    assert_raises(ArgumentError) { tracer.load_blacklist(snapshot[0..-2]) }
+    assert_raises(ArgumentError) { tracer.load_blacklist("RGBL") }
+  end
+
+  def test_embedded_blacklist_snapshot
+    skip "built without an embedded blacklist snapshot" unless Raygun::Apm::Tracer::BLACKLIST_SNAPSHOT_DIGEST
+    assert Raygun::Apm::Blacklist::Snapshot.embedded?
+
+    snapshot = Raygun::Apm::Tracer.allocate
+    assert snapshot.load_blacklist
+    parsed = Raygun::Apm::Tracer.allocate
+    parser = Raygun::Apm::Blacklist::Parser.new(parsed)
+    Raygun::Apm::Blacklist.default_entries.each do |filter|
+      kind, translated = parser.rule(filter.strip)
+      next if !kind || !translated || translated.compact.empty?
+      kind == :whitelist ? parsed.add_whitelist(*translated) : parsed.add_blacklist(*translated)
+    end
+
+    corpus = ObjectSpace.each_object(Module).select{|mod| String === mod.name }.flat_map do |mod|
+      (mod.instance_methods(false) + mod.private_instance_methods(false)).map{|method| ["#{mod.name}##{method}", mod.name, method.to_s] }
+    end
+    assert_equal corpus.map{|entry| parsed.blacklisted?(*entry) }, corpus.map{|entry| snapshot.blacklisted?(*entry) }
+  end
+
+  def test_blacklist_overrides_cache
+    Dir.mktmpdir do |dir|
+      overrides = File.read(File.join(__dir__, 'blacklist_overrides.txt'))
+      snapshot = Raygun::Apm::Blacklist::Snapshot.cached(overrides, dir)
+      assert_equal 1, Dir.glob(File.join(dir, "raygun-apm-blacklist-*.bin")).size
+      assert_equal snapshot, Raygun::Apm::Blacklist::Snapshot.cached(overrides, dir)
+      # Keyed by contents
+      Raygun::Apm::Blacklist::Snapshot.cached(overrides + "Subject#blacklist2\n", dir)
+      assert_equal 2, Dir.glob(File.join(dir, "raygun-apm-blacklist-*.bin")).size
+      Raygun::Apm::Blacklist::Snapshot.evict(overrides, dir)
+      assert_equal 1, Dir.glob(File.join(dir, "raygun-apm-blacklist-*.bin")).size
+    end
+  end
+
+  def test_blacklist_overrides_cache_writable_by_others_is_not_loaded
+    skip "ownership not tracked" if Gem.win_platform?
+    Dir.mktmpdir do |dir|
+      overrides = File.read(File.join(__dir__, 'blacklist_overrides.txt'))
+      snapshot = Raygun::Apm::Blacklist::Snapshot.cached(overrides, dir)
+      path = Dir.glob(File.join(dir, "raygun-apm-blacklist-*.bin")).first
+      File.binwrite(path, "planted")
+      File.chmod(0666, path)
+      assert_equal snapshot, Raygun::Apm::Blacklist::Snapshot.cached(overrides, dir)
+      # Replaced by a trusted one
+      assert_equal 0, File.stat(path).mode & 0022
+      assert_equal snapshot, File.binread(path)
+    end
+  end
+
+  def test_default_cache_folder_is_private
+    skip "ownership not tracked" if Gem.win_platform?
+    dir = Raygun::Apm::CacheFolder.default
+    assert dir
+    assert_equal 0, File.stat(dir).mode & 0077
+    assert_equal Process.euid, File.stat(dir).uid
+    assert_equal dir, Raygun::Apm::Config.new({}).proton_method_cache_folder
+  end
+
   def test_wildcard_blacklist
     tracer = Raygun::Apm::Tracer.new
     events = []
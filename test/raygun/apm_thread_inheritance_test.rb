@@ -69,4 +69,77 @@ class Raygun::ApmThreadInheritanceTest < Raygun::Test
     assert_equal 1, events[10][:parent_tid]
     assert_equal 9, events[10][:tid]
   end
+
+  def test_thread_moved_out_of_the_trace_group_is_not_traced
+    events = []
+    subject = Subject.new
+    tracer = Raygun::Apm::Tracer.new
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+
+    tracer.start_trace
+    Thread.new do
+      subject.simple_call(:traced)
+      # The cached trace context of this thread must not outlive it's membership of the trace's thread group
+      ThreadGroup.new.add(Thread.current)
+      subject.simple_call(:not_traced)
+    end.join
+    tracer.end_trace
+
+    methodinfo = events.find{|e| Raygun::Apm::Event::Methodinfo === e && e[:method_name] == "simple_call" }
+    begins = events.select{|e| Raygun::Apm::Event::Begin === e && e[:function_id] == methodinfo[:function_id] }
+    assert_equal 1, begins.size
+    assert_equal 1, events.count{|e| Raygun::Apm::Event::End === e && e[:function_id] == methodinfo[:function_id] }
+  end
+
+  def test_thread_left_in_the_group_of_an_ended_trace_is_not_traced
+    events = []
+    subject = Subject.new
+    tracer = Raygun::Apm::Tracer.new
+    tracer.callback_sink = Proc.new do |event|
+      events << event
+    end
+    resume = Queue.new
+
+    tracer.start_trace
+    thread = Thread.new do
+      subject.simple_call(:traced)
+      resume.pop
+      subject.simple_call(:not_traced)
+    end
+    Thread.pass until thread.status == "sleep"
+    tracer.end_trace
+    # Reuses the pooled trace context the thread still has cached
+    tracer.start_trace
+    resume << true
+    thread.join
+    tracer.end_trace
+
+    methodinfo = events.find{|e| Raygun::Apm::Event::Methodinfo === e && e[:method_name] == "simple_call" }
+    assert_equal 1, events.count{|e| Raygun::Apm::Event::Begin === e && e[:function_id] == methodinfo[:function_id] }
+    assert_equal 1, events.count{|e| Raygun::Apm::Event::End === e && e[:function_id] == methodinfo[:function_id] }
+  end
+
+  def test_threads_that_died_outside_of_a_trace_are_reclaimed
+    require 'objspace'
+    tracer = Raygun::Apm::Tracer.new
+    tracer.callback_sink = Proc.new{|event| }
+    sizes = 5.times.map do
+      # Shadow threads registered outside of a trace never see a thread ended event
+      50.times.map{ Thread.new{ tracer.get_thread_id(Thread.current) } }.each(&:join)
+      # The timer thread may have swept some already
+      tracer.reclaim_dead_threads
+      ObjectSpace.memsize_of(tracer)
+    end
+    # Swept and recycled for the next batch of threads
+    assert_operator sizes.last, :<=, sizes.first
+    # Marking is free of side effects, reachability traversal doesn't reclaim dead threads
+    Thread.new{ tracer.get_thread_id(Thread.current) }.join
+    ObjectSpace.reachable_objects_from(tracer)
+    assert_equal 1, tracer.reclaim_dead_threads
+    # Thread IDs are never reused
+    tid = tracer.get_thread_id(Thread.new{}.tap(&:join))
+    assert_operator tid, :>, 250
+  end
 end
@@ -0,0 +1,45 @@
+require "test_helper"
+
+class Raygun::RactorStressTest < Raygun::Test
+
+  if defined?(Ractor) && ENV['STRESS_RACTORS']
+    describe 'context' do
+      def test_traced_workloads_in_parallel_ractors
+        count = Integer(ENV['STRESS_RACTORS']) rescue 4
+        times = 1000
+        ractors = count.times.map do
+          Ractor.new(times) do |times|
+            # Tracer#initialize configures the tracer through Ruby APIs that aren't Ractor safe yet - the C core is, so bypass it
+            tracer = Raygun::Apm::Tracer.allocate
+            Raygun::Apm::Tracer.instance = tracer
+            subject = Subject.new
+            counts = Hash.new(0)
+            tracer.callback_sink = Proc.new do |event|
+              counts[event.class.name] += 1
+            end
+            tracer.start_trace
+            times.times do
+              subject.simple_call(:foo)
+              begin
+                subject.exception_raised
+              rescue
+              end
+            end
+            tracer.end_trace
+            tracer.process_ended
+            [Raygun::Apm::Tracer.instance.equal?(tracer), counts]
+          end
+        end
+        results = ractors.map(&:take)
+        # Every Ractor traced through it's own tracer and observed exactly it's own workload
+        assert results.all?{|instance, _| instance }
+        results.each do |_, counts|
+          assert counts["Raygun::Apm::Event::Begin"] >= times * 2
+          assert_equal counts["Raygun::Apm::Event::Begin"], counts["Raygun::Apm::Event::End"]
+          assert_equal times, counts["Raygun::Apm::Event::ExceptionThrown"]
+        end
+        assert_equal 1, results.map{|_, counts| counts }.uniq.size
+      end
+    end
+  end
+end
@@ -0,0 +1,441 @@
+require "test_helper"
+
+class Raygun::WireProtocolTest < Raygun::Test
+  def setup
+    @subject = Subject.new
+  end
+
+  def test_protocol_version_setter
+    tracer = Raygun::Apm::Tracer.new
+    tracer.protocol_version = Raygun::Apm::Tracer::PROTOCOL_VERSION_2
+    assert_equal Raygun::Apm::Tracer::PROTOCOL_VERSION_2, tracer.protocol_version
+    tracer.protocol_version = Raygun::Apm::Tracer::PROTOCOL_VERSION_3
+    assert_equal Raygun::Apm::Tracer::PROTOCOL_VERSION_3, tracer.protocol_version
+    assert_raises ArgumentError do
+      tracer.protocol_version = 4
+    end
+  end
+
+  def test_decode_malformed_batch
+    decoder = Raygun::Apm::Decoder.new
+    assert_raises ArgumentError do
+      decoder.decode("\x00")
+    end
+    assert_raises ArgumentError do
+      decoder.decode(["0d00fb01000000000000000000"].pack("H*"))
+    end
+    # Compact SQL record referring to undefined string IDs
+    assert_raises ArgumentError do
+      decoder.decode(["2100fb010000000000000000000100000000000000000000000300000102030500"].pack("H*"))
+    end
+  end
+
+  def test_compact_framing_describes_the_same_events
+    v2_packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_2) { trace_calls }
+    v3_packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_3) { trace_calls }
+
+    v2_commands = decode(v2_packets)
+    v3_commands = decode(v3_packets)
+
+    # Threads batch into lanes of their own - the commands of each thread keep their order, methodinfos are dispatched ahead of them
+    assert_equal commands_by_thread(v2_commands), commands_by_thread(v3_commands)
+    assert_equal commands_without_timestamps(v2_commands.select{|c| command_type(c) == 0xf }).sort, commands_without_timestamps(v3_commands.select{|c| command_type(c) == 0xf }).sort
+    # Expanded compact BEGIN and END are byte for byte v2 commands, bar the timestamp
+    v3_commands.select{|c| command_type(c) == 0x1 || command_type(c) == 0x2 }.each do |command|
+      assert_equal command.unpack("s<").first, command.bytesize
+    end
+    # Every BEGIN and END in the same batch belong to the same thread
+    decoder = Raygun::Apm::Decoder.new
+    v3_packets.each do |packet|
+      tids = decoder.decode(packet).select{|c| command_type(c) == 0x1 || command_type(c) == 0x2 }.map{|c| c.unpack("s<CL<L<")[3] }
+      assert tids.uniq.size <= 1
+    end
+    # BEGIN with arguments and END with return values are embedded as-is
+    unless Raygun::Apm::Tracer::FEATURE_EMIT_ARGUMENTS
+      assert v3_packets.map(&:bytesize).sum < v2_packets.map(&:bytesize).sum / 2
+    end
+  end
+
+  def test_concurrent_threads_batch_into_their_own_lanes
+    packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_3) do
+      2.times.map do
+        Thread.new do
+          100.times { @subject.simple_call(:foo); Thread.pass }
+        end
+      end.each(&:join)
+    end
+    decoder = Raygun::Apm::Decoder.new
+    batches = packets.map{|p| decoder.decode(p).select{|c| command_type(c) == 0x1 || command_type(c) == 0x2 } }
+    # Threads switching on every call don't seal each other's partial batches
+    assert batches.all?{|commands| commands.map{|c| c.unpack("s<CL<L<")[3] }.uniq.size <= 1 }
+    assert packets.size < 20
+    commands_by_thread(batches.flatten).each_value do |types|
+      assert_equal types.count(0x1), types.count(0x2)
+    end
+  end
+
+  def test_interned_sql_strings
+    v2_packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_2) {|tracer| emit_redis_events(tracer) }
+    v3_packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_3) {|tracer| emit_redis_events(tracer) }
+
+    decoder = Raygun::Apm::Decoder.new
+    v2_commands = decode(v2_packets)
+    v3_commands = v3_packets.map{|p| decoder.decode(p) }.flatten
+    sql_commands = ->(commands) { commands_without_timestamps(commands.select{|c| command_type(c) == 0x64 }) }
+
+    # Provider, host and database defined once ahead of the first SQL event and expanded back to the same v2 commands
+    assert_equal 3, v3_commands.count{|c| command_type(c) == 0x14 }
+    assert_equal 3, decoder.strings
+    assert_equal 0, v2_commands.count{|c| command_type(c) == 0x14 }
+    assert_equal 200, sql_commands.call(v3_commands).size
+    assert_equal sql_commands.call(v2_commands), sql_commands.call(v3_commands)
+    assert v3_packets.map(&:bytesize).sum < v2_packets.map(&:bytesize).sum / 2
+  end
+
+  def test_interned_strings_redefined_on_udp
+    v3_packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_3) do |tracer|
+      emit_redis_events(tracer)
+      # Referred to again past the redefinition interval
+      event = Raygun::Apm::Event::Sql.new
+      event[:pid] = Process.pid
+      event[:tid] = 1
+      event[:timestamp] = tracer.now + 2_000_000
+      event[:provider] = "redis"
+      event[:host] = "127.0.0.1:6379"
+      event[:database] = "0"
+      event[:query] = "GET key:0"
+      event[:duration] = 120
+      tracer.emit(event)
+    end
+    decoder = Raygun::Apm::Decoder.new
+    v3_commands = v3_packets.map{|p| decoder.decode(p) }.flatten
+    # A lost definition datagram only leaves the strings undefined until their next redefinition
+    assert_equal 6, v3_commands.count{|c| command_type(c) == 0x14 }
+    assert_equal 3, decoder.strings
+    assert_equal 201, v3_commands.count{|c| command_type(c) == 0x64 }
+  end
+
+  def test_strings_not_interned_for_v2
+    v2_packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_2) {|tracer| emit_redis_events(tracer) }
+    decoder = Raygun::Apm::Decoder.new
+    v2_packets.each{|p| decoder.decode(p) }
+    assert_equal 0, decoder.strings
+  end
+
+  def test_compressed_batches_inflate_to_the_same_commands
+    packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_2) { trace_calls }
+    compressed = packets.map{|p| Raygun::Apm::Tracer.compress_batch(p) }
+    # Small batches that don't compress are sent as-is
+    assert compressed.any?{|p| command_type(p) == 0xfc }
+    assert_equal decode(packets), decode(compressed)
+    assert compressed.map(&:bytesize).sum < packets.map(&:bytesize).sum * 3 / 4
+    assert_raises ArgumentError do
+      Raygun::Apm::Decoder.new.decode(compressed.find{|p| command_type(p) == 0xfc }.byteslice(0..-2))
+    end
+  end
+
+  def test_tcp_sink_compression
+    server = TCPServer.new('127.0.0.1', 0)
+    tracer = Raygun::Apm::Tracer.new
+    tracer.tcp_sink(host: '127.0.0.1', port: server.addr[1])
+    tracer.compression = true
+    assert tracer.compression
+    tracer.start_trace
+    trace_calls
+    tracer.end_trace
+    tracer.process_ended
+    client = server.accept
+    stream = "".b
+    loop do
+      stream << client.read_nonblock(65536)
+    rescue IO::WaitReadable, EOFError
+      break
+    end
+    frames = []
+    until stream.empty?
+      length = stream.unpack("s<").first
+      frames << stream.slice!(0, length)
+    end
+    assert frames.any?{|f| command_type(f) == 0xfc }
+    assert decode(frames.select{|f| [0xfa, 0xfb, 0xfc].include?(command_type(f)) }).any?{|c| command_type(c) == 0x1 }
+    assert tracer.compression_ratio < 1.0
+  ensure
+    client&.close
+    server.close
+  end
+
+  def test_batch_size_setter
+    tracer = Raygun::Apm::Tracer.new
+    assert_equal Raygun::Apm::Tracer::BATCH_PACKET_SIZE, tracer.batch_size
+    tracer.batch_size = Raygun::Apm::Tracer::MAX_BATCH_PACKET_SIZE
+    assert_equal Raygun::Apm::Tracer::MAX_BATCH_PACKET_SIZE, tracer.batch_size
+    assert_raises ArgumentError do
+      tracer.batch_size = Raygun::Apm::Tracer::MIN_BATCH_PACKET_SIZE - 1
+    end
+    # Datagram sinks are bound by the UDP payload ceiling
+    assert_raises ArgumentError do
+      tracer.batch_size = Raygun::Apm::Tracer::MAX_BATCH_PACKET_SIZE + 1
+    end
+    server = TCPServer.new('127.0.0.1', 0)
+    tracer.tcp_sink(host: '127.0.0.1', port: server.addr[1])
+    tracer.batch_size = Raygun::Apm::Tracer::MAX_STREAM_BATCH_PACKET_SIZE
+    assert_equal Raygun::Apm::Tracer::MAX_STREAM_BATCH_PACKET_SIZE, tracer.batch_size
+    assert_raises ArgumentError do
+      tracer.batch_size = Raygun::Apm::Tracer::MAX_STREAM_BATCH_PACKET_SIZE + 1
+    end
+  ensure
+    server&.close
+  end
+
+  def test_tcp_sink_large_batches
+    frames = tcp_frames(Raygun::Apm::Tracer::MAX_STREAM_BATCH_PACKET_SIZE) {|tracer| trace_calls; emit_large_sql_event(tracer) }
+    default_frames = tcp_frames(Raygun::Apm::Tracer::BATCH_PACKET_SIZE) {|tracer| trace_calls; emit_large_sql_event(tracer) }
+    # SQL events larger than the datagram ceiling still travel batched on a stream sink
+    assert frames.all?{|f| [0xfa, 0xfb].include?(command_type(f)) }
+    assert default_frames.all?{|f| [0xfa, 0xfb].include?(command_type(f)) }
+    assert_equal 1, decode(frames).count{|c| command_type(c) == 0x64 }
+    assert_equal decode(default_frames).size, decode(frames).size
+    assert frames.size < default_frames.size
+    assert frames.map(&:bytesize).max > Raygun::Apm::Tracer::MAX_BATCH_PACKET_SIZE
+  end
+
+  def test_raw_event_dispatches_pending_batch
+    packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_2, batches_only: false) {|tracer| trace_calls; emit_large_sql_event(tracer); trace_calls }
+    raw = packets.reject{|p| [0xfa, 0xfb].include?(command_type(p)) }
+    commands = decode(packets - raw)
+    assert_equal 1, raw.count{|p| command_type(p) == 0x64 }
+    # Commands batched ahead of the oversized event are not dropped
+    assert_equal commands.count{|c| command_type(c) == 0x1 }, commands.count{|c| command_type(c) == 0x2 }
+  end
+
+  def test_tcp_sink_coalesces_writes
+    tracer = nil
+    frames = tcp_frames(Raygun::Apm::Tracer::BATCH_PACKET_SIZE) {|t| tracer = t; trace_calls }
+    # Batches drained from the ring buffer together go out in a single write, the stream still frames them one by one
+    assert frames.size > 1
+    assert tracer.writes >= 1
+    assert tracer.writes < frames.size
+    assert decode(frames).any?{|c| command_type(c) == 0x1 }
+  end
+
+  def test_sealed_batches_wake_up_the_sink_thread
+    server = UDPSocket.new
+    server.bind('127.0.0.1', 0)
+    tracer = Raygun::Apm::Tracer.new
+    sock = UDPSocket.new
+    tracer.udp_sink(socket: sock, host: '127.0.0.1', port: server.addr[1], receive_buffer_size: sock.getsockopt(Socket::SOL_SOCKET, Socket::SO_RCVBUF).int)
+    # Let the sink thread block on the empty ring buffer
+    sleep 0.2
+    tracer.start_trace
+    emit_redis_events(tracer)
+    # Sealed batches don't wait out a polling interval
+    assert IO.select([server], nil, nil, 0.05)
+    tracer.end_trace
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    tracer.process_ended
+    # Nor does shutdown wait out the idle timeout of the sink thread
+    assert Process.clock_gettime(Process::CLOCK_MONOTONIC) - started < 1
+  ensure
+    server.close
+  end
+
+  def test_batch_linger_setter
+    tracer = Raygun::Apm::Tracer.new
+    assert_equal 500, tracer.batch_linger
+    tracer.batch_linger = 0
+    assert_equal 0, tracer.batch_linger
+    assert_raises ArgumentError do
+      tracer.batch_linger = -1
+    end
+    assert_raises ArgumentError do
+      tracer.batch_linger = 1_000_001
+    end
+  end
+
+  def test_end_trace_seals_partial_batch
+    [[0, 0.05], [100_000, 0.5]].each do |linger, timeout|
+      server = UDPSocket.new
+      server.bind('127.0.0.1', 0)
+      tracer = Raygun::Apm::Tracer.new
+      tracer.batch_linger = linger
+      sock = UDPSocket.new
+      tracer.udp_sink(socket: sock, host: '127.0.0.1', port: server.addr[1], receive_buffer_size: sock.getsockopt(Socket::SOL_SOCKET, Socket::SO_RCVBUF).int)
+      tracer.start_trace
+      @subject.simple_call(:foo)
+      tracer.end_trace
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      # Delivered well ahead of the 1s timer thread flush
+      assert IO.select([server], nil, nil, timeout)
+      elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+      assert elapsed >= linger / 1_000_000.0 * 0.9 if linger > 0
+      # Methodinfos are batched in the process lane, sealed and sent ahead of the trace's batch
+      packets = []
+      loop do
+        packets << server.recvfrom_nonblock(65536).first
+      rescue IO::WaitReadable
+        break if packets.any?{|p| decode([p]).any?{|c| command_type(c) == 0x11 } } || !IO.select([server], nil, nil, 0.05)
+      end
+      assert decode(packets).any?{|c| command_type(c) == 0x11 }
+      tracer.process_ended
+    ensure
+      server&.close
+    end
+  end
+
+  def test_oversized_events_are_fragmented
+    v2_packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_2, batches_only: false) {|tracer| trace_calls; emit_large_sql_event(tracer) }
+    v3_packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_3, batches_only: false) {|tracer| trace_calls; emit_large_sql_event(tracer) }
+    sql_commands = ->(commands) { commands_without_timestamps(commands.select{|c| command_type(c) == 0x64 }) }
+
+    # v2 Agents don't reassemble fragments, the event is sent as-is
+    assert_equal 0, v2_packets.count{|p| command_type(p) == 0xfd }
+    raw = v2_packets.select{|p| command_type(p) == 0x64 }
+    assert_equal 1, raw.size
+    assert raw.first.bytesize > Raygun::Apm::Tracer::BATCH_PACKET_SIZE
+
+    assert v3_packets.count{|p| command_type(p) == 0xfd } > 1
+    assert v3_packets.all?{|p| p.bytesize <= Raygun::Apm::Tracer::BATCH_PACKET_SIZE }
+    assert_equal sql_commands.call(raw), sql_commands.call(decode(v3_packets))
+  end
+
+  def test_lost_fragment_groups
+    packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_3, batches_only: false) {|tracer| 3.times { emit_large_sql_event(tracer) } }
+    fragments = packets.select{|p| command_type(p) == 0xfd }
+    groups = fragments.group_by{|f| f.unpack("s<CL<L<")[3] }
+    assert_equal 3, groups.size
+    # Drop a fragment of the first group and the whole second group
+    lossy = packets - [groups.values[0][1]] - groups.values[1]
+    decoder = Raygun::Apm::Decoder.new
+    commands = lossy.map{|p| decoder.decode(p) }.flatten
+    assert_equal 1, commands.count{|c| command_type(c) == 0x64 }
+    assert_equal 2, decoder.lost_fragment_groups
+    assert_raises ArgumentError do
+      decoder.decode(groups.values[2][0].byteslice(0..-2))
+    end
+  end
+
+  def test_concurrent_fragment_groups_are_not_interleaved
+    packets = traced_packets(Raygun::Apm::Tracer::PROTOCOL_VERSION_3, batches_only: false) do |tracer|
+      [1, 2].map do |tid|
+        Thread.new do
+          5.times { emit_large_sql_event(tracer, tid); Thread.pass }
+        end
+      end.each(&:join)
+    end
+    groups = packets.select{|p| command_type(p) == 0xfd }.map{|f| f.unpack("s<CL<L<")[3] }
+    assert_equal 10, groups.uniq.size
+    # The fragments of a group go out back to back, even with both lanes holding fragments
+    assert_equal groups.uniq, groups.chunk_while{|a, b| a == b }.map(&:first)
+    decoder = Raygun::Apm::Decoder.new
+    commands = packets.map{|p| decoder.decode(p) }.flatten
+    assert_equal 10, commands.count{|c| command_type(c) == 0x64 }
+    assert_equal 0, decoder.lost_fragment_groups
+  end
+
+  private
+  def decode(packets)
+    decoder = Raygun::Apm::Decoder.new
+    packets.map{|p| decoder.decode(p) }.flatten
+  end
+
+  def trace_calls
+    500.times { @subject.simple_call(:foo) }
+    Thread.new do
+      50.times { @subject.boolean_return }
+    end.join
+  end
+
+  def emit_redis_events(tracer)
+    event = Raygun::Apm::Event::Sql.new
+    200.times do |i|
+      event[:pid] = Process.pid
+      event[:tid] = 1
+      event[:timestamp] = tracer.now
+      event[:provider] = "redis"
+      event[:host] = "127.0.0.1:6379"
+      event[:database] = "0"
+      event[:query] = "GET key:#{i % 10}"
+      event[:duration] = 120
+      tracer.emit(event)
+    end
+  end
+
+  def emit_large_sql_event(tracer, tid = 1)
+    event = Raygun::Apm::Event::Sql.new
+    event[:pid] = Process.pid
+    event[:tid] = tid
+    event[:timestamp] = tracer.now
+    event[:provider] = "postgres"
+    event[:host] = "localhost"
+    event[:database] = "rails"
+    event[:query] = "SELECT * FROM users WHERE id IN (#{(1..2000).to_a.join(',')})"
+    event[:duration] = 1000
+    tracer.emit(event)
+  end
+
+  def command_type(command)
+    command.unpack("s<C")[1]
+  end
+
+  def commands_by_thread(commands)
+    commands_without_timestamps(commands).reject{|c| c[0] == 0xf }.group_by{|c| c[1] }.transform_values{|cs| cs.map(&:first) }
+  end
+
+  def commands_without_timestamps(commands)
+    commands.map do |command|
+      length, type, pid, tid, _timestamp = command.unpack("s<CL<L<q<")
+      [type, tid, command.byteslice(19..-1)]
+    end
+  end
+
+  def tcp_frames(batch_size)
+    server = TCPServer.new('127.0.0.1', 0)
+    tracer = Raygun::Apm::Tracer.new
+    tracer.tcp_sink(host: '127.0.0.1', port: server.addr[1])
+    tracer.batch_size = batch_size
+    tracer.start_trace
+    yield tracer
+    tracer.end_trace
+    tracer.process_ended
+    client = server.accept
+    stream = "".b
+    loop do
+      stream << client.read_nonblock(65536)
+    rescue IO::WaitReadable, EOFError
+      break
+    end
+    frames = []
+    until stream.empty?
+      length = stream.unpack("s<").first
+      frames << stream.slice!(0, length)
+    end
+    frames
+  ensure
+    client&.close
+    server.close
+  end
+
+  def traced_packets(protocol_version, batches_only: true)
+    server = UDPSocket.new
+    server.bind('127.0.0.1', 0)
+    tracer = Raygun::Apm::Tracer.new
+    tracer.protocol_version = protocol_version
+    tracer.instance_ids = true
+    sock = UDPSocket.new
+    tracer.udp_sink(socket: sock, host: '127.0.0.1', port: server.addr[1], receive_buffer_size: sock.getsockopt(Socket::SOL_SOCKET, Socket::SO_RCVBUF).int)
+    tracer.start_trace
+    yield tracer
+    tracer.end_trace
+    tracer.process_ended
+    packets = []
+    loop do
+      packets << server.recvfrom_nonblock(65536).first
+    rescue IO::WaitReadable
+      break
+    end
+    return packets unless batches_only
+    packets.select{|p| [0xfa, 0xfb].include?(p.unpack("s<C")[1]) }
+  ensure
+    server.close
+  end
+end
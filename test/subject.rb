@@ -100,6 +100,12 @@ class Subject
       recursive_limited(max_depth)
     end
 
+    # Suspends the fiber it runs in max_depth frames deep
+    def recursive_fiber_yield(max_depth)
+      return Fiber.yield if max_depth == 0
+      recursive_fiber_yield(max_depth - 1)
+    end
+
     # Non-recursive nested methods deep stack
     300.times do |i|
       define_method "deep_stack_method#{i}" do